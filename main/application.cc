@@ -5,6 +5,7 @@
 #include "audio_codec.h"
 #include "mqtt_protocol.h"
 #include "websocket_protocol.h"
+#include "udp_protocol.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
 #include "assets.h"
@@ -20,7 +21,8 @@
 #define TAG "Application"
 
 
-Application::Application() {
+Application::Application()
+    : worker_pool_("worker", WORKER_POOL_SIZE, WORKER_POOL_STACK_SIZE, 3, WORKER_POOL_MAX_QUEUE) {
     event_group_ = xEventGroupCreate();
 
 #if CONFIG_USE_DEVICE_AEC && CONFIG_USE_SERVER_AEC
@@ -61,17 +63,7 @@ bool Application::SetDeviceState(DeviceState state) {
 void Application::Initialize() {
     auto& board = Board::GetInstance();
     SetDeviceState(kDeviceStateStarting);
-
-    // Setup the display
-    auto display = board.GetDisplay();
-    display->SetupUI();
-    // Print board name/version info
-    display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
-
-    // Setup the audio service
-    auto codec = board.GetAudioCodec();
-    audio_service_.Initialize(codec);
-    audio_service_.Start();
+    boot_sequence_.Mark("board_ready");
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
@@ -93,11 +85,6 @@ void Application::Initialize() {
     // Start the clock timer to update the status bar
     esp_timer_start_periodic(clock_timer_handle_, 1000000);
 
-    // Add MCP common tools (only once during initialization)
-    auto& mcp_server = McpServer::GetInstance();
-    mcp_server.AddCommonTools();
-    mcp_server.AddUserOnlyTools();
-
     // Set network event callback for UI updates and network state handling
     board.SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
         auto display = Board::GetInstance().GetDisplay();
@@ -140,14 +127,21 @@ void Application::Initialize() {
             case NetworkEvent::ModemDetecting:
                 display->SetStatus(Lang::Strings::DETECTING_MODULE);
                 break;
+            // Alerts play a sound, schedule them so they never run before the audio stage finished
             case NetworkEvent::ModemErrorNoSim:
-                Alert(Lang::Strings::ERROR, Lang::Strings::PIN_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_PIN);
+                Schedule([this]() {
+                    Alert(Lang::Strings::ERROR, Lang::Strings::PIN_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_PIN);
+                });
                 break;
             case NetworkEvent::ModemErrorRegDenied:
-                Alert(Lang::Strings::ERROR, Lang::Strings::REG_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_REG);
+                Schedule([this]() {
+                    Alert(Lang::Strings::ERROR, Lang::Strings::REG_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_REG);
+                });
                 break;
             case NetworkEvent::ModemErrorInitFailed:
-                Alert(Lang::Strings::ERROR, Lang::Strings::MODEM_INIT_ERROR, "triangle_exclamation", Lang::Sounds::OGG_EXCLAMATION);
+                Schedule([this]() {
+                    Alert(Lang::Strings::ERROR, Lang::Strings::MODEM_INIT_ERROR, "triangle_exclamation", Lang::Sounds::OGG_EXCLAMATION);
+                });
                 break;
             case NetworkEvent::ModemErrorTimeout:
                 display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
@@ -155,11 +149,56 @@ void Application::Initialize() {
         }
     });
 
-    // Start network asynchronously
-    board.StartNetwork();
+    // Display and codec do not depend on each other, bring them up in parallel with the network
+    boot_sequence_.AddStage("display", {}, [&board]() {
+        auto display = board.GetDisplay();
+        display->SetupUI();
+        // Print board name/version info
+        display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    });
+    boot_sequence_.AddStage("audio", {}, [this, &board]() {
+        audio_service_.Initialize(board.GetAudioCodec());
+        audio_service_.Start();
+    });
+    // Network events update the display
+    boot_sequence_.AddStage("network", {"display"}, [&board]() {
+        board.StartNetwork();
+    });
+
+    // Mapping and checking the assets partition is the slowest part of the boot and nothing
+    // before activation needs it, so it runs in the background on the second core
+    boot_sequence_.AddStage("assets", {}, []() {
+        Assets::GetInstance();
+    }, kBootStageBackground, 1);
+    boot_sequence_.AddStage("mcp_tools", {"assets"}, []() {
+        // Add MCP common tools (only once during initialization)
+        auto& mcp_server = McpServer::GetInstance();
+        mcp_server.AddCommonTools();
+        mcp_server.AddUserOnlyTools();
+    }, kBootStageBackground);
+    // Fonts, emoji and srmodels from the assets partition
+    boot_sequence_.AddStage("assets_apply", {"assets", "display", "audio"}, []() {
+        auto& assets = Assets::GetInstance();
+        if (!assets.partition_valid()) {
+            return;
+        }
+        Settings settings("assets");
+        if (!settings.GetString("download_url").empty()) {
+            // The partition is about to be overwritten, CheckAssetsVersion applies the new assets
+            ESP_LOGI(TAG, "New assets pending, skip applying the current ones");
+            return;
+        }
+        assets.Apply();
+    }, kBootStageBackground);
+    // Loading the wake word model takes a while, do it before the device becomes idle
+    boot_sequence_.AddStage("wake_word", {"assets_apply"}, [this]() {
+        audio_service_.PreloadWakeWord();
+    }, kBootStageBackground);
+
+    boot_sequence_.Run();
 
     // Update the status bar immediately to show the network state
-    display->UpdateStatusBar(true);
+    board.GetDisplay()->UpdateStatusBar(true);
 }
 
 void Application::Run() {
@@ -237,11 +276,9 @@ void Application::Run() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
+            if (scheduler_.RunPending(MAIN_TASK_BUDGET_US)) {
+                // Out of budget, handle the other events first and continue in the next iteration
+                xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
             }
         }
 
@@ -249,17 +286,27 @@ void Application::Run() {
             clock_ticks_++;
             auto display = Board::GetInstance().GetDisplay();
             display->UpdateStatusBar();
+            McpServer::GetInstance().CheckToolCallTimeouts();
+            task_monitor_.Sample();
         
             // Print debug info every 10 seconds
             if (clock_ticks_ % 10 == 0) {
                 SystemInfo::PrintHeapStats();
             }
+
+            // clock_ticks_ restarts at every state change, so this is the time spent idle
+            if (firmware_staged_ && GetDeviceState() == kDeviceStateIdle &&
+                clock_ticks_ >= OTA_STAGING_REBOOT_IDLE_SECONDS && audio_service_.IsIdle()) {
+                ESP_LOGI(TAG, "Rebooting into the staged firmware");
+                Reboot();
+            }
         }
     }
 }
 
 void Application::HandleNetworkConnectedEvent() {
     ESP_LOGI(TAG, "Network connected");
+    boot_sequence_.Mark("network_connected");
     auto state = GetDeviceState();
 
     if (state == kDeviceStateStarting || state == kDeviceStateWifiConfiguring) {
@@ -298,6 +345,7 @@ void Application::HandleNetworkDisconnectedEvent() {
 
 void Application::HandleActivationDoneEvent() {
     ESP_LOGI(TAG, "Activation done");
+    boot_sequence_.Mark("activation_done");
 
     SystemInfo::PrintHeapStats();
     SetDeviceState(kDeviceStateIdle);
@@ -330,7 +378,8 @@ void Application::ActivationTask() {
     // Check for new firmware version
     CheckNewVersion();
 
-    // Initialize the protocol
+    // Initialize the protocol, the server lists the MCP tools right after the connection is up
+    boot_sequence_.WaitFor("mcp_tools");
     InitializeProtocol();
 
     // Signal completion to main loop
@@ -346,6 +395,8 @@ void Application::CheckAssetsVersion() {
 
     auto& board = Board::GetInstance();
     auto display = board.GetDisplay();
+    // The current assets are applied by a boot stage, never download over them while it runs
+    boot_sequence_.WaitFor("assets_apply");
     auto& assets = Assets::GetInstance();
 
     if (!assets.partition_valid()) {
@@ -382,15 +433,23 @@ void Application::CheckAssetsVersion() {
         vTaskDelay(pdMS_TO_TICKS(1000));
 
         if (!success) {
+            if (assets.download_resumable()) {
+                // Continue the download on the next boot
+                settings.SetString("download_url", download_url);
+            } else if (!assets.partition_changed()) {
+                // The server never answered, the old assets are untouched
+                assets.Apply();
+            }
             Alert(Lang::Strings::ERROR, Lang::Strings::DOWNLOAD_ASSETS_FAILED, "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
             vTaskDelay(pdMS_TO_TICKS(2000));
             SetDeviceState(kDeviceStateActivating);
             return;
         }
+
+        // Apply the new assets, the boot stage skipped the old ones
+        assets.Apply();
     }
 
-    // Apply assets
-    assets.Apply();
     display->SetChatMessage("system", "");
     display->SetEmotion("microchip_ai");
 }
@@ -433,10 +492,14 @@ void Application::CheckNewVersion() {
         retry_delay = 10; // Reset retry delay
 
         if (ota_->HasNewVersion()) {
+#if CONFIG_OTA_BACKGROUND_STAGING
+            StageFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion());
+#else
             if (UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion())) {
                 return; // This line will never be reached after reboot
             }
             // If upgrade failed, continue to normal operation
+#endif
         }
 
         // No new version, mark the current version as valid
@@ -479,6 +542,8 @@ void Application::InitializeProtocol() {
 
     if (ota_->HasMqttConfig()) {
         protocol_ = std::make_unique<MqttProtocol>();
+    } else if (ota_->HasUdpConfig()) {
+        protocol_ = std::make_unique<UdpProtocol>();
     } else if (ota_->HasWebsocketConfig()) {
         protocol_ = std::make_unique<WebsocketProtocol>();
     } else {
@@ -527,9 +592,11 @@ void Application::InitializeProtocol() {
                 Schedule([this]() {
                     aborted_ = false;
                     SetDeviceState(kDeviceStateSpeaking);
-                });
+                    audio_service_.BeginDownlink();
+                }, kTaskClassAudio);
             } else if (strcmp(state->valuestring, "stop") == 0) {
                 Schedule([this]() {
+                    audio_service_.EndDownlink();
                     if (GetDeviceState() == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
                             SetDeviceState(kDeviceStateIdle);
@@ -537,8 +604,11 @@ void Application::InitializeProtocol() {
                             SetDeviceState(kDeviceStateListening);
                         }
                     }
-                });
+                }, kTaskClassAudio);
             } else if (strcmp(state->valuestring, "sentence_start") == 0) {
+                Schedule([this]() {
+                    audio_service_.StartDownlinkSentence();
+                }, kTaskClassAudio);
                 auto text = cJSON_GetObjectItem(root, "text");
                 if (cJSON_IsString(text)) {
                     ESP_LOGI(TAG, "<< %s", text->valuestring);
@@ -564,7 +634,7 @@ void Application::InitializeProtocol() {
             }
         } else if (strcmp(type->valuestring, "mcp") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
+            if (cJSON_IsObject(payload) || cJSON_IsArray(payload)) {
                 McpServer::GetInstance().ParseMessage(payload);
             }
         } else if (strcmp(type->valuestring, "system") == 0) {
@@ -866,6 +936,9 @@ void Application::HandleStateChangedEvent() {
             display->SetEmotion("neutral"); // Then set emotion (wechat mode checks child count)
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(true);
+            if (audio_service_.IsWakeWordRunning()) {
+                boot_sequence_.Mark("wake_word_ready");
+            }
             break;
         case kDeviceStateConnecting:
             display->SetStatus(Lang::Strings::CONNECTING);
@@ -923,11 +996,8 @@ void Application::HandleStateChangedEvent() {
     }
 }
 
-void Application::Schedule(std::function<void()>&& callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
-    }
+void Application::Schedule(MainTask&& callback, TaskClass task_class) {
+    scheduler_.Push(task_class, std::move(callback));
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
 
@@ -941,6 +1011,8 @@ void Application::AbortSpeaking(AbortReason reason) {
 
 void Application::SetListeningMode(ListeningMode mode) {
     listening_mode_ = mode;
+    // Realtime conversation has no use for speech that got stuck behind a stalled link
+    audio_service_.SetSendQueueMaxAge(mode == kListeningModeRealtime ? SEND_QUEUE_REALTIME_MAX_AGE_MS : 0);
     SetDeviceState(kDeviceStateListening);
 }
 
@@ -1013,6 +1085,50 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
     }
 }
 
+/*
+ * Downloads and verifies the firmware into the next OTA partition on a low priority task while the device
+ * keeps working. The voice uplink goes first: the download holds while audio packets wait to be sent.
+ * Once staged, the clock tick reboots into it when the device has been idle for a while.
+ */
+void Application::StageFirmware(const std::string& url, const std::string& version) {
+    if (ota_staging_task_handle_ != nullptr || firmware_staged_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Staging firmware %s in the background", version.c_str());
+
+    auto args = new std::string(url);
+    auto ret = xTaskCreate([](void* arg) {
+        auto url = static_cast<std::string*>(arg);
+        auto& app = Application::GetInstance();
+        auto throttle = [&app]() {
+            while (app.audio_service_.GetQueueStatistics().send_queue_size >= OTA_STAGING_SEND_QUEUE_LIMIT) {
+                vTaskDelay(pdMS_TO_TICKS(OTA_STAGING_PAUSE_MS));
+            }
+            if (app.GetDeviceState() != kDeviceStateIdle) {
+                vTaskDelay(pdMS_TO_TICKS(OTA_STAGING_CONVERSATION_DELAY_MS));
+            }
+        };
+        for (int attempt = 1; attempt <= OTA_STAGING_MAX_ATTEMPTS; attempt++) {
+            if (Ota::Upgrade(*url, nullptr, throttle)) {
+                ESP_LOGI(TAG, "Firmware staged, rebooting into it when idle");
+                app.firmware_staged_ = true;
+                break;
+            }
+            ESP_LOGW(TAG, "Firmware staging failed (%d/%d)", attempt, OTA_STAGING_MAX_ATTEMPTS);
+            if (attempt < OTA_STAGING_MAX_ATTEMPTS) {
+                vTaskDelay(pdMS_TO_TICKS(OTA_STAGING_RETRY_DELAY_MS));
+            }
+        }
+        delete url;
+        app.ota_staging_task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, "ota_staging", 4096 * 2, args, 1, &ota_staging_task_handle_);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create firmware staging task");
+        delete args;
+    }
+}
+
 void Application::WakeWordInvoke(const std::string& wake_word) {
     if (!protocol_) {
         return;
@@ -1072,6 +1188,14 @@ void Application::SendMcpMessage(const std::string& payload) {
     });
 }
 
+void Application::SendMcpMessage(std::unique_ptr<MessageStream> payload) {
+    Schedule([this, payload = std::move(payload)]() {
+        if (protocol_) {
+            protocol_->SendMcpMessage(*payload);
+        }
+    });
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
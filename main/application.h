@@ -10,12 +10,17 @@
 #include <mutex>
 #include <deque>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
 #include "device_state.h"
 #include "device_state_machine.h"
+#include "main_task_scheduler.h"
+#include "worker_pool.h"
+#include "boot_sequence.h"
+#include "task_monitor.h"
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
@@ -32,6 +37,24 @@
 #define MAIN_EVENT_STOP_LISTENING       (1 << 11)
 #define MAIN_EVENT_STATE_CHANGED        (1 << 12)
 
+#if CONFIG_SPIRAM
+#define WORKER_POOL_SIZE                2
+#else
+#define WORKER_POOL_SIZE                1
+#endif
+#define WORKER_POOL_STACK_SIZE          8192
+#define WORKER_POOL_MAX_QUEUE           8
+
+// Background firmware staging (CONFIG_OTA_BACKGROUND_STAGING): the download holds while this many
+// voice packets wait to be sent, and reads slower during conversations
+#define OTA_STAGING_SEND_QUEUE_LIMIT    1
+#define OTA_STAGING_PAUSE_MS            50
+#define OTA_STAGING_CONVERSATION_DELAY_MS 20
+#define OTA_STAGING_MAX_ATTEMPTS        3
+#define OTA_STAGING_RETRY_DELAY_MS      60000
+// The staged firmware takes over after the device has been idle this long
+#define OTA_STAGING_REBOOT_IDLE_SECONDS 60
+
 
 enum AecMode {
     kAecOff,
@@ -51,8 +74,9 @@ public:
 
     /**
      * Initialize the application
-     * This sets up display, audio, network callbacks, etc.
-     * Network connection starts asynchronously.
+     * This sets up display, audio, network callbacks, etc. in parallel boot stages and returns
+     * once the critical ones are done. Assets, srmodels and the wake word model keep loading
+     * in the background. Network connection starts asynchronously.
      */
     void Initialize();
 
@@ -74,8 +98,18 @@ public:
 
     /**
      * Schedule a callback to be executed in the main task
+     * Audio tasks run before UI tasks, background tasks run last and may be deferred
+     * to later loop iterations when the per-iteration budget is used up.
+     */
+    void Schedule(MainTask&& callback, TaskClass task_class = kTaskClassUi);
+
+    /**
+     * Worker tasks for long-running work that must not block the main task
      */
-    void Schedule(std::function<void()>&& callback);
+    WorkerPool& GetWorkerPool() { return worker_pool_; }
+    TaskClassStatistics GetScheduleStatistics(TaskClass task_class) { return scheduler_.GetStatistics(task_class); }
+    BootSequence& GetBootSequence() { return boot_sequence_; }
+    TaskMonitor& GetTaskMonitor() { return task_monitor_; }
 
     /**
      * Alert with status, message, emotion and optional sound
@@ -108,6 +142,7 @@ public:
     bool UpgradeFirmware(const std::string& url, const std::string& version = "");
     bool CanEnterSleepMode();
     void SendMcpMessage(const std::string& payload);
+    void SendMcpMessage(std::unique_ptr<MessageStream> payload);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
     void PlaySound(const std::string_view& sound);
@@ -124,8 +159,10 @@ private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    MainTaskScheduler scheduler_;
+    WorkerPool worker_pool_;
+    BootSequence boot_sequence_;
+    TaskMonitor task_monitor_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
@@ -142,6 +179,8 @@ private:
     bool play_popup_on_listening_ = false;  // Flag to play popup sound after state changes to listening
     int clock_ticks_ = 0;
     TaskHandle_t activation_task_handle_ = nullptr;
+    TaskHandle_t ota_staging_task_handle_ = nullptr;
+    std::atomic<bool> firmware_staged_ = false;
 
 
     // Event handlers
@@ -162,6 +201,7 @@ private:
     // Helper methods
     void CheckAssetsVersion();
     void CheckNewVersion();
+    void StageFirmware(const std::string& url, const std::string& version);
     void InitializeProtocol();
     void ShowActivationCode(const std::string& code, const std::string& message);
     void SetListeningMode(ListeningMode mode);
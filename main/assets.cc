@@ -5,6 +5,10 @@
 #include "lvgl_theme.h"
 #include "emote_display.h"
 #include "expression_emote.h"
+#include "settings.h"
+#include "download_pipeline.h"
+#include "delta_patch.h"
+#include "lz4_block.h"
 #if HAVE_LVGL
 #include "display/lcd_display.h"
 #include <spi_flash_mmap.h>
@@ -13,12 +17,27 @@
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
 #include <cbin_font.h>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
 
 
 #define TAG "Assets"
 #define PARTITION_LABEL "assets"
 
+// A partition verified on a previous boot is only checked at the header, the file table and these sampled blocks
+#define ASSETS_SAMPLE_COUNT 16
+#define ASSETS_SAMPLE_SIZE 256
+// The full check then runs in a low priority task, pausing after each chunk
+#define ASSETS_VERIFY_CHUNK_SIZE (64 * 1024)
+#define ASSETS_VERIFY_PAUSE_MS 10
+// Downloads erase ahead of the writes in flash blocks of this size
+#define ASSETS_ERASE_BLOCK_SIZE (64 * 1024)
+// Stored asset prefixes: 'ZZ' for plain data, 'ZC' for a 4 byte size and an LZ4 block (scripts/spiffs_assets/lz4_block.py)
+#define ASSETS_COMPRESSED_HEADER_SIZE 6
+
 struct mmap_assets_table {
     char asset_name[32];          /*!< Name of the asset */
     uint32_t asset_size;          /*!< Size of the asset */
@@ -59,6 +78,12 @@ bool Assets::InitializePartition() {
 }
 
 void Assets::UnApplyPartition() {
+    if (models_list_ != nullptr) {
+        // The wake word reads its models from the mapping
+        Application::GetInstance().GetAudioService().ReleaseModelsList();
+        models_list_ = nullptr;
+        srmodels_key_ = AssetKey{};
+    }
     if (strategy_) {
         strategy_->UnApplyPartition(this);
     }
@@ -68,6 +93,20 @@ bool Assets::GetAssetData(const std::string& name, void*& ptr, size_t& size) {
     return strategy_ ? strategy_->GetAssetData(this, name, ptr, size) : false;
 }
 
+bool Assets::AssetKey::Matches(const void* data, size_t size) const {
+    if (data != this->data || size != this->size) {
+        return false;
+    }
+    return !sealed || crc == esp_rom_crc32_le(0, static_cast<const uint8_t*>(data), size);
+}
+
+void Assets::AssetKey::Seal() {
+    if (!sealed && data != nullptr) {
+        crc = esp_rom_crc32_le(0, static_cast<const uint8_t*>(data), size);
+        sealed = true;
+    }
+}
+
 bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
     void* ptr = nullptr;
     size_t size = 0;
@@ -92,11 +131,18 @@ bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
     if (cJSON_IsString(srmodels)) {
         std::string srmodels_file = srmodels->valuestring;
         if (assets->GetAssetData(srmodels_file, ptr, size)) {
-            if (assets->models_list_ != nullptr) {
-                esp_srmodel_deinit(assets->models_list_);
-                assets->models_list_ = nullptr;
+            // Reloading the models restarts the wake word engine, skip it when an update kept them
+            if (assets->models_list_ != nullptr && assets->srmodels_key_.Matches(ptr, size)) {
+                ESP_LOGI(TAG, "The srmodels are unchanged");
+                if (need_delete_root) {
+                    cJSON_Delete(root);
+                }
+                return true;
             }
+            // The models are read in place from the mapped partition, the list only points into it.
+            // The audio service owns the list from here and frees the old one with its wake word.
             assets->models_list_ = srmodel_load(static_cast<uint8_t*>(ptr));
+            assets->srmodels_key_ = assets->models_list_ != nullptr ? AssetKey{ptr, size} : AssetKey{};
             if (assets->models_list_ != nullptr) {
                 auto& app = Application::GetInstance();
                 app.GetAudioService().SetModelsList(assets->models_list_);
@@ -119,17 +165,118 @@ bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
 }
 
 #if HAVE_LVGL
-uint32_t Assets::LvglStrategy::CalculateChecksum(const char* data, uint32_t length) {
+// Additive byte sum, four bytes per load: the bytes are summed in two 16-bit lanes which are
+// folded into the result before they can overflow
+uint32_t Assets::LvglStrategy::CalculateChecksum(const char* data, uint32_t length, uint32_t checksum) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    while (length > 0 && (reinterpret_cast<uintptr_t>(bytes) & 3) != 0) {
+        checksum += *bytes++;
+        length--;
+    }
+
+    auto words = reinterpret_cast<const uint32_t*>(bytes);
+    uint32_t word_count = length / 4;
+    while (word_count > 0) {
+        // A word adds at most 2 * 255 to a lane
+        uint32_t batch = std::min<uint32_t>(word_count, 128);
+        uint32_t lanes = 0;
+        for (uint32_t i = 0; i < batch; i++) {
+            uint32_t word = words[i];
+            lanes += (word & 0x00FF00FF) + ((word >> 8) & 0x00FF00FF);
+        }
+        checksum += (lanes & 0xFFFF) + (lanes >> 16);
+        words += batch;
+        word_count -= batch;
+    }
+
+    bytes = reinterpret_cast<const uint8_t*>(words);
+    for (uint32_t i = 0; i < (length & 3); i++) {
+        checksum += bytes[i];
+    }
+    return checksum;
+}
+
+uint32_t Assets::LvglStrategy::CalculateSampleDigest(uint32_t files, uint32_t length) {
+    // Header and file table
+    uint32_t table_size = std::min<uint32_t>(12 + files * sizeof(mmap_assets_table), 12 + length);
+    uint32_t digest = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(mmap_root_), table_size);
+    if (length == 0) {
+        return digest;
+    }
+
+    // Blocks spread evenly over the data, including its first and last bytes
+    uint32_t sample_size = std::min<uint32_t>(ASSETS_SAMPLE_SIZE, length);
+    for (int i = 0; i < ASSETS_SAMPLE_COUNT; i++) {
+        uint32_t offset = (uint64_t)(length - sample_size) * i / (ASSETS_SAMPLE_COUNT - 1);
+        digest = esp_rom_crc32_le(digest, reinterpret_cast<const uint8_t*>(mmap_root_ + 12 + offset), sample_size);
+    }
+    return digest;
+}
+
+void Assets::LvglStrategy::StartBackgroundVerify(uint32_t checksum, uint32_t length) {
+    {
+        std::lock_guard<std::mutex> lock(verify_mutex_);
+        verify_running_ = true;
+        verify_cancel_ = false;
+        verify_checksum_ = checksum;
+        verify_length_ = length;
+    }
+
+    auto ret = xTaskCreate([](void* arg) {
+        auto strategy = static_cast<LvglStrategy*>(arg);
+        strategy->BackgroundVerify();
+        vTaskDelete(NULL);
+    }, "assets_verify", 4096, this, 1, nullptr);
+    if (ret != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create assets verify task");
+        std::lock_guard<std::mutex> lock(verify_mutex_);
+        verify_running_ = false;
+    }
+}
+
+// The partition must stay mapped while the task reads it
+void Assets::LvglStrategy::StopBackgroundVerify() {
+    std::unique_lock<std::mutex> lock(verify_mutex_);
+    verify_cancel_ = true;
+    verify_cv_.wait(lock, [this]() { return !verify_running_; });
+}
+
+void Assets::LvglStrategy::BackgroundVerify() {
+    auto start_time = esp_timer_get_time();
     uint32_t checksum = 0;
-    for (uint32_t i = 0; i < length; i++) {
-        checksum += data[i];
+    uint32_t offset = 0;
+    while (offset < verify_length_ && !verify_cancel_) {
+        uint32_t length = std::min<uint32_t>(ASSETS_VERIFY_CHUNK_SIZE, verify_length_ - offset);
+        checksum = CalculateChecksum(mmap_root_ + 12 + offset, length, checksum);
+        offset += length;
+        // Leave the flash cache to the tasks executing from flash for a moment
+        vTaskDelay(pdMS_TO_TICKS(ASSETS_VERIFY_PAUSE_MS));
+    }
+
+    if (offset >= verify_length_ && !verify_cancel_) {
+        checksum &= 0xFFFF;
+        if (checksum == verify_checksum_) {
+            ESP_LOGI(TAG, "The assets partition is verified in the background in %d ms",
+                int((esp_timer_get_time() - start_time) / 1000));
+        } else {
+            // The assets stay in use until the reboot, the next boot checks in full and rejects them
+            ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", checksum, verify_checksum_);
+            Settings settings("assets", true);
+            settings.EraseKey("verified_gen");
+            settings.EraseKey("verified_digest");
+        }
     }
-    return checksum & 0xFFFF;
+
+    std::lock_guard<std::mutex> lock(verify_mutex_);
+    verify_running_ = false;
+    verify_cv_.notify_all();
 }
 
 bool Assets::LvglStrategy::InitializePartition(Assets* assets) {
     assets->partition_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_count_ = 0;
+    sorted_order_.clear();
 
     if (!Assets::FindPartition(assets)) {
         return false;
@@ -161,56 +308,190 @@ bool Assets::LvglStrategy::InitializePartition(Assets* assets) {
         return false;
     }
 
-    auto start_time = esp_timer_get_time();
-    uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
-    auto end_time = esp_timer_get_time();
-    ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+    // The verified state is bound to the download generation and to a digest of sampled blocks,
+    // so both a new download and a partition flashed over USB trigger a full check
+    Settings settings("assets", true);
+    int32_t generation = settings.GetInt("generation");
+    uint32_t digest = CalculateSampleDigest(stored_files, stored_len);
+    if (settings.GetInt("verified_gen", -1) == generation && (uint32_t)settings.GetInt("verified_digest") == digest) {
+        ESP_LOGI(TAG, "The assets partition was verified before, checking it in the background");
+        StartBackgroundVerify(stored_chksum, stored_len);
+    } else {
+        auto start_time = esp_timer_get_time();
+        uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len) & 0xFFFF;
+        auto end_time = esp_timer_get_time();
+        ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
 
-    if (calculated_checksum != stored_chksum) {
-        ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+        if (calculated_checksum != stored_chksum) {
+            ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+            return false;
+        }
+        settings.SetInt("verified_gen", generation);
+        settings.SetInt("verified_digest", (int32_t)digest);
+    }
+
+    if (sizeof(mmap_assets_table) * stored_files > stored_len) {
+        ESP_LOGE(TAG, "The asset table of %lu files does not fit in the stored length 0x%lx", stored_files, stored_len);
         return false;
     }
 
     checksum_valid_ = true;
-
-    for (uint32_t i = 0; i < stored_files; i++) {
-        auto item = (const mmap_assets_table*)(mmap_root_ + 12 + i * sizeof(mmap_assets_table));
-        auto asset = Asset{
-            .size = static_cast<size_t>(item->asset_size),
-            .offset = static_cast<size_t>(12 + sizeof(mmap_assets_table) * stored_files + item->asset_offset)
-        };
-        assets_[item->asset_name] = asset;
+    table_ = (const mmap_assets_table*)(mmap_root_ + 12);
+    table_count_ = stored_files;
+    data_offset_ = 12 + sizeof(mmap_assets_table) * stored_files;
+
+    // The packing scripts sort the table by name, older partitions get a sorted index of the table
+    auto name_less = [this](uint32_t a, uint32_t b) {
+        return strncmp(table_[a].asset_name, table_[b].asset_name, sizeof(table_[a].asset_name)) < 0;
+    };
+    for (uint32_t i = 1; i < table_count_; i++) {
+        if (name_less(i, i - 1)) {
+            ESP_LOGI(TAG, "The asset table is not sorted, building a lookup index");
+            sorted_order_.resize(table_count_);
+            std::iota(sorted_order_.begin(), sorted_order_.end(), 0);
+            std::sort(sorted_order_.begin(), sorted_order_.end(), name_less);
+            break;
+        }
     }
     return checksum_valid_;
 }
 
+// Binary search over the table names, they are fixed size and NUL padded
+const mmap_assets_table* Assets::LvglStrategy::FindAsset(const std::string& name) {
+    if (table_ == nullptr || name.size() > sizeof(table_->asset_name)) {
+        return nullptr;
+    }
+    uint32_t low = 0;
+    uint32_t high = table_count_;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        auto item = &table_[sorted_order_.empty() ? middle : sorted_order_[middle]];
+        int result = strncmp(item->asset_name, name.c_str(), sizeof(item->asset_name));
+        if (result == 0) {
+            return item;
+        }
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return nullptr;
+}
+
 void Assets::LvglStrategy::UnApplyPartition(Assets* assets) {
+    StopBackgroundVerify();
+    // The partition is about to be rewritten, remember what the built objects were made of while it is still mapped
+    for (auto& [name, built] : built_assets_) {
+        built.key.Seal();
+    }
     if (mmap_handle_ != 0) {
         esp_partition_munmap(mmap_handle_);
         mmap_handle_ = 0;
         mmap_root_ = nullptr;
     }
     checksum_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_count_ = 0;
+    std::vector<uint32_t>().swap(sorted_order_);
+    {
+        std::lock_guard<std::mutex> lock(decompress_mutex_);
+        for (auto& [offset, buffer] : decompressed_) {
+            heap_caps_free(buffer);
+        }
+        decompressed_.clear();
+        decompressed_size_ = 0;
+    }
     (void)assets; // Unused parameter
 }
 
 bool Assets::LvglStrategy::GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) {
-    auto asset = assets_.find(name);
-    if (asset == assets_.end()) {
+    auto item = FindAsset(name);
+    if (item == nullptr) {
         return false;
     }
-    auto data = (const char*)(mmap_root_ + asset->second.offset);
+    auto data = (const char*)(mmap_root_ + data_offset_ + item->asset_offset);
+    if (data[0] == 'Z' && data[1] == 'C') {
+        ptr = GetCompressedAsset(assets, item, data);
+        size = item->asset_size;
+        return ptr != nullptr;
+    }
     if (data[0] != 'Z' || data[1] != 'Z') {
         ESP_LOGE(TAG, "The asset %s is not valid with magic %02x%02x", name.c_str(), data[0], data[1]);
         return false;
     }
 
     ptr = static_cast<void*>(const_cast<char*>(data + 2));
-    size = asset->second.size;
+    size = item->asset_size;
+    return true;
+}
+
+void* Assets::LvglStrategy::GetCompressedAsset(Assets* assets, const mmap_assets_table* item, const char* data) {
+    std::lock_guard<std::mutex> lock(decompress_mutex_);
+    auto it = decompressed_.find(item->asset_offset);
+    if (it != decompressed_.end()) {
+        return it->second;
+    }
+
+    uint32_t compressed_size;
+    if (!GetCompressedSize(assets, item, data, compressed_size)) {
+        return nullptr;
+    }
+    auto buffer = Decompress((const uint8_t*)data + ASSETS_COMPRESSED_HEADER_SIZE, compressed_size, item->asset_size);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to decompress asset %.32s", item->asset_name);
+        return nullptr;
+    }
+    decompressed_[item->asset_offset] = buffer;
+    decompressed_size_ += item->asset_size;
+    ESP_LOGI(TAG, "Decompressed %.32s: %lu -> %lu bytes, %u bytes decompressed in total", item->asset_name,
+        compressed_size, item->asset_size, decompressed_size_);
+    return buffer;
+}
+
+bool Assets::LvglStrategy::GetCompressedSize(Assets* assets, const mmap_assets_table* item, const char* data, uint32_t& compressed_size) {
+    memcpy(&compressed_size, data + 2, sizeof(compressed_size));
+    size_t end = data + ASSETS_COMPRESSED_HEADER_SIZE + compressed_size - mmap_root_;
+    if (compressed_size > assets->partition_->size || end > assets->partition_->size) {
+        ESP_LOGE(TAG, "The compressed asset %.32s exceeds the partition", item->asset_name);
+        return false;
+    }
     return true;
 }
 
+bool Assets::LvglStrategy::GetCompressedAssetData(Assets* assets, const std::string& name, const uint8_t*& src, uint32_t& src_size, size_t& size) {
+    auto item = FindAsset(name);
+    if (item == nullptr) {
+        return false;
+    }
+    auto data = (const char*)(mmap_root_ + data_offset_ + item->asset_offset);
+    if (data[0] != 'Z' || data[1] != 'C' || !GetCompressedSize(assets, item, data, src_size)) {
+        return false;
+    }
+    src = (const uint8_t*)data + ASSETS_COMPRESSED_HEADER_SIZE;
+    size = item->asset_size;
+    return true;
+}
+
+// Allocates the buffer in PSRAM if there is any, the caller frees it with heap_caps_free
+uint8_t* Assets::LvglStrategy::Decompress(const uint8_t* src, size_t src_size, size_t size) {
+    auto buffer = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (buffer == nullptr) {
+        buffer = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes to decompress", size);
+        return nullptr;
+    }
+    auto start_time = esp_timer_get_time();
+    if (!Lz4DecompressBlock(src, src_size, buffer, size)) {
+        heap_caps_free(buffer);
+        return nullptr;
+    }
+    ESP_LOGD(TAG, "Decompressed %u -> %u bytes in %d us", src_size, size, int(esp_timer_get_time() - start_time));
+    return buffer;
+}
+
 bool Assets::LvglStrategy::Apply(Assets* assets, bool refresh_display_theme) {
     void* ptr = nullptr;
     size_t size = 0;
@@ -229,39 +510,78 @@ bool Assets::LvglStrategy::Apply(Assets* assets, bool refresh_display_theme) {
     if (cJSON_IsNumber(version)) {
         if (version->valuedouble > 1) {
             ESP_LOGE(TAG, "The assets version %d is not supported, please upgrade the firmware", version->valueint);
+            cJSON_Delete(root);
             return false;
         }
     }
 
+    int64_t start_time = esp_timer_get_time();
+    size_t start_free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    size_t start_free_spiram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    size_t start_minimum_internal = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    size_t start_minimum_spiram = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+
     Assets::LoadSrmodelsFromIndex(assets, root);
 
+    // Objects of assets that did not change are taken over from the last Apply, only the others are built
+    std::map<std::string, BuiltAsset> built;
+    int rebuilt_count = 0;
+    int reused_count = 0;
+    auto build_from = [&](const std::string& role, const char* file, void* data, size_t data_size, auto create) -> decltype(create(nullptr, 0)) {
+        std::string name = role + ":" + file;
+        auto it = built_assets_.find(name);
+        if (it != built_assets_.end() && it->second.key.Matches(data, data_size)) {
+            built[name] = BuiltAsset{AssetKey{data, data_size}, it->second.object};
+            reused_count++;
+            return std::static_pointer_cast<typename decltype(create(nullptr, 0))::element_type>(it->second.object);
+        }
+        auto object = create(data, data_size);
+        if (object != nullptr) {
+            built[name] = BuiltAsset{AssetKey{data, data_size}, object};
+            rebuilt_count++;
+        }
+        return object;
+    };
+    auto build = [&](const std::string& role, const char* file, auto create) -> decltype(create(nullptr, 0)) {
+        void* data = nullptr;
+        size_t data_size = 0;
+        if (!assets->GetAssetData(file, data, data_size)) {
+            return nullptr;
+        }
+        return build_from(role, file, data, data_size, create);
+    };
+
     auto& theme_manager = LvglThemeManager::GetInstance();
     auto light_theme = theme_manager.GetTheme("light");
     auto dark_theme = theme_manager.GetTheme("dark");
+    // The display redraws with the theme only if something it draws changed
+    bool theme_changed = false;
+    std::vector<std::shared_ptr<void>> retired;
 
     cJSON* font = cJSON_GetObjectItem(root, "text_font");
     if (cJSON_IsString(font)) {
-        std::string fonts_text_file = font->valuestring;
-        if (assets->GetAssetData(fonts_text_file, ptr, size)) {
-            auto text_font = std::make_shared<LvglCBinFont>(ptr);
-            if (text_font->font() == nullptr) {
-                ESP_LOGE(TAG, "Failed to load fonts.bin");
-                return false;
-            }
-            if (light_theme != nullptr) {
-                light_theme->set_text_font(text_font);
-            }
-            if (dark_theme != nullptr) {
-                dark_theme->set_text_font(text_font);
+        auto text_font = build("font", font->valuestring, [](void* data, size_t) -> std::shared_ptr<LvglFont> {
+            auto cbin_font = std::make_shared<LvglCBinFont>(data);
+            return cbin_font->font() != nullptr ? cbin_font : nullptr;
+        });
+        if (text_font == nullptr) {
+            ESP_LOGE(TAG, "Failed to load the font file %s", font->valuestring);
+            cJSON_Delete(root);
+            return false;
+        }
+        for (auto theme : {light_theme, dark_theme}) {
+            if (theme != nullptr && theme->text_font() != text_font) {
+                retired.push_back(theme->text_font());
+                theme->set_text_font(text_font);
+                theme_changed = true;
             }
-        } else {
-            ESP_LOGE(TAG, "The font file %s is not found", fonts_text_file.c_str());
         }
     }
 
     cJSON* emoji_collection = cJSON_GetObjectItem(root, "emoji_collection");
     if (cJSON_IsArray(emoji_collection)) {
         auto custom_emoji_collection = std::make_shared<EmojiCollection>();
+        std::vector<std::pair<std::string, void*>> emoji_layout;
         int emoji_count = cJSON_GetArraySize(emoji_collection);
         for (int i = 0; i < emoji_count; i++) {
             cJSON* emoji = cJSON_GetArrayItem(emoji_collection, i);
@@ -270,75 +590,102 @@ bool Assets::LvglStrategy::Apply(Assets* assets, bool refresh_display_theme) {
                 cJSON* file = cJSON_GetObjectItem(emoji, "file");
                 cJSON* eaf = cJSON_GetObjectItem(emoji, "eaf");
                 if (cJSON_IsString(name) && cJSON_IsString(file) && (NULL== eaf)) {
-                    if (!assets->GetAssetData(file->valuestring, ptr, size)) {
+                    std::shared_ptr<LvglImage> image;
+                    const uint8_t* compressed = nullptr;
+                    uint32_t compressed_size = 0;
+                    size_t image_size = 0;
+                    if (GetCompressedAssetData(assets, file->valuestring, compressed, compressed_size, image_size)) {
+                        // Compressed emoji are decompressed when they are shown and dropped when another one is,
+                        // so at most one of them is held in RAM
+                        image = build_from("emoji", file->valuestring, (void*)compressed, compressed_size,
+                            [image_size](void* data, size_t data_size) -> std::shared_ptr<LvglImage> {
+                                return std::make_shared<LvglLazyImage>(image_size, [data, data_size, image_size]() {
+                                    return Decompress((const uint8_t*)data, data_size, image_size);
+                                });
+                            });
+                    } else {
+                        image = build("emoji", file->valuestring, [](void* data, size_t data_size) -> std::shared_ptr<LvglImage> {
+                            return std::make_shared<LvglRawImage>(data, data_size);
+                        });
+                    }
+                    if (image == nullptr) {
                         ESP_LOGE(TAG, "Emoji %s image file %s is not found", name->valuestring, file->valuestring);
                         continue;
                     }
-                    custom_emoji_collection->AddEmoji(name->valuestring, new LvglRawImage(ptr, size));
+                    custom_emoji_collection->AddEmoji(name->valuestring, image);
+                    emoji_layout.emplace_back(name->valuestring, image.get());
                 }
             }
         }
-        if (light_theme != nullptr) {
-            light_theme->set_emoji_collection(custom_emoji_collection);
-        }
-        if (dark_theme != nullptr) {
-            dark_theme->set_emoji_collection(custom_emoji_collection);
+        // The emoji on screen is held by the display, the old collection can go
+        if (emoji_layout != emoji_layout_) {
+            if (light_theme != nullptr) {
+                light_theme->set_emoji_collection(custom_emoji_collection);
+            }
+            if (dark_theme != nullptr) {
+                dark_theme->set_emoji_collection(custom_emoji_collection);
+            }
+            emoji_layout_ = std::move(emoji_layout);
         }
     }
 
-    cJSON* skin = cJSON_GetObjectItem(root, "skin");
-    if (cJSON_IsObject(skin)) {
-        cJSON* light_skin = cJSON_GetObjectItem(skin, "light");
-        if (cJSON_IsObject(light_skin) && light_theme != nullptr) {
-            cJSON* text_color = cJSON_GetObjectItem(light_skin, "text_color");
-            cJSON* background_color = cJSON_GetObjectItem(light_skin, "background_color");
-            cJSON* background_image = cJSON_GetObjectItem(light_skin, "background_image");
-            if (cJSON_IsString(text_color)) {
-                light_theme->set_text_color(LvglTheme::ParseColor(text_color->valuestring));
-            }
-            if (cJSON_IsString(background_color)) {
-                light_theme->set_background_color(LvglTheme::ParseColor(background_color->valuestring));
-                light_theme->set_chat_background_color(LvglTheme::ParseColor(background_color->valuestring));
+    auto apply_skin = [&](cJSON* skin, LvglTheme* theme) -> bool {
+        cJSON* text_color = cJSON_GetObjectItem(skin, "text_color");
+        cJSON* background_color = cJSON_GetObjectItem(skin, "background_color");
+        cJSON* background_image = cJSON_GetObjectItem(skin, "background_image");
+        if (cJSON_IsString(text_color)) {
+            auto color = LvglTheme::ParseColor(text_color->valuestring);
+            theme_changed |= !lv_color_eq(theme->text_color(), color);
+            theme->set_text_color(color);
+        }
+        if (cJSON_IsString(background_color)) {
+            auto color = LvglTheme::ParseColor(background_color->valuestring);
+            theme_changed |= !lv_color_eq(theme->background_color(), color) || !lv_color_eq(theme->chat_background_color(), color);
+            theme->set_background_color(color);
+            theme->set_chat_background_color(color);
+        }
+        if (cJSON_IsString(background_image)) {
+            auto image = build("image", background_image->valuestring, [](void* data, size_t) -> std::shared_ptr<LvglImage> {
+                return std::make_shared<LvglCBinImage>(data);
+            });
+            if (image == nullptr) {
+                ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
+                return false;
             }
-            if (cJSON_IsString(background_image)) {
-                if (!assets->GetAssetData(background_image->valuestring, ptr, size)) {
-                    ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
-                    return false;
-                }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
-                light_theme->set_background_image(background_image);
+            if (theme->background_image() != image) {
+                retired.push_back(theme->background_image());
+                theme->set_background_image(image);
+                theme_changed = true;
             }
         }
+        return true;
+    };
+
+    cJSON* skin = cJSON_GetObjectItem(root, "skin");
+    if (cJSON_IsObject(skin)) {
+        cJSON* light_skin = cJSON_GetObjectItem(skin, "light");
         cJSON* dark_skin = cJSON_GetObjectItem(skin, "dark");
-        if (cJSON_IsObject(dark_skin) && dark_theme != nullptr) {
-            cJSON* text_color = cJSON_GetObjectItem(dark_skin, "text_color");
-            cJSON* background_color = cJSON_GetObjectItem(dark_skin, "background_color");
-            cJSON* background_image = cJSON_GetObjectItem(dark_skin, "background_image");
-            if (cJSON_IsString(text_color)) {
-                dark_theme->set_text_color(LvglTheme::ParseColor(text_color->valuestring));
-            }
-            if (cJSON_IsString(background_color)) {
-                dark_theme->set_background_color(LvglTheme::ParseColor(background_color->valuestring));
-                dark_theme->set_chat_background_color(LvglTheme::ParseColor(background_color->valuestring));
-            }
-            if (cJSON_IsString(background_image)) {
-                if (!assets->GetAssetData(background_image->valuestring, ptr, size)) {
-                    ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
-                    return false;
-                }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
-                dark_theme->set_background_image(background_image);
-            }
+        if ((cJSON_IsObject(light_skin) && light_theme != nullptr && !apply_skin(light_skin, light_theme)) ||
+            (cJSON_IsObject(dark_skin) && dark_theme != nullptr && !apply_skin(dark_skin, dark_theme))) {
+            cJSON_Delete(root);
+            return false;
         }
     }
 
+    // Objects of assets that are gone are released here, unless a theme still holds them
+    built_assets_ = std::move(built);
+
     if (refresh_display_theme) {
         auto display = Board::GetInstance().GetDisplay();
-        ESP_LOGI(TAG, "Refreshing display theme...");
-
-        auto current_theme = display->GetTheme();
-        if (current_theme != nullptr) {
-            display->SetTheme(current_theme);
+        if (theme_changed || !retired_assets_.empty()) {
+            ESP_LOGI(TAG, "Refreshing display theme...");
+            auto current_theme = display->GetTheme();
+            if (current_theme != nullptr) {
+                display->SetTheme(current_theme);
+            }
+            // The display no longer draws with the replaced fonts and images
+            retired_assets_.clear();
+            retired.clear();
         }
 
         // Parse hide_subtitle configuration
@@ -352,7 +699,24 @@ bool Assets::LvglStrategy::Apply(Assets* assets, bool refresh_display_theme) {
             }
         }
     }
-    
+    retired_assets_.insert(retired_assets_.end(), retired.begin(), retired.end());
+
+    int64_t elapsed = (esp_timer_get_time() - start_time) / 1000;
+    int net_internal = (int)start_free_internal - (int)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    int net_spiram = (int)start_free_spiram - (int)heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    // The peak comes from the low-water mark, which is exact if Apply lowered it and otherwise only bounds
+    // the peak from above, the old mark was lower than anything Apply reached
+    auto peak = [](size_t start_free, size_t start_minimum, uint32_t caps) {
+        size_t minimum = heap_caps_get_minimum_free_size(caps);
+        return (minimum < start_minimum ? "" : "<=") + std::to_string((int)start_free - (int)minimum);
+    };
+    auto peak_internal = peak(start_free_internal, start_minimum_internal, MALLOC_CAP_INTERNAL);
+    auto peak_spiram = peak(start_free_spiram, start_minimum_spiram, MALLOC_CAP_SPIRAM);
+    ESP_LOGI(TAG, "Assets applied in %lld ms: %d objects built, %d reused, theme %s, "
+        "heap net %d internal, %d PSRAM, peak %s internal, %s PSRAM",
+        elapsed, rebuilt_count, reused_count, theme_changed ? "changed" : "unchanged", net_internal, net_spiram,
+        peak_internal.c_str(), peak_spiram.c_str());
+
     cJSON_Delete(root);
     return true;
 }
@@ -425,138 +789,191 @@ bool Assets::EmoteStrategy::Apply(Assets* assets, bool refresh_display_theme) {
     return true;
 }
 
+static std::string ToHexString(const uint8_t* data, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    for (size_t i = 0; i < length; i++) {
+        result += hex[data[i] >> 4];
+        result += hex[data[i] & 0x0F];
+    }
+    return result;
+}
+
 bool Assets::Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback) {
     ESP_LOGI(TAG, "Downloading new version of assets from %s", url.c_str());
+    partition_changed_ = false;
+    download_resumable_ = false;
+    patch_source_mismatch_ = false;
+    patch_source_rejected_ = false;
+
+    // 下载中断后从中断处继续，本次重试或重启后再次下载时都会续传
+    DownloadJournal journal("assets", partition_);
+    for (int attempt = 1; !DownloadAttempt(url, journal, progress_callback); attempt++) {
+        if (patch_source_mismatch_) {
+            // Nothing was written yet, ask for the full image right away, without the source hash
+            ESP_LOGW(TAG, "Requesting the full assets image instead of the patch");
+            patch_source_mismatch_ = false;
+            continue;
+        }
+        if (!journal.worth_retrying() || attempt >= DOWNLOAD_MAX_ATTEMPTS) {
+            download_resumable_ = journal.offset() > 0;
+            return false;
+        }
+        ESP_LOGW(TAG, "Assets download interrupted, retrying (%d/%d)", attempt, DOWNLOAD_MAX_ATTEMPTS);
+        vTaskDelay(pdMS_TO_TICKS(DOWNLOAD_RETRY_DELAY_MS));
+    }
 
-    // 取消当前资源分区的内存映射
-    UnApplyPartition();
+    // 重新初始化资源分区
+    if (!InitializePartition()) {
+        ESP_LOGE(TAG, "Failed to re-initialize assets partition");
+        return false;
+    }
+
+    return true;
+}
 
-    // 下载新的资源文件
+bool Assets::DownloadAttempt(const std::string& url, DownloadJournal& journal, std::function<void(int progress, size_t speed)> progress_callback) {
+    // 下载新的资源文件，服务器响应之前旧资源保持可用
     auto network = Board::GetInstance().GetNetwork();
     auto http = network->CreateHttp(0);
-    
-    if (!http->Open("GET", url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+    // The server may send a patch against the assets of this hash, without it the full image.
+    // Unknown after factory flashing and after any interrupted write of the partition.
+    std::string source_sha256;
+    if (!patch_source_rejected_) {
+        Settings settings("assets", false);
+        source_sha256 = settings.GetString("sha256");
     }
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get assets, status code: %d", http->GetStatusCode());
-        return false;
+    if (!source_sha256.empty()) {
+        http->SetHeader("Assets-Sha256", source_sha256);
     }
-
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
+    if (!journal.Open(http.get(), url)) {
         return false;
     }
 
+    size_t content_length = journal.total_length();
     if (content_length > partition_->size) {
         ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", content_length, partition_->size);
+        journal.Clear();
         return false;
     }
 
-    // 定义扇区大小为4KB（ESP32的标准扇区大小）
-    const size_t SECTOR_SIZE = esp_partition_get_main_flash_sector_size();
-    
-    // 计算需要擦除的扇区数量
-    size_t sectors_to_erase = (content_length + SECTOR_SIZE - 1) / SECTOR_SIZE; // 向上取整
-    size_t total_erase_size = sectors_to_erase * SECTOR_SIZE;
-    
-    ESP_LOGI(TAG, "Sector size: %u, content length: %u, sectors to erase: %u, total erase size: %u", 
-             SECTOR_SIZE, content_length, sectors_to_erase, total_erase_size);
-    
-    // 写入新的资源文件到分区，一边erase一边写入
-    char* buffer = (char*)heap_caps_malloc(SECTOR_SIZE, MALLOC_CAP_INTERNAL);
-    if (buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to allocate buffer");
-        return false;
-    }
-    size_t total_written = 0;
-    size_t recent_written = 0;
-    size_t current_sector = 0;
-    auto last_calc_time = esp_timer_get_time();
-    
-    while (true) {
-        int ret = http->Read(buffer, SECTOR_SIZE);
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            heap_caps_free(buffer);
-            return false;
-        }
+    if (!partition_changed_) {
+        // 取消当前资源分区的内存映射
+        UnApplyPartition();
 
-        if (ret == 0) {
-            break;
+        // 分区内容即将改变，递增代数使之前的校验结果失效
+        {
+            Settings settings("assets", true);
+            settings.SetInt("generation", settings.GetInt("generation") + 1);
+            settings.EraseKey("sha256");
         }
+        Settings::Flush();
+        partition_changed_ = true;
+    }
 
-        // 检查是否需要擦除新的扇区
-        size_t write_end_offset = total_written + ret;
-        size_t needed_sectors = (write_end_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        
-        // 擦除需要的新扇区
-        while (current_sector < needed_sectors) {
-            size_t sector_start = current_sector * SECTOR_SIZE;
-            size_t sector_end = (current_sector + 1) * SECTOR_SIZE;
-            
-            // 确保擦除范围不超过分区大小
-            if (sector_end > partition_->size) {
-                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, partition_->size);
-                heap_caps_free(buffer);
+    // 扇区大小为4KB（ESP32的标准扇区大小），写入线程空闲时按64KB块提前擦除
+    const size_t SECTOR_SIZE = esp_partition_get_main_flash_sector_size();
+    const size_t erase_limit = std::min<size_t>((content_length + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE, partition_->size);
+    ESP_LOGI(TAG, "Sector size: %u, content length: %u, total erase size: %u", SECTOR_SIZE, content_length, erase_limit);
+
+    // 续传时从已写入的位置开始擦除，该位置总是扇区对齐的
+    size_t erased_end = journal.offset();
+    // 擦除下一块，64KB对齐时整块擦除，否则擦除到下一个64KB边界
+    auto erase_next = [this, &erased_end, erase_limit]() -> bool {
+        size_t block_end = std::min<size_t>((erased_end / ASSETS_ERASE_BLOCK_SIZE + 1) * ASSETS_ERASE_BLOCK_SIZE, erase_limit);
+        esp_err_t err = esp_partition_erase_range(partition_, erased_end, block_end - erased_end);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase at offset %u: %s", erased_end, esp_err_to_name(err));
+            return false;
+        }
+        erased_end = block_end;
+        return true;
+    };
+
+    // 服务器也可以发送相对于当前资源的差分补丁（scripts/delta_patch.py --assets），按扇区原地写入
+    std::unique_ptr<InPlacePartitionWriter> patch_writer;
+    std::unique_ptr<DeltaPatcher> patcher;
+    uint8_t target_sha256[32];
+    auto create_patcher = [&]() {
+        patch_writer = std::make_unique<InPlacePartitionWriter>(partition_);
+        patcher = std::make_unique<DeltaPatcher>([&](const DeltaPatchHeader& header) {
+            if (header.block_size != patch_writer->sector_size() || header.source_size > partition_->size || header.target_size > partition_->size) {
+                ESP_LOGE(TAG, "Invalid assets patch");
                 return false;
             }
-            
-            ESP_LOGD(TAG, "Erasing sector %u (offset: %u, size: %u)", current_sector, sector_start, SECTOR_SIZE);
-            esp_err_t err = esp_partition_erase_range(partition_, sector_start, SECTOR_SIZE);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to erase sector %u at offset %u: %s", current_sector, sector_start, esp_err_to_name(err));
-                heap_caps_free(buffer);
+            uint8_t sha256[32];
+            if (!DeltaPatcher::HashPartition(partition_, header.source_size, sha256) ||
+                memcmp(sha256, header.source_sha256, sizeof(sha256)) != 0) {
+                ESP_LOGE(TAG, "The assets patch was made for other assets");
+                patch_source_mismatch_ = !patch_source_rejected_;
+                patch_source_rejected_ = true;
                 return false;
             }
-            
-            current_sector++;
+            memcpy(target_sha256, header.target_sha256, sizeof(target_sha256));
+            return true;
+        }, [&](size_t offset, void* buffer, size_t length) {
+            return patch_writer->Read(offset, buffer, length);
+        }, [&](const char* data, size_t length) {
+            return patch_writer->Write(data, length);
+        });
+    };
+
+    // 下载线程读取数据的同时，写入线程擦除并写入分区
+    bool erase_failed = false;
+    DownloadPipeline pipeline;
+    bool success = pipeline.Run(http.get(), journal.offset(), content_length, [&](const char* data, size_t offset, size_t length) {
+        if (offset == 0 && DeltaPatcher::IsPatch(data, length)) {
+            // 补丁按扇区原地改写分区，中断后无法续传
+            ESP_LOGI(TAG, "Applying assets patch");
+            journal.Clear();
+            create_patcher();
+        }
+        if (patcher) {
+            return patcher->Feed(data, length);
         }
 
-        // 写入数据到分区
-        esp_err_t err = esp_partition_write(partition_, total_written, buffer, ret);
+        while (erased_end < offset + length) {
+            if (!erase_next()) {
+                erase_failed = true;
+                return false;
+            }
+        }
+        esp_err_t err = esp_partition_write(partition_, offset, data, length);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", total_written, esp_err_to_name(err));
-            heap_caps_free(buffer);
+            ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", offset, esp_err_to_name(err));
             return false;
         }
-
-        total_written += ret;
-        recent_written += ret;
-
-        // 计算进度和速度
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || total_written == content_length || ret == 0) {
-            size_t progress = total_written * 100 / content_length;
-            size_t speed = recent_written; // 每秒的字节数
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s, Sectors erased: %u", 
-                     progress, total_written, content_length, speed, current_sector);
-            if (progress_callback) {
-                progress_callback(progress, speed);
-            }
-            last_calc_time = esp_timer_get_time();
-            recent_written = 0; // 重置最近写入的字节数
+        journal.Commit(offset, data, length);
+        return true;
+    }, progress_callback, [&]() -> bool {
+        // 补丁模式下只重写有变化的扇区，不提前擦除
+        if (patcher || erased_end >= erase_limit || erase_failed) {
+            return false;
         }
-    }
-    
+        erase_failed = !erase_next();
+        return !erase_failed && erased_end < erase_limit;
+    });
     http->Close();
-    heap_caps_free(buffer);
 
-    if (total_written != content_length) {
-        ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_written, content_length);
-        return false;
+    if (success && patcher) {
+        success = patch_writer->Flush() && patcher->Finish();
     }
-
-    ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total sectors erased: %u", 
-             total_written, current_sector);
-
-    // 重新初始化资源分区
-    if (!InitializePartition()) {
-        ESP_LOGE(TAG, "Failed to re-initialize assets partition");
+    if (!success) {
         return false;
     }
 
+    if (patcher) {
+        ESP_LOGI(TAG, "Assets patch applied, %u bytes downloaded, %u sectors rewritten", content_length, patch_writer->rewritten_sectors());
+    } else {
+        ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total erased: %u bytes", content_length, erased_end);
+        // Hashed once here so the next update can be a patch
+        if (!DeltaPatcher::HashPartition(partition_, content_length, target_sha256)) {
+            journal.Clear();
+            return true;
+        }
+    }
+    journal.Clear();
+    Settings settings("assets", true);
+    settings.SetString("sha256", ToHexString(target_sha256, sizeof(target_sha256)));
     return true;
 }
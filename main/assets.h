@@ -4,21 +4,22 @@
 #include <string>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <cJSON.h>
 #include <esp_partition.h>
 #include <model_path.h>
+#include <vector>
 #include <map>
-#include <string>
 
 #if HAVE_LVGL
 #include <spi_flash_mmap.h>
 #endif
 
-struct Asset {
-    size_t size;
-    size_t offset;
-};
+struct mmap_assets_table;
+class DownloadJournal;
 
 class Assets {
 public:
@@ -33,6 +34,9 @@ public:
     bool GetAssetData(const std::string& name, void*& ptr, size_t& size);
 
     inline bool partition_valid() const { return partition_valid_; }
+    // State after a failed Download: whether the old assets were overwritten, and whether a retry continues the download
+    inline bool partition_changed() const { return partition_changed_; }
+    inline bool download_resumable() const { return download_resumable_; }
     inline std::string default_assets_url() const { return default_assets_url_; }
 
 private:
@@ -42,8 +46,21 @@ private:
 
     bool InitializePartition();
     void UnApplyPartition();
+    bool DownloadAttempt(const std::string& url, DownloadJournal& journal, std::function<void(int progress, size_t speed)> progress_callback);
     static bool FindPartition(Assets* assets);
     static bool LoadSrmodelsFromIndex(Assets* assets, cJSON* root = nullptr);
+
+    // Identifies the content an object was built from, so Apply can keep the objects of assets an update did not change.
+    // Until the partition is rewritten the same address and size means the same content, the CRC is only taken
+    // (sealed) right before the partition is unmapped for a download.
+    struct AssetKey {
+        const void* data = nullptr;
+        size_t size = 0;
+        uint32_t crc = 0;
+        bool sealed = false;
+        bool Matches(const void* data, size_t size) const;
+        void Seal();
+    };
   
     class AssetStrategy {
     public:
@@ -61,11 +78,52 @@ private:
         void UnApplyPartition(Assets* assets) override;
         bool GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) override;
     private:
-        static uint32_t CalculateChecksum(const char* data, uint32_t length);
-        std::map<std::string, Asset> assets_;
+        static uint32_t CalculateChecksum(const char* data, uint32_t length, uint32_t checksum = 0);
+        static uint8_t* Decompress(const uint8_t* src, size_t src_size, size_t size);
+        void* GetCompressedAsset(Assets* assets, const mmap_assets_table* item, const char* data);
+        bool GetCompressedSize(Assets* assets, const mmap_assets_table* item, const char* data, uint32_t& compressed_size);
+        // The LZ4 block of a compressed asset, false if the asset is stored as is
+        bool GetCompressedAssetData(Assets* assets, const std::string& name, const uint8_t*& src, uint32_t& src_size, size_t& size);
+        const mmap_assets_table* FindAsset(const std::string& name);
+        uint32_t CalculateSampleDigest(uint32_t files, uint32_t length);
+        void StartBackgroundVerify(uint32_t checksum, uint32_t length);
+        void StopBackgroundVerify();
+        void BackgroundVerify();
+
+        // The file table is used in place, in the mmapped partition
+        const mmap_assets_table* table_ = nullptr;
+        uint32_t table_count_ = 0;
+        size_t data_offset_ = 0;
+        // Lookup order for partitions packed before the table was sorted by name, empty if it is sorted
+        std::vector<uint32_t> sorted_order_;
         esp_partition_mmap_handle_t mmap_handle_ = 0;
         const char* mmap_root_ = nullptr;
         bool checksum_valid_ = false;
+
+        // Compressed assets read through GetAssetData, decompressed on first use and kept until the partition
+        // is unmapped, users hold on to the pointers like they do for mmapped assets. Emoji are not among them.
+        std::mutex decompress_mutex_;
+        std::map<uint32_t, void*> decompressed_;
+        size_t decompressed_size_ = 0;
+
+        // Fonts and images built by the last Apply, by role and asset name
+        struct BuiltAsset {
+            AssetKey key;
+            std::shared_ptr<void> object;
+        };
+        std::map<std::string, BuiltAsset> built_assets_;
+        // Emoji names and images of the applied collection, to tell whether an update changed it
+        std::vector<std::pair<std::string, void*>> emoji_layout_;
+        // Replaced fonts and images that the display may still draw, until the next theme refresh
+        std::vector<std::shared_ptr<void>> retired_assets_;
+
+        // Full verification of a partition that was verified on a previous boot
+        std::mutex verify_mutex_;
+        std::condition_variable verify_cv_;
+        bool verify_running_ = false;
+        std::atomic<bool> verify_cancel_ = false;
+        uint32_t verify_checksum_ = 0;
+        uint32_t verify_length_ = 0;
     };
     
     class EmoteStrategy : public AssetStrategy {
@@ -82,8 +140,15 @@ private:
 protected:
     const esp_partition_t* partition_ = nullptr;
     bool partition_valid_ = false;
+    bool partition_changed_ = false;
+    bool download_resumable_ = false;
+    // Set when a patch did not match the assets, the retry asks for the full image
+    bool patch_source_mismatch_ = false;
+    // Stops sending the source hash for the rest of the download once a patch was rejected
+    bool patch_source_rejected_ = false;
     std::string default_assets_url_;
     srmodel_list_t* models_list_ = nullptr;
+    AssetKey srmodels_key_;
 };
 
 #endif
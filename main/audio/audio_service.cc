@@ -1,6 +1,7 @@
 #include "audio_service.h"
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 
 #define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
     (esp_ae_rate_cvt_cfg_t)                                  \
@@ -35,6 +36,8 @@
 #include "wake_words/esp_wake_word.h"
 #endif
 
+#include "heap_profiler.h"
+
 #define TAG "AudioService"
 
 AudioService::AudioService() {
@@ -228,6 +231,7 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 }
 
 void AudioService::AudioInputTask() {
+    HeapTagScope heap_tag(kHeapTagAudio);
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
             AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
@@ -271,7 +275,10 @@ void AudioService::AudioInputTask() {
             std::vector<int16_t> data;
             if (ReadAudioData(data, 16000, samples)) {
                 if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-                    wake_word_->Feed(data);
+                    auto wake_word = GetWakeWord();
+                    if (wake_word) {
+                        wake_word->Feed(data);
+                    }
                 }
                 if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
                     audio_processor_->Feed(std::move(data));
@@ -288,6 +295,7 @@ void AudioService::AudioInputTask() {
 }
 
 void AudioService::AudioOutputTask() {
+    HeapTagScope heap_tag(kHeapTagAudio);
     while (true) {
         std::unique_lock<std::mutex> lock(audio_queue_mutex_);
         audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
@@ -325,21 +333,27 @@ void AudioService::AudioOutputTask() {
 }
 
 void AudioService::OpusCodecTask() {
+    HeapTagScope heap_tag(kHeapTagAudio);
     while (true) {
         std::unique_lock<std::mutex> lock(audio_queue_mutex_);
         audio_queue_cv_.wait(lock, [this]() {
             return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
+                (!audio_encode_queue_.empty() &&
+                    (audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE || send_queue_max_age_ms_ > 0)) ||
+                (CanDecode() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
         });
         if (service_stopped_) {
             break;
         }
 
         /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
+        if (CanDecode() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
             auto packet = std::move(audio_decode_queue_.front());
             audio_decode_queue_.pop_front();
+            decode_queue_duration_ms_ -= packet->frame_duration;
+            if (decode_release_count_ > 0) {
+                decode_release_count_--;
+            }
             audio_queue_cv_.notify_all();
             lock.unlock();
 
@@ -391,8 +405,9 @@ void AudioService::OpusCodecTask() {
             }
             debug_statistics_.decode_count++;
         }
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
+        /* Encode the audio to send queue, a deadline policy never blocks the encoder on a full queue */
+        if (!audio_encode_queue_.empty() &&
+            (audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE || send_queue_max_age_ms_ > 0)) {
             auto task = std::move(audio_encode_queue_.front());
             audio_encode_queue_.pop_front();
             audio_queue_cv_.notify_all();
@@ -402,6 +417,7 @@ void AudioService::OpusCodecTask() {
             packet->frame_duration = OPUS_FRAME_DURATION_MS;
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
+            packet->capture_time = task->capture_time;
 
             if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
                 std::vector<uint8_t> buf(encoder_outbuf_size_);
@@ -421,6 +437,11 @@ void AudioService::OpusCodecTask() {
                     if (task->type == kAudioTaskTypeEncodeToSendQueue) {
                         {
                             std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
+                            DropStaleSendPackets(esp_timer_get_time());
+                            if (audio_send_queue_.size() >= MAX_SEND_PACKETS_IN_QUEUE) {
+                                audio_send_queue_.pop_front();
+                                queue_statistics_.send_dropped_count++;
+                            }
                             audio_send_queue_.push_back(std::move(packet));
                         }
                         if (callbacks_.on_send_queue_available) {
@@ -485,6 +506,7 @@ void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t
     auto task = std::make_unique<AudioTask>();
     task->type = type;
     task->pcm = std::move(pcm);
+    task->capture_time = esp_timer_get_time();
     /* Push the task to the encode queue */
     std::unique_lock<std::mutex> lock(audio_queue_mutex_);
 
@@ -512,64 +534,179 @@ bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> pa
             return false;
         }
     }
+    if (downlink_started_ && !downlink_gated_ && audio_decode_queue_.empty() && audio_playback_queue_.empty()) {
+        // Playback ran dry in the middle of a sentence, rebuffer with a higher start threshold
+        queue_statistics_.downlink_underrun_count++;
+        response_underrun_count_++;
+        playback_start_threshold_ms_ = std::min(playback_start_threshold_ms_ + DOWNLINK_BUFFER_STEP_MS,
+            std::max(DOWNLINK_BUFFER_HIGH_WATERMARK_MS, DOWNLINK_BUFFER_LOW_WATERMARK_MS));
+        downlink_gated_ = true;
+        ESP_LOGW(TAG, "Downlink underrun, start threshold %d ms", playback_start_threshold_ms_);
+    }
+    decode_queue_duration_ms_ += packet->frame_duration;
     audio_decode_queue_.push_back(std::move(packet));
+    if (downlink_gated_ && (decode_queue_duration_ms_ >= playback_start_threshold_ms_ ||
+        audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE)) {
+        downlink_gated_ = false;
+    }
+    downlink_started_ = downlink_active_ && !downlink_gated_;
     audio_queue_cv_.notify_all();
     return true;
 }
 
+// Called with audio_queue_mutex_ held
+bool AudioService::CanDecode() const {
+    return !audio_decode_queue_.empty() && (!downlink_gated_ || decode_release_count_ > 0);
+}
+
+void AudioService::BeginDownlink() {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    downlink_active_ = true;
+    downlink_gated_ = decode_queue_duration_ms_ < playback_start_threshold_ms_;
+    downlink_started_ = false;
+    decode_release_count_ = 0;
+    response_underrun_count_ = 0;
+}
+
+void AudioService::StartDownlinkSentence() {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    if (!downlink_active_) {
+        return;
+    }
+    // The previous sentence is complete, play its tail and buffer the new one
+    decode_release_count_ = audio_decode_queue_.size();
+    downlink_gated_ = true;
+    downlink_started_ = false;
+    audio_queue_cv_.notify_all();
+}
+
+void AudioService::EndDownlink() {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    if (!downlink_active_) {
+        return;
+    }
+    if (response_underrun_count_ == 0) {
+        playback_start_threshold_ms_ = std::max(playback_start_threshold_ms_ - DOWNLINK_BUFFER_STEP_MS / 2,
+            DOWNLINK_BUFFER_LOW_WATERMARK_MS);
+    }
+    downlink_active_ = false;
+    downlink_gated_ = false;
+    downlink_started_ = false;
+    decode_release_count_ = 0;
+    audio_queue_cv_.notify_all();
+}
+
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
     std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    auto now = esp_timer_get_time();
+    DropStaleSendPackets(now);
     if (audio_send_queue_.empty()) {
         return nullptr;
     }
     auto packet = std::move(audio_send_queue_.front());
     audio_send_queue_.pop_front();
+    if (packet->capture_time > 0 && now - packet->capture_time > SEND_QUEUE_LATE_THRESHOLD_MS * 1000LL) {
+        queue_statistics_.send_late_count++;
+    }
     audio_queue_cv_.notify_all();
     return packet;
 }
 
+// Called with audio_queue_mutex_ held
+void AudioService::DropStaleSendPackets(int64_t now) {
+    if (send_queue_max_age_ms_ <= 0) {
+        return;
+    }
+    int64_t deadline = now - send_queue_max_age_ms_ * 1000LL;
+    size_t dropped = 0;
+    while (!audio_send_queue_.empty() && audio_send_queue_.front()->capture_time > 0 &&
+        audio_send_queue_.front()->capture_time < deadline) {
+        audio_send_queue_.pop_front();
+        dropped++;
+    }
+    if (dropped > 0) {
+        queue_statistics_.send_dropped_count += dropped;
+        ESP_LOGW(TAG, "Dropped %u stale packets from send queue", dropped);
+        audio_queue_cv_.notify_all();
+    }
+}
+
+void AudioService::SetSendQueueMaxAge(int max_age_ms) {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    send_queue_max_age_ms_ = max_age_ms;
+    audio_queue_cv_.notify_all();
+}
+
+AudioQueueStatistics AudioService::GetQueueStatistics() {
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    auto statistics = queue_statistics_;
+    statistics.send_queue_size = audio_send_queue_.size();
+    statistics.decode_buffered_ms = decode_queue_duration_ms_;
+    statistics.playback_start_threshold_ms = playback_start_threshold_ms_;
+    return statistics;
+}
+
+std::shared_ptr<WakeWord> AudioService::GetWakeWord() const {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    return wake_word_;
+}
+
 void AudioService::EncodeWakeWord() {
-    if (wake_word_) {
-        wake_word_->EncodeWakeWordData();
+    auto wake_word = GetWakeWord();
+    if (wake_word) {
+        wake_word->EncodeWakeWordData();
     }
 }
 
-const std::string& AudioService::GetLastWakeWord() const {
-    return wake_word_->GetLastDetectedWakeWord();
+std::string AudioService::GetLastWakeWord() const {
+    auto wake_word = GetWakeWord();
+    return wake_word ? wake_word->GetLastDetectedWakeWord() : std::string();
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
     auto packet = std::make_unique<AudioStreamPacket>();
-    if (wake_word_->GetWakeWordOpus(packet->payload)) {
+    auto wake_word = GetWakeWord();
+    if (wake_word && wake_word->GetWakeWordOpus(packet->payload)) {
         return packet;
     }
     return nullptr;
 }
 
+// Called with wake_word_mutex_ held
+void AudioService::StartWakeWord() {
+    // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
+    // This prevents buffer overflow when switching between different feed sizes
+    {
+        std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+        if (input_resampler_ != nullptr) {
+            esp_ae_rate_cvt_reset(input_resampler_);
+        }
+    }
+    wake_word_->Start();
+    xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+}
+
 void AudioService::EnableWakeWordDetection(bool enable) {
+    ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    wake_word_enabled_ = enable;
     if (!wake_word_) {
         return;
     }
 
-    ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!wake_word_initialized_) {
+            if (models_loading_ > 0) {
+                // The wake word loading in the background starts when it is ready
+                return;
+            }
             if (!wake_word_->Initialize(codec_, models_list_)) {
                 ESP_LOGE(TAG, "Failed to initialize wake word");
                 return;
             }
             wake_word_initialized_ = true;
         }
-        // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
-            }
-        }
-        wake_word_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+        StartWakeWord();
     } else {
         wake_word_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
@@ -651,6 +788,11 @@ void AudioService::PlaySound(const std::string_view& ogg) {
     });
     demuxer->Reset();
     demuxer->Process(buf, size);
+
+    // Local sounds are complete, never hold them behind the downlink buffering gate
+    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    decode_release_count_ = audio_decode_queue_.size();
+    audio_queue_cv_.notify_all();
 }
 
 bool AudioService::IsIdle() {
@@ -674,6 +816,11 @@ void AudioService::ResetDecoder() {
     decoder_lock.unlock();
     timestamp_queue_.clear();
     audio_decode_queue_.clear();
+    decode_queue_duration_ms_ = 0;
+    decode_release_count_ = 0;
+    downlink_active_ = false;
+    downlink_gated_ = false;
+    downlink_started_ = false;
     audio_playback_queue_.clear();
     audio_testing_queue_.clear();
     audio_queue_cv_.notify_all();
@@ -697,37 +844,130 @@ void AudioService::CheckAndUpdateAudioPowerState() {
     }
 }
 
-void AudioService::SetModelsList(srmodel_list_t* models_list) {
-    models_list_ = models_list;
+bool AudioService::PreloadWakeWord() {
+    std::unique_lock<std::mutex> lock(wake_word_mutex_);
+    // The wake word loading in the background is initialized by then
+    models_cv_.wait(lock, [this]() { return models_loading_ == 0; });
+    if (!wake_word_) {
+        return false;
+    }
+    if (!wake_word_initialized_) {
+        if (!wake_word_->Initialize(codec_, models_list_)) {
+            ESP_LOGE(TAG, "Failed to initialize wake word");
+            return false;
+        }
+        wake_word_initialized_ = true;
+    }
+    return true;
+}
 
+std::unique_ptr<WakeWord> AudioService::CreateWakeWord(srmodel_list_t* models_list) {
+    std::unique_ptr<WakeWord> created;
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
-    if (esp_srmodel_filter(models_list_, ESP_MN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<CustomWakeWord>();
-    } else if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<AfeWakeWord>();
-    } else {
-        wake_word_ = nullptr;
+    if (esp_srmodel_filter(models_list, ESP_MN_PREFIX, NULL) != nullptr) {
+        created = std::make_unique<CustomWakeWord>();
+    } else if (esp_srmodel_filter(models_list, ESP_WN_PREFIX, NULL) != nullptr) {
+        created = std::make_unique<AfeWakeWord>();
     }
 #else
-    if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<EspWakeWord>();
-    } else {
-        wake_word_ = nullptr;
+    if (esp_srmodel_filter(models_list, ESP_WN_PREFIX, NULL) != nullptr) {
+        created = std::make_unique<EspWakeWord>();
     }
 #endif
 
-    if (wake_word_) {
-        wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+    if (created) {
+        created->OnWakeWordDetected([this](const std::string& wake_word) {
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
     }
+    return created;
+}
+
+// Called with wake_word_mutex_ held, the old wake word is returned to be released after the lock is,
+// its destructor waits for the detection and encode tasks to exit.
+// The models a wake word was initialized with are freed by it.
+std::shared_ptr<WakeWord> AudioService::SwapWakeWord(std::shared_ptr<WakeWord> wake_word, srmodel_list_t* models_list, bool initialized) {
+    bool running = xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING;
+    if (running && wake_word_) {
+        wake_word_->Stop();
+        xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+    }
+    auto old_wake_word = std::move(wake_word_);
+    wake_word_ = std::move(wake_word);
+    models_list_ = models_list;
+    wake_word_initialized_ = initialized;
+    if (wake_word_ && wake_word_initialized_ && wake_word_enabled_) {
+        StartWakeWord();
+    }
+    return old_wake_word;
+}
+
+void AudioService::LoadModelsList(srmodel_list_t* models_list, uint32_t generation) {
+    HeapTagScope heap_tag(kHeapTagAudio);
+    auto start_time = esp_timer_get_time();
+    auto wake_word = CreateWakeWord(models_list);
+    bool initialized = wake_word && wake_word->Initialize(codec_, models_list);
+    if (wake_word && !initialized) {
+        ESP_LOGE(TAG, "Failed to initialize wake word");
+    }
+
+    std::shared_ptr<WakeWord> old_wake_word;
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        if (generation == models_generation_) {
+            old_wake_word = SwapWakeWord(std::move(wake_word), models_list, initialized);
+        } else {
+            // Newer models arrived while these loaded
+            old_wake_word = std::move(wake_word);
+        }
+        models_loading_--;
+    }
+    models_cv_.notify_all();
+    old_wake_word.reset();
+    ESP_LOGI(TAG, "Models loaded in %d ms on core %d", int((esp_timer_get_time() - start_time) / 1000), xPortGetCoreID());
+}
+
+void AudioService::SetModelsList(srmodel_list_t* models_list) {
+    uint32_t generation;
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        generation = ++models_generation_;
+        models_loading_++;
+    }
+
+    struct LoadArgs {
+        AudioService* service;
+        srmodel_list_t* models_list;
+        uint32_t generation;
+    };
+    auto args = new LoadArgs{this, models_list, generation};
+    auto ret = xTaskCreatePinnedToCore([](void* arg) {
+        auto args = static_cast<LoadArgs*>(arg);
+        args->service->LoadModelsList(args->models_list, args->generation);
+        delete args;
+        vTaskDelete(NULL);
+    }, "load_models", MODELS_LOAD_STACK_SIZE, args, MODELS_LOAD_PRIORITY, nullptr, portNUM_PROCESSORS - 1);
+    if (ret != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create models load task, loading in place");
+        delete args;
+        LoadModelsList(models_list, generation);
+    }
+}
+
+void AudioService::ReleaseModelsList() {
+    std::shared_ptr<WakeWord> old_wake_word;
+    {
+        std::unique_lock<std::mutex> lock(wake_word_mutex_);
+        models_cv_.wait(lock, [this]() { return models_loading_ == 0; });
+        old_wake_word = SwapWakeWord(nullptr, nullptr, false);
+    }
 }
 
 bool AudioService::IsAfeWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
-    return wake_word_ != nullptr && dynamic_cast<AfeWakeWord*>(wake_word_.get()) != nullptr;
+    return dynamic_cast<AfeWakeWord*>(GetWakeWord().get()) != nullptr;
 #else
     return false;
 #endif
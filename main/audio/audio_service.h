@@ -44,9 +44,28 @@
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
 #define MAX_TIMESTAMPS_IN_QUEUE 3
 
+// Uplink packets older than this are dropped in realtime mode, other modes keep everything
+#define SEND_QUEUE_REALTIME_MAX_AGE_MS 500
+// Packets that leave the send queue later than this after capture are counted as late
+#define SEND_QUEUE_LATE_THRESHOLD_MS 200
+
+/*
+ * Downlink playback of each TTS sentence is held back until the decode queue holds the start
+ * threshold worth of audio, or the next sentence_start / tts stop proves nothing more is coming.
+ * The threshold moves between the low and high watermarks: it grows on every underrun and
+ * shrinks after a response that played without underruns.
+ */
+#define DOWNLINK_BUFFER_LOW_WATERMARK_MS CONFIG_DOWNLINK_BUFFER_LOW_WATERMARK_MS
+#define DOWNLINK_BUFFER_HIGH_WATERMARK_MS CONFIG_DOWNLINK_BUFFER_HIGH_WATERMARK_MS
+#define DOWNLINK_BUFFER_STEP_MS OPUS_FRAME_DURATION_MS
+
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
 
+// The wake word for new models is initialized by a task on the last core, off the assets apply path
+#define MODELS_LOAD_STACK_SIZE (4096 * 2)
+#define MODELS_LOAD_PRIORITY 2
+
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
@@ -93,6 +112,7 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    int64_t capture_time = 0;
 };
 
 struct DebugStatistics {
@@ -102,6 +122,15 @@ struct DebugStatistics {
     uint32_t playback_count = 0;
 };
 
+struct AudioQueueStatistics {
+    uint32_t send_queue_size = 0;
+    uint32_t send_dropped_count = 0;    // Stale or overflowed uplink packets dropped before sending
+    uint32_t send_late_count = 0;       // Uplink packets sent later than SEND_QUEUE_LATE_THRESHOLD_MS
+    uint32_t downlink_underrun_count = 0;
+    uint32_t decode_buffered_ms = 0;
+    uint32_t playback_start_threshold_ms = 0;
+};
+
 class AudioService {
 public:
     AudioService();
@@ -112,7 +141,7 @@ public:
     void Stop();
     void EncodeWakeWord();
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
-    const std::string& GetLastWakeWord() const;
+    std::string GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     void WaitForPlaybackQueueEmpty();
@@ -129,16 +158,33 @@ public:
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    void SetSendQueueMaxAge(int max_age_ms);
+    void BeginDownlink();
+    void StartDownlinkSentence();
+    void EndDownlink();
+    AudioQueueStatistics GetQueueStatistics();
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Takes over the models. The wake word for them is initialized in the background and replaces the
+    // current one when it is ready, a running detection continues on it without a gap.
     void SetModelsList(srmodel_list_t* models_list);
+    // Drops the wake word before the models it reads in place are unmapped
+    void ReleaseModelsList();
+    // Loads the wake word model ahead of time, so enabling detection later only has to start it
+    bool PreloadWakeWord();
 
 private:
     AudioCodec* codec_ = nullptr;
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
-    std::unique_ptr<WakeWord> wake_word_;
+    // Users copy it under wake_word_mutex_, a models update replaces it while they hold the old one
+    std::shared_ptr<WakeWord> wake_word_;
+    mutable std::mutex wake_word_mutex_;
+    std::condition_variable models_cv_;
+    int models_loading_ = 0;
+    uint32_t models_generation_ = 0;
+    bool wake_word_enabled_ = false;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     void* opus_encoder_ = nullptr;
     void* opus_decoder_ = nullptr;
@@ -156,6 +202,17 @@ private:
     int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int decoder_frame_size_ = 0;
     DebugStatistics debug_statistics_;
+    AudioQueueStatistics queue_statistics_;
+    int send_queue_max_age_ms_ = 0;
+
+    // Downlink buffering state, guarded by audio_queue_mutex_
+    bool downlink_active_ = false;
+    bool downlink_gated_ = false;
+    bool downlink_started_ = false;     // Sentence is playing, an empty queue now means an underrun
+    size_t decode_release_count_ = 0;   // Packets at the front of the decode queue that bypass the gate
+    int decode_queue_duration_ms_ = 0;
+    int playback_start_threshold_ms_ = DOWNLINK_BUFFER_LOW_WATERMARK_MS;
+    uint32_t response_underrun_count_ = 0;
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
@@ -188,8 +245,15 @@ private:
     void AudioOutputTask();
     void OpusCodecTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void DropStaleSendPackets(int64_t now);
+    bool CanDecode() const;
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckAndUpdateAudioPowerState();
+    std::unique_ptr<WakeWord> CreateWakeWord(srmodel_list_t* models_list);
+    void LoadModelsList(srmodel_list_t* models_list, uint32_t generation);
+    std::shared_ptr<WakeWord> GetWakeWord() const;
+    std::shared_ptr<WakeWord> SwapWakeWord(std::shared_ptr<WakeWord> wake_word, srmodel_list_t* models_list, bool initialized);
+    void StartWakeWord();
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include <sstream>
 
 #define DETECTION_RUNNING_EVENT 1
+#define DETECTION_EXIT_EVENT    2
+// How often a running detection task checks whether it has to exit
+#define DETECTION_FETCH_TIMEOUT_MS 100
 
 #define TAG "AfeWakeWord"
 
@@ -16,6 +19,14 @@ AfeWakeWord::AfeWakeWord()
 }
 
 AfeWakeWord::~AfeWakeWord() {
+    // The tasks use AFE and the event group, they have to be gone first
+    xEventGroupSetBits(event_group_, DETECTION_EXIT_EVENT);
+    {
+        std::unique_lock<std::mutex> lock(wake_word_mutex_);
+        wake_word_cv_.wait(lock, [this]() { return !detecting_; });
+    }
+    WaitForEncodeTask();
+
     if (afe_data_ != nullptr) {
         afe_iface_->destroy(afe_data_);
     }
@@ -80,11 +91,23 @@ bool AfeWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
 
-    xTaskCreate([](void* arg) {
+    detecting_ = true;
+    auto ret = xTaskCreate([](void* arg) {
         auto this_ = (AfeWakeWord*)arg;
         this_->AudioDetectionTask();
+        {
+            // Nothing of this_ is touched after the unlock, the destructor may run right away
+            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
+            this_->detecting_ = false;
+            this_->wake_word_cv_.notify_all();
+        }
         vTaskDelete(NULL);
     }, "audio_detection", 4096, this, 3, nullptr);
+    if (ret != pdPASS) {
+        detecting_ = false;
+        ESP_LOGE(TAG, "Failed to create audio detection task");
+        return false;
+    }
 
     return true;
 }
@@ -139,9 +162,12 @@ void AfeWakeWord::AudioDetectionTask() {
         feed_size, fetch_size);
 
     while (true) {
-        xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+        auto bits = xEventGroupWaitBits(event_group_, DETECTION_RUNNING_EVENT | DETECTION_EXIT_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+        if (bits & DETECTION_EXIT_EVENT) {
+            break;
+        }
 
-        auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
+        auto res = afe_iface_->fetch_with_delay(afe_data_, pdMS_TO_TICKS(DETECTION_FETCH_TIMEOUT_MS));
         if (res == nullptr || res->ret_value == ESP_FAIL) {
             continue;;
         }
@@ -171,7 +197,6 @@ void AfeWakeWord::StoreWakeWordData(const int16_t* data, size_t samples) {
 
 void AfeWakeWord::EncodeWakeWordData() {
     const size_t stack_size = 4096 * 6;
-    wake_word_opus_.clear();
     if (wake_word_encode_task_stack_ == nullptr) {
         wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
         assert(wake_word_encode_task_stack_ != nullptr);
@@ -181,6 +206,13 @@ void AfeWakeWord::EncodeWakeWordData() {
         assert(wake_word_encode_task_buffer_ != nullptr);
     }
 
+    // The stack and task buffer are reused, let a previous run finish first
+    WaitForEncodeTask();
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        wake_word_opus_.clear();
+        encoding_ = true;
+    }
     wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
         auto this_ = (AfeWakeWord*)arg;
         {
@@ -191,10 +223,13 @@ void AfeWakeWord::EncodeWakeWordData() {
             auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
             if (encoder_handle == nullptr) {
                 ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-                this_->wake_word_cv_.notify_all();
-                return;
+                {
+                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
+                    this_->wake_word_opus_.push_back(std::vector<uint8_t>());
+                    this_->encoding_ = false;
+                    this_->wake_word_cv_.notify_all();
+                }
+                vTaskDelete(NULL);
             }
             
             // Get frame size
@@ -246,12 +281,27 @@ void AfeWakeWord::EncodeWakeWordData() {
 
             std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
             this_->wake_word_opus_.push_back(std::vector<uint8_t>());
+            this_->encoding_ = false;
             this_->wake_word_cv_.notify_all();
         }
         vTaskDelete(NULL);
     }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
 }
 
+void AfeWakeWord::WaitForEncodeTask() {
+    {
+        std::unique_lock<std::mutex> lock(wake_word_mutex_);
+        wake_word_cv_.wait(lock, [this]() { return !encoding_; });
+    }
+    // The task still runs on its static stack until it deleted itself
+    if (wake_word_encode_task_ != nullptr) {
+        while (eTaskGetState(wake_word_encode_task_) != eDeleted) {
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+        wake_word_encode_task_ = nullptr;
+    }
+}
+
 bool AfeWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
     std::unique_lock<std::mutex> lock(wake_word_mutex_);
     wake_word_cv_.wait(lock, [this]() {
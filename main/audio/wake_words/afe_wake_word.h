@@ -50,6 +50,9 @@ private:
     TaskHandle_t wake_word_encode_task_ = nullptr;
     StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
     StackType_t* wake_word_encode_task_stack_ = nullptr;
+    // Cleared by the tasks under wake_word_mutex_ as they exit, the destructor waits for both
+    bool detecting_ = false;
+    bool encoding_ = false;
     std::deque<std::vector<int16_t>> wake_word_pcm_;
     std::deque<std::vector<uint8_t>> wake_word_opus_;
     std::mutex wake_word_mutex_;
@@ -57,6 +60,7 @@ private:
 
     void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
+    void WaitForEncodeTask();
 };
 
 #endif
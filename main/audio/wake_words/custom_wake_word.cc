@@ -16,6 +16,8 @@ CustomWakeWord::CustomWakeWord()
 }
 
 CustomWakeWord::~CustomWakeWord() {
+    WaitForEncodeTask();
+
     if (multinet_model_data_ != nullptr && multinet_ != nullptr) {
         multinet_->destroy(multinet_model_data_);
         multinet_model_data_ = nullptr;
@@ -217,7 +219,6 @@ void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
 
 void CustomWakeWord::EncodeWakeWordData() {
     const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
     if (wake_word_encode_task_stack_ == nullptr) {
         wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
         assert(wake_word_encode_task_stack_ != nullptr);
@@ -227,6 +228,13 @@ void CustomWakeWord::EncodeWakeWordData() {
         assert(wake_word_encode_task_buffer_ != nullptr);
     }
 
+    // The stack and task buffer are reused, let a previous run finish first
+    WaitForEncodeTask();
+    {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        wake_word_opus_.clear();
+        encoding_ = true;
+    }
     wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
         auto this_ = (CustomWakeWord*)arg;
         {
@@ -237,10 +245,13 @@ void CustomWakeWord::EncodeWakeWordData() {
             auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
             if (encoder_handle == nullptr) {
                 ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-                this_->wake_word_cv_.notify_all();
-                return;
+                {
+                    std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
+                    this_->wake_word_opus_.push_back(std::vector<uint8_t>());
+                    this_->encoding_ = false;
+                    this_->wake_word_cv_.notify_all();
+                }
+                vTaskDelete(NULL);
             }
             // Get frame size
             int frame_size = 0;
@@ -286,12 +297,27 @@ void CustomWakeWord::EncodeWakeWordData() {
 
             std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
             this_->wake_word_opus_.push_back(std::vector<uint8_t>());
+            this_->encoding_ = false;
             this_->wake_word_cv_.notify_all();
         }
         vTaskDelete(NULL);
     }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
 }
 
+void CustomWakeWord::WaitForEncodeTask() {
+    {
+        std::unique_lock<std::mutex> lock(wake_word_mutex_);
+        wake_word_cv_.wait(lock, [this]() { return !encoding_; });
+    }
+    // The task still runs on its static stack until it deleted itself
+    if (wake_word_encode_task_ != nullptr) {
+        while (eTaskGetState(wake_word_encode_task_) != eDeleted) {
+            vTaskDelay(pdMS_TO_TICKS(1));
+        }
+        wake_word_encode_task_ = nullptr;
+    }
+}
+
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
     std::unique_lock<std::mutex> lock(wake_word_mutex_);
     wake_word_cv_.wait(lock, [this]() {
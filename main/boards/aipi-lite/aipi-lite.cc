@@ -9,6 +9,7 @@
 #include <esp_sleep.h>
 
 #include "application.h"
+#include "settings.h"
 #include "button.h"
 #include "codecs/es8311_audio_codec.h"
 #include "config.h"
@@ -163,6 +164,7 @@ class AIPILite : public WifiBoard {
                 !(power_manager_->IsCharging() &&
                   power_manager_->GetBatteryLevel() < 100)) {
                 ESP_LOGI(TAG, "Power button long pressed, shutting down");
+                Settings::Flush();
                 esp_lcd_panel_disp_on_off(panel_, false);  // 关闭显示
                 rtc_gpio_set_level(POWER_CONTROL_PIN, 0);
                 rtc_gpio_hold_dis(POWER_CONTROL_PIN);
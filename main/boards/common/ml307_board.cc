@@ -2,6 +2,7 @@
 
 #include "audio_codec.h"
 #include "display.h"
+#include "application.h"
 
 #include <esp_log.h>
 #include <esp_timer.h>
@@ -190,7 +191,10 @@ std::string Ml307Board::GetDeviceStatusJson() {
      * 返回的JSON结构如下：
      * {
      *     "audio_speaker": {
-     *         "volume": 70
+     *         "volume": 70,
+     *         "downlink_underruns": 0,
+     *         "decode_buffered_ms": 0,
+     *         "playback_start_threshold_ms": 180
      *     },
      *     "screen": {
      *         "brightness": 100,
@@ -216,6 +220,11 @@ std::string Ml307Board::GetDeviceStatusJson() {
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
     }
+    // Downlink buffering, see AudioService
+    auto audio_statistics = Application::GetInstance().GetAudioService().GetQueueStatistics();
+    cJSON_AddNumberToObject(audio_speaker, "downlink_underruns", audio_statistics.downlink_underrun_count);
+    cJSON_AddNumberToObject(audio_speaker, "decode_buffered_ms", audio_statistics.decode_buffered_ms);
+    cJSON_AddNumberToObject(audio_speaker, "playback_start_threshold_ms", audio_statistics.playback_start_threshold_ms);
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
     // Screen brightness
@@ -262,6 +271,9 @@ std::string Ml307Board::GetDeviceStatusJson() {
     }
     cJSON_AddItemToObject(root, "network", network);
 
+    // CPU load and tasks low on stack
+    cJSON_AddItemToObject(root, "system", Application::GetInstance().GetTaskMonitor().GetStatusJson());
+
     auto json_str = cJSON_PrintUnformatted(root);
     std::string json(json_str);
     cJSON_free(json_str);
@@ -216,6 +216,11 @@ std::string Nt26Board::GetDeviceStatusJson() {
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
     }
+    // Downlink buffering, see AudioService
+    auto audio_statistics = Application::GetInstance().GetAudioService().GetQueueStatistics();
+    cJSON_AddNumberToObject(audio_speaker, "downlink_underruns", audio_statistics.downlink_underrun_count);
+    cJSON_AddNumberToObject(audio_speaker, "decode_buffered_ms", audio_statistics.decode_buffered_ms);
+    cJSON_AddNumberToObject(audio_speaker, "playback_start_threshold_ms", audio_statistics.playback_start_threshold_ms);
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
     // Screen
@@ -261,6 +266,9 @@ std::string Nt26Board::GetDeviceStatusJson() {
     }
     cJSON_AddItemToObject(root, "network", network);
 
+    // CPU load and tasks low on stack
+    cJSON_AddItemToObject(root, "system", Application::GetInstance().GetTaskMonitor().GetStatusJson());
+
     auto json_str = cJSON_PrintUnformatted(root);
     std::string json(json_str);
     cJSON_free(json_str);
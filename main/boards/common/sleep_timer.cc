@@ -114,6 +114,8 @@ void SleepTimer::CheckTimer() {
         }
     }
     if (seconds_to_deep_sleep_ != -1 && ticks_ >= seconds_to_deep_sleep_) {
+        // esp_deep_sleep_start() does not run the shutdown handlers that flush the settings
+        Settings::Flush();
         if (on_enter_deep_sleep_mode_) {
             on_enter_deep_sleep_mode_();
         }
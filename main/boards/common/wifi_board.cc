@@ -188,6 +188,8 @@ void WifiBoard::StartWifiConfigMode() {
     xTaskCreate([](void* arg) {
         auto ch = reinterpret_cast<intptr_t>(arg);
         auto& app = Application::GetInstance();
+        // The network may start while the audio service is still being initialized
+        app.GetBootSequence().WaitFor("audio");
         auto& wifi = WifiManager::GetInstance();
         auto disp = Board::GetInstance().GetDisplay();
         audio_wifi_config::ReceiveWifiCredentialsFromAudio(&app, &wifi, disp, ch);
@@ -307,6 +309,11 @@ std::string WifiBoard::GetDeviceStatusJson() {
     if (auto codec = board.GetAudioCodec()) {
         cJSON_AddNumberToObject(audio_speaker, "volume", codec->output_volume());
     }
+    // Downlink buffering, see AudioService
+    auto audio_statistics = Application::GetInstance().GetAudioService().GetQueueStatistics();
+    cJSON_AddNumberToObject(audio_speaker, "downlink_underruns", audio_statistics.downlink_underrun_count);
+    cJSON_AddNumberToObject(audio_speaker, "decode_buffered_ms", audio_statistics.decode_buffered_ms);
+    cJSON_AddNumberToObject(audio_speaker, "playback_start_threshold_ms", audio_statistics.playback_start_threshold_ms);
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
     // Screen
@@ -349,6 +356,9 @@ std::string WifiBoard::GetDeviceStatusJson() {
         cJSON_AddItemToObject(root, "chip", chip);
     }
 
+    // CPU load and tasks low on stack
+    cJSON_AddItemToObject(root, "system", Application::GetInstance().GetTaskMonitor().GetStatusJson());
+
     auto str = cJSON_PrintUnformatted(root);
     std::string result(str);
     cJSON_free(str);
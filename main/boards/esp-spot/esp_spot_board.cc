@@ -8,6 +8,7 @@
 #include <esp_timer.h>
 
 #include "esp_idf_version.h"
+#include "settings.h"
 #include "led/circular_strip.h"
 #include "sdkconfig.h"
 
@@ -340,6 +341,7 @@ private:
         const uint64_t wakeup_mask = (1ULL << KEY_BUTTON_GPIO) | (1ULL << IMU_INT_GPIO);
         ESP_ERROR_CHECK(esp_sleep_enable_ext1_wakeup(wakeup_mask, ESP_EXT1_WAKEUP_ANY_HIGH));
         ESP_LOGI(TAG, "Entering deep sleep, waiting for key or wrist gesture");
+        Settings::Flush();
         esp_deep_sleep_start();
     }
 #endif  // IMU_INT_GPIO
@@ -5,6 +5,7 @@
 #include <esp_timer.h>
 #include <driver/gpio.h>
 #include "adc_battery_estimation.h"
+#include "settings.h"
 #include "power_controller.h"
 #include <driver/rtc_io.h>
 #include <esp_sleep.h>
@@ -170,6 +171,7 @@ public:
                     ESP_ERROR_CHECK(esp_sleep_enable_ext0_wakeup(PWR_BUTTON_GPIO, 0));
                     ESP_ERROR_CHECK(rtc_gpio_pulldown_en(PWR_BUTTON_GPIO)); // 内部下拉
                     ESP_ERROR_CHECK(rtc_gpio_pullup_dis(PWR_BUTTON_GPIO));
+                    Settings::Flush();
                     /* 关闭电源使能 */
                     rtc_gpio_set_level(PWR_EN_GPIO, 0);
                     rtc_gpio_hold_dis(PWR_EN_GPIO);
@@ -11,6 +11,8 @@
 
 #include <math.h>
 
+#include "settings.h"
+
 class PowerManager
 {
 private:
@@ -197,6 +199,8 @@ public:
     }
     void PowerOff(void)
     {
+        // Debounced settings writes would be lost with the power
+        Settings::Flush();
         if (bat_power_pin_ != GPIO_NUM_NC)
         {
             gpio_set_level(bat_power_pin_, 0);
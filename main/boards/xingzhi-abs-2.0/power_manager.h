@@ -8,6 +8,7 @@
 #include "sdkconfig.h"
 #include "button.h"
 #include "board.h"
+#include "settings.h"
 #include "config.h"
 #include "assets/lang_config.h"
 #include <esp_sleep.h>
@@ -288,6 +289,7 @@ public:
     void shutdown() {
         if (!new_charging_status && shutdown_first_) {
             shutdown_first_ = false;
+            Settings::Flush();
             gpio_set_level(DISPLAY_BACKLIGHT_PIN, 0);
             for (int i=1;i<15;i++) {
                 gpio_set_level(Power_Control, 1);
@@ -0,0 +1,222 @@
+#include "boot_sequence.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "BootSequence"
+
+namespace {
+
+struct StageTaskArgs {
+    BootSequence* sequence;
+    int index;
+};
+
+} // namespace
+
+BootSequence::BootSequence() {
+    event_group_ = xEventGroupCreate();
+    // Stage pointers must stay valid while stage tasks run
+    stages_.reserve(BOOT_MAX_STAGES);
+}
+
+BootSequence::~BootSequence() {
+    vEventGroupDelete(event_group_);
+}
+
+void BootSequence::AddStage(const char* name, std::initializer_list<const char*> dependencies, std::function<void()>&& function,
+    BootStageKind kind, BaseType_t core, uint32_t stack_size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stages_.size() >= BOOT_MAX_STAGES) {
+        ESP_LOGE(TAG, "Too many boot stages, running %s now", name);
+        lock.unlock();
+        function();
+        return;
+    }
+
+    Stage stage;
+    stage.name = name;
+    stage.function = std::move(function);
+    stage.kind = kind;
+    stage.core = core < portNUM_PROCESSORS ? core : tskNO_AFFINITY;
+    stage.stack_size = stack_size;
+    for (auto dependency : dependencies) {
+        int index = FindStage(dependency);
+        if (index < 0) {
+            ESP_LOGE(TAG, "Stage %s depends on unknown stage %s", name, dependency);
+            continue;
+        }
+        stage.dependencies.push_back(index);
+    }
+    stages_.push_back(std::move(stage));
+}
+
+int BootSequence::FindStage(const char* name) {
+    for (size_t i = 0; i < stages_.size(); i++) {
+        if (stages_[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void BootSequence::Run() {
+    EventBits_t critical_bits = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < stages_.size(); i++) {
+            if (stages_[i].kind == kBootStageCritical) {
+                critical_bits |= 1 << i;
+            }
+        }
+        StartReadyStages();
+    }
+    if (critical_bits != 0) {
+        xEventGroupWaitBits(event_group_, critical_bits, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    Mark("critical_stages_done");
+}
+
+void BootSequence::WaitFor(const char* name) {
+    int index;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index = FindStage(name);
+    }
+    if (index >= 0) {
+        xEventGroupWaitBits(event_group_, 1 << index, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+}
+
+bool BootSequence::IsDone(const char* name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int index = FindStage(name);
+    return index >= 0 && (done_bits_ & (1 << index));
+}
+
+// Called with mutex_ held
+void BootSequence::StartReadyStages() {
+    bool rescan = true;
+    while (rescan) {
+        rescan = false;
+        for (size_t i = 0; i < stages_.size(); i++) {
+            auto& stage = stages_[i];
+            if (stage.started) {
+                continue;
+            }
+            bool ready = true;
+            for (int dependency : stage.dependencies) {
+                if (!(done_bits_ & (1 << dependency))) {
+                    ready = false;
+                    break;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+
+            stage.started = true;
+            auto args = new StageTaskArgs{this, (int)i};
+            UBaseType_t priority = stage.kind == kBootStageCritical ? BOOT_STAGE_PRIORITY : BOOT_BACKGROUND_PRIORITY;
+            auto ret = xTaskCreatePinnedToCore([](void* arg) {
+                auto args = static_cast<StageTaskArgs*>(arg);
+                args->sequence->RunStage(args->index);
+                delete args;
+                vTaskDelete(NULL);
+            }, stage.name.c_str(), stage.stack_size, args, priority, nullptr, stage.core);
+            if (ret != pdPASS) {
+                // Out of memory this early is fatal anyway, but never leave dependants waiting forever
+                ESP_LOGE(TAG, "Failed to create task for stage %s", stage.name.c_str());
+                delete args;
+                stage.start_time = stage.end_time = esp_timer_get_time();
+                done_bits_ |= 1 << i;
+                xEventGroupSetBits(event_group_, 1 << i);
+                rescan = true;
+            }
+        }
+    }
+}
+
+void BootSequence::RunStage(int index) {
+    auto& stage = stages_[index];
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stage.start_time = esp_timer_get_time();
+        stage.running_core = xPortGetCoreID();
+    }
+
+    stage.function();
+    // Release the captures, the stage never runs again
+    stage.function = nullptr;
+
+    bool all_done;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stage.end_time = esp_timer_get_time();
+        done_bits_ |= 1 << index;
+        all_done = done_bits_ == (EventBits_t)((1 << stages_.size()) - 1);
+        ESP_LOGI(TAG, "Stage %s done in %lld us on core %d", stage.name.c_str(),
+            stage.end_time - stage.start_time, stage.running_core);
+        StartReadyStages();
+    }
+    xEventGroupSetBits(event_group_, 1 << index);
+
+    if (all_done) {
+        PrintTimeline();
+    }
+}
+
+void BootSequence::Mark(const char* milestone) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& m : milestones_) {
+        if (m.name == milestone) {
+            return;
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    milestones_.push_back({milestone, now});
+    ESP_LOGI(TAG, "Milestone %s at %lld ms", milestone, now / 1000);
+}
+
+void BootSequence::PrintTimeline() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ESP_LOGI(TAG, "Boot timeline (us since boot):");
+    for (auto& stage : stages_) {
+        if (stage.end_time == 0) {
+            ESP_LOGI(TAG, "  %-16s %s", stage.name.c_str(), stage.started ? "running" : "waiting");
+            continue;
+        }
+        ESP_LOGI(TAG, "  %-16s core %2d  start %9lld  end %9lld  took %9lld", stage.name.c_str(), stage.running_core,
+            stage.start_time, stage.end_time, stage.end_time - stage.start_time);
+    }
+    for (auto& milestone : milestones_) {
+        ESP_LOGI(TAG, "  %-16s at %9lld", milestone.name.c_str(), milestone.time);
+    }
+}
+
+cJSON* BootSequence::GetTimelineJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+    cJSON* stages = cJSON_CreateArray();
+    for (auto& stage : stages_) {
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", stage.name.c_str());
+        cJSON_AddBoolToObject(item, "critical", stage.kind == kBootStageCritical);
+        if (stage.start_time != 0) {
+            cJSON_AddNumberToObject(item, "core", stage.running_core);
+            cJSON_AddNumberToObject(item, "start_us", stage.start_time);
+        }
+        if (stage.end_time != 0) {
+            cJSON_AddNumberToObject(item, "duration_us", stage.end_time - stage.start_time);
+        }
+        cJSON_AddItemToArray(stages, item);
+    }
+    cJSON_AddItemToObject(json, "stages", stages);
+
+    cJSON* milestones = cJSON_CreateObject();
+    for (auto& milestone : milestones_) {
+        cJSON_AddNumberToObject(milestones, milestone.name.c_str(), milestone.time);
+    }
+    cJSON_AddItemToObject(json, "milestones_us", milestones);
+    return json;
+}
@@ -0,0 +1,87 @@
+#ifndef BOOT_SEQUENCE_H
+#define BOOT_SEQUENCE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cJSON.h>
+
+// One event group bit per stage
+#define BOOT_MAX_STAGES         24
+// Stages run code that used to run on the main task
+#define BOOT_STAGE_STACK_SIZE   CONFIG_ESP_MAIN_TASK_STACK_SIZE
+#define BOOT_STAGE_PRIORITY     5
+// Background stages must not compete with the audio and main tasks once the device is up
+#define BOOT_BACKGROUND_PRIORITY 2
+
+enum BootStageKind {
+    kBootStageCritical,     // Run() waits for it
+    kBootStageBackground,   // Keeps running after Run() returned, use WaitFor() before relying on it
+};
+
+/*
+ * Dependency-declared initialization graph. Every stage runs in its own short-lived task as soon as
+ * all of its dependencies finished, so independent stages run concurrently on both cores.
+ * Start and end times (microseconds since boot) of every stage and of named milestones are kept
+ * for the boot timeline.
+ */
+class BootSequence {
+public:
+    BootSequence();
+    ~BootSequence();
+
+    // Dependencies must have been added before. core is a core id or tskNO_AFFINITY.
+    void AddStage(const char* name, std::initializer_list<const char*> dependencies, std::function<void()>&& function,
+        BootStageKind kind = kBootStageCritical, BaseType_t core = tskNO_AFFINITY, uint32_t stack_size = BOOT_STAGE_STACK_SIZE);
+
+    // Starts the graph and returns once all critical stages finished
+    void Run();
+    // Blocks until the stage finished, returns immediately for unknown stages
+    void WaitFor(const char* name);
+    bool IsDone(const char* name);
+
+    // Records the first time a milestone is reached, e.g. "wake_word_ready"
+    void Mark(const char* milestone);
+
+    void PrintTimeline();
+    cJSON* GetTimelineJson();
+
+private:
+    struct Stage {
+        std::string name;
+        std::vector<int> dependencies;
+        std::function<void()> function;
+        BootStageKind kind;
+        BaseType_t core;
+        uint32_t stack_size;
+        bool started = false;
+        int running_core = -1;
+        int64_t start_time = 0;
+        int64_t end_time = 0;
+    };
+
+    struct Milestone {
+        std::string name;
+        int64_t time;
+    };
+
+    std::mutex mutex_;
+    std::vector<Stage> stages_;
+    std::vector<Milestone> milestones_;
+    EventGroupHandle_t event_group_ = nullptr;
+    EventBits_t done_bits_ = 0;
+
+    int FindStage(const char* name);
+    void StartReadyStages();
+    void RunStage(int index);
+};
+
+#endif // BOOT_SEQUENCE_H
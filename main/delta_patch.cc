@@ -0,0 +1,269 @@
+#include "delta_patch.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "DeltaPatch"
+
+#define DELTA_OP_END        0x00
+#define DELTA_OP_COPY       0x01
+#define DELTA_OP_INSERT     0x02
+
+static uint32_t ReadUint32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+DeltaPatcher::DeltaPatcher(HeaderCallback on_header, Reader reader, Writer writer)
+    : on_header_(std::move(on_header)), reader_(std::move(reader)), writer_(std::move(writer)) {
+    mbedtls_sha256_init(&sha256_);
+    mbedtls_sha256_starts(&sha256_, 0);
+}
+
+DeltaPatcher::~DeltaPatcher() {
+    mbedtls_sha256_free(&sha256_);
+}
+
+bool DeltaPatcher::IsPatch(const char* data, size_t length) {
+    return length >= 4 && memcmp(data, DELTA_PATCH_MAGIC, 4) == 0;
+}
+
+bool DeltaPatcher::HashPartition(const esp_partition_t* partition, size_t size, uint8_t sha256[32]) {
+    if (size > partition->size) {
+        return false;
+    }
+    auto buffer = std::make_unique<char[]>(DELTA_PATCH_COPY_SIZE);
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+    bool success = true;
+    for (size_t offset = 0; offset < size; offset += DELTA_PATCH_COPY_SIZE) {
+        size_t length = std::min(size - offset, (size_t)DELTA_PATCH_COPY_SIZE);
+        if (esp_partition_read(partition, offset, buffer.get(), length) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read partition %s at 0x%x", partition->label, offset);
+            success = false;
+            break;
+        }
+        mbedtls_sha256_update(&context, (const unsigned char*)buffer.get(), length);
+    }
+    mbedtls_sha256_finish(&context, sha256);
+    mbedtls_sha256_free(&context);
+    return success;
+}
+
+size_t DeltaPatcher::PendingNeeded() const {
+    switch (state_) {
+    case kStateHeader:
+        return DELTA_PATCH_HEADER_SIZE;
+    case kStateCopyArguments:
+        return 8;
+    case kStateInsertLength:
+        return 4;
+    default:
+        return 1;
+    }
+}
+
+bool DeltaPatcher::Feed(const char* data, size_t length) {
+    if (failed_) {
+        return false;
+    }
+    while (length > 0) {
+        if (state_ == kStateEnd) {
+            ESP_LOGE(TAG, "Unexpected data after the end of the patch");
+            failed_ = true;
+            return false;
+        }
+
+        if (state_ == kStateInsertData) {
+            size_t size = std::min(length, (size_t)insert_remaining_);
+            if (!Output(data, size)) {
+                failed_ = true;
+                return false;
+            }
+            data += size;
+            length -= size;
+            insert_remaining_ -= size;
+            if (insert_remaining_ == 0) {
+                state_ = kStateOpcode;
+            }
+            continue;
+        }
+
+        // Opcodes and their arguments may be split across pieces, collect them first
+        size_t needed = PendingNeeded();
+        size_t size = std::min(length, needed - pending_size_);
+        memcpy(pending_ + pending_size_, data, size);
+        pending_size_ += size;
+        data += size;
+        length -= size;
+        if (pending_size_ < needed) {
+            break;
+        }
+        pending_size_ = 0;
+        if (!Process()) {
+            failed_ = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DeltaPatcher::Process() {
+    switch (state_) {
+    case kStateHeader:
+        if (memcmp(pending_, DELTA_PATCH_MAGIC, 4) != 0) {
+            ESP_LOGE(TAG, "Invalid patch magic");
+            return false;
+        }
+        header_.block_size = ReadUint32(pending_ + 4);
+        header_.source_size = ReadUint32(pending_ + 8);
+        memcpy(header_.source_sha256, pending_ + 12, 32);
+        header_.target_size = ReadUint32(pending_ + 44);
+        memcpy(header_.target_sha256, pending_ + 48, 32);
+        ESP_LOGI(TAG, "Patch from %lu to %lu bytes, block size %lu", header_.source_size, header_.target_size, header_.block_size);
+        if (!on_header_(header_)) {
+            return false;
+        }
+        if (header_.block_size != 0) {
+            copy_buffer_ = std::make_unique<char[]>(std::min((size_t)header_.block_size, (size_t)DELTA_PATCH_COPY_SIZE));
+        } else {
+            copy_buffer_ = std::make_unique<char[]>(DELTA_PATCH_COPY_SIZE);
+        }
+        state_ = kStateOpcode;
+        return true;
+    case kStateOpcode:
+        switch (pending_[0]) {
+        case DELTA_OP_END:
+            state_ = kStateEnd;
+            return true;
+        case DELTA_OP_COPY:
+            state_ = kStateCopyArguments;
+            return true;
+        case DELTA_OP_INSERT:
+            state_ = kStateInsertLength;
+            return true;
+        default:
+            ESP_LOGE(TAG, "Invalid patch opcode: 0x%02x", pending_[0]);
+            return false;
+        }
+    case kStateCopyArguments:
+        state_ = kStateOpcode;
+        return Copy(ReadUint32(pending_), ReadUint32(pending_ + 4));
+    case kStateInsertLength:
+        insert_remaining_ = ReadUint32(pending_);
+        state_ = insert_remaining_ > 0 ? kStateInsertData : kStateOpcode;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool DeltaPatcher::Copy(uint32_t offset, uint32_t length) {
+    if ((uint64_t)offset + length > header_.source_size) {
+        ESP_LOGE(TAG, "Copy out of the source: offset %lu, length %lu", offset, length);
+        return false;
+    }
+    // Read in pieces that do not cross a block, in place patches check every piece against the rewritten blocks
+    size_t piece_size = header_.block_size != 0 ? std::min((size_t)header_.block_size, (size_t)DELTA_PATCH_COPY_SIZE) : DELTA_PATCH_COPY_SIZE;
+    while (length > 0) {
+        size_t size = std::min((size_t)length, piece_size - offset % piece_size);
+        if (!reader_(offset, copy_buffer_.get(), size) || !Output(copy_buffer_.get(), size)) {
+            return false;
+        }
+        offset += size;
+        length -= size;
+    }
+    return true;
+}
+
+bool DeltaPatcher::Output(const char* data, size_t length) {
+    if (output_size_ + length > header_.target_size) {
+        ESP_LOGE(TAG, "Patch output exceeds the target size %lu", header_.target_size);
+        return false;
+    }
+    mbedtls_sha256_update(&sha256_, (const unsigned char*)data, length);
+    output_size_ += length;
+    return writer_(data, length);
+}
+
+bool DeltaPatcher::Finish() {
+    if (failed_ || state_ != kStateEnd) {
+        ESP_LOGE(TAG, "Patch is incomplete");
+        return false;
+    }
+    if (output_size_ != header_.target_size) {
+        ESP_LOGE(TAG, "Patch output size %u does not match the target size %lu", output_size_, header_.target_size);
+        return false;
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&sha256_, sha256);
+    if (memcmp(sha256, header_.target_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGE(TAG, "Patch output does not match the target hash");
+        return false;
+    }
+    return true;
+}
+
+InPlacePartitionWriter::InPlacePartitionWriter(const esp_partition_t* partition)
+    : partition_(partition), sector_size_(partition->erase_size) {
+    sector_ = std::make_unique<char[]>(sector_size_);
+}
+
+bool InPlacePartitionWriter::Read(size_t offset, void* buffer, size_t length) {
+    if (offset < sector_offset_) {
+        ESP_LOGE(TAG, "Patch reads 0x%x, which was already rewritten", offset);
+        return false;
+    }
+    return esp_partition_read(partition_, offset, buffer, length) == ESP_OK;
+}
+
+bool InPlacePartitionWriter::SectorChanged() {
+    char buffer[256];
+    for (size_t i = 0; i < sector_fill_; i += sizeof(buffer)) {
+        size_t size = std::min(sector_fill_ - i, sizeof(buffer));
+        if (esp_partition_read(partition_, sector_offset_ + i, buffer, size) != ESP_OK ||
+            memcmp(buffer, sector_.get() + i, size) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool InPlacePartitionWriter::Flush() {
+    if (sector_fill_ == 0) {
+        return true;
+    }
+    if (SectorChanged()) {
+        if (sector_offset_ + sector_size_ > partition_->size) {
+            ESP_LOGE(TAG, "Patch output exceeds the partition size");
+            return false;
+        }
+        esp_err_t err = esp_partition_erase_range(partition_, sector_offset_, sector_size_);
+        if (err == ESP_OK) {
+            err = esp_partition_write(partition_, sector_offset_, sector_.get(), sector_fill_);
+        }
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to rewrite sector at 0x%x: %s", sector_offset_, esp_err_to_name(err));
+            return false;
+        }
+        rewritten_sectors_++;
+    }
+    sector_offset_ += sector_size_;
+    sector_fill_ = 0;
+    return true;
+}
+
+bool InPlacePartitionWriter::Write(const char* data, size_t length) {
+    while (length > 0) {
+        size_t size = std::min(length, sector_size_ - sector_fill_);
+        memcpy(sector_.get() + sector_fill_, data, size);
+        sector_fill_ += size;
+        data += size;
+        length -= size;
+        if (sector_fill_ == sector_size_ && !Flush()) {
+            return false;
+        }
+    }
+    return true;
+}
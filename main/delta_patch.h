@@ -0,0 +1,103 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#define DELTA_PATCH_MAGIC           "XZD1"
+#define DELTA_PATCH_HEADER_SIZE     80
+#define DELTA_PATCH_COPY_SIZE       4096
+
+struct DeltaPatchHeader {
+    uint32_t block_size;        // 0: written to another partition, otherwise patched in place in blocks of this size
+    uint32_t source_size;
+    uint8_t source_sha256[32];
+    uint32_t target_size;
+    uint8_t target_sha256[32];
+};
+
+/*
+ * Streaming applier of the delta patches made by scripts/delta_patch.py. The patch is fed in pieces of
+ * any size while it downloads, COPY ops read the old image through the reader and the output goes to the
+ * writer in order. The output is hashed and checked against the header in Finish().
+ */
+class DeltaPatcher {
+public:
+    // Called once the header arrived, before any output. Check the source here.
+    using HeaderCallback = std::function<bool(const DeltaPatchHeader& header)>;
+    using Reader = std::function<bool(size_t offset, void* buffer, size_t length)>;
+    using Writer = std::function<bool(const char* data, size_t length)>;
+
+    DeltaPatcher(HeaderCallback on_header, Reader reader, Writer writer);
+    ~DeltaPatcher();
+
+    static bool IsPatch(const char* data, size_t length);
+    static bool HashPartition(const esp_partition_t* partition, size_t size, uint8_t sha256[32]);
+
+    bool Feed(const char* data, size_t length);
+    // Returns true if the patch ended and the output matches the target hash
+    bool Finish();
+
+private:
+    enum State {
+        kStateHeader,
+        kStateOpcode,
+        kStateCopyArguments,
+        kStateInsertLength,
+        kStateInsertData,
+        kStateEnd,
+    };
+
+    HeaderCallback on_header_;
+    Reader reader_;
+    Writer writer_;
+    State state_ = kStateHeader;
+    bool failed_ = false;
+    uint8_t pending_[DELTA_PATCH_HEADER_SIZE];
+    size_t pending_size_ = 0;
+    uint32_t insert_remaining_ = 0;
+    DeltaPatchHeader header_ = {};
+    size_t output_size_ = 0;
+    mbedtls_sha256_context sha256_;
+    std::unique_ptr<char[]> copy_buffer_;
+
+    size_t PendingNeeded() const;
+    bool Process();
+    bool Copy(uint32_t offset, uint32_t length);
+    bool Output(const char* data, size_t length);
+};
+
+/*
+ * Reader and writer for a patch applied in place: the output replaces the partition one sector at a time,
+ * sectors that did not change are neither erased nor written. Reads from sectors that were already
+ * rewritten fail, scripts/delta_patch.py never emits them.
+ */
+class InPlacePartitionWriter {
+public:
+    InPlacePartitionWriter(const esp_partition_t* partition);
+
+    size_t sector_size() const { return sector_size_; }
+    size_t rewritten_sectors() const { return rewritten_sectors_; }
+
+    bool Read(size_t offset, void* buffer, size_t length);
+    bool Write(const char* data, size_t length);
+    // Writes the last, partial sector
+    bool Flush();
+
+private:
+    const esp_partition_t* partition_;
+    size_t sector_size_;
+    std::unique_ptr<char[]> sector_;
+    size_t sector_offset_ = 0;
+    size_t sector_fill_ = 0;
+    size_t rewritten_sectors_ = 0;
+
+    bool SectorChanged();
+};
+
+#endif // DELTA_PATCH_H
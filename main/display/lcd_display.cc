@@ -15,6 +15,7 @@
 #include <src/misc/cache/lv_cache.h>
 
 #include "board.h"
+#include "heap_profiler.h"
 
 #define TAG "LcdDisplay"
 
@@ -352,6 +353,7 @@ void LcdDisplay::Unlock() {
 
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
 void LcdDisplay::SetupUI() {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     // Prevent duplicate calls - if already called, return early
     if (setup_ui_called_) {
         ESP_LOGW(TAG, "SetupUI() called multiple times, skipping duplicate call");
@@ -502,6 +504,7 @@ void LcdDisplay::SetupUI() {
 #define  MAX_MESSAGES 20
 #endif
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     if (!setup_ui_called_) {
         ESP_LOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
     }
@@ -698,6 +701,7 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
 }
 
 void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     DisplayLockGuard lock(this);
     if (content_ == nullptr) {
         return;
@@ -802,6 +806,7 @@ void LcdDisplay::ClearChatMessages() {
 }
 #else
 void LcdDisplay::SetupUI() {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     // Prevent duplicate calls - if already called, return early
     if (setup_ui_called_) {
         ESP_LOGW(TAG, "SetupUI() called multiple times, skipping duplicate call");
@@ -995,6 +1000,7 @@ void LcdDisplay::SetupUI() {
 }
 
 void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     DisplayLockGuard lock(this);
     if (preview_image_ == nullptr) {
         ESP_LOGE(TAG, "Preview image is not initialized");
@@ -1031,6 +1037,7 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 }
 
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     if (!setup_ui_called_) {
         ESP_LOGW(TAG, "SetChatMessage('%s', '%s') called before SetupUI() - message will be lost!", role, content);
     }
@@ -1072,6 +1079,7 @@ void LcdDisplay::ClearChatMessages() {
 #endif
 
 void LcdDisplay::SetEmotion(const char* emotion) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     if (!setup_ui_called_) {
         ESP_LOGW(TAG, "SetEmotion('%s') called before SetupUI() - emotion will not be displayed!", emotion);
     }
@@ -1083,11 +1091,14 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     }
 
     auto emoji_collection = static_cast<LvglTheme*>(current_theme_)->emoji_collection();
-    auto image = emoji_collection != nullptr ? emoji_collection->GetEmojiImage(emotion) : nullptr;
-    if (image == nullptr) {
+    auto image = emoji_collection != nullptr ? emoji_collection->GetSharedEmojiImage(emotion) : nullptr;
+
+    DisplayLockGuard lock(this);
+    // A compressed emoji is inflated here and may fail to load, then the icon font is used like for a missing emoji
+    auto image_dsc = image != nullptr ? image->image_dsc() : nullptr;
+    if (image_dsc == nullptr) {
         const char* utf8 = font_awesome_get_utf8(emotion);
         if (utf8 != nullptr && emoji_label_ != nullptr) {
-            DisplayLockGuard lock(this);
             if (gif_controller_) {
                 gif_controller_->Stop();
                 gif_controller_.reset();
@@ -1095,11 +1106,14 @@ void LcdDisplay::SetEmotion(const char* emotion) {
             lv_label_set_text(emoji_label_, utf8);
             lv_obj_add_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
             lv_obj_remove_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
+            if (current_emoji_image_ != nullptr) {
+                current_emoji_image_->Unload();
+                current_emoji_image_.reset();
+            }
         }
         return;
     }
 
-    DisplayLockGuard lock(this);
     // Stop any running GIF animation in the same lock scope as setting new image
     // to prevent LVGL from accessing freed image data between operations
     if (gif_controller_) {
@@ -1108,7 +1122,7 @@ void LcdDisplay::SetEmotion(const char* emotion) {
     }
     if (image->IsGif()) {
         // Create new GIF controller
-        gif_controller_ = std::make_unique<LvglGif>(image->image_dsc());
+        gif_controller_ = std::make_unique<LvglGif>(image_dsc);
         
         if (gif_controller_->IsLoaded()) {
             // Set up frame update callback
@@ -1128,10 +1142,15 @@ void LcdDisplay::SetEmotion(const char* emotion) {
             gif_controller_.reset();
         }
     } else {
-        lv_image_set_src(emoji_image_, image->image_dsc());
+        lv_image_set_src(emoji_image_, image_dsc);
         lv_obj_add_flag(emoji_label_, LV_OBJ_FLAG_HIDDEN);
         lv_obj_remove_flag(emoji_image_, LV_OBJ_FLAG_HIDDEN);
     }
+    // Compressed emoji are only kept inflated while they are shown
+    if (current_emoji_image_ != nullptr && current_emoji_image_ != image) {
+        current_emoji_image_->Unload();
+    }
+    current_emoji_image_ = image;
 
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
     // In WeChat message style, if emotion is neutral, don't display it
@@ -1150,6 +1169,7 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 }
 
 void LcdDisplay::SetTheme(Theme* theme) {
+    HeapTagScope heap_tag(kHeapTagDisplay);
     DisplayLockGuard lock(this);
     
     auto lvgl_theme = static_cast<LvglTheme*>(theme);
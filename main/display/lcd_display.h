@@ -30,6 +30,8 @@ protected:
     lv_obj_t* emoji_label_ = nullptr;
     lv_obj_t* emoji_image_ = nullptr;
     std::unique_ptr<LvglGif> gif_controller_ = nullptr;
+    // The image emoji_image_ shows, kept alive when the theme gets a new emoji collection
+    std::shared_ptr<LvglImage> current_emoji_image_;
     lv_obj_t* emoji_box_ = nullptr;
     lv_obj_t* chat_message_label_ = nullptr;
     esp_timer_handle_t preview_timer_ = nullptr;
@@ -7,10 +7,18 @@
 #define TAG "EmojiCollection"
 
 void EmojiCollection::AddEmoji(const std::string& name, LvglImage* image) {
-    emoji_collection_[name] = image;
+    emoji_collection_[name] = std::shared_ptr<LvglImage>(image);
+}
+
+void EmojiCollection::AddEmoji(const std::string& name, std::shared_ptr<LvglImage> image) {
+    emoji_collection_[name] = std::move(image);
 }
 
 const LvglImage* EmojiCollection::GetEmojiImage(const char* name) {
+    return GetSharedEmojiImage(name).get();
+}
+
+std::shared_ptr<LvglImage> EmojiCollection::GetSharedEmojiImage(const char* name) {
     auto it = emoji_collection_.find(name);
     if (it != emoji_collection_.end()) {
         return it->second;
@@ -20,13 +28,6 @@ const LvglImage* EmojiCollection::GetEmojiImage(const char* name) {
     return nullptr;
 }
 
-EmojiCollection::~EmojiCollection() {
-    for (auto it = emoji_collection_.begin(); it != emoji_collection_.end(); ++it) {
-        delete it->second;
-    }
-    emoji_collection_.clear();
-}
-
 // These are declared in xiaozhi-fonts/src/font_emoji_32.c
 extern const lv_image_dsc_t emoji_1f636_32; // neutral
 extern const lv_image_dsc_t emoji_1f642_32; // happy
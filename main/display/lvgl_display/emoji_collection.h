@@ -14,11 +14,15 @@
 class EmojiCollection {
 public:
     virtual void AddEmoji(const std::string& name, LvglImage* image);
+    // Images can be shared between collections, e.g. the ones an assets update did not change
+    virtual void AddEmoji(const std::string& name, std::shared_ptr<LvglImage> image);
     virtual const LvglImage* GetEmojiImage(const char* name);
-    virtual ~EmojiCollection();
+    // Holding the image keeps it valid after the collection is replaced
+    virtual std::shared_ptr<LvglImage> GetSharedEmojiImage(const char* name);
+    virtual ~EmojiCollection() = default;
 
 private:
-    std::map<std::string, LvglImage*> emoji_collection_;
+    std::map<std::string, std::shared_ptr<LvglImage>> emoji_collection_;
 };
 
 class Twemoji32 : public EmojiCollection {
@@ -24,6 +24,43 @@ bool LvglRawImage::IsGif() const {
     return ptr[0] == 'G' && ptr[1] == 'I' && ptr[2] == 'F';
 }
 
+LvglLazyImage::LvglLazyImage(size_t size, std::function<uint8_t*()> load) : load_(load) {
+    bzero(&image_dsc_, sizeof(image_dsc_));
+    image_dsc_.data_size = size;
+    image_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
+    image_dsc_.header.cf = LV_COLOR_FORMAT_RAW_ALPHA;
+}
+
+LvglLazyImage::~LvglLazyImage() {
+    Unload();
+}
+
+const lv_img_dsc_t* LvglLazyImage::image_dsc() const {
+    if (image_dsc_.data == nullptr) {
+        image_dsc_.data = load_();
+        if (image_dsc_.data == nullptr) {
+            ESP_LOGE(TAG, "Failed to load image of %lu bytes", image_dsc_.data_size);
+            return nullptr;
+        }
+    }
+    return &image_dsc_;
+}
+
+bool LvglLazyImage::IsGif() const {
+    auto dsc = image_dsc();
+    if (dsc == nullptr || dsc->data_size < 3) {
+        return false;
+    }
+    return dsc->data[0] == 'G' && dsc->data[1] == 'I' && dsc->data[2] == 'F';
+}
+
+void LvglLazyImage::Unload() {
+    if (image_dsc_.data != nullptr) {
+        heap_caps_free((void*)image_dsc_.data);
+        image_dsc_.data = nullptr;
+    }
+}
+
 LvglCBinImage::LvglCBinImage(void* data) {
     image_dsc_ = cbin_img_dsc_create(static_cast<uint8_t*>(data));
 }
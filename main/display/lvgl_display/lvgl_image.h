@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lvgl.h>
+#include <functional>
 
 
 // Wrap around lv_img_dsc_t
@@ -8,6 +9,8 @@ class LvglImage {
 public:
     virtual const lv_img_dsc_t* image_dsc() const = 0;
     virtual bool IsGif() const { return false; }
+    // Drops data that can be loaded again, called once the image is no longer drawn
+    virtual void Unload() {}
     virtual ~LvglImage() = default;
 };
 
@@ -22,6 +25,21 @@ private:
     lv_img_dsc_t image_dsc_;
 };
 
+// Raw image whose data is loaded on first draw, for emoji stored compressed in the assets partition.
+// The loader returns a buffer from heap_caps_malloc of the given size, or nullptr.
+class LvglLazyImage : public LvglImage {
+public:
+    LvglLazyImage(size_t size, std::function<uint8_t*()> load);
+    virtual ~LvglLazyImage();
+    virtual const lv_img_dsc_t* image_dsc() const override;
+    virtual bool IsGif() const override;
+    virtual void Unload() override;
+
+private:
+    std::function<uint8_t*()> load_;
+    mutable lv_img_dsc_t image_dsc_;
+};
+
 class LvglCBinImage : public LvglImage {
 public:
     LvglCBinImage(void* data);
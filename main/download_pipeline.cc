@@ -0,0 +1,289 @@
+#include "download_pipeline.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+
+#define TAG "DownloadPipeline"
+
+DownloadPipeline::DownloadPipeline(size_t chunk_size, int chunk_count) : chunk_size_(chunk_size) {
+    for (int i = 0; i < chunk_count; i++) {
+        Chunk chunk;
+#if CONFIG_SPIRAM
+        chunk.data = (char*)heap_caps_malloc(chunk_size, MALLOC_CAP_SPIRAM);
+#endif
+        if (chunk.data == nullptr) {
+            chunk.data = (char*)heap_caps_malloc(chunk_size, MALLOC_CAP_INTERNAL);
+        }
+        if (chunk.data == nullptr) {
+            ESP_LOGW(TAG, "Failed to allocate chunk %d", i);
+            break;
+        }
+        chunks_.push_back(chunk);
+    }
+}
+
+DownloadPipeline::~DownloadPipeline() {
+    for (auto& chunk : chunks_) {
+        heap_caps_free(chunk.data);
+    }
+}
+
+bool DownloadPipeline::Run(Http* http, size_t offset, size_t total_length, Sink sink, ProgressCallback progress_callback, Prepare prepare) {
+    if (chunks_.empty()) {
+        ESP_LOGE(TAG, "Failed to allocate buffer");
+        return false;
+    }
+
+    sink_ = std::move(sink);
+    prepare_ = std::move(prepare);
+    free_chunks_.clear();
+    ready_chunks_.clear();
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        free_chunks_.push_back(i);
+    }
+    reader_done_ = false;
+    failed_ = false;
+    written_ = 0;
+    writer_running_ = true;
+
+    auto ret = xTaskCreate([](void* arg) {
+        auto pipeline = static_cast<DownloadPipeline*>(arg);
+        pipeline->WriterLoop();
+        vTaskDelete(NULL);
+    }, "download_writer", DOWNLOAD_WRITER_STACK_SIZE, this, uxTaskPriorityGet(NULL), nullptr);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create writer task");
+        return false;
+    }
+
+    size_t total_read = 0;
+    size_t recent_read = 0;
+    bool read_failed = false;
+    auto last_calc_time = esp_timer_get_time();
+    while (!read_failed) {
+        int index;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return !free_chunks_.empty() || failed_; });
+            if (failed_) {
+                break;
+            }
+            index = free_chunks_.front();
+            free_chunks_.pop_front();
+        }
+
+        // Fill the chunk completely, so the writer always gets large aligned writes
+        auto& chunk = chunks_[index];
+        chunk.offset = offset + total_read;
+        chunk.length = 0;
+        bool end_of_body = false;
+        while (chunk.length < chunk_size_) {
+            if (throttle_) {
+                throttle_();
+            }
+            int ret = http->Read(chunk.data + chunk.length, chunk_size_ - chunk.length);
+            if (ret < 0) {
+                ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
+                read_failed = true;
+                break;
+            }
+
+            chunk.length += ret;
+            total_read += ret;
+            recent_read += ret;
+            end_of_body = ret == 0 || offset + total_read >= total_length;
+
+            // Calculate speed and progress every second
+            if (esp_timer_get_time() - last_calc_time >= 1000000 || end_of_body) {
+                size_t progress = (offset + total_read) * 100 / total_length;
+                ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, offset + total_read, total_length, recent_read);
+                if (progress_callback) {
+                    progress_callback(progress, recent_read);
+                }
+                last_calc_time = esp_timer_get_time();
+                recent_read = 0;
+            }
+            if (end_of_body) {
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (chunk.length > 0 && !read_failed) {
+            ready_chunks_.push_back(index);
+        } else {
+            free_chunks_.push_back(index);
+        }
+        cv_.notify_all();
+        if (end_of_body) {
+            break;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    reader_done_ = true;
+    if (read_failed) {
+        failed_ = true;
+    }
+    cv_.notify_all();
+    cv_.wait(lock, [this]() { return !writer_running_; });
+
+    sink_ = nullptr;
+    prepare_ = nullptr;
+    if (failed_) {
+        return false;
+    }
+    if (offset + written_ != total_length) {
+        ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", offset + written_, total_length);
+        return false;
+    }
+    return true;
+}
+
+void DownloadPipeline::WriterLoop() {
+    bool can_prepare = prepare_ != nullptr;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        // Only after the first chunk, so the sink has seen what kind of download this is
+        if (can_prepare && written_ > 0 && ready_chunks_.empty() && !reader_done_ && !failed_) {
+            lock.unlock();
+            can_prepare = prepare_();
+            lock.lock();
+            continue;
+        }
+
+        cv_.wait(lock, [this]() { return !ready_chunks_.empty() || reader_done_ || failed_; });
+        if (failed_ || ready_chunks_.empty()) {
+            break;
+        }
+        int index = ready_chunks_.front();
+        ready_chunks_.pop_front();
+        auto& chunk = chunks_[index];
+
+        lock.unlock();
+        bool success = sink_(chunk.data, chunk.offset, chunk.length);
+        lock.lock();
+
+        if (!success) {
+            failed_ = true;
+        } else {
+            written_ += chunk.length;
+        }
+        free_chunks_.push_back(index);
+        cv_.notify_all();
+    }
+    writer_running_ = false;
+    cv_.notify_all();
+}
+
+bool DownloadJournal::Open(Http* http, const std::string& url) {
+    worth_retrying_ = false;
+    offset_ = Load(url);
+    if (offset_ > 0) {
+        http->SetHeader("Range", "bytes=" + std::to_string(offset_) + "-");
+    }
+    if (!http->Open("GET", url)) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection");
+        return false;
+    }
+
+    status_code_ = http->GetStatusCode();
+    if (offset_ > 0 && status_code_ == 206) {
+        // Content-Range: bytes <first>-<last>/<total>
+        auto content_range = http->GetResponseHeader("Content-Range");
+        unsigned int first = 0, last = 0, total = 0;
+        if (sscanf(content_range.c_str(), "bytes %u-%u/%u", &first, &last, &total) != 3 ||
+            first != offset_ || total != total_length_ || http->GetBodyLength() != total - first) {
+            // The file changed on the server, the next attempt starts over
+            ESP_LOGW(TAG, "Unexpected content range: %s", content_range.c_str());
+            Clear();
+            worth_retrying_ = true;
+            return false;
+        }
+        ESP_LOGI(TAG, "Resuming download at %u of %u bytes", offset_, total_length_);
+        return true;
+    }
+
+    if (status_code_ != 200) {
+        ESP_LOGE(TAG, "Failed to download %s, status code: %d", url.c_str(), status_code_);
+        if (offset_ > 0) {
+            // The range was refused (e.g. 416 after the file shrank), the next attempt starts over
+            Clear();
+            worth_retrying_ = true;
+        }
+        return false;
+    }
+    if (offset_ > 0) {
+        ESP_LOGW(TAG, "The server does not support ranges, starting over");
+    }
+    offset_ = 0;
+    crc_ = 0;
+    total_length_ = http->GetBodyLength();
+    if (total_length_ == 0) {
+        ESP_LOGE(TAG, "Failed to get content length");
+        return false;
+    }
+
+    Settings settings(ns_, true);
+    settings.SetString("resume_url", url);
+    settings.SetInt("resume_total", total_length_);
+    settings.SetInt("resume_offset", 0);
+    settings.SetInt("resume_crc", 0);
+    return true;
+}
+
+size_t DownloadJournal::Load(const std::string& url) {
+    Settings settings(ns_);
+    if (settings.GetString("resume_url") != url) {
+        return 0;
+    }
+    size_t offset = settings.GetInt("resume_offset");
+    size_t total_length = settings.GetInt("resume_total");
+    uint32_t crc = settings.GetInt("resume_crc");
+    // Chunks are whole sectors except the last one, so a resumed download never writes into a written sector
+    if (offset == 0 || offset >= total_length || total_length > partition_->size || offset % partition_->erase_size != 0) {
+        return 0;
+    }
+
+    auto buffer = std::make_unique<char[]>(partition_->erase_size);
+    uint32_t partition_crc = 0;
+    for (size_t position = 0; position < offset; position += partition_->erase_size) {
+        if (esp_partition_read(partition_, position, buffer.get(), partition_->erase_size) != ESP_OK) {
+            return 0;
+        }
+        partition_crc = esp_rom_crc32_le(partition_crc, (const uint8_t*)buffer.get(), partition_->erase_size);
+    }
+    if (partition_crc != crc) {
+        ESP_LOGW(TAG, "The downloaded %u bytes in %s changed, starting over", offset, partition_->label);
+        return 0;
+    }
+    total_length_ = total_length;
+    crc_ = crc;
+    return offset;
+}
+
+void DownloadJournal::Commit(size_t offset, const char* data, size_t length) {
+    crc_ = esp_rom_crc32_le(crc_, (const uint8_t*)data, length);
+    offset_ = offset + length;
+    worth_retrying_ = true;
+    // Committed to NVS with a delay, a journal that lags behind the partition only costs a few chunks
+    Settings settings(ns_, true);
+    settings.SetInt("resume_offset", offset_);
+    settings.SetInt("resume_crc", crc_);
+}
+
+void DownloadJournal::Clear() {
+    Settings settings(ns_, true);
+    settings.EraseKey("resume_url");
+    settings.EraseKey("resume_total");
+    settings.EraseKey("resume_offset");
+    settings.EraseKey("resume_crc");
+    offset_ = 0;
+    crc_ = 0;
+}
@@ -0,0 +1,110 @@
+#ifndef DOWNLOAD_PIPELINE_H
+#define DOWNLOAD_PIPELINE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <esp_partition.h>
+#include <http.h>
+
+#if CONFIG_SPIRAM
+#define DOWNLOAD_CHUNK_SIZE     (32 * 1024)
+#define DOWNLOAD_CHUNK_COUNT    4
+#else
+#define DOWNLOAD_CHUNK_SIZE     4096
+#define DOWNLOAD_CHUNK_COUNT    2
+#endif
+#define DOWNLOAD_WRITER_STACK_SIZE (4096 * 2)
+// Attempts of a download that made progress, each one continues where the last one stopped
+#define DOWNLOAD_MAX_ATTEMPTS       3
+#define DOWNLOAD_RETRY_DELAY_MS     3000
+
+/*
+ * Overlaps network reads and flash writes of a download. The calling task reads the HTTP body into
+ * a ring of chunks (in PSRAM when available) while a writer task hands the filled chunks to the sink,
+ * so the network keeps receiving during flash erases and writes.
+ */
+class DownloadPipeline {
+public:
+    // Writes length bytes at offset of the download, chunks arrive in order
+    using Sink = std::function<bool(const char* data, size_t offset, size_t length)>;
+    // Runs on the writer task while it waits for data after the first chunk, e.g. to erase ahead. Returns false when there is nothing left to do.
+    using Prepare = std::function<bool()>;
+    using ProgressCallback = std::function<void(int progress, size_t speed)>;
+    // Runs on the reading task before every network read, it may block to slow the download down
+    using Throttle = std::function<void()>;
+
+    DownloadPipeline(size_t chunk_size = DOWNLOAD_CHUNK_SIZE, int chunk_count = DOWNLOAD_CHUNK_COUNT);
+    ~DownloadPipeline();
+
+    // Returns true once the body, bytes offset to total_length of the download, was read and written
+    bool Run(Http* http, size_t offset, size_t total_length, Sink sink, ProgressCallback progress_callback, Prepare prepare = nullptr);
+    void SetThrottle(Throttle throttle) { throttle_ = std::move(throttle); }
+
+private:
+    struct Chunk {
+        char* data = nullptr;
+        size_t offset = 0;
+        size_t length = 0;
+    };
+
+    size_t chunk_size_;
+    std::vector<Chunk> chunks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<int> free_chunks_;
+    std::deque<int> ready_chunks_;
+    bool reader_done_ = false;
+    bool failed_ = false;
+    bool writer_running_ = false;
+    size_t written_ = 0;
+    Sink sink_;
+    Prepare prepare_;
+    Throttle throttle_;
+
+    void WriterLoop();
+};
+
+/*
+ * Progress of a download kept in NVS, so a download that was cut off continues with an HTTP Range request,
+ * also after a reboot. It holds the number of bytes that reached the partition and their CRC32, which is
+ * checked against the partition before resuming.
+ */
+class DownloadJournal {
+public:
+    DownloadJournal(const std::string& ns, const esp_partition_t* partition) : ns_(ns), partition_(partition) {}
+
+    // Requests url from where the last download of it stopped, or from the start. Fails unless the body follows.
+    bool Open(Http* http, const std::string& url);
+    // Records that the bytes up to offset + length were written, data being the last length bytes
+    void Commit(size_t offset, const char* data, size_t length);
+    // Forgets the progress, after the download completed or when it cannot be resumed
+    void Clear();
+
+    size_t offset() const { return offset_; }
+    size_t total_length() const { return total_length_; }
+    int status_code() const { return status_code_; }
+    // Whether another attempt gets further: the last one wrote data or has to start over
+    bool worth_retrying() const { return worth_retrying_; }
+
+private:
+    std::string ns_;
+    const esp_partition_t* partition_;
+    size_t offset_ = 0;
+    size_t total_length_ = 0;
+    uint32_t crc_ = 0;
+    int status_code_ = 0;
+    bool worth_retrying_ = false;
+
+    size_t Load(const std::string& url);
+};
+
+#endif // DOWNLOAD_PIPELINE_H
@@ -0,0 +1,298 @@
+#include "heap_profiler.h"
+
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_memory_utils.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cJSON.h>
+#include <vector>
+
+#define TAG "HeapProfiler"
+
+static const char* const kHeapTagNames[kHeapTagCount] = { "untagged", "audio", "protocol", "mcp", "display" };
+
+#if CONFIG_HEAP_PROFILER
+// Tasks inside a tag scope, tag paths times heaps, and live allocations (a power of two, 8 bytes each)
+#define HEAP_PROFILER_MAX_TASKS         32
+#define HEAP_PROFILER_MAX_STATS         64
+#define HEAP_PROFILER_MAX_ALLOCATIONS   CONFIG_HEAP_PROFILER_MAX_ALLOCATIONS
+
+static_assert((HEAP_PROFILER_MAX_ALLOCATIONS & (HEAP_PROFILER_MAX_ALLOCATIONS - 1)) == 0,
+    "CONFIG_HEAP_PROFILER_MAX_ALLOCATIONS must be a power of two");
+
+struct HeapTaskPath {
+    TaskHandle_t task;
+    uint32_t path;          // One tag per byte, the outermost scope in the highest used byte
+};
+
+struct HeapStat {
+    uint32_t path;
+    bool spiram;
+    size_t live;
+    size_t peak;
+    uint32_t count;
+};
+
+struct HeapAllocation {
+    void* ptr;
+    uint32_t size : 24;
+    uint32_t stat : 8;
+};
+
+/*
+ * The hooks run inside every heap_caps allocation and free, on any task and from ISRs. They must not allocate,
+ * so everything lives in fixed tables in internal RAM behind one spinlock. Allocations are found by address in
+ * an open addressing table, the free hook does not tell the size.
+ */
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static HeapTaskPath s_tasks[HEAP_PROFILER_MAX_TASKS];
+// The first two are the untagged allocations in internal RAM and PSRAM, also used when the table is full
+static HeapStat s_stats[HEAP_PROFILER_MAX_STATS] = { { 0, false, 0, 0, 0 }, { 0, true, 0, 0, 0 } };
+static int s_stat_count = 2;
+static HeapAllocation s_allocations[HEAP_PROFILER_MAX_ALLOCATIONS];
+static uint32_t s_allocation_count = 0;
+static uint32_t s_untracked_count = 0;
+
+static inline uint32_t IRAM_ATTR AllocationSlot(const void* ptr) {
+    return ((uint32_t)((uintptr_t)ptr >> 3) * 2654435761u >> 8) & (HEAP_PROFILER_MAX_ALLOCATIONS - 1);
+}
+
+static int IRAM_ATTR FindTask(TaskHandle_t task) {
+    for (int i = 0; i < HEAP_PROFILER_MAX_TASKS; i++) {
+        if (s_tasks[i].task == task) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint32_t IRAM_ATTR CurrentPath() {
+    if (xPortInIsrContext()) {
+        return 0;
+    }
+    auto task = xTaskGetCurrentTaskHandle();
+    if (task == nullptr) {
+        return 0;
+    }
+    int index = FindTask(task);
+    return index >= 0 ? s_tasks[index].path : 0;
+}
+
+static int IRAM_ATTR FindStat(uint32_t path, bool spiram) {
+    for (int i = 0; i < s_stat_count; i++) {
+        if (s_stats[i].path == path && s_stats[i].spiram == spiram) {
+            return i;
+        }
+    }
+    if (s_stat_count == HEAP_PROFILER_MAX_STATS) {
+        return spiram ? 1 : 0;
+    }
+    s_stats[s_stat_count] = { path, spiram, 0, 0, 0 };
+    return s_stat_count++;
+}
+
+static bool IRAM_ATTR InsertAllocation(void* ptr, size_t size, int stat) {
+    // Keep the probe runs short
+    if (s_allocation_count >= HEAP_PROFILER_MAX_ALLOCATIONS / 4 * 3) {
+        return false;
+    }
+    uint32_t i = AllocationSlot(ptr);
+    while (s_allocations[i].ptr != nullptr) {
+        i = (i + 1) & (HEAP_PROFILER_MAX_ALLOCATIONS - 1);
+    }
+    s_allocations[i].ptr = ptr;
+    s_allocations[i].size = size < 0xFFFFFF ? size : 0xFFFFFF;
+    s_allocations[i].stat = stat;
+    s_allocation_count++;
+
+    auto& entry = s_stats[stat];
+    entry.live += s_allocations[i].size;
+    entry.count++;
+    if (entry.live > entry.peak) {
+        entry.peak = entry.live;
+    }
+    return true;
+}
+
+static void IRAM_ATTR RemoveAllocation(void* ptr) {
+    const uint32_t mask = HEAP_PROFILER_MAX_ALLOCATIONS - 1;
+    uint32_t i = AllocationSlot(ptr);
+    while (s_allocations[i].ptr != ptr) {
+        if (s_allocations[i].ptr == nullptr) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    auto& entry = s_stats[s_allocations[i].stat];
+    entry.live -= s_allocations[i].size;
+    entry.count--;
+
+    // Backward shift deletion: move the following entries of the probe run into the hole when their
+    // home slot allows it, so lookups never need tombstones
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & mask; s_allocations[j].ptr != nullptr; j = (j + 1) & mask) {
+        uint32_t home = AllocationSlot(s_allocations[j].ptr);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            s_allocations[hole] = s_allocations[j];
+            hole = j;
+        }
+    }
+    s_allocations[hole].ptr = nullptr;
+    s_allocation_count--;
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps) {
+    if (ptr == nullptr) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_lock);
+    // A realloc in place reports the same block again
+    RemoveAllocation(ptr);
+    if (!InsertAllocation(ptr, size, FindStat(CurrentPath(), esp_ptr_external_ram(ptr)))) {
+        s_untracked_count++;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_free_hook(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_lock);
+    RemoveAllocation(ptr);
+    portEXIT_CRITICAL_SAFE(&s_lock);
+}
+
+HeapTagScope::HeapTagScope(HeapTag tag) {
+    auto task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&s_lock);
+    int index = FindTask(task);
+    if (index < 0) {
+        index = FindTask(nullptr);
+        if (index >= 0) {
+            s_tasks[index] = { task, 0 };
+        }
+    }
+    previous_path_ = index >= 0 ? s_tasks[index].path : 0;
+    // Re-entering the innermost subsystem or nesting deeper than four scopes keeps the path
+    if (index >= 0 && (previous_path_ & 0xFF) != tag && (previous_path_ >> 24) == 0) {
+        s_tasks[index].path = (previous_path_ << 8) | tag;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+HeapTagScope::~HeapTagScope() {
+    auto task = xTaskGetCurrentTaskHandle();
+    portENTER_CRITICAL(&s_lock);
+    int index = FindTask(task);
+    if (index >= 0) {
+        s_tasks[index].path = previous_path_;
+        if (previous_path_ == 0) {
+            s_tasks[index].task = nullptr;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+static std::string PathName(uint32_t path) {
+    std::string name;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        uint8_t tag = (path >> shift) & 0xFF;
+        if (tag == 0) {
+            continue;
+        }
+        if (!name.empty()) {
+            name += ";";
+        }
+        name += tag < kHeapTagCount ? kHeapTagNames[tag] : "unknown";
+    }
+    return name.empty() ? kHeapTagNames[kHeapTagNone] : name;
+}
+#endif // CONFIG_HEAP_PROFILER
+
+std::string HeapProfiler::GetReportJson() {
+    static const struct {
+        const char* name;
+        uint32_t caps;
+    } heaps[] = {
+        { "internal", MALLOC_CAP_INTERNAL },
+        { "spiram", MALLOC_CAP_SPIRAM },
+        { "dma", MALLOC_CAP_DMA },
+    };
+
+    cJSON* root = cJSON_CreateObject();
+    cJSON* heap_array = cJSON_CreateArray();
+    for (auto& heap : heaps) {
+        if (heap_caps_get_total_size(heap.caps) == 0) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", heap.name);
+        cJSON_AddNumberToObject(item, "total", heap_caps_get_total_size(heap.caps));
+        cJSON_AddNumberToObject(item, "free", heap_caps_get_free_size(heap.caps));
+        cJSON_AddNumberToObject(item, "minimum_free", heap_caps_get_minimum_free_size(heap.caps));
+        cJSON_AddNumberToObject(item, "largest_free_block", heap_caps_get_largest_free_block(heap.caps));
+        cJSON_AddItemToArray(heap_array, item);
+    }
+    cJSON_AddItemToObject(root, "heaps", heap_array);
+
+#if CONFIG_HEAP_PROFILER
+    // Copy the counters first, building the JSON allocates and would run the hooks under the lock
+    std::vector<HeapStat> stats;
+    stats.reserve(HEAP_PROFILER_MAX_STATS);
+    uint32_t allocation_count;
+    uint32_t untracked_count;
+    portENTER_CRITICAL(&s_lock);
+    stats.assign(s_stats, s_stats + s_stat_count);
+    allocation_count = s_allocation_count;
+    untracked_count = s_untracked_count;
+    portEXIT_CRITICAL(&s_lock);
+
+    cJSON* tag_array = cJSON_CreateArray();
+    for (auto& stat : stats) {
+        if (stat.peak == 0) {
+            continue;
+        }
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "path", PathName(stat.path).c_str());
+        cJSON_AddStringToObject(item, "heap", stat.spiram ? "spiram" : "internal");
+        cJSON_AddNumberToObject(item, "live", stat.live);
+        cJSON_AddNumberToObject(item, "peak", stat.peak);
+        cJSON_AddNumberToObject(item, "count", stat.count);
+        cJSON_AddItemToArray(tag_array, item);
+    }
+    cJSON_AddItemToObject(root, "tags", tag_array);
+    cJSON_AddNumberToObject(root, "tracked_allocations", allocation_count);
+    cJSON_AddNumberToObject(root, "untracked_allocations", untracked_count);
+#endif
+
+    char* json = cJSON_PrintUnformatted(root);
+    std::string result = json != nullptr ? json : "{}";
+    cJSON_free(json);
+    cJSON_Delete(root);
+    return result;
+}
+
+void HeapProfiler::PrintReport() {
+    auto json = GetReportJson();
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (root == nullptr) {
+        return;
+    }
+    cJSON* item = nullptr;
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "heaps")) {
+        ESP_LOGI(TAG, "%s: free %d, minimum free %d, largest free block %d",
+            cJSON_GetObjectItem(item, "name")->valuestring, cJSON_GetObjectItem(item, "free")->valueint,
+            cJSON_GetObjectItem(item, "minimum_free")->valueint, cJSON_GetObjectItem(item, "largest_free_block")->valueint);
+    }
+    cJSON_ArrayForEach(item, cJSON_GetObjectItem(root, "tags")) {
+        ESP_LOGI(TAG, "%s (%s): live %d, peak %d, %d blocks",
+            cJSON_GetObjectItem(item, "path")->valuestring, cJSON_GetObjectItem(item, "heap")->valuestring,
+            cJSON_GetObjectItem(item, "live")->valueint, cJSON_GetObjectItem(item, "peak")->valueint,
+            cJSON_GetObjectItem(item, "count")->valueint);
+    }
+    cJSON_Delete(root);
+    ESP_LOGI(TAG, "heap_profile: %s", json.c_str());
+}
@@ -0,0 +1,53 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+#include <cstdint>
+#include <string>
+
+#include <sdkconfig.h>
+
+// Subsystems that allocations are charged to, see HeapTagScope
+enum HeapTag : uint8_t {
+    kHeapTagNone = 0,
+    kHeapTagAudio,
+    kHeapTagProtocol,
+    kHeapTagMcp,
+    kHeapTagDisplay,
+    kHeapTagCount,
+};
+
+#if CONFIG_HEAP_PROFILER
+/*
+ * Charges the allocations of the current task to a subsystem until the scope ends. Scopes nest up to
+ * four levels and the profile keeps the whole path, e.g. "protocol;mcp" for a tool call that arrived
+ * on the protocol task.
+ */
+class HeapTagScope {
+public:
+    explicit HeapTagScope(HeapTag tag);
+    ~HeapTagScope();
+    HeapTagScope(const HeapTagScope&) = delete;
+    HeapTagScope& operator=(const HeapTagScope&) = delete;
+
+private:
+    uint32_t previous_path_;
+};
+#else
+class HeapTagScope {
+public:
+    explicit HeapTagScope(HeapTag tag) { (void)tag; }
+};
+#endif
+
+/*
+ * Free memory per heap capability and, with CONFIG_HEAP_PROFILER, the live and peak bytes of every tag
+ * path and heap. scripts/heap_flamegraph.py renders the JSON report as a flame graph.
+ */
+class HeapProfiler {
+public:
+    static std::string GetReportJson();
+    // Prints the report, one line per tag path, followed by the JSON after "heap_profile: "
+    static void PrintReport();
+};
+
+#endif // HEAP_PROFILER_H
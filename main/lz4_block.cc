@@ -0,0 +1,67 @@
+#include "lz4_block.h"
+
+#include <cstring>
+
+// Decodes an LZ4 block, checking every length against both buffers. Fails unless dst is filled exactly.
+bool Lz4DecompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size) {
+    const uint8_t* src_end = src + src_size;
+    auto read_length = [&src, src_end](size_t& length) {
+        uint8_t byte;
+        do {
+            if (src >= src_end) {
+                return false;
+            }
+            byte = *src++;
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+
+    uint8_t* out = dst;
+    uint8_t* out_end = dst + dst_size;
+    while (src < src_end) {
+        uint8_t token = *src++;
+        size_t length = token >> 4;
+        if (length == 15 && !read_length(length)) {
+            return false;
+        }
+        if (length > (size_t)(src_end - src) || length > (size_t)(out_end - out)) {
+            return false;
+        }
+        memcpy(out, src, length);
+        src += length;
+        out += length;
+        // The last sequence has literals only
+        if (src == src_end) {
+            break;
+        }
+
+        if (src_end - src < 2) {
+            return false;
+        }
+        size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (offset == 0 || offset > (size_t)(out - dst)) {
+            return false;
+        }
+        length = token & 15;
+        if (length == 15 && !read_length(length)) {
+            return false;
+        }
+        length += 4;
+        if (length > (size_t)(out_end - out)) {
+            return false;
+        }
+        const uint8_t* match = out - offset;
+        if (offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        } else {
+            // Overlapping match, a repeated pattern
+            while (length-- > 0) {
+                *out++ = *match++;
+            }
+        }
+    }
+    return out == out_end;
+}
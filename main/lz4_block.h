@@ -0,0 +1,11 @@
+#ifndef LZ4_BLOCK_H
+#define LZ4_BLOCK_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Decoder of the LZ4 blocks written by scripts/spiffs_assets/lz4_block.py (no frame header). Compressed
+// assets come from flash, the decoder never reads or writes outside the two buffers whatever src holds.
+bool Lz4DecompressBlock(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size);
+
+#endif // LZ4_BLOCK_H
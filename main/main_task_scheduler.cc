@@ -0,0 +1,63 @@
+#include "main_task_scheduler.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+
+void MainTaskScheduler::Push(TaskClass task_class, MainTask&& task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queues_[task_class].push_back(Entry{ std::move(task), esp_timer_get_time(), next_sequence_++ });
+}
+
+bool MainTaskScheduler::RunPending(int64_t budget_us) {
+    int64_t start_time = esp_timer_get_time();
+    bool ran_any = false;
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto& audio = queues_[kTaskClassAudio];
+        auto& ui = queues_[kTaskClassUi];
+        int task_class;
+        if (!audio.empty() && (ui.empty() || (int32_t)(audio.front().sequence - ui.front().sequence) < 0)) {
+            task_class = kTaskClassAudio;
+        } else if (!ui.empty()) {
+            task_class = kTaskClassUi;
+        } else if (!queues_[kTaskClassBackground].empty()) {
+            task_class = kTaskClassBackground;
+        } else {
+            return false;
+        }
+        if (audio.empty() && ran_any && esp_timer_get_time() - start_time >= budget_us) {
+            return true;
+        }
+        auto entry = std::move(queues_[task_class].front());
+        queues_[task_class].pop_front();
+        lock.unlock();
+
+        int64_t run_start = esp_timer_get_time();
+        entry.task();
+        int64_t run_end = esp_timer_get_time();
+        ran_any = true;
+
+        lock.lock();
+        auto& counters = counters_[task_class];
+        uint32_t latency = run_start - entry.enqueue_time;
+        counters.executed_count++;
+        counters.total_latency_us += latency;
+        counters.max_latency_us = std::max(counters.max_latency_us, latency);
+        counters.max_run_time_us = std::max(counters.max_run_time_us, (uint32_t)(run_end - run_start));
+    }
+}
+
+TaskClassStatistics MainTaskScheduler::GetStatistics(TaskClass task_class) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& counters = counters_[task_class];
+    TaskClassStatistics statistics;
+    statistics.pending_count = queues_[task_class].size();
+    statistics.executed_count = counters.executed_count;
+    if (counters.executed_count > 0) {
+        statistics.average_latency_us = counters.total_latency_us / counters.executed_count;
+    }
+    statistics.max_latency_us = counters.max_latency_us;
+    statistics.max_run_time_us = counters.max_run_time_us;
+    return statistics;
+}
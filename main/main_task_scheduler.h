@@ -0,0 +1,162 @@
+#ifndef MAIN_TASK_SCHEDULER_H
+#define MAIN_TASK_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Captures up to this size (e.g. `this` plus a std::string) are stored inline without heap allocation
+#define MAIN_TASK_INLINE_SIZE 32
+// Time budget of scheduled UI / background tasks per main loop iteration
+#define MAIN_TASK_BUDGET_US (20 * 1000)
+
+/*
+ * Audio and UI tasks run in the order they were scheduled, since state changes depend on each other
+ * (e.g. a tts start after the state change that opened the channel). Only background tasks, which must
+ * not depend on that order, are overtaken.
+ */
+enum TaskClass {
+    kTaskClassAudio,        // Audio-critical state changes, never deferred by the budget
+    kTaskClassUi,           // Display and state updates, the default class
+    kTaskClassBackground,   // Everything that can wait, e.g. MCP tool calls, runs when nothing else is pending
+    kTaskClassCount
+};
+
+/*
+ * Move-only void() callable with small buffer optimization, used in place of std::function
+ * for callbacks scheduled on the main task.
+ */
+class MainTask {
+public:
+    MainTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MainTask>>>
+    MainTask(F&& callable) {
+        using T = std::decay_t<F>;
+        if constexpr (sizeof(T) <= MAIN_TASK_INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible_v<T>) {
+            new (storage_) T(std::forward<F>(callable));
+            ops_ = &InlineOps<T>::ops;
+        } else {
+            *reinterpret_cast<T**>(storage_) = new T(std::forward<F>(callable));
+            ops_ = &HeapOps<T>::ops;
+        }
+    }
+
+    MainTask(MainTask&& other) noexcept {
+        MoveFrom(other);
+    }
+
+    MainTask& operator=(MainTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+
+    MainTask(const MainTask&) = delete;
+    MainTask& operator=(const MainTask&) = delete;
+
+    ~MainTask() {
+        Reset();
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename T>
+    struct InlineOps {
+        static void Invoke(void* storage) { (*static_cast<T*>(storage))(); }
+        static void Move(void* dst, void* src) {
+            new (dst) T(std::move(*static_cast<T*>(src)));
+            static_cast<T*>(src)->~T();
+        }
+        static void Destroy(void* storage) { static_cast<T*>(storage)->~T(); }
+        static constexpr Ops ops = { Invoke, Move, Destroy };
+    };
+
+    template <typename T>
+    struct HeapOps {
+        static void Invoke(void* storage) { (**static_cast<T**>(storage))(); }
+        static void Move(void* dst, void* src) { *static_cast<T**>(dst) = *static_cast<T**>(src); }
+        static void Destroy(void* storage) { delete *static_cast<T**>(storage); }
+        static constexpr Ops ops = { Invoke, Move, Destroy };
+    };
+
+    void MoveFrom(MainTask& other) {
+        ops_ = other.ops_;
+        if (ops_ != nullptr) {
+            ops_->move(storage_, other.storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[MAIN_TASK_INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+};
+
+struct TaskClassStatistics {
+    uint32_t pending_count = 0;
+    uint32_t executed_count = 0;
+    uint32_t average_latency_us = 0;    // Time from Schedule() until the task started
+    uint32_t max_latency_us = 0;
+    uint32_t max_run_time_us = 0;
+};
+
+class MainTaskScheduler {
+public:
+    void Push(TaskClass task_class, MainTask&& task);
+
+    /*
+     * Run pending audio and UI tasks in scheduling order, then background tasks. Tasks run until budget_us
+     * is used up (at least one task per call), except while audio tasks are pending: those and the UI tasks
+     * scheduled before them always run.
+     * Returns true if tasks are left for the next main loop iteration.
+     */
+    bool RunPending(int64_t budget_us);
+
+    TaskClassStatistics GetStatistics(TaskClass task_class);
+
+private:
+    struct Entry {
+        MainTask task;
+        int64_t enqueue_time;
+        uint32_t sequence;
+    };
+
+    struct Counters {
+        uint32_t executed_count = 0;
+        uint64_t total_latency_us = 0;
+        uint32_t max_latency_us = 0;
+        uint32_t max_run_time_us = 0;
+    };
+
+    std::mutex mutex_;
+    std::deque<Entry> queues_[kTaskClassCount];
+    Counters counters_[kTaskClassCount];
+    uint32_t next_sequence_ = 0;
+};
+
+#endif // MAIN_TASK_SCHEDULER_H
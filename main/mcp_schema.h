@@ -0,0 +1,344 @@
+#ifndef MCP_SCHEMA_H
+#define MCP_SCHEMA_H
+
+#include <array>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include <cJSON.h>
+
+/*
+ * Compile-time MCP tool arguments.
+ *
+ *   McpInteger<"volume", 0, 100>           required integer in [0, 100]
+ *   McpInteger<"quality", 1, 100, 80>      optional integer, default 80
+ *   McpBoolean<"enabled", false>           optional boolean
+ *   McpString<"url">                       required string
+ *
+ * The inputSchema JSON of an argument list is generated by the compiler and placed in flash,
+ * call arguments are parsed straight into a std::tuple of the argument value types.
+ */
+
+template <size_t N>
+struct McpName {
+    char value[N] {};
+
+    constexpr McpName(const char (&text)[N]) {
+        for (size_t i = 0; i < N; i++) {
+            value[i] = text[i];
+        }
+    }
+
+    constexpr std::string_view view() const { return std::string_view(value, N - 1); }
+};
+
+// Default value of an argument that must be provided by the caller
+struct McpRequired {};
+
+// Class type template parameter objects are const, decltype() of them is const T
+template <auto Default>
+inline constexpr bool kMcpIsRequired = std::is_same_v<std::remove_cv_t<decltype(Default)>, McpRequired>;
+
+class McpSchemaWriter {
+public:
+    // Only counts the size if out is nullptr
+    constexpr explicit McpSchemaWriter(char* out) : out_(out) {}
+
+    constexpr size_t size() const { return size_; }
+
+    constexpr void Append(char c) {
+        if (out_ != nullptr) {
+            out_[size_] = c;
+        }
+        size_++;
+    }
+
+    constexpr void Append(std::string_view text) {
+        for (char c : text) {
+            Append(c);
+        }
+    }
+
+    // Quoted and escaped the same way cJSON prints strings
+    constexpr void AppendString(std::string_view text) {
+        constexpr char hex[] = "0123456789abcdef";
+        Append('"');
+        for (char ch : text) {
+            auto c = static_cast<unsigned char>(ch);
+            switch (c) {
+            case '"': Append("\\\""); break;
+            case '\\': Append("\\\\"); break;
+            case '\b': Append("\\b"); break;
+            case '\f': Append("\\f"); break;
+            case '\n': Append("\\n"); break;
+            case '\r': Append("\\r"); break;
+            case '\t': Append("\\t"); break;
+            default:
+                if (c < 32) {
+                    Append("\\u00");
+                    Append(hex[c >> 4]);
+                    Append(hex[c & 0x0F]);
+                } else {
+                    Append(ch);
+                }
+            }
+        }
+        Append('"');
+    }
+
+    constexpr void AppendInteger(int value) {
+        long long v = value;
+        if (v < 0) {
+            Append('-');
+            v = -v;
+        }
+        char digits[12] {};
+        int count = 0;
+        do {
+            digits[count++] = '0' + v % 10;
+            v /= 10;
+        } while (v > 0);
+        while (count > 0) {
+            Append(digits[--count]);
+        }
+    }
+
+private:
+    char* out_;
+    size_t size_ = 0;
+};
+
+template <McpName Name, int Min = INT_MIN, int Max = INT_MAX, auto Default = McpRequired{}>
+struct McpInteger {
+    using value_type = int;
+    static constexpr std::string_view name = Name.view();
+    static constexpr bool required = kMcpIsRequired<Default>;
+
+    static constexpr bool IsValid() {
+        if constexpr (required) {
+            return Min <= Max;
+        } else {
+            return std::is_same_v<decltype(Default), int> && Min <= Default && Default <= Max;
+        }
+    }
+    static_assert(IsValid(), "Integer default value must be an int within the specified range");
+
+    static value_type default_value() {
+        if constexpr (required) {
+            return 0;
+        } else {
+            return Default;
+        }
+    }
+
+    static constexpr void WriteSchema(McpSchemaWriter& writer) {
+        writer.Append("{\"type\":\"integer\"");
+        if constexpr (!required) {
+            writer.Append(",\"default\":");
+            writer.AppendInteger(Default);
+        }
+        if constexpr (Min != INT_MIN) {
+            writer.Append(",\"minimum\":");
+            writer.AppendInteger(Min);
+        }
+        if constexpr (Max != INT_MAX) {
+            writer.Append(",\"maximum\":");
+            writer.AppendInteger(Max);
+        }
+        writer.Append('}');
+    }
+
+    // Returns false for a value of the wrong type (treated as missing) or with error set if out of range
+    static bool Parse(const cJSON* item, value_type& value, std::string& error) {
+        if (!cJSON_IsNumber(item)) {
+            return false;
+        }
+        if (item->valueint < Min) {
+            error = "Value is below minimum allowed: " + std::to_string(Min);
+            return false;
+        }
+        if (item->valueint > Max) {
+            error = "Value exceeds maximum allowed: " + std::to_string(Max);
+            return false;
+        }
+        value = item->valueint;
+        return true;
+    }
+};
+
+template <McpName Name, auto Default = McpRequired{}>
+struct McpBoolean {
+    using value_type = bool;
+    static constexpr std::string_view name = Name.view();
+    static constexpr bool required = kMcpIsRequired<Default>;
+    static_assert(required || std::is_same_v<decltype(Default), bool>, "Boolean default value must be a bool");
+
+    static value_type default_value() {
+        if constexpr (required) {
+            return false;
+        } else {
+            return Default;
+        }
+    }
+
+    static constexpr void WriteSchema(McpSchemaWriter& writer) {
+        writer.Append("{\"type\":\"boolean\"");
+        if constexpr (!required) {
+            writer.Append(Default ? ",\"default\":true" : ",\"default\":false");
+        }
+        writer.Append('}');
+    }
+
+    static bool Parse(const cJSON* item, value_type& value, std::string& error) {
+        if (!cJSON_IsBool(item)) {
+            return false;
+        }
+        value = item->valueint == 1;
+        return true;
+    }
+};
+
+// The default value of a string argument is given as McpName, e.g. McpString<"theme", McpName("light")>
+template <McpName Name, auto Default = McpRequired{}>
+struct McpString {
+    using value_type = std::string;
+    static constexpr std::string_view name = Name.view();
+    static constexpr bool required = kMcpIsRequired<Default>;
+
+    static value_type default_value() {
+        if constexpr (required) {
+            return std::string();
+        } else {
+            return std::string(Default.view());
+        }
+    }
+
+    static constexpr void WriteSchema(McpSchemaWriter& writer) {
+        writer.Append("{\"type\":\"string\"");
+        if constexpr (!required) {
+            writer.Append(",\"default\":");
+            writer.AppendString(Default.view());
+        }
+        writer.Append('}');
+    }
+
+    static bool Parse(const cJSON* item, value_type& value, std::string& error) {
+        if (!cJSON_IsString(item)) {
+            return false;
+        }
+        value = item->valuestring;
+        return true;
+    }
+};
+
+// Same layout as the schema printed by PropertyList: {"type":"object","properties":{...},"required":[...]}
+template <typename... Args>
+constexpr void McpWriteInputSchema(McpSchemaWriter& writer) {
+    writer.Append("{\"type\":\"object\",\"properties\":{");
+    bool first = true;
+    [[maybe_unused]] auto write_property = [&writer, &first](std::string_view name, auto write_schema) {
+        if (!first) {
+            writer.Append(',');
+        }
+        first = false;
+        writer.AppendString(name);
+        writer.Append(':');
+        write_schema(writer);
+    };
+    (write_property(Args::name, Args::WriteSchema), ...);
+    writer.Append('}');
+
+    if constexpr ((Args::required || ...)) {
+        writer.Append(",\"required\":[");
+        first = true;
+        auto write_required = [&writer, &first](std::string_view name, bool required) {
+            if (!required) {
+                return;
+            }
+            if (!first) {
+                writer.Append(',');
+            }
+            first = false;
+            writer.AppendString(name);
+        };
+        (write_required(Args::name, Args::required), ...);
+        writer.Append(']');
+    }
+    writer.Append('}');
+}
+
+template <typename... Args>
+inline constexpr size_t kMcpInputSchemaSize = [] {
+    McpSchemaWriter writer(nullptr);
+    McpWriteInputSchema<Args...>(writer);
+    return writer.size();
+}();
+
+template <typename... Args>
+inline constexpr auto kMcpInputSchemaData = [] {
+    std::array<char, kMcpInputSchemaSize<Args...> + 1> data {};
+    McpSchemaWriter writer(data.data());
+    McpWriteInputSchema<Args...>(writer);
+    return data;
+}();
+
+template <typename... Args>
+class McpSchema {
+public:
+    using Values = std::tuple<typename Args::value_type...>;
+
+    static constexpr std::string_view input_schema() {
+        return std::string_view(kMcpInputSchemaData<Args...>.data(), kMcpInputSchemaSize<Args...>);
+    }
+
+    // Walks the arguments object once, missing optional arguments keep their default value
+    static bool Bind(const cJSON* arguments, Values& values, std::string& error) {
+        values = Values(Args::default_value()...);
+        bool found[sizeof...(Args) + 1] = {};
+        if (cJSON_IsObject(arguments)) {
+            for (auto item = arguments->child; item != nullptr; item = item->next) {
+                if (item->string != nullptr && !BindItem(item, values, found, error, std::index_sequence_for<Args...>{})) {
+                    return false;
+                }
+            }
+        }
+        return CheckRequired(found, error, std::index_sequence_for<Args...>{});
+    }
+
+private:
+    template <size_t I>
+    using Arg = std::tuple_element_t<I, std::tuple<Args...>>;
+
+    template <size_t I>
+    static bool BindArgument(const cJSON* item, Values& values, bool* found, std::string& error) {
+        if (found[I] || Arg<I>::name != item->string) {
+            return true;
+        }
+        found[I] = Arg<I>::Parse(item, std::get<I>(values), error);
+        return error.empty();
+    }
+
+    template <size_t... I>
+    static bool BindItem(const cJSON* item, Values& values, bool* found, std::string& error, std::index_sequence<I...>) {
+        return (BindArgument<I>(item, values, found, error) && ...);
+    }
+
+    template <size_t... I>
+    static bool CheckRequired(const bool* found, std::string& error, std::index_sequence<I...>) {
+        auto check = [&error](bool is_found, bool required, std::string_view name) {
+            if (required && !is_found) {
+                error = "Missing valid argument: " + std::string(name);
+                return false;
+            }
+            return true;
+        };
+        return (check(found[I], Arg<I>::required, Arg<I>::name) && ...);
+    }
+};
+
+#endif // MCP_SCHEMA_H
@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <cstring>
 #include <esp_pthread.h>
+#include <esp_timer.h>
 
 #include "application.h"
 #include "display.h"
@@ -17,9 +18,137 @@
 #include "settings.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
+#include "heap_profiler.h"
 
 #define TAG "MCP"
 
+// Worker tools share HTTP connect id 3, only one of them may use it at a time
+static std::mutex http_tool_mutex;
+
+size_t McpResultStream::EscapeJsonChar(unsigned char c, char* out) {
+    switch (c) {
+    case '"': out[0] = '\\'; out[1] = '"'; return 2;
+    case '\\': out[0] = '\\'; out[1] = '\\'; return 2;
+    case '\b': out[0] = '\\'; out[1] = 'b'; return 2;
+    case '\f': out[0] = '\\'; out[1] = 'f'; return 2;
+    case '\n': out[0] = '\\'; out[1] = 'n'; return 2;
+    case '\r': out[0] = '\\'; out[1] = 'r'; return 2;
+    case '\t': out[0] = '\\'; out[1] = 't'; return 2;
+    default:
+        if (c < 32) {
+            static const char hex[] = "0123456789abcdef";
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0x0F];
+            return 6;
+        }
+        out[0] = c;
+        return 1;
+    }
+}
+
+std::string McpResultStream::EscapeJsonString(const std::string& text) {
+    std::string result;
+    result.reserve(text.size());
+    char escaped[8];
+    for (unsigned char c : text) {
+        result.append(escaped, EscapeJsonChar(c, escaped));
+    }
+    return result;
+}
+
+size_t McpResultStream::EncodeUnit(char* out) {
+    if (encoding_ == kEncodingJsonString) {
+        return EscapeJsonChar(body_data_[offset_++], out);
+    }
+
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t left = body_size_ - offset_;
+    auto in = (const uint8_t*)body_data_ + offset_;
+    uint32_t group = in[0] << 16 | (left > 1 ? in[1] << 8 : 0) | (left > 2 ? in[2] : 0);
+    out[0] = table[(group >> 18) & 0x3F];
+    out[1] = table[(group >> 12) & 0x3F];
+    out[2] = left > 1 ? table[(group >> 6) & 0x3F] : '=';
+    out[3] = left > 2 ? table[group & 0x3F] : '=';
+    offset_ += left > 2 ? 3 : left;
+    return 4;
+}
+
+size_t McpResultStream::Read(char* buffer, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        if (pending_offset_ < pending_size_) {
+            size_t n = std::min(size - written, pending_size_ - pending_offset_);
+            memcpy(buffer + written, pending_ + pending_offset_, n);
+            pending_offset_ += n;
+            written += n;
+            continue;
+        }
+
+        if (stage_ == 0 || stage_ == 2) {
+            auto& text = stage_ == 0 ? prefix_ : suffix_;
+            size_t n = std::min(size - written, text.size() - offset_);
+            memcpy(buffer + written, text.data() + offset_, n);
+            offset_ += n;
+            written += n;
+            if (offset_ == text.size()) {
+                stage_++;
+                offset_ = 0;
+            }
+        } else if (stage_ == 1) {
+            if (offset_ == body_size_) {
+                stage_++;
+                offset_ = 0;
+                // Release the raw data before the suffix is sent
+                ReleaseBody();
+                continue;
+            }
+            // Encode straight into the buffer while a whole unit fits, otherwise through pending_
+            if (size - written >= 6) {
+                written += EncodeUnit(buffer + written);
+            } else {
+                pending_size_ = EncodeUnit(pending_);
+                pending_offset_ = 0;
+            }
+        } else {
+            break;
+        }
+    }
+    return written;
+}
+
+void McpResultStream::ReleaseBody() {
+    std::string().swap(body_);
+    body_data_ = nullptr;
+    body_size_ = 0;
+    if (release_) {
+        std::exchange(release_, nullptr)();
+    }
+}
+
+size_t McpBatchStream::Read(char* buffer, size_t size) {
+    size_t written = 0;
+    while (written < size && !closed_) {
+        if (!opened_) {
+            buffer[written++] = '[';
+            opened_ = true;
+        } else if (index_ == replies_.size()) {
+            buffer[written++] = ']';
+            closed_ = true;
+        } else {
+            size_t count = replies_[index_]->Read(buffer + written, size - written);
+            written += count;
+            if (count == 0) {
+                replies_[index_].reset();
+                if (++index_ < replies_.size()) {
+                    buffer[written++] = ',';
+                }
+            }
+        }
+    }
+    return written;
+}
+
 McpServer::McpServer() {
 }
 
@@ -80,13 +209,9 @@ void McpServer::AddCommonTools() {
 #ifdef HAVE_LVGL
     auto display = board.GetDisplay();
     if (display && display->GetTheme() != nullptr) {
-        AddTool("self.screen.set_theme",
+        AddTool<McpString<"theme">>("self.screen.set_theme",
             "Set the theme of the screen. The theme can be `light` or `dark`.",
-            PropertyList({
-                Property("theme", kPropertyTypeString)
-            }),
-            [display](const PropertyList& properties) -> ReturnValue {
-                auto theme_name = properties["theme"].value<std::string>();
+            [display](const std::string& theme_name) -> ReturnValue {
                 auto& theme_manager = LvglThemeManager::GetInstance();
                 auto theme = theme_manager.GetTheme(theme_name);
                 if (theme != nullptr) {
@@ -99,30 +224,29 @@ void McpServer::AddCommonTools() {
 
     auto camera = board.GetCamera();
     if (camera) {
-        AddTool("self.camera.take_photo",
+        AddTool<McpString<"question">>("self.camera.take_photo",
             "Always remember you have a camera. If the user asks you to see something, use this tool to take a photo and then explain it.\n"
             "Args:\n"
             "  `question`: The question that you want to ask about the photo.\n"
             "Return:\n"
             "  A JSON object that provides the photo information.",
-            PropertyList({
-                Property("question", kPropertyTypeString)
-            }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [camera](const std::string& question) -> ReturnValue {
                 // Lower the priority to do the camera capture
                 TaskPriorityReset priority_reset(1);
 
                 if (!camera->Capture()) {
                     throw std::runtime_error("Failed to capture photo");
                 }
-                auto question = properties["question"].value<std::string>();
+                std::lock_guard<std::mutex> lock(http_tool_mutex);
                 return camera->Explain(question);
-            });
+            }, McpToolOptions{ .execution = kMcpToolExecutionWorker, .timeout_ms = 60000 });
     }
 #endif
 
     // Restore the original tools list to the end of the tools list
+    std::lock_guard<std::mutex> lock(index_mutex_);
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    index_dirty_ = true;
 }
 
 void McpServer::AddUserOnlyTools() {
@@ -135,6 +259,80 @@ void McpServer::AddUserOnlyTools() {
             return board.GetSystemInfoJson();
         });
 
+    AddUserOnlyTool("self.audio.get_statistics",
+        "Get the audio queue statistics, including dropped and late uplink packets and downlink underruns",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto statistics = Application::GetInstance().GetAudioService().GetQueueStatistics();
+            cJSON *json = cJSON_CreateObject();
+            cJSON_AddNumberToObject(json, "send_queue_size", statistics.send_queue_size);
+            cJSON_AddNumberToObject(json, "send_dropped", statistics.send_dropped_count);
+            cJSON_AddNumberToObject(json, "send_late", statistics.send_late_count);
+            cJSON_AddNumberToObject(json, "downlink_underruns", statistics.downlink_underrun_count);
+            cJSON_AddNumberToObject(json, "decode_buffered_ms", statistics.decode_buffered_ms);
+            cJSON_AddNumberToObject(json, "playback_start_threshold_ms", statistics.playback_start_threshold_ms);
+            return json;
+        });
+
+    AddUserOnlyTool("self.scheduler.get_statistics",
+        "Get the main task scheduler statistics, including queue latency per task class",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            static const char* const class_names[kTaskClassCount] = { "audio", "ui", "background" };
+            auto& app = Application::GetInstance();
+            cJSON *json = cJSON_CreateObject();
+            for (int i = 0; i < kTaskClassCount; i++) {
+                auto statistics = app.GetScheduleStatistics((TaskClass)i);
+                cJSON *item = cJSON_CreateObject();
+                cJSON_AddNumberToObject(item, "pending", statistics.pending_count);
+                cJSON_AddNumberToObject(item, "executed", statistics.executed_count);
+                cJSON_AddNumberToObject(item, "average_latency_us", statistics.average_latency_us);
+                cJSON_AddNumberToObject(item, "max_latency_us", statistics.max_latency_us);
+                cJSON_AddNumberToObject(item, "max_run_time_us", statistics.max_run_time_us);
+                cJSON_AddItemToObject(json, class_names[i], item);
+            }
+            {
+                std::lock_guard<std::mutex> lock(calls_mutex_);
+                cJSON *mcp = cJSON_CreateObject();
+                cJSON_AddNumberToObject(mcp, "main_stall_total_ms", main_stall_total_us_ / 1000);
+                cJSON_AddNumberToObject(mcp, "main_stall_max_ms", main_stall_max_us_ / 1000);
+                cJSON_AddNumberToObject(mcp, "pending_calls", pending_calls_.size());
+                cJSON_AddNumberToObject(mcp, "timeouts", timeout_count_);
+                cJSON_AddNumberToObject(mcp, "rejected", rejected_count_);
+                cJSON_AddItemToObject(json, "mcp_tools", mcp);
+            }
+            auto& pool = app.GetWorkerPool();
+            cJSON *workers = cJSON_CreateObject();
+            cJSON_AddNumberToObject(workers, "size", pool.worker_count());
+            cJSON_AddNumberToObject(workers, "busy", pool.busy_count());
+            cJSON_AddNumberToObject(workers, "pending", pool.pending_count());
+            cJSON_AddItemToObject(json, "workers", workers);
+            return json;
+        });
+
+    AddUserOnlyTool("self.tasks.get_statistics",
+        "Get the CPU usage and lowest free stack (bytes) of every task, and the recent per-core load history",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetTaskMonitor().GetStatisticsJson();
+        });
+
+    AddUserOnlyTool("self.boot.get_timeline",
+        "Get the boot timeline: start time and duration of every initialization stage and when milestones "
+        "like network_connected and wake_word_ready were reached, in microseconds since boot",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return Application::GetInstance().GetBootSequence().GetTimelineJson();
+        });
+
+    AddUserOnlyTool("self.heap.get_profile",
+        "Get free, minimum free and largest free block of every heap, and with the heap profiler enabled "
+        "the live and peak bytes allocated by each subsystem (audio, protocol, mcp, display)",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            return HeapProfiler::GetReportJson();
+        });
+
     AddUserOnlyTool("self.reboot", "Reboot the system",
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
@@ -187,15 +385,9 @@ void McpServer::AddUserOnlyTools() {
             });
 
 #if CONFIG_LV_USE_SNAPSHOT
-        AddUserOnlyTool("self.screen.snapshot", "Snapshot the screen and upload it to a specific URL",
-            PropertyList({
-                Property("url", kPropertyTypeString),
-                Property("quality", kPropertyTypeInteger, 80, 1, 100)
-            }),
-            [display](const PropertyList& properties) -> ReturnValue {
-                auto url = properties["url"].value<std::string>();
-                auto quality = properties["quality"].value<int>();
-
+        AddUserOnlyTool<McpString<"url">, McpInteger<"quality", 1, 100, 80>>("self.screen.snapshot",
+            "Snapshot the screen and upload it to a specific URL",
+            [display](const std::string& url, int quality) -> ReturnValue {
                 std::string jpeg_data;
                 if (!display->SnapshotToJpeg(jpeg_data, quality)) {
                     throw std::runtime_error("Failed to snapshot screen");
@@ -206,6 +398,7 @@ void McpServer::AddUserOnlyTools() {
                 // 构造multipart/form-data请求体
                 std::string boundary = "----ESP32_SCREEN_SNAPSHOT_BOUNDARY";
                 
+                std::lock_guard<std::mutex> lock(http_tool_mutex);
                 auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
                 http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
                 if (!http->Open("POST", url)) {
@@ -239,14 +432,11 @@ void McpServer::AddUserOnlyTools() {
                 http->Close();
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
-            });
+            }, McpToolOptions{ .execution = kMcpToolExecutionWorker, .timeout_ms = 30000 });
         
-        AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
-            PropertyList({
-                Property("url", kPropertyTypeString)
-            }),
-            [display](const PropertyList& properties) -> ReturnValue {
-                auto url = properties["url"].value<std::string>();
+        AddUserOnlyTool<McpString<"url">>("self.screen.preview_image", "Preview an image on the screen",
+            [display](const std::string& url) -> ReturnValue {
+                std::lock_guard<std::mutex> lock(http_tool_mutex);
                 auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
 
                 if (!http->Open("GET", url)) {
@@ -279,7 +469,7 @@ void McpServer::AddUserOnlyTools() {
                 auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
                 display->SetPreviewImage(std::move(image));
                 return true;
-            });
+            }, McpToolOptions{ .execution = kMcpToolExecutionWorker, .timeout_ms = 30000 });
 #endif // CONFIG_LV_USE_SNAPSHOT
     }
 #endif // HAVE_LVGL
@@ -287,12 +477,8 @@ void McpServer::AddUserOnlyTools() {
     // Assets download url
     auto& assets = Assets::GetInstance();
     if (assets.partition_valid()) {
-        AddUserOnlyTool("self.assets.set_download_url", "Set the download url for the assets",
-            PropertyList({
-                Property("url", kPropertyTypeString)
-            }),
-            [](const PropertyList& properties) -> ReturnValue {
-                auto url = properties["url"].value<std::string>();
+        AddUserOnlyTool<McpString<"url">>("self.assets.set_download_url", "Set the download url for the assets",
+            [](const std::string& url) -> ReturnValue {
                 Settings settings("assets", true);
                 settings.SetString("download_url", url);
                 return true;
@@ -308,20 +494,23 @@ void McpServer::AddTool(McpTool* tool) {
     }
 
     ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
+    std::lock_guard<std::mutex> lock(index_mutex_);
     tools_.push_back(tool);
+    index_dirty_ = true;
 }
 
-void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    AddTool(new McpTool(name, description, properties, callback));
+void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, const McpToolOptions& options) {
+    AddTool(new McpPropertyListTool(name, description, properties, callback, options));
 }
 
-void McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    auto tool = new McpTool(name, description, properties, callback);
+void McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, const McpToolOptions& options) {
+    auto tool = new McpPropertyListTool(name, description, properties, callback, options);
     tool->set_user_only(true);
     AddTool(tool);
 }
 
 void McpServer::ParseMessage(const std::string& message) {
+    HeapTagScope heap_tag(kHeapTagMcp);
     cJSON* json = cJSON_Parse(message.c_str());
     if (json == nullptr) {
         ESP_LOGE(TAG, "Failed to parse MCP message: %s", message.c_str());
@@ -351,6 +540,58 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
 }
 
 void McpServer::ParseMessage(const cJSON* json) {
+    HeapTagScope heap_tag(kHeapTagMcp);
+    if (cJSON_IsArray(json)) {
+        ParseBatch(json);
+    } else {
+        ParseRequest(json, nullptr);
+    }
+}
+
+void McpServer::ParseBatch(const cJSON* json) {
+    if (cJSON_GetArraySize(json) == 0) {
+        ESP_LOGE(TAG, "Empty batch");
+        return;
+    }
+
+    auto batch = new BatchReply();
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        // 0 stands for a request outside a batch
+        if (++last_batch_id_ == 0) {
+            last_batch_id_ = 1;
+        }
+        batch->batch_id = last_batch_id_;
+        batches_.emplace_back(batch);
+    }
+
+    cJSON* item;
+    cJSON_ArrayForEach(item, json) {
+        if (!cJSON_IsObject(item)) {
+            ESP_LOGE(TAG, "Invalid batch item");
+            continue;
+        }
+        ParseRequest(item, batch);
+    }
+
+    // Requests handled on this task have replied already, tool calls may still be running
+    std::unique_ptr<MessageStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        batch->parsing = false;
+        if (batch->reply_count == batch->ids.size()) {
+            if (!batch->ids.empty()) {
+                stream = std::make_unique<McpBatchStream>(std::move(batch->replies));
+            }
+            batches_.erase(std::find_if(batches_.begin(), batches_.end(), [batch](const auto& b) { return b.get() == batch; }));
+        }
+    }
+    if (stream) {
+        Application::GetInstance().SendMcpMessage(std::move(stream));
+    }
+}
+
+void McpServer::ParseRequest(const cJSON* json, BatchReply* batch) {
     // Check JSONRPC version
     auto version = cJSON_GetObjectItem(json, "jsonrpc");
     if (version == nullptr || !cJSON_IsString(version) || strcmp(version->valuestring, "2.0") != 0) {
@@ -383,6 +624,14 @@ void McpServer::ParseMessage(const cJSON* json) {
         return;
     }
     auto id_int = id->valueint;
+    uint32_t batch_id = batch != nullptr ? batch->batch_id : 0;
+
+    // Every request with a valid id gets exactly one reply from here on
+    if (batch != nullptr) {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        batch->ids.push_back(id_int);
+        batch->replies.emplace_back();
+    }
     
     if (method_str == "initialize") {
         if (cJSON_IsObject(params)) {
@@ -395,7 +644,7 @@ void McpServer::ParseMessage(const cJSON* json) {
         std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
         message += app_desc->version;
         message += "\"}}";
-        ReplyResult(id_int, message);
+        ReplyResult(id_int, batch_id, message);
     } else if (method_str == "tools/list") {
         std::string cursor_str = "";
         bool list_user_only_tools = false;
@@ -409,155 +658,334 @@ void McpServer::ParseMessage(const cJSON* json) {
                 list_user_only_tools = with_user_tools->valueint == 1;
             }
         }
-        GetToolsList(id_int, cursor_str, list_user_only_tools);
+        GetToolsList(id_int, batch_id, cursor_str, list_user_only_tools);
     } else if (method_str == "tools/call") {
         if (!cJSON_IsObject(params)) {
             ESP_LOGE(TAG, "tools/call: Missing params");
-            ReplyError(id_int, "Missing params");
+            ReplyError(id_int, batch_id, "Missing params");
             return;
         }
         auto tool_name = cJSON_GetObjectItem(params, "name");
         if (!cJSON_IsString(tool_name)) {
             ESP_LOGE(TAG, "tools/call: Missing name");
-            ReplyError(id_int, "Missing name");
+            ReplyError(id_int, batch_id, "Missing name");
             return;
         }
         auto tool_arguments = cJSON_GetObjectItem(params, "arguments");
         if (tool_arguments != nullptr && !cJSON_IsObject(tool_arguments)) {
             ESP_LOGE(TAG, "tools/call: Invalid arguments");
-            ReplyError(id_int, "Invalid arguments");
+            ReplyError(id_int, batch_id, "Invalid arguments");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments);
+        DoToolCall(id_int, batch_id, std::string(tool_name->valuestring), tool_arguments);
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
-        ReplyError(id_int, "Method not implemented: " + method_str);
+        ReplyError(id_int, batch_id, "Method not implemented: " + method_str);
+    }
+}
+
+void McpServer::SendReply(int id, uint32_t batch_id, std::string&& payload) {
+    if (batch_id != 0) {
+        SendReply(id, batch_id, std::make_unique<StringMessageStream>(std::move(payload)));
+    } else {
+        Application::GetInstance().SendMcpMessage(payload);
     }
 }
 
-void McpServer::ReplyResult(int id, const std::string& result) {
+void McpServer::SendReply(int id, uint32_t batch_id, std::unique_ptr<MessageStream>&& payload) {
+    std::unique_ptr<MessageStream> batch_stream;
+    if (batch_id != 0) {
+        std::lock_guard<std::mutex> lock(batch_mutex_);
+        for (auto it = batches_.begin(); it != batches_.end(); ++it) {
+            auto& batch = **it;
+            if (batch.batch_id != batch_id) {
+                continue;
+            }
+            for (size_t i = 0; i < batch.ids.size(); i++) {
+                if (batch.ids[i] != id || batch.replies[i]) {
+                    continue;
+                }
+                batch.replies[i] = std::move(payload);
+                batch.reply_count++;
+                if (!batch.parsing && batch.reply_count == batch.ids.size()) {
+                    batch_stream = std::make_unique<McpBatchStream>(std::move(batch.replies));
+                    batches_.erase(it);
+                }
+                break;
+            }
+            break;
+        }
+    }
+
+    auto& app = Application::GetInstance();
+    if (payload) {
+        app.SendMcpMessage(std::move(payload));
+    } else if (batch_stream) {
+        app.SendMcpMessage(std::move(batch_stream));
+    }
+}
+
+void McpServer::ReplyResult(int id, uint32_t batch_id, const std::string& result) {
     std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
     payload += std::to_string(id) + ",\"result\":";
     payload += result;
     payload += "}";
-    Application::GetInstance().SendMcpMessage(payload);
+    SendReply(id, batch_id, std::move(payload));
+}
+
+void McpServer::ReplyToolResult(int id, uint32_t batch_id, ReturnValue&& return_value) {
+    if (std::holds_alternative<cJSON*>(return_value)) {
+        // JSON results are sent as text
+        auto json = std::get<cJSON*>(return_value);
+        char* json_str = cJSON_PrintUnformatted(json);
+        cJSON_Delete(json);
+        return_value = std::string(json_str);
+        cJSON_free(json_str);
+    }
+
+    // The output is byte-identical to McpTool::FormatResult wrapped by ReplyResult
+    std::string prefix = "{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(id) + ",\"result\":{\"content\":[{\"type\":";
+    std::unique_ptr<MessageStream> stream;
+    if (std::holds_alternative<ImageContent*>(return_value)) {
+        auto image = std::get<ImageContent*>(return_value);
+        // The image object is embedded as a JSON string, so the mime type is escaped twice
+        prefix += "\"image\",\"image\":\"{\\\"type\\\":\\\"image\\\",\\\"mimeType\\\":\\\"";
+        prefix += McpResultStream::EscapeJsonString(McpResultStream::EscapeJsonString(image->mime_type()));
+        prefix += "\\\",\\\"data\\\":\\\"";
+        std::string suffix = "\\\"}\"}],\"isError\":false}}";
+        if (image->borrowed()) {
+            stream = std::make_unique<McpResultStream>(std::move(prefix), image->data(), image->size(),
+                image->take_release(), McpResultStream::kEncodingBase64, std::move(suffix));
+        } else {
+            stream = std::make_unique<McpResultStream>(std::move(prefix), image->take_data(),
+                McpResultStream::kEncodingBase64, std::move(suffix));
+        }
+        delete image;
+    } else if (std::holds_alternative<std::string>(return_value) &&
+        std::get<std::string>(return_value).size() >= MCP_STREAM_RESULT_MIN_SIZE) {
+        prefix += "\"text\",\"text\":\"";
+        stream = std::make_unique<McpResultStream>(std::move(prefix), std::move(std::get<std::string>(return_value)),
+            McpResultStream::kEncodingJsonString, "\"}],\"isError\":false}}");
+    } else {
+        ReplyResult(id, batch_id, McpTool::FormatResult(std::move(return_value)));
+        return;
+    }
+    SendReply(id, batch_id, std::move(stream));
 }
 
-void McpServer::ReplyError(int id, const std::string& message) {
+void McpServer::ReplyError(int id, uint32_t batch_id, const std::string& message) {
     std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
     payload += std::to_string(id);
     payload += ",\"error\":{\"message\":\"";
     payload += message;
     payload += "\"}}";
-    Application::GetInstance().SendMcpMessage(payload);
+    SendReply(id, batch_id, std::move(payload));
+}
+
+void McpServer::BuildToolIndex() {
+    tool_index_.clear();
+    tool_index_.reserve(tools_.size());
+    for (auto tool : tools_) {
+        tool_index_.emplace(tool->name(), tool);
+    }
+    for (auto& pages : tools_list_pages_) {
+        pages = ToolsListPages();
+    }
+    index_dirty_ = false;
 }
 
-void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
+void McpServer::BuildToolsListPages(bool list_user_only_tools) {
     const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
-    std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
-        }
+    auto& result = tools_list_pages_[list_user_only_tools ? 1 : 0];
+    result.built = true;
 
-        if (!list_user_only_tools && (*it)->user_only()) {
-            ++it;
+    std::string json = "{\"tools\":[";
+    std::string page_cursor;
+    for (auto tool : tools_) {
+        if (!list_user_only_tools && tool->user_only()) {
             continue;
         }
-        
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
+
+        // 添加tool前检查大小，超出限制时以该tool作为下一页的cursor
+        std::string tool_json = tool->to_json() + ",";
         if (json.length() + tool_json.length() + 30 > max_payload_size) {
-            // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
-            break;
+            if (json.back() == '[') {
+                // 单个tool超出大小限制，该页返回错误
+                ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", tool->name().c_str());
+                result.cursor_index[page_cursor] = result.pages.size();
+                result.pages.push_back(std::string());
+                result.oversized_tool = tool->name();
+                return;
+            }
+            json.pop_back();
+            json += "],\"nextCursor\":\"" + tool->name() + "\"}";
+            result.cursor_index[page_cursor] = result.pages.size();
+            result.pages.push_back(std::move(json));
+            json = "{\"tools\":[";
+            page_cursor = tool->name();
         }
-        
         json += tool_json;
-        ++it;
     }
-    
+
     if (json.back() == ',') {
         json.pop_back();
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
-        // 如果没有添加任何tool，返回错误
-        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
-        ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
-        return;
+    json += "]}";
+    result.cursor_index[page_cursor] = result.pages.size();
+    result.pages.push_back(std::move(json));
+    ESP_LOGI(TAG, "tools/list: %u pages cached%s", result.pages.size(), list_user_only_tools ? " (with user tools)" : "");
+}
+
+McpTool* McpServer::FindTool(const std::string& name) {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    if (index_dirty_) {
+        BuildToolIndex();
+    }
+    auto it = tool_index_.find(name);
+    return it != tool_index_.end() ? it->second : nullptr;
+}
+
+void McpServer::GetToolsList(int id, uint32_t batch_id, const std::string& cursor, bool list_user_only_tools) {
+    std::unique_lock<std::mutex> lock(index_mutex_);
+    if (index_dirty_) {
+        BuildToolIndex();
+    }
+    auto& pages = tools_list_pages_[list_user_only_tools ? 1 : 0];
+    if (!pages.built) {
+        BuildToolsListPages(list_user_only_tools);
     }
 
-    if (next_cursor.empty()) {
-        json += "]}";
-    } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+    auto it = pages.cursor_index.find(cursor);
+    if (it == pages.cursor_index.end()) {
+        lock.unlock();
+        ESP_LOGE(TAG, "tools/list: Invalid cursor: %s", cursor.c_str());
+        ReplyError(id, batch_id, "Invalid cursor: " + cursor);
+        return;
     }
-    
-    ReplyResult(id, json);
+    const auto& page = pages.pages[it->second];
+    if (page.empty()) {
+        std::string message = "Failed to add tool " + pages.oversized_tool + " because of payload size limit";
+        lock.unlock();
+        ReplyError(id, batch_id, message);
+        return;
+    }
+    ReplyResult(id, batch_id, page);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+void McpServer::DoToolCall(int id, uint32_t batch_id, const std::string& tool_name, const cJSON* tool_arguments) {
+    auto tool = FindTool(tool_name);
+    if (tool == nullptr) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
-        ReplyError(id, "Unknown tool: " + tool_name);
+        ReplyError(id, batch_id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
-    try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
-            }
+    std::string error;
+    auto invoke = tool->Bind(tool_arguments, error);
+    if (!invoke) {
+        ESP_LOGE(TAG, "tools/call: %s", error.c_str());
+        ReplyError(id, batch_id, error);
+        return;
+    }
 
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
-            }
+    if (!tool->TryBeginCall()) {
+        ESP_LOGW(TAG, "tools/call: %s is busy", tool_name.c_str());
+        {
+            std::lock_guard<std::mutex> lock(calls_mutex_);
+            rejected_count_++;
         }
-    } catch (const std::exception& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+        ReplyError(id, batch_id, "Tool is busy: " + tool_name);
         return;
     }
 
-    // Use main thread to call the tool
-    auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
+    // Whoever sets replied first (the call or the timeout check) sends the reply
+    auto replied = std::make_shared<std::atomic<bool>>(false);
+    auto execution = tool->options().execution;
+    if (execution != kMcpToolExecutionMain && tool->options().timeout_ms > 0) {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        pending_calls_.push_back({id, batch_id, esp_timer_get_time() + tool->options().timeout_ms * 1000LL, replied});
+    }
+
+    auto call = [this, id, batch_id, tool, invoke = std::move(invoke), replied]() {
+        // Runs on the worker, tool or main task, away from the scope of ParseMessage
+        HeapTagScope heap_tag(kHeapTagMcp);
+        int64_t start_time = esp_timer_get_time();
+        ReturnValue result;
+        std::string error;
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
+            result = invoke();
         } catch (const std::exception& e) {
             ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+            error = e.what();
+        }
+        tool->EndCall();
+
+        if (tool->options().execution == kMcpToolExecutionMain) {
+            uint32_t elapsed = esp_timer_get_time() - start_time;
+            std::lock_guard<std::mutex> lock(calls_mutex_);
+            main_stall_total_us_ += elapsed;
+            main_stall_max_us_ = std::max(main_stall_max_us_, elapsed);
+        }
+        if (replied->exchange(true)) {
+            ESP_LOGW(TAG, "tools/call: %s finished after its timeout, result dropped", tool->name().c_str());
+            McpTool::ReleaseResult(result);
+            return;
+        }
+        if (error.empty()) {
+            ReplyToolResult(id, batch_id, std::move(result));
+        } else {
+            ReplyError(id, batch_id, error);
+        }
+    };
+
+    auto& app = Application::GetInstance();
+    if (execution == kMcpToolExecutionWorker) {
+        if (!app.GetWorkerPool().Submit(std::move(call))) {
+            tool->EndCall();
+            replied->store(true);
+            ReplyError(id, batch_id, "Too many tool calls in progress");
+        }
+    } else if (execution == kMcpToolExecutionAsync) {
+        try {
+            auto config = esp_pthread_get_default_config();
+            config.thread_name = "mcp_tool";
+            config.stack_size = WORKER_POOL_STACK_SIZE;
+            config.prio = 3;
+            esp_pthread_set_cfg(&config);
+            std::thread(std::move(call)).detach();
+        } catch (const std::exception& e) {
+            ESP_LOGE(TAG, "tools/call: failed to start task: %s", e.what());
+            tool->EndCall();
+            replied->store(true);
+            ReplyError(id, batch_id, "Failed to start tool task");
         }
-    });
+    } else {
+        // Use main thread to call the tool, after audio and UI work
+        app.Schedule(std::move(call), kTaskClassBackground);
+    }
+}
+
+void McpServer::CheckToolCallTimeouts() {
+    std::vector<std::pair<int, uint32_t>> timed_out_calls;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        auto now = esp_timer_get_time();
+        for (auto it = pending_calls_.begin(); it != pending_calls_.end();) {
+            if (it->replied->load()) {
+                it = pending_calls_.erase(it);
+            } else if (now >= it->deadline) {
+                if (!it->replied->exchange(true)) {
+                    timed_out_calls.emplace_back(it->id, it->batch_id);
+                    timeout_count_++;
+                }
+                it = pending_calls_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto [id, batch_id] : timed_out_calls) {
+        ESP_LOGW(TAG, "tools/call: id %d timed out", id);
+        ReplyError(id, batch_id, "Tool call timed out");
+    }
 }
@@ -4,40 +4,67 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <string_view>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <utility>
 #include <mbedtls/base64.h>
 
 #include <cJSON.h>
+#include "protocol.h"
+#include "mcp_schema.h"
 
 class ImageContent {
 private:
-    std::string encoded_data_;
+    std::string data_;
+    const char* source_ = nullptr;      // Borrowed data, see the third constructor
+    size_t source_size_ = 0;
+    std::function<void()> release_;
     std::string mime_type_;
 
-    static std::string Base64Encode(const std::string& data) {
+    static std::string Base64Encode(const char* data, size_t size) {
         size_t dlen = 0, olen = 0;
-        mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data.data(), data.size());
+        mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data, size);
         std::string result(dlen, 0);
-        mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data.data(), data.size());
+        mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data, size);
+        result.resize(olen);
         return result;
     }
 
 public:
-    ImageContent(const std::string& mime_type, const std::string& data) {
-        mime_type_ = mime_type;
-        // base64 encode data
-        encoded_data_ = Base64Encode(data);
+    // The data is kept raw and base64 encoded while the reply is sent
+    ImageContent(const std::string& mime_type, const std::string& data) : data_(data), mime_type_(mime_type) {}
+    ImageContent(const std::string& mime_type, std::string&& data) : data_(std::move(data)), mime_type_(mime_type) {}
+    // Borrows an encoded image, such as a camera frame buffer, until the reply has been sent and then calls
+    // release, so the reply is encoded straight from it without a copy
+    ImageContent(const std::string& mime_type, const uint8_t* data, size_t size, std::function<void()> release)
+        : source_((const char*)data), source_size_(size), release_(std::move(release)), mime_type_(mime_type) {}
+    ~ImageContent() {
+        if (release_) {
+            release_();
+        }
     }
 
+    inline const std::string& mime_type() const { return mime_type_; }
+    inline bool borrowed() const { return source_ != nullptr; }
+    inline const char* data() const { return borrowed() ? source_ : data_.data(); }
+    inline size_t size() const { return borrowed() ? source_size_ : data_.size(); }
+    inline std::string&& take_data() { return std::move(data_); }
+    // The caller now calls release once it is done with data()
+    inline std::function<void()> take_release() { return std::exchange(release_, nullptr); }
+
     std::string to_json() const {
         cJSON *json = cJSON_CreateObject();
         cJSON_AddStringToObject(json, "type", "image");
         cJSON_AddStringToObject(json, "mimeType", mime_type_.c_str());
-        cJSON_AddStringToObject(json, "data", encoded_data_.c_str());
+        cJSON_AddStringToObject(json, "data", Base64Encode(data(), size()).c_str());
         char* json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -46,6 +73,69 @@ public:
     }
 };
 
+// Text results at least this large and all image results are streamed instead of formatted as one string
+#define MCP_STREAM_RESULT_MIN_SIZE 2048
+
+/*
+ * Streams prefix + encoded body + suffix. The body is either base64 encoded or escaped as the
+ * contents of a JSON string while it is read, so a large tool result costs its raw size plus one chunk.
+ * The body is owned, or borrowed and released once it has been read or the stream is dropped. Only a
+ * borrowed body avoids holding the raw data in a second buffer while the reply is sent.
+ */
+class McpResultStream : public MessageStream {
+public:
+    enum Encoding {
+        kEncodingJsonString,
+        kEncodingBase64
+    };
+
+    McpResultStream(std::string&& prefix, std::string&& body, Encoding encoding, std::string&& suffix)
+        : prefix_(std::move(prefix)), body_(std::move(body)), body_data_(body_.data()), body_size_(body_.size()),
+          suffix_(std::move(suffix)), encoding_(encoding) {}
+    McpResultStream(std::string&& prefix, const char* body, size_t body_size, std::function<void()> release,
+        Encoding encoding, std::string&& suffix)
+        : prefix_(std::move(prefix)), body_data_(body), body_size_(body_size), release_(std::move(release)),
+          suffix_(std::move(suffix)), encoding_(encoding) {}
+    ~McpResultStream() override { ReleaseBody(); }
+
+    size_t Read(char* buffer, size_t size) override;
+
+    // Escape text the way cJSON prints string values, without the quotes
+    static size_t EscapeJsonChar(unsigned char c, char* out);
+    static std::string EscapeJsonString(const std::string& text);
+
+private:
+    std::string prefix_;
+    std::string body_;
+    const char* body_data_;
+    size_t body_size_;
+    std::function<void()> release_;
+    std::string suffix_;
+    Encoding encoding_;
+    int stage_ = 0;         // 0: prefix, 1: body, 2: suffix, 3: done
+    size_t offset_ = 0;
+    char pending_[8];       // Encoded bytes of the last unit that did not fit into the buffer
+    size_t pending_size_ = 0;
+    size_t pending_offset_ = 0;
+
+    size_t EncodeUnit(char* out);
+    void ReleaseBody();
+};
+
+// Replies of a JSON-RPC batch in request order, streamed as one array
+class McpBatchStream : public MessageStream {
+public:
+    explicit McpBatchStream(std::vector<std::unique_ptr<MessageStream>>&& replies) : replies_(std::move(replies)) {}
+
+    size_t Read(char* buffer, size_t size) override;
+
+private:
+    std::vector<std::unique_ptr<MessageStream>> replies_;
+    size_t index_ = 0;
+    bool opened_ = false;
+    bool closed_ = false;
+};
+
 // 添加类型别名
 using ReturnValue = std::variant<bool, int, std::string, cJSON*, ImageContent*>;
 
@@ -120,7 +210,7 @@ public:
         value_ = value;
     }
 
-    std::string to_json() const {
+    cJSON* to_cjson() const {
         cJSON *json = cJSON_CreateObject();
         
         if (type_ == kPropertyTypeBoolean) {
@@ -145,7 +235,11 @@ public:
                 cJSON_AddStringToObject(json, "default", value<std::string>().c_str());
             }
         }
-        
+        return json;
+    }
+
+    std::string to_json() const {
+        cJSON *json = to_cjson();
         char *json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -188,14 +282,16 @@ public:
         return required;
     }
 
-    std::string to_json() const {
+    cJSON* to_cjson() const {
         cJSON *json = cJSON_CreateObject();
-        
         for (const auto& property : properties_) {
-            cJSON *prop_json = cJSON_Parse(property.to_json().c_str());
-            cJSON_AddItemToObject(json, property.name().c_str(), prop_json);
+            cJSON_AddItemToObject(json, property.name().c_str(), property.to_cjson());
         }
-        
+        return json;
+    }
+
+    std::string to_json() const {
+        cJSON *json = to_cjson();
         char *json_str = cJSON_PrintUnformatted(json);
         std::string result(json_str);
         cJSON_free(json_str);
@@ -205,72 +301,94 @@ public:
     }
 };
 
+// Where the body of a tool call runs
+enum McpToolExecution {
+    kMcpToolExecutionMain,      // Main task, for tools that touch application state (default)
+    kMcpToolExecutionWorker,    // Application worker pool, for blocking I/O such as HTTP uploads
+    kMcpToolExecutionAsync      // A dedicated task per call, for long-running tools
+};
+
+struct McpToolOptions {
+    McpToolExecution execution = kMcpToolExecutionMain;
+    int timeout_ms = 0;         // Worker / async only, reply an error if the call takes longer, 0 waits forever
+    int max_concurrency = 1;    // Worker / async only, calls beyond the limit are rejected
+};
+
+/*
+ * Base of all tools. Subclasses provide the inputSchema JSON and bind the call arguments,
+ * see McpPropertyListTool (runtime PropertyList) and McpTypedTool (compile-time schema).
+ */
 class McpTool {
-private:
+protected:
     std::string name_;
     std::string description_;
-    PropertyList properties_;
-    std::function<ReturnValue(const PropertyList&)> callback_;
     bool user_only_ = false;
+    McpToolOptions options_;
+    std::atomic<int> active_calls_ = 0;
 
 public:
-    McpTool(const std::string& name, 
-            const std::string& description, 
-            const PropertyList& properties, 
-            std::function<ReturnValue(const PropertyList&)> callback)
-        : name_(name), 
-        description_(description), 
-        properties_(properties), 
-        callback_(callback) {}
+    McpTool(const std::string& name, const std::string& description, const McpToolOptions& options)
+        : name_(name), description_(description), options_(options) {}
+    virtual ~McpTool() = default;
 
     void set_user_only(bool user_only) { user_only_ = user_only; }
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
-    inline const PropertyList& properties() const { return properties_; }
     inline bool user_only() const { return user_only_; }
+    inline const McpToolOptions& options() const { return options_; }
 
-    std::string to_json() const {
-        std::vector<std::string> required = properties_.GetRequired();
-        
-        cJSON *json = cJSON_CreateObject();
-        cJSON_AddStringToObject(json, "name", name_.c_str());
-        cJSON_AddStringToObject(json, "description", description_.c_str());
-        
-        cJSON *input_schema = cJSON_CreateObject();
-        cJSON_AddStringToObject(input_schema, "type", "object");
-        
-        cJSON *properties = cJSON_Parse(properties_.to_json().c_str());
-        cJSON_AddItemToObject(input_schema, "properties", properties);
-        
-        if (!required.empty()) {
-            cJSON *required_array = cJSON_CreateArray();
-            for (const auto& property : required) {
-                cJSON_AddItemToArray(required_array, cJSON_CreateString(property.c_str()));
-            }
-            cJSON_AddItemToObject(input_schema, "required", required_array);
+    virtual std::string_view input_schema() const = 0;
+
+    // Parse and validate the call arguments, returns the call with its arguments bound or nullptr with error set
+    virtual std::function<ReturnValue()> Bind(const cJSON* arguments, std::string& error) const = 0;
+
+    bool TryBeginCall() {
+        if (options_.execution == kMcpToolExecutionMain) {
+            return true;
         }
-        
-        cJSON_AddItemToObject(json, "inputSchema", input_schema);
+        if (active_calls_.fetch_add(1) >= options_.max_concurrency) {
+            active_calls_--;
+            return false;
+        }
+        return true;
+    }
+
+    void EndCall() {
+        if (options_.execution != kMcpToolExecutionMain) {
+            active_calls_--;
+        }
+    }
+
+    std::string to_json() const {
+        auto input_schema = this->input_schema();
+        std::string json;
+        json.reserve(name_.size() + description_.size() + input_schema.size() + 80);
+        json += "{\"name\":\"";
+        json += McpResultStream::EscapeJsonString(name_);
+        json += "\",\"description\":\"";
+        json += McpResultStream::EscapeJsonString(description_);
+        json += "\",\"inputSchema\":";
+        json += input_schema;
 
         // Add audience annotation if the tool is user only (invisible to AI)
         if (user_only_) {
-            cJSON *annotations = cJSON_CreateObject();
-            cJSON *audience = cJSON_CreateArray();
-            cJSON_AddItemToArray(audience, cJSON_CreateString("user"));
-            cJSON_AddItemToObject(annotations, "audience", audience);
-            cJSON_AddItemToObject(json, "annotations", annotations);
+            json += ",\"annotations\":{\"audience\":[\"user\"]}";
         }
-        
-        char *json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        
-        return result;
+        json += "}";
+        return json;
     }
 
-    std::string Call(const PropertyList& properties) {
-        ReturnValue return_value = callback_(properties);
+    // Free the resources owned by a result that will not be sent
+    static void ReleaseResult(ReturnValue& return_value) {
+        if (std::holds_alternative<ImageContent*>(return_value)) {
+            delete std::get<ImageContent*>(return_value);
+        } else if (std::holds_alternative<cJSON*>(return_value)) {
+            cJSON_Delete(std::get<cJSON*>(return_value));
+        }
+        return_value = false;
+    }
+
+    static std::string FormatResult(ReturnValue return_value) {
         // 返回结果
         cJSON* result = cJSON_CreateObject();
         cJSON* content = cJSON_CreateArray();
@@ -311,6 +429,104 @@ public:
     }
 };
 
+// Adapter for tools registered with a PropertyList, the schema is printed once at registration
+class McpPropertyListTool : public McpTool {
+private:
+    PropertyList properties_;
+    std::function<ReturnValue(const PropertyList&)> callback_;
+    std::string input_schema_;
+
+public:
+    McpPropertyListTool(const std::string& name,
+            const std::string& description,
+            const PropertyList& properties,
+            std::function<ReturnValue(const PropertyList&)> callback,
+            const McpToolOptions& options = McpToolOptions())
+        : McpTool(name, description, options),
+        properties_(properties),
+        callback_(callback) {
+        std::vector<std::string> required = properties_.GetRequired();
+
+        cJSON *input_schema = cJSON_CreateObject();
+        cJSON_AddStringToObject(input_schema, "type", "object");
+        cJSON_AddItemToObject(input_schema, "properties", properties_.to_cjson());
+        if (!required.empty()) {
+            cJSON *required_array = cJSON_CreateArray();
+            for (const auto& property : required) {
+                cJSON_AddItemToArray(required_array, cJSON_CreateString(property.c_str()));
+            }
+            cJSON_AddItemToObject(input_schema, "required", required_array);
+        }
+
+        char *json_str = cJSON_PrintUnformatted(input_schema);
+        input_schema_ = json_str;
+        cJSON_free(json_str);
+        cJSON_Delete(input_schema);
+    }
+
+    inline const PropertyList& properties() const { return properties_; }
+
+    std::string_view input_schema() const override { return input_schema_; }
+
+    std::function<ReturnValue()> Bind(const cJSON* arguments, std::string& error) const override {
+        PropertyList values = properties_;
+        try {
+            for (auto& argument : values) {
+                bool found = false;
+                if (cJSON_IsObject(arguments)) {
+                    auto value = cJSON_GetObjectItem(arguments, argument.name().c_str());
+                    if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
+                        argument.set_value<bool>(value->valueint == 1);
+                        found = true;
+                    } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
+                        argument.set_value<int>(value->valueint);
+                        found = true;
+                    } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
+                        argument.set_value<std::string>(value->valuestring);
+                        found = true;
+                    }
+                }
+
+                if (!argument.has_default_value() && !found) {
+                    error = "Missing valid argument: " + argument.name();
+                    return nullptr;
+                }
+            }
+        } catch (const std::exception& e) {
+            error = e.what();
+            return nullptr;
+        }
+        return [this, values = std::move(values)]() { return callback_(values); };
+    }
+};
+
+/*
+ * Tool with compile-time arguments, the callback receives the parsed values in argument order:
+ *   McpTypedTool<McpString<"url">, McpInteger<"quality", 1, 100, 80>>(..., [](const std::string& url, int quality) ...)
+ */
+template <typename... Args>
+class McpTypedTool : public McpTool {
+public:
+    using Callback = std::function<ReturnValue(const typename Args::value_type&...)>;
+
+    McpTypedTool(const std::string& name, const std::string& description, Callback callback,
+            const McpToolOptions& options = McpToolOptions())
+        : McpTool(name, description, options), callback_(std::move(callback)) {}
+
+    std::string_view input_schema() const override { return McpSchema<Args...>::input_schema(); }
+
+    std::function<ReturnValue()> Bind(const cJSON* arguments, std::string& error) const override {
+        typename McpSchema<Args...>::Values values;
+        if (!McpSchema<Args...>::Bind(arguments, values, error)) {
+            return nullptr;
+        }
+        return [this, values = std::move(values)]() { return std::apply(callback_, values); };
+    }
+
+private:
+    Callback callback_;
+};
+
 class McpServer {
 public:
     static McpServer& GetInstance() {
@@ -321,24 +537,89 @@ public:
     void AddCommonTools();
     void AddUserOnlyTools();
     void AddTool(McpTool* tool);
-    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
-    void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, const McpToolOptions& options = McpToolOptions());
+    void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, const McpToolOptions& options = McpToolOptions());
+
+    // Typed tools, e.g. AddTool<McpInteger<"volume", 0, 100>>(name, description, [](int volume) -> ReturnValue { ... })
+    template <typename... Args>
+    void AddTool(const std::string& name, const std::string& description, typename McpTypedTool<Args...>::Callback callback, const McpToolOptions& options = McpToolOptions()) {
+        AddTool(new McpTypedTool<Args...>(name, description, std::move(callback), options));
+    }
+
+    template <typename... Args>
+    void AddUserOnlyTool(const std::string& name, const std::string& description, typename McpTypedTool<Args...>::Callback callback, const McpToolOptions& options = McpToolOptions()) {
+        auto tool = new McpTypedTool<Args...>(name, description, std::move(callback), options);
+        tool->set_user_only(true);
+        AddTool(tool);
+    }
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
+    // Called periodically from the main task to fail worker / async calls that exceeded their timeout
+    void CheckToolCallTimeouts();
 
 private:
     McpServer();
     ~McpServer();
 
-    void ParseCapabilities(const cJSON* capabilities);
+    // Replies to a JSON-RPC batch, sent together once every request in it has replied
+    struct BatchReply {
+        uint32_t batch_id = 0;
+        std::vector<int> ids;
+        std::vector<std::unique_ptr<MessageStream>> replies;
+        size_t reply_count = 0;
+        bool parsing = true;    // More requests of the batch may still be added
+    };
 
-    void ReplyResult(int id, const std::string& result);
-    void ReplyError(int id, const std::string& message);
-
-    void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
+    void ParseCapabilities(const cJSON* capabilities);
+    void ParseBatch(const cJSON* json);
+    void ParseRequest(const cJSON* json, BatchReply* batch);
+
+    // batch_id is the BatchReply the request came in, 0 for a single request. Request ids only need to be
+    // unique within a batch, so replies are matched by both.
+    void SendReply(int id, uint32_t batch_id, std::string&& payload);
+    void SendReply(int id, uint32_t batch_id, std::unique_ptr<MessageStream>&& payload);
+    void ReplyResult(int id, uint32_t batch_id, const std::string& result);
+    void ReplyToolResult(int id, uint32_t batch_id, ReturnValue&& return_value);
+    void ReplyError(int id, uint32_t batch_id, const std::string& message);
+
+    void GetToolsList(int id, uint32_t batch_id, const std::string& cursor, bool list_user_only_tools);
+    void BuildToolIndex();
+    void BuildToolsListPages(bool list_user_only_tools);
+    McpTool* FindTool(const std::string& name);
+    void DoToolCall(int id, uint32_t batch_id, const std::string& tool_name, const cJSON* tool_arguments);
+
+    struct PendingToolCall {
+        int id;
+        uint32_t batch_id;
+        int64_t deadline;
+        std::shared_ptr<std::atomic<bool>> replied;
+    };
 
     std::vector<McpTool*> tools_;
+
+    // Built on first use after registration and rebuilt if tools are added later, guarded by index_mutex_.
+    // Each tools/list page is the complete result JSON, pages after the first are keyed by their cursor.
+    struct ToolsListPages {
+        bool built = false;
+        std::vector<std::string> pages;
+        std::unordered_map<std::string, size_t> cursor_index;
+        std::string oversized_tool;     // The last page is empty if this tool alone exceeds the size limit
+    };
+    std::mutex index_mutex_;
+    bool index_dirty_ = true;
+    std::unordered_map<std::string_view, McpTool*> tool_index_;
+    ToolsListPages tools_list_pages_[2];    // Without / with user only tools
+
+    std::mutex batch_mutex_;
+    std::vector<std::unique_ptr<BatchReply>> batches_;
+    uint32_t last_batch_id_ = 0;
+
+    std::mutex calls_mutex_;
+    std::vector<PendingToolCall> pending_calls_;
+    uint64_t main_stall_total_us_ = 0;  // Time tools spent blocking the main task
+    uint32_t main_stall_max_us_ = 0;
+    uint32_t timeout_count_ = 0;
+    uint32_t rejected_count_ = 0;
 };
 
 #endif // MCP_SERVER_H
@@ -1,6 +1,8 @@
 #include "ota.h"
 #include "system_info.h"
 #include "settings.h"
+#include "download_pipeline.h"
+#include "delta_patch.h"
 #include "assets/lang_config.h"
 
 #include <freertos/FreeRTOS.h>
@@ -13,17 +15,24 @@
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
 #include <esp_heap_caps.h>
+#include <esp_chip_info.h>
+#include <mbedtls/sha256.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
 
+#include <cstdio>
 #include <cstring>
+#include <mutex>
 #include <vector>
 #include <sstream>
 #include <algorithm>
 
 #define TAG "Ota"
 
+// Check responses up to this size are kept for conditional checks, NVS strings hold at most 4000 bytes
+#define OTA_CHECK_CACHE_MAX_SIZE 3072
+
 
 Ota::Ota() {
 #ifdef ESP_EFUSE_BLOCK_USR_DATA
@@ -71,10 +80,107 @@ std::unique_ptr<Http> Ota::SetupHttp() {
     return http;
 }
 
+/*
+ * Copy a server config section into the settings namespace of the same name.
+ * Arrays of strings (a ranked endpoint list) are stored comma separated. The list key is erased
+ * when the server stops sending it, so a stale list never shadows the single endpoint.
+ */
+void Ota::SaveServerConfig(const char* ns, const cJSON* section, const char* list_key) {
+    Settings settings(ns, true);
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, section) {
+        if (cJSON_IsString(item)) {
+            if (settings.GetString(item->string) != item->valuestring) {
+                settings.SetString(item->string, item->valuestring);
+            }
+        } else if (cJSON_IsNumber(item)) {
+            if (settings.GetInt(item->string) != item->valueint) {
+                settings.SetInt(item->string, item->valueint);
+            }
+        } else if (cJSON_IsArray(item)) {
+            std::string joined;
+            cJSON *element = NULL;
+            cJSON_ArrayForEach(element, item) {
+                if (cJSON_IsString(element)) {
+                    if (!joined.empty()) {
+                        joined += ",";
+                    }
+                    joined += element->valuestring;
+                }
+            }
+            if (settings.GetString(item->string) != joined) {
+                settings.SetString(item->string, joined);
+            }
+        }
+    }
+    if (!cJSON_HasObjectItem(section, list_key)) {
+        settings.EraseKey(list_key);
+    }
+}
+
+/*
+ * Digest of what the full system info is built from, leaving out the values that change at every boot
+ * (free heap, signal strength). The full system info is only sent again when it changes.
+ */
+std::string Ota::GetSystemInfoDigest() {
+    auto& board = Board::GetInstance();
+    auto app_desc = esp_app_get_description();
+    auto running_partition = esp_ota_get_running_partition();
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+    std::string identity = std::string(Lang::CODE) + "," + SystemInfo::GetMacAddress() + "," + board.GetUuid() + "," +
+        board.GetBoardType() + "," + BOARD_NAME + "," + std::to_string(SystemInfo::GetFlashSize()) + "," +
+        running_partition->label + "," + std::to_string(chip_info.model) + "," + std::to_string(chip_info.revision);
+
+    uint8_t sha256[32];
+    mbedtls_sha256_context context;
+    mbedtls_sha256_init(&context);
+    mbedtls_sha256_starts(&context, 0);
+    mbedtls_sha256_update(&context, app_desc->app_elf_sha256, sizeof(app_desc->app_elf_sha256));
+    mbedtls_sha256_update(&context, (const unsigned char*)identity.data(), identity.size());
+    mbedtls_sha256_finish(&context, sha256);
+    mbedtls_sha256_free(&context);
+
+    char digest[17];
+    for (int i = 0; i < 8; i++) {
+        snprintf(digest + i * 2, sizeof(digest) - i * 2, "%02x", sha256[i]);
+    }
+    return digest;
+}
+
 /* 
  * Specification: https://ccnphfhqs21z.feishu.cn/wiki/FjW6wZmisimNBBkov6OcmfvknVd
+ *
+ * Once the server tags its response with an ETag and the system info did not change, the check is a
+ * conditional GET with If-None-Match and the digest of the system info. A 304 reuses the response
+ * kept from the last full check, with the time taken from its Date header. Servers without ETag
+ * always get the full system info.
+ */
+/*
+ * Milliseconds since the epoch of an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), or 0 if it cannot be parsed
  */
-esp_err_t Ota::CheckVersion() {
+static int64_t ParseHttpDate(const std::string& date) {
+    static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    char month_name[4] = {};
+    int day, year, hour, minute, second;
+    if (sscanf(date.c_str(), "%*3s, %d %3s %d %d:%d:%d", &day, month_name, &year, &hour, &minute, &second) != 6) {
+        return 0;
+    }
+    int month = std::find_if(std::begin(months), std::end(months), [&](const char* m) { return strcmp(m, month_name) == 0; }) - std::begin(months) + 1;
+    if (month > 12 || year < 1970) {
+        return 0;
+    }
+    // Days since the epoch of a proleptic Gregorian date, months counted from March
+    int y = month <= 2 ? year - 1 : year;
+    int era = y / 400;
+    int year_of_era = y - era * 400;
+    int day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = (int64_t)era * 146097 + day_of_era - 719468;
+    return ((days * 24 + hour) * 60 + minute) * 60000LL + second * 1000LL;
+}
+
+esp_err_t Ota::CheckVersion(bool allow_conditional) {
     auto& board = Board::GetInstance();
     auto app_desc = esp_app_get_description();
 
@@ -90,9 +196,20 @@ esp_err_t Ota::CheckVersion() {
 
     auto http = SetupHttp();
 
-    std::string data = board.GetSystemInfoJson();
-    std::string method = data.length() > 0 ? "POST" : "GET";
-    http->SetContent(std::move(data));
+    Settings settings("ota", true);
+    std::string digest = GetSystemInfoDigest();
+    std::string etag = settings.GetString("check_etag");
+    bool conditional = allow_conditional && !etag.empty() && settings.GetString("check_digest") == digest;
+    std::string method;
+    if (conditional) {
+        http->SetHeader("If-None-Match", etag);
+        http->SetHeader("System-Info-Digest", digest);
+        method = "GET";
+    } else {
+        std::string data = board.GetSystemInfoJson();
+        method = data.length() > 0 ? "POST" : "GET";
+        http->SetContent(std::move(data));
+    }
 
     if (!http->Open(method, url)) {
         int last_error = http->GetLastError();
@@ -101,19 +218,74 @@ esp_err_t Ota::CheckVersion() {
     }
 
     auto status_code = http->GetStatusCode();
+    if (conditional && status_code == 304) {
+        // Nothing else sets the clock, the Date header of the 304 replaces the outdated server time of the cached response
+        int64_t date_ms = ParseHttpDate(http->GetResponseHeader("Date"));
+        http->Close();
+        if (date_ms == 0) {
+            ESP_LOGW(TAG, "No Date in the 304 response, checking again with the full system info");
+            return CheckVersion(false);
+        }
+        ESP_LOGI(TAG, "Check version response is unchanged");
+        std::string cached = settings.GetString("check_body");
+        return ParseCheckVersionResponse(cached.data(), cached.size(), date_ms);
+    }
     if (status_code != 200) {
         ESP_LOGE(TAG, "Failed to check version, status code: %d", status_code);
         return status_code;
     }
 
-    data = http->ReadAll();
+    // Read the body into one buffer of the announced size instead of growing it, cJSON parses it in place
+    std::string data;
+    size_t body_length = http->GetBodyLength();
+    if (body_length > 0) {
+        data.resize(body_length);
+        size_t received = 0;
+        while (received < body_length) {
+            int ret = http->Read(data.data() + received, body_length - received);
+            if (ret <= 0) {
+                break;
+            }
+            received += ret;
+        }
+        data.resize(received);
+    } else {
+        data = http->ReadAll();
+    }
+    std::string new_etag = http->GetResponseHeader("ETag");
     http->Close();
 
+    esp_err_t err = ParseCheckVersionResponse(data.data(), data.size());
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Keep the response for conditional checks, or stop them when the server no longer sends an ETag
+    if (!new_etag.empty() && data.size() <= OTA_CHECK_CACHE_MAX_SIZE) {
+        if (settings.GetString("check_body") != data) {
+            settings.SetString("check_body", data);
+        }
+        if (etag != new_etag) {
+            settings.SetString("check_etag", new_etag);
+        }
+        if (settings.GetString("check_digest") != digest) {
+            settings.SetString("check_digest", digest);
+        }
+    } else if (!etag.empty()) {
+        settings.EraseKey("check_etag");
+        settings.EraseKey("check_digest");
+        settings.EraseKey("check_body");
+    }
+    return ESP_OK;
+}
+
+// A cached response is one the server confirmed with 304, date_ms is the time of that 304 and replaces its server time
+esp_err_t Ota::ParseCheckVersionResponse(const char* data, size_t length, int64_t date_ms) {
     // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
     // Parse the JSON response and check if the version is newer
     // If it is, set has_new_version_ to true and store the new version and URL
     
-    cJSON *root = cJSON_Parse(data.c_str());
+    cJSON *root = cJSON_ParseWithLength(data, length);
     if (root == NULL) {
         ESP_LOGE(TAG, "Failed to parse JSON response");
         return ESP_ERR_INVALID_RESPONSE;
@@ -146,19 +318,7 @@ esp_err_t Ota::CheckVersion() {
     has_mqtt_config_ = false;
     cJSON *mqtt = cJSON_GetObjectItem(root, "mqtt");
     if (cJSON_IsObject(mqtt)) {
-        Settings settings("mqtt", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, mqtt) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
+        SaveServerConfig("mqtt", mqtt, "endpoints");
         has_mqtt_config_ = true;
     } else {
         ESP_LOGI(TAG, "No mqtt section found !");
@@ -167,34 +327,29 @@ esp_err_t Ota::CheckVersion() {
     has_websocket_config_ = false;
     cJSON *websocket = cJSON_GetObjectItem(root, "websocket");
     if (cJSON_IsObject(websocket)) {
-        Settings settings("websocket", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, websocket) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
+        SaveServerConfig("websocket", websocket, "urls");
         has_websocket_config_ = true;
     } else {
         ESP_LOGI(TAG, "No websocket section found!");
     }
 
+    has_udp_config_ = false;
+    cJSON *udp = cJSON_GetObjectItem(root, "udp");
+    if (cJSON_IsObject(udp)) {
+        SaveServerConfig("udp", udp, "endpoints");
+        has_udp_config_ = true;
+    }
+
     has_server_time_ = false;
     cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
     if (cJSON_IsObject(server_time)) {
         cJSON *timestamp = cJSON_GetObjectItem(server_time, "timestamp");
         cJSON *timezone_offset = cJSON_GetObjectItem(server_time, "timezone_offset");
         
-        if (cJSON_IsNumber(timestamp)) {
+        if (date_ms != 0 || cJSON_IsNumber(timestamp)) {
             // 设置系统时间
             struct timeval tv;
-            double ts = timestamp->valuedouble;
+            double ts = date_ms != 0 ? (double)date_ms : timestamp->valuedouble;
             
             // 如果有时区偏移，计算本地时间
             if (cJSON_IsNumber(timezone_offset)) {
@@ -264,9 +419,17 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback) {
+bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback,
+    std::function<void()> throttle) {
+    // A background staging and a manual upgrade would write the same partition
+    static std::mutex upgrade_mutex;
+    std::unique_lock<std::mutex> lock(upgrade_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        ESP_LOGE(TAG, "Another firmware upgrade is in progress");
+        return false;
+    }
+
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
     auto update_partition = esp_ota_get_next_update_partition(NULL);
     if (update_partition == NULL) {
         ESP_LOGE(TAG, "Failed to get update partition");
@@ -274,98 +437,126 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
     }
 
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
+    // An interrupted download continues where it stopped, in this call or after a reboot
+    DownloadJournal journal("ota", update_partition);
+    for (int attempt = 1; !DownloadFirmware(firmware_url, update_partition, journal, callback, throttle); attempt++) {
+        if (!journal.worth_retrying() || attempt >= DOWNLOAD_MAX_ATTEMPTS) {
+            return false;
+        }
+        ESP_LOGW(TAG, "Firmware download interrupted, retrying (%d/%d)", attempt, DOWNLOAD_MAX_ATTEMPTS);
+        vTaskDelay(pdMS_TO_TICKS(DOWNLOAD_RETRY_DELAY_MS));
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
+    esp_err_t err = esp_ota_set_boot_partition(update_partition);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
         return false;
     }
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        return false;
-    }
+    ESP_LOGI(TAG, "Firmware upgrade successful");
+    return true;
+}
 
-    constexpr size_t PAGE_SIZE = 4096;
-    char* buffer = (char*)heap_caps_malloc(PAGE_SIZE, MALLOC_CAP_INTERNAL);
-    if (buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to allocate buffer");
+bool Ota::DownloadFirmware(const std::string& firmware_url, const esp_partition_t* update_partition, DownloadJournal& journal,
+    std::function<void(int progress, size_t speed)> callback, std::function<void()> throttle) {
+    auto network = Board::GetInstance().GetNetwork();
+    auto http = network->CreateHttp(0);
+    if (!journal.Open(http.get(), firmware_url)) {
         return false;
     }
 
-    size_t buffer_offset = 0;  // Current data size in buffer
-    size_t total_read = 0, recent_read = 0;
-    auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer + buffer_offset, PAGE_SIZE - buffer_offset);
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            heap_caps_free(buffer);
+    esp_ota_handle_t update_handle = 0;
+    bool ota_begun = false;
+    constexpr size_t IMAGE_HEADER_SIZE = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t);
+    auto begin_ota = [&]() {
+        esp_err_t err;
+        if (journal.offset() > 0) {
+            err = esp_ota_resume(update_partition, OTA_WITH_SEQUENTIAL_WRITES, journal.offset(), &update_handle);
+        } else {
+            err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+        }
+        if (err != ESP_OK) {
+            esp_ota_abort(update_handle);
+            ESP_LOGE(TAG, "Failed to begin OTA: %s", esp_err_to_name(err));
             return false;
         }
-
-        // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        buffer_offset += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
-            if (callback) {
-                callback(progress, recent_read);
-            }
-            last_calc_time = esp_timer_get_time();
-            recent_read = 0;
+        ota_begun = true;
+        return true;
+    };
+    auto write_ota = [&](const char* data, size_t length) {
+        auto err = esp_ota_write(update_handle, data, length);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+            return false;
         }
-
-        if (!image_header_checked) {
-            image_header.append(buffer, buffer_offset);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    heap_caps_free(buffer);
-                    return false;
-                }
-
-                image_header_checked = true;
-                std::string().swap(image_header);
+        return true;
+    };
+
+    // The server may send a delta patch (scripts/delta_patch.py) against the running firmware instead of the image
+    std::unique_ptr<DeltaPatcher> patcher;
+    auto create_patcher = [&]() {
+        auto running_partition = esp_ota_get_running_partition();
+        patcher = std::make_unique<DeltaPatcher>([&, running_partition](const DeltaPatchHeader& header) {
+            if (header.block_size != 0 || header.source_size > running_partition->size || header.target_size > update_partition->size) {
+                ESP_LOGE(TAG, "Invalid firmware patch");
+                return false;
+            }
+            uint8_t sha256[32];
+            if (!DeltaPatcher::HashPartition(running_partition, header.source_size, sha256) ||
+                memcmp(sha256, header.source_sha256, sizeof(sha256)) != 0) {
+                ESP_LOGE(TAG, "The firmware patch was made for another version");
+                return false;
             }
+            return begin_ota();
+        }, [running_partition](size_t offset, void* buffer, size_t length) {
+            return esp_partition_read(running_partition, offset, buffer, length) == ESP_OK;
+        }, write_ota);
+    };
+
+    // The first chunk holds the whole image header, begin the OTA when it arrives
+    DownloadPipeline pipeline;
+    pipeline.SetThrottle(throttle);
+    bool success = pipeline.Run(http.get(), journal.offset(), journal.total_length(), [&](const char* data, size_t offset, size_t length) {
+        if (offset == 0 && DeltaPatcher::IsPatch(data, length)) {
+            // Patches are small and their state lives in RAM, they are not resumed
+            ESP_LOGI(TAG, "Applying firmware patch");
+            journal.Clear();
+            create_patcher();
+        }
+        if (patcher) {
+            return patcher->Feed(data, length);
         }
 
-        // Write to flash when buffer is full (4KB) or it's the last chunk
-        bool is_last_chunk = (ret == 0);
-        if (buffer_offset == PAGE_SIZE || (is_last_chunk && buffer_offset > 0)) {
-            auto err = esp_ota_write(update_handle, buffer, buffer_offset);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-                esp_ota_abort(update_handle);
-                heap_caps_free(buffer);
+        if (!ota_begun) {
+            if (offset == 0 && length < IMAGE_HEADER_SIZE) {
+                ESP_LOGE(TAG, "The first chunk does not hold the image header");
                 return false;
             }
-
-            buffer_offset = 0;
+            if (!begin_ota()) {
+                return false;
+            }
+        }
+        if (!write_ota(data, length)) {
+            return false;
         }
+        journal.Commit(offset, data, length);
+        return true;
+    }, callback);
+    http->Close();
 
-        if (is_last_chunk) {
-            break;
+    if (success && patcher) {
+        success = patcher->Finish();
+    }
+    if (!success) {
+        if (ota_begun) {
+            esp_ota_abort(update_handle);
         }
+        return false;
     }
-    http->Close();
-    heap_caps_free(buffer);
 
+    // The image is complete, whether it validates or not there is nothing left to resume
+    journal.Clear();
     esp_err_t err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
@@ -375,14 +566,6 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
         }
         return false;
     }
-
-    err = esp_ota_set_boot_partition(update_partition);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
-        return false;
-    }
-
-    ESP_LOGI(TAG, "Firmware upgrade successful");
     return true;
 }
 
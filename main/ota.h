@@ -5,23 +5,31 @@
 #include <string>
 
 #include <esp_err.h>
+#include <esp_partition.h>
+#include <cJSON.h>
 #include "board.h"
 
+class DownloadJournal;
+
 class Ota {
 public:
     Ota();
     ~Ota();
 
-    esp_err_t CheckVersion();
+    // allow_conditional false always sends the full system info
+    esp_err_t CheckVersion(bool allow_conditional = true);
     esp_err_t Activate();
     bool HasActivationChallenge() { return has_activation_challenge_; }
     bool HasNewVersion() { return has_new_version_; }
     bool HasMqttConfig() { return has_mqtt_config_; }
     bool HasWebsocketConfig() { return has_websocket_config_; }
+    bool HasUdpConfig() { return has_udp_config_; }
     bool HasActivationCode() { return has_activation_code_; }
     bool HasServerTime() { return has_server_time_; }
     bool StartUpgrade(std::function<void(int progress, size_t speed)> callback);
-    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback);
+    // The throttle runs before every network read of the download, see DownloadPipeline::Throttle
+    static bool Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback,
+        std::function<void()> throttle = nullptr);
     void MarkCurrentVersionValid();
 
     const std::string& GetFirmwareVersion() const { return firmware_version_; }
@@ -37,6 +45,7 @@ private:
     bool has_new_version_ = false;
     bool has_mqtt_config_ = false;
     bool has_websocket_config_ = false;
+    bool has_udp_config_ = false;
     bool has_server_time_ = false;
     bool has_activation_code_ = false;
     bool has_serial_number_ = false;
@@ -53,6 +62,11 @@ private:
     bool IsNewVersionAvailable(const std::string& currentVersion, const std::string& newVersion);
     std::string GetActivationPayload();
     std::unique_ptr<Http> SetupHttp();
+    std::string GetSystemInfoDigest();
+    esp_err_t ParseCheckVersionResponse(const char* data, size_t length, int64_t date_ms = 0);
+    static bool DownloadFirmware(const std::string& firmware_url, const esp_partition_t* update_partition, DownloadJournal& journal,
+        std::function<void(int progress, size_t speed)> callback, std::function<void()> throttle);
+    void SaveServerConfig(const char* ns, const cJSON* section, const char* list_key);
 };
 
 #endif // _OTA_H
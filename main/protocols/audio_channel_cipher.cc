@@ -0,0 +1,101 @@
+#include "audio_channel_cipher.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <arpa/inet.h>
+
+#define TAG "AudioCipher"
+
+AudioChannelCipher::AudioChannelCipher(CounterMode mode) : mode_(mode) {
+    mbedtls_aes_init(&aes_ctx_);
+}
+
+AudioChannelCipher::~AudioChannelCipher() {
+    mbedtls_aes_free(&aes_ctx_);
+}
+
+bool AudioChannelCipher::SetKey(const std::string& key, const std::string& nonce) {
+    Clear();
+    if (key.size() != AUDIO_CHANNEL_KEY_SIZE || nonce.size() != AUDIO_CHANNEL_NONCE_SIZE) {
+        ESP_LOGE(TAG, "Invalid key/nonce size: %u/%u", key.size(), nonce.size());
+        return false;
+    }
+    int ret = mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)key.data(), AUDIO_CHANNEL_KEY_SIZE * 8);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to set AES key, ret: %d", ret);
+        return false;
+    }
+    memcpy(nonce_, nonce.data(), AUDIO_CHANNEL_NONCE_SIZE);
+    ready_ = true;
+    return true;
+}
+
+void AudioChannelCipher::Clear() {
+    // Release the old key schedule before the context is reused for another session
+    mbedtls_aes_free(&aes_ctx_);
+    mbedtls_aes_init(&aes_ctx_);
+    memset(nonce_, 0, sizeof(nonce_));
+    ready_ = false;
+}
+
+bool AudioChannelCipher::Encrypt(const uint8_t* payload, size_t size, uint32_t timestamp, uint32_t sequence,
+    std::string& out) {
+    return EncryptPacket(nonce_[0], nonce_[1], payload, size, timestamp, sequence, out);
+}
+
+bool AudioChannelCipher::EncryptPacket(uint8_t type, uint8_t flags, const uint8_t* payload, size_t size,
+    uint32_t timestamp, uint32_t sequence, std::string& out) {
+    if (!ready_ || size > UINT16_MAX) {
+        return false;
+    }
+
+    out.resize(AUDIO_CHANNEL_NONCE_SIZE + size);
+    auto header = (uint8_t*)out.data();
+    memcpy(header, nonce_, AUDIO_CHANNEL_NONCE_SIZE);
+    header[0] = type;
+    header[1] = flags;
+    uint16_t payload_len = htons(size);
+    timestamp = htonl(timestamp);
+    sequence = htonl(sequence);
+    memcpy(header + 2, &payload_len, sizeof(payload_len));
+    memcpy(header + 8, &timestamp, sizeof(timestamp));
+    memcpy(header + 12, &sequence, sizeof(sequence));
+
+    // The counter block is advanced by mbedtls, so work on a stack copy
+    uint8_t counter[AUDIO_CHANNEL_NONCE_SIZE];
+    MakeCounter(header, counter);
+    size_t nc_off = 0;
+    uint8_t stream_block[16];
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, counter, stream_block,
+        payload, header + AUDIO_CHANNEL_NONCE_SIZE) != 0) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    return true;
+}
+
+bool AudioChannelCipher::Decrypt(const uint8_t* data, size_t size, uint8_t* out) {
+    if (!ready_ || size < AUDIO_CHANNEL_NONCE_SIZE) {
+        return false;
+    }
+
+    uint8_t counter[AUDIO_CHANNEL_NONCE_SIZE];
+    MakeCounter(data, counter);
+    size_t nc_off = 0;
+    uint8_t stream_block[16];
+    int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, size - AUDIO_CHANNEL_NONCE_SIZE, &nc_off, counter, stream_block,
+        data + AUDIO_CHANNEL_NONCE_SIZE, out);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        return false;
+    }
+    return true;
+}
+
+void AudioChannelCipher::MakeCounter(const uint8_t* header, uint8_t* counter) const {
+    memcpy(counter, header, AUDIO_CHANNEL_NONCE_SIZE);
+    if (mode_ == kCounterSequence) {
+        memcpy(counter + 8, header + 12, 4);
+        memset(counter + 12, 0, 4);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef AUDIO_CHANNEL_CIPHER_H
+#define AUDIO_CHANNEL_CIPHER_H
+
+#include <mbedtls/aes.h>
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define AUDIO_CHANNEL_NONCE_SIZE 16
+#define AUDIO_CHANNEL_KEY_SIZE 16
+
+/*
+ * AES-128-CTR cipher for the encrypted UDP audio channel.
+ *
+ * Packet format (see docs/mqtt-udp.md):
+ * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+ * |payload payload_len|
+ *
+ * The counter block is derived from the 16 byte header, see CounterMode. One instance lives for the whole
+ * protocol object; SetKey() re-keys it for every new session without leaking the
+ * previous context. On ESP32 targets mbedtls routes the block cipher to the AES
+ * peripheral (CONFIG_MBEDTLS_HARDWARE_AES).
+ */
+class AudioChannelCipher {
+public:
+    enum CounterMode {
+        // The header itself, as the MQTT+UDP server expects. mbedtls increments the sequence field for the
+        // following blocks, so packets are only kept apart by their timestamps.
+        kCounterHeader,
+        // |type|flags|payload_len|ssrc|sequence|0 0 0 0|: the blocks of a packet are counted in the low word
+        // and never reach the counter of another sequence
+        kCounterSequence,
+    };
+
+    explicit AudioChannelCipher(CounterMode mode = kCounterHeader);
+    ~AudioChannelCipher();
+    AudioChannelCipher(const AudioChannelCipher&) = delete;
+    AudioChannelCipher& operator=(const AudioChannelCipher&) = delete;
+
+    // key and nonce are raw bytes (already hex decoded)
+    bool SetKey(const std::string& key, const std::string& nonce);
+    void Clear();
+    bool IsReady() const { return ready_; }
+
+    // Write header + encrypted payload into `out`. The buffer is resized in place, so passing the
+    // same buffer for every packet avoids per-packet allocations once it has grown to frame size.
+    bool Encrypt(const uint8_t* payload, size_t size, uint32_t timestamp, uint32_t sequence,
+        std::string& out);
+    // Same as Encrypt() but overrides the type and flags bytes of the header
+    bool EncryptPacket(uint8_t type, uint8_t flags, const uint8_t* payload, size_t size, uint32_t timestamp,
+        uint32_t sequence, std::string& out);
+
+    // Decrypt the payload of `data` (header included) into `out`, which must hold
+    // size - AUDIO_CHANNEL_NONCE_SIZE bytes. `out` may alias the payload part of `data`.
+    bool Decrypt(const uint8_t* data, size_t size, uint8_t* out);
+
+private:
+    CounterMode mode_;
+    mbedtls_aes_context aes_ctx_;
+    uint8_t nonce_[AUDIO_CHANNEL_NONCE_SIZE] = {0};
+    bool ready_ = false;
+
+    void MakeCounter(const uint8_t* header, uint8_t* counter) const;
+};
+
+#endif // AUDIO_CHANNEL_CIPHER_H
@@ -0,0 +1,206 @@
+#include "endpoint_selector.h"
+#include "board.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <sstream>
+#include <climits>
+#include <cstdlib>
+
+#define TAG "EndpointSelector"
+
+// The probe tasks of all selectors share ENDPOINT_PROBE_CONNECT_ID, only one of them may use it at a time
+static std::mutex probe_connect_mutex;
+
+EndpointSelector::EndpointSelector(const std::string& ns, const std::string& list_key, const std::string& single_key,
+    int default_port, bool probe)
+    : ns_(ns), list_key_(list_key), single_key_(single_key), default_port_(default_port),
+      probe_(probe), probe_state_(std::make_shared<ProbeState>()) {
+}
+
+bool EndpointSelector::ParseHostPort(const std::string& endpoint, int default_port, std::string& host, int& port) {
+    // Accepts "host", "host:port" and URLs like "wss://host:port/path"
+    std::string rest = endpoint;
+    port = default_port;
+    size_t scheme_end = rest.find("://");
+    if (scheme_end != std::string::npos) {
+        auto scheme = rest.substr(0, scheme_end);
+        if (scheme == "wss" || scheme == "https") {
+            port = 443;
+        } else if (scheme == "ws" || scheme == "http") {
+            port = 80;
+        }
+        rest = rest.substr(scheme_end + 3);
+    }
+    size_t path_start = rest.find('/');
+    if (path_start != std::string::npos) {
+        rest = rest.substr(0, path_start);
+    }
+    size_t colon = rest.find(':');
+    if (colon != std::string::npos) {
+        port = atoi(rest.c_str() + colon + 1);
+        rest = rest.substr(0, colon);
+    }
+    host = rest;
+    return !host.empty() && port > 0;
+}
+
+std::vector<std::string> EndpointSelector::LoadEndpoints() {
+    Settings settings(ns_, false);
+    std::vector<std::string> endpoints;
+    std::stringstream ss(settings.GetString(list_key_));
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty() && std::find(endpoints.begin(), endpoints.end(), item) == endpoints.end()) {
+            endpoints.push_back(item);
+        }
+    }
+    if (endpoints.empty()) {
+        auto single = settings.GetString(single_key_);
+        if (!single.empty()) {
+            endpoints.push_back(single);
+        }
+    }
+    return endpoints;
+}
+
+std::vector<std::string> EndpointSelector::GetCandidates() {
+    auto endpoints = LoadEndpoints();
+    if (endpoints.size() <= 1) {
+        return endpoints;
+    }
+
+    // Stick with the endpoint that worked last time until it fails
+    Settings settings(ns_, false);
+    auto preferred = settings.GetString("preferred");
+    auto it = std::find(endpoints.begin(), endpoints.end(), preferred);
+    if (failures_ == 0 && it != endpoints.end()) {
+        std::rotate(endpoints.begin(), it, it + 1);
+        return endpoints;
+    }
+
+    // Rank by the latest probe results without waiting for running probes. Endpoints not probed yet
+    // come after the reachable ones, unreachable ones last, both in their server-given order.
+    std::vector<std::pair<int, std::string>> ranked;
+    {
+        std::lock_guard<std::mutex> lock(probe_state_->mutex);
+        for (auto& endpoint : endpoints) {
+            auto it = probe_state_->latencies.find(endpoint);
+            ranked.emplace_back(it != probe_state_->latencies.end() ? it->second : INT_MAX - 1, endpoint);
+        }
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+    endpoints.clear();
+    for (auto& [latency, endpoint] : ranked) {
+        endpoints.push_back(endpoint);
+    }
+    return endpoints;
+}
+
+void EndpointSelector::StartProbes() {
+    if (!probe_) {
+        return;
+    }
+    auto endpoints = LoadEndpoints();
+    if (endpoints.size() <= 1) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(probe_state_->mutex);
+        if (probe_state_->probing) {
+            return;
+        }
+        probe_state_->probing = true;
+    }
+
+    struct ProbeTaskArgs {
+        std::shared_ptr<ProbeState> state;
+        std::vector<std::string> endpoints;
+        int default_port;
+    };
+    auto args = new ProbeTaskArgs{probe_state_, std::move(endpoints), default_port_};
+    BaseType_t ret = xTaskCreate([](void* arg) {
+        auto args = static_cast<ProbeTaskArgs*>(arg);
+        for (auto& endpoint : args->endpoints) {
+            int latency = ProbeConnectTimeMs(endpoint, args->default_port);
+            std::lock_guard<std::mutex> lock(args->state->mutex);
+            args->state->latencies[endpoint] = latency;
+        }
+        {
+            std::lock_guard<std::mutex> lock(args->state->mutex);
+            args->state->probing = false;
+        }
+        delete args;
+        vTaskDelete(NULL);
+    }, "endpoint_probe", ENDPOINT_PROBE_STACK_SIZE, args, ENDPOINT_PROBE_PRIORITY, nullptr);
+    if (ret != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create probe task");
+        delete args;
+        std::lock_guard<std::mutex> lock(probe_state_->mutex);
+        probe_state_->probing = false;
+    }
+}
+
+int EndpointSelector::ProbeConnectTimeMs(const std::string& endpoint, int default_port) {
+    std::string host;
+    int port;
+    if (!ParseHostPort(endpoint, default_port, host, port)) {
+        return INT_MAX;
+    }
+
+    std::lock_guard<std::mutex> lock(probe_connect_mutex);
+    auto network = Board::GetInstance().GetNetwork();
+    auto tcp = network->CreateTcp(ENDPOINT_PROBE_CONNECT_ID);
+    if (tcp == nullptr) {
+        return INT_MAX;
+    }
+    auto start_time = esp_timer_get_time();
+    if (!tcp->Connect(host, port)) {
+        ESP_LOGW(TAG, "Probe %s:%d failed", host.c_str(), port);
+        return INT_MAX;
+    }
+    int elapsed_ms = (esp_timer_get_time() - start_time) / 1000;
+    tcp->Disconnect();
+    ESP_LOGI(TAG, "Probe %s:%d connect time %d ms", host.c_str(), port, elapsed_ms);
+    return elapsed_ms;
+}
+
+void EndpointSelector::ReportSuccess(const std::string& endpoint) {
+    failures_ = 0;
+    Settings settings(ns_, true);
+    if (settings.GetString("preferred") != endpoint) {
+        settings.SetString("preferred", endpoint);
+    }
+}
+
+void EndpointSelector::ReportFailure() {
+    int failures = failures_;
+    while (failures < 16 && !failures_.compare_exchange_weak(failures, failures + 1)) {
+    }
+    // Ready for the next attempt, which comes after the backoff delay
+    StartProbes();
+}
+
+void EndpointSelector::ReportLatency(const std::string& endpoint, int latency_ms) {
+    std::lock_guard<std::mutex> lock(probe_state_->mutex);
+    probe_state_->latencies[endpoint] = latency_ms;
+}
+
+int EndpointSelector::GetRetryDelayMs(int min_delay_ms, int max_delay_ms) const {
+    // Exponential backoff with "equal jitter": half of the delay is fixed, the other half is random,
+    // so devices that lost the same server do not come back in lockstep
+    int failures = failures_;
+    int64_t delay = min_delay_ms;
+    for (int i = 1; i < failures && delay < max_delay_ms; i++) {
+        delay *= 2;
+    }
+    delay = std::min<int64_t>(delay, max_delay_ms);
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
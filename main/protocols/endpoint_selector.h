@@ -0,0 +1,65 @@
+#ifndef ENDPOINT_SELECTOR_H
+#define ENDPOINT_SELECTOR_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define ENDPOINT_PROBE_STACK_SIZE   4096
+#define ENDPOINT_PROBE_PRIORITY     1
+// Connect id of the probes. 0 is OTA and MQTT, 1 the websocket, 2 the UDP channel, 3 the HTTP tools.
+#define ENDPOINT_PROBE_CONNECT_ID   4
+
+/*
+ * Chooses which server endpoint a protocol connects to.
+ *
+ * The OTA config may carry a ranked list of endpoints (stored comma separated under `list_key`)
+ * next to the legacy single endpoint (`single_key`). The last endpoint that worked is kept in NVS
+ * under "preferred" and tried first. A failure starts TCP connect probes on a background task, and
+ * the next attempts rank the candidates by the latest results so they go to the fastest reachable
+ * host without waiting for the probes. Reconnects are spread out with exponential backoff plus jitter.
+ */
+class EndpointSelector {
+public:
+    // probe = false disables the TCP probes, for servers that do not accept TCP. The protocol then
+    // ranks the endpoints itself with ReportLatency.
+    EndpointSelector(const std::string& ns, const std::string& list_key, const std::string& single_key,
+        int default_port, bool probe);
+
+    // Endpoints in the order they should be tried, reloaded from settings on every call
+    std::vector<std::string> GetCandidates();
+    void ReportSuccess(const std::string& endpoint);
+    void ReportFailure();
+    // Records how long endpoint took to answer, INT_MAX when it did not
+    void ReportLatency(const std::string& endpoint, int latency_ms);
+    int GetRetryDelayMs(int min_delay_ms, int max_delay_ms) const;
+    int failures() const { return failures_; }
+
+    static bool ParseHostPort(const std::string& endpoint, int default_port, std::string& host, int& port);
+
+private:
+    std::string ns_;
+    std::string list_key_;
+    std::string single_key_;
+    int default_port_;
+    bool probe_;
+    // Written by the protocol's network callbacks, read by its reconnect timer
+    std::atomic<int> failures_ = 0;
+
+    // Shared with the probe task, which may outlive the selector
+    struct ProbeState {
+        std::mutex mutex;
+        std::map<std::string, int> latencies;   // Connect time in ms, INT_MAX when unreachable
+        bool probing = false;
+    };
+    std::shared_ptr<ProbeState> probe_state_;
+
+    std::vector<std::string> LoadEndpoints();
+    void StartProbes();
+    static int ProbeConnectTimeMs(const std::string& endpoint, int default_port);
+};
+
+#endif // ENDPOINT_SELECTOR_H
@@ -2,6 +2,7 @@
 #include "board.h"
 #include "application.h"
 #include "settings.h"
+#include "heap_profiler.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -10,7 +11,7 @@
 
 #define TAG "MQTT"
 
-MqttProtocol::MqttProtocol() {
+MqttProtocol::MqttProtocol() : endpoint_selector_("mqtt", "endpoints", "endpoint", 8883, true) {
     event_group_handle_ = xEventGroupCreate();
 
     // Initialize reconnect timer
@@ -22,10 +23,12 @@ MqttProtocol::MqttProtocol() {
                 ESP_LOGI(TAG, "Reconnecting to MQTT server");
                 auto alive = protocol->alive_;  // Capture alive flag
                 app.Schedule([protocol, alive]() {
-                    if (*alive) {
-                        protocol->StartMqttClient(false);
+                    if (*alive && !protocol->StartMqttClient(false)) {
+                        protocol->ScheduleReconnect();
                     }
                 });
+            } else {
+                protocol->ScheduleReconnect();
             }
         },
         .arg = this,
@@ -44,7 +47,7 @@ MqttProtocol::~MqttProtocol() {
         esp_timer_delete(reconnect_timer_);
     }
 
-    udp_.reset();
+    ResetUdp();
     mqtt_.reset();
     
     if (event_group_handle_ != nullptr) {
@@ -62,15 +65,8 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         mqtt_.reset();
     }
 
-    Settings settings("mqtt", false);
-    auto endpoint = settings.GetString("endpoint");
-    auto client_id = settings.GetString("client_id");
-    auto username = settings.GetString("username");
-    auto password = settings.GetString("password");
-    int keepalive_interval = settings.GetInt("keepalive", 240);
-    publish_topic_ = settings.GetString("publish_topic");
-
-    if (endpoint.empty()) {
+    auto candidates = endpoint_selector_.GetCandidates();
+    if (candidates.empty()) {
         ESP_LOGW(TAG, "MQTT endpoint is not specified");
         if (report_error) {
             SetError(Lang::Strings::SERVER_NOT_FOUND);
@@ -78,6 +74,28 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         return false;
     }
 
+    Settings settings("mqtt", false);
+    int keepalive_interval = settings.GetInt("keepalive", 240);
+    publish_topic_ = settings.GetString("publish_topic");
+
+    for (auto& endpoint : candidates) {
+        if (ConnectToEndpoint(endpoint, keepalive_interval)) {
+            endpoint_selector_.ReportSuccess(endpoint);
+            return true;
+        }
+    }
+
+    endpoint_selector_.ReportFailure();
+    SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+    return false;
+}
+
+bool MqttProtocol::ConnectToEndpoint(const std::string& endpoint, int keepalive_interval) {
+    Settings settings("mqtt", false);
+    auto client_id = settings.GetString("client_id");
+    auto username = settings.GetString("username");
+    auto password = settings.GetString("password");
+
     auto network = Board::GetInstance().GetNetwork();
     mqtt_ = network->CreateMqtt(0);
     mqtt_->SetKeepAlive(keepalive_interval);
@@ -86,8 +104,9 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         if (on_disconnected_ != nullptr) {
             on_disconnected_();
         }
-        ESP_LOGI(TAG, "MQTT disconnected, schedule reconnect in %d seconds", MQTT_RECONNECT_INTERVAL_MS / 1000);
-        esp_timer_start_once(reconnect_timer_, MQTT_RECONNECT_INTERVAL_MS * 1000);
+        // Count the drop so the next attempts back off and re-rank the endpoints
+        endpoint_selector_.ReportFailure();
+        ScheduleReconnect();
     });
 
     mqtt_->OnConnected([this]() {
@@ -98,6 +117,7 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+        HeapTagScope heap_tag(kHeapTagProtocol);
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -133,17 +153,15 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
 
     ESP_LOGI(TAG, "Connecting to endpoint %s", endpoint.c_str());
     std::string broker_address;
-    int broker_port = 8883;
-    size_t pos = endpoint.find(':');
-    if (pos != std::string::npos) {
-        broker_address = endpoint.substr(0, pos);
-        broker_port = std::stoi(endpoint.substr(pos + 1));
-    } else {
-        broker_address = endpoint;
+    int broker_port;
+    if (!EndpointSelector::ParseHostPort(endpoint, 8883, broker_address, broker_port)) {
+        ESP_LOGE(TAG, "Invalid endpoint: %s", endpoint.c_str());
+        mqtt_.reset();
+        return false;
     }
     if (!mqtt_->Connect(broker_address, broker_port, client_id, username, password)) {
-        ESP_LOGE(TAG, "Failed to connect to endpoint, code=%d", mqtt_->GetLastError());
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        ESP_LOGE(TAG, "Failed to connect to endpoint %s, code=%d", endpoint.c_str(), mqtt_->GetLastError());
+        mqtt_.reset();
         return false;
     }
 
@@ -151,6 +169,13 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
+void MqttProtocol::ScheduleReconnect() {
+    int delay_ms = endpoint_selector_.GetRetryDelayMs(MQTT_RECONNECT_MIN_INTERVAL_MS, MQTT_RECONNECT_INTERVAL_MS);
+    ESP_LOGI(TAG, "Schedule MQTT reconnect in %d ms", delay_ms);
+    esp_timer_stop(reconnect_timer_);
+    esp_timer_start_once(reconnect_timer_, delay_ms * 1000LL);
+}
+
 bool MqttProtocol::SendText(const std::string& text) {
     if (publish_topic_.empty()) {
         return false;
@@ -169,31 +194,18 @@ bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    // send_buffer_ keeps its capacity between packets, so steady state sending does not allocate
+    if (!cipher_.Encrypt((const uint8_t*)packet->payload.data(), packet->payload.size(), packet->timestamp,
+        ++local_sequence_, send_buffer_)) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    return udp_->Send(send_buffer_) > 0;
 }
 
 void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
-    {
-        std::lock_guard<std::mutex> lock(channel_mutex_);
-        udp_.reset();
-    }
+    ResetUdp();
 
     ESP_LOGI(TAG, "Closing audio channel, send_goodbye: %d", send_goodbye);
 
@@ -237,16 +249,18 @@ bool MqttProtocol::OpenAudioChannel() {
         return false;
     }
 
+    ResetUdp();
     std::lock_guard<std::mutex> lock(channel_mutex_);
     auto network = Board::GetInstance().GetNetwork();
     udp_ = network->CreateUdp(2);
     udp_->OnMessage([this](const std::string& data) {
+        HeapTagScope heap_tag(kHeapTagProtocol);
         /*
          * UDP Encrypted OPUS Packet Format:
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < AUDIO_CHANNEL_NONCE_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -264,20 +278,17 @@ bool MqttProtocol::OpenAudioChannel() {
             ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
         auto packet = std::make_unique<AudioStreamPacket>();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
-            return;
+        packet->payload.resize(data.size() - AUDIO_CHANNEL_NONCE_SIZE);
+        {
+            // ParseServerHello re-keys the cipher under the same lock
+            std::lock_guard<std::mutex> lock(channel_mutex_);
+            if (udp_ == nullptr || !cipher_.Decrypt((const uint8_t*)data.data(), data.size(), packet->payload.data())) {
+                return;
+            }
         }
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
@@ -357,11 +368,15 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
 
     // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
     // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        if (!cipher_.SetKey(DecodeHexString(key), DecodeHexString(nonce))) {
+            ESP_LOGE(TAG, "Invalid UDP encryption parameters");
+            return;
+        }
+        local_sequence_ = 0;
+        remote_sequence_ = 0;
+    }
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
@@ -384,6 +399,15 @@ std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
     return decoded;
 }
 
+// The Udp is destroyed outside the lock, its receive task may be waiting for it in the decrypt
+void MqttProtocol::ResetUdp() {
+    std::unique_ptr<Udp> udp;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        udp = std::move(udp_);
+    }
+}
+
 bool MqttProtocol::IsAudioChannelOpened() const {
     return udp_ != nullptr && !error_occurred_ && !IsTimeout();
 }
@@ -3,10 +3,11 @@
 
 
 #include "protocol.h"
+#include "audio_channel_cipher.h"
+#include "endpoint_selector.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
-#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
@@ -19,6 +20,7 @@
 #include <atomic>
 
 #define MQTT_PING_INTERVAL_SECONDS 90
+#define MQTT_RECONNECT_MIN_INTERVAL_MS 10000
 #define MQTT_RECONNECT_INTERVAL_MS 60000
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
@@ -45,15 +47,19 @@ private:
     std::mutex channel_mutex_;
     std::unique_ptr<Mqtt> mqtt_;
     std::unique_ptr<Udp> udp_;
-    mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
+    AudioChannelCipher cipher_;
+    std::string send_buffer_;
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
     esp_timer_handle_t reconnect_timer_;
+    EndpointSelector endpoint_selector_;
 
     bool StartMqttClient(bool report_error=false);
+    void ResetUdp();
+    bool ConnectToEndpoint(const std::string& endpoint, int keepalive_interval);
+    void ScheduleReconnect();
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
 
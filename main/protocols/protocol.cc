@@ -78,6 +78,21 @@ void Protocol::SendMcpMessage(const std::string& payload) {
     SendText(message);
 }
 
+void Protocol::SendMcpMessage(MessageStream& payload) {
+    std::string message;
+    size_t offset = 0;
+    while (true) {
+        message.resize(offset + MESSAGE_STREAM_CHUNK_SIZE);
+        size_t size = payload.Read(message.data() + offset, MESSAGE_STREAM_CHUNK_SIZE);
+        offset += size;
+        if (size == 0) {
+            break;
+        }
+    }
+    message.resize(offset);
+    SendMcpMessage(message);
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
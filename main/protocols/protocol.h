@@ -6,12 +6,15 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <algorithm>
+#include <cstring>
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
     std::vector<uint8_t> payload;
+    int64_t capture_time = 0;   // esp_timer_get_time() when the PCM was captured, 0 if unknown
 };
 
 struct BinaryProtocol2 {
@@ -30,6 +33,32 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// A message produced in pieces, so large payloads never need to exist as one string
+class MessageStream {
+public:
+    virtual ~MessageStream() = default;
+    // Copy up to size bytes of the rest of the message into buffer, returns 0 at the end
+    virtual size_t Read(char* buffer, size_t size) = 0;
+};
+
+class StringMessageStream : public MessageStream {
+public:
+    explicit StringMessageStream(std::string&& message) : message_(std::move(message)) {}
+
+    size_t Read(char* buffer, size_t size) override {
+        size_t count = std::min(size, message_.size() - offset_);
+        memcpy(buffer, message_.data() + offset_, count);
+        offset_ += count;
+        return count;
+    }
+
+private:
+    std::string message_;
+    size_t offset_ = 0;
+};
+
+#define MESSAGE_STREAM_CHUNK_SIZE 2048
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -73,6 +102,8 @@ public:
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
     virtual void SendMcpMessage(const std::string& message);
+    // Protocols that can send a message in fragments override this, the default collects the stream
+    virtual void SendMcpMessage(MessageStream& payload);
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
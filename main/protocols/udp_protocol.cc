@@ -0,0 +1,506 @@
+#include "udp_protocol.h"
+#include "board.h"
+#include "system_info.h"
+#include "application.h"
+#include "settings.h"
+#include "heap_profiler.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <arpa/inet.h>
+#include "assets/lang_config.h"
+
+#define TAG "UDP"
+
+static inline uint8_t CharToHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0;
+}
+
+static std::string DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i + 1 < hex_string.size(); i += 2) {
+        decoded.push_back((CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]));
+    }
+    return decoded;
+}
+
+// Sequence numbers start at random values and may wrap around
+static inline bool SequenceAfter(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+// The UDP server does not accept TCP, the endpoints are ranked by the round trip of the hello instead
+UdpProtocol::UdpProtocol() : endpoint_selector_("udp", "endpoints", "endpoint", 8884, false),
+    cipher_(AudioChannelCipher::kCounterSequence) {
+    event_group_handle_ = xEventGroupCreate();
+
+    esp_timer_create_args_t control_timer_args = {
+        .callback = [](void* arg) {
+            static_cast<UdpProtocol*>(arg)->RetransmitControls();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "udp_control",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&control_timer_args, &control_timer_);
+}
+
+UdpProtocol::~UdpProtocol() {
+    ESP_LOGI(TAG, "UdpProtocol deinit");
+    *alive_ = false;
+
+    if (control_timer_ != nullptr) {
+        esp_timer_stop(control_timer_);
+        esp_timer_delete(control_timer_);
+    }
+    ResetUdp();
+    vEventGroupDelete(event_group_handle_);
+}
+
+bool UdpProtocol::Start() {
+    // Only connect to server when audio channel is needed
+    return true;
+}
+
+bool UdpProtocol::OpenAudioChannel() {
+    Settings settings("udp", false);
+    auto key = DecodeHexString(settings.GetString("key"));
+    uint32_t ssrc = settings.GetInt("ssrc");
+
+    error_occurred_ = false;
+    session_id_ = "";
+
+    auto candidates = endpoint_selector_.GetCandidates();
+    if (candidates.empty()) {
+        ESP_LOGE(TAG, "UDP endpoint is not specified");
+        SetError(Lang::Strings::SERVER_NOT_FOUND);
+        return false;
+    }
+
+    // Counter block template: |type|flags|payload_len|ssrc|timestamp|sequence|
+    std::string nonce(AUDIO_CHANNEL_NONCE_SIZE, '\0');
+    nonce[0] = UDP_PACKET_TYPE_AUDIO;
+    uint32_t ssrc_be = htonl(ssrc);
+    memcpy(&nonce[4], &ssrc_be, sizeof(ssrc_be));
+
+    auto network = Board::GetInstance().GetNetwork();
+    for (auto& endpoint : candidates) {
+        std::string host;
+        int port;
+        if (!EndpointSelector::ParseHostPort(endpoint, 8884, host, port)) {
+            continue;
+        }
+
+        std::unique_ptr<Udp> failed_udp;
+        ResetUdp();
+        {
+            std::lock_guard<std::mutex> lock(channel_mutex_);
+            if (!cipher_.SetKey(key, nonce)) {
+                SetError(Lang::Strings::SERVER_ERROR);
+                return false;
+            }
+            std::lock_guard<std::mutex> control_lock(control_mutex_);
+            audio_sequence_ = esp_random();
+            remote_audio_sequence_ = 0;
+            control_sequence_ = esp_random();
+            control_synced_ = false;
+            control_failed_ = false;
+            pending_controls_.clear();
+            out_of_order_controls_.clear();
+            partial_control_.clear();
+
+            udp_ = network->CreateUdp(2);
+            if (udp_ == nullptr) {
+                ESP_LOGE(TAG, "Failed to create udp");
+                return false;
+            }
+            udp_->OnMessage([this](const std::string& data) {
+                HeapTagScope heap_tag(kHeapTagProtocol);
+                OnPacket(data);
+            });
+            ESP_LOGI(TAG, "Connecting to udp server: %s:%d", host.c_str(), port);
+            if (!udp_->Connect(host, port)) {
+                ESP_LOGE(TAG, "Failed to connect to udp server");
+                // Destroyed after the lock is released
+                failed_udp = std::move(udp_);
+                endpoint_selector_.ReportLatency(endpoint, INT_MAX);
+                continue;
+            }
+        }
+
+        xEventGroupClearBits(event_group_handle_, UDP_PROTOCOL_SERVER_HELLO_EVENT);
+        esp_timer_stop(control_timer_);
+        esp_timer_start_periodic(control_timer_, UDP_CONTROL_TICK_MS * 1000);
+
+        // The hello is delivered reliably, so a silent server is detected by the hello timeout
+        int64_t hello_time = esp_timer_get_time();
+        if (!SendControl(GetHelloMessage(), true)) {
+            return false;
+        }
+        EventBits_t bits = xEventGroupWaitBits(event_group_handle_, UDP_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE,
+            pdMS_TO_TICKS(5000));
+        if (bits & UDP_PROTOCOL_SERVER_HELLO_EVENT) {
+            endpoint_selector_.ReportLatency(endpoint, (esp_timer_get_time() - hello_time) / 1000);
+            endpoint_selector_.ReportSuccess(endpoint);
+            if (on_audio_channel_opened_ != nullptr) {
+                on_audio_channel_opened_();
+            }
+            return true;
+        }
+
+        ESP_LOGW(TAG, "No server hello from %s", endpoint.c_str());
+        endpoint_selector_.ReportLatency(endpoint, INT_MAX);
+        esp_timer_stop(control_timer_);
+        ResetUdp();
+    }
+
+    endpoint_selector_.ReportFailure();
+    SetError(Lang::Strings::SERVER_TIMEOUT);
+    return false;
+}
+
+void UdpProtocol::CloseAudioChannel(bool send_goodbye) {
+    ESP_LOGI(TAG, "Closing audio channel, send_goodbye: %d", send_goodbye);
+
+    // Best effort, the channel is torn down before the ack can arrive
+    if (send_goodbye && !session_id_.empty()) {
+        std::string message = "{";
+        message += "\"session_id\":\"" + session_id_ + "\",";
+        message += "\"type\":\"goodbye\"";
+        message += "}";
+        SendText(message);
+    }
+
+    esp_timer_stop(control_timer_);
+    ResetUdp();
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        pending_controls_.clear();
+        out_of_order_controls_.clear();
+        partial_control_.clear();
+    }
+
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
+
+// The socket is destroyed outside channel_mutex_, its receive task may be waiting for the lock in OnPacket
+void UdpProtocol::ResetUdp() {
+    std::unique_ptr<Udp> udp;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        udp = std::move(udp_);
+    }
+}
+
+bool UdpProtocol::IsAudioChannelOpened() const {
+    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+}
+
+bool UdpProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ == nullptr) {
+        return false;
+    }
+
+    if (!cipher_.EncryptPacket(UDP_PACKET_TYPE_AUDIO, 0, packet->payload.data(), packet->payload.size(),
+        packet->timestamp, ++audio_sequence_, audio_buffer_)) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    return udp_->Send(audio_buffer_) > 0;
+}
+
+bool UdpProtocol::SendText(const std::string& text) {
+    return SendControl(text, false);
+}
+
+bool UdpProtocol::SendControl(const std::string& text, bool syn) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ == nullptr) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> control_lock(control_mutex_);
+    size_t fragments = (text.size() + UDP_CONTROL_FRAGMENT_SIZE - 1) / UDP_CONTROL_FRAGMENT_SIZE;
+    if (pending_controls_.size() + fragments > UDP_CONTROL_MAX_PENDING) {
+        ESP_LOGE(TAG, "Too many unacknowledged control messages");
+        return false;
+    }
+
+    uint32_t ack = remote_control_expected_ - 1;
+    auto now = esp_timer_get_time();
+    for (size_t offset = 0; offset < text.size(); offset += UDP_CONTROL_FRAGMENT_SIZE) {
+        size_t size = std::min<size_t>(UDP_CONTROL_FRAGMENT_SIZE, text.size() - offset);
+        uint8_t flags = control_synced_ ? UDP_PACKET_FLAG_ACK : 0;
+        if (offset + size < text.size()) {
+            flags |= UDP_PACKET_FLAG_MORE;
+        }
+        if (syn && offset == 0) {
+            flags |= UDP_PACKET_FLAG_SYN;
+        }
+
+        PendingControl pending = {
+            .sequence = ++control_sequence_,
+            .packet = std::string(),
+            .last_send_time = now,
+            .rto_ms = UDP_CONTROL_MIN_RTO_MS,
+            .retries = 0,
+        };
+        if (!cipher_.EncryptPacket(UDP_PACKET_TYPE_CONTROL, flags, (const uint8_t*)text.data() + offset, size,
+            ack, pending.sequence, pending.packet)) {
+            ESP_LOGE(TAG, "Failed to encrypt control message");
+            return false;
+        }
+        udp_->Send(pending.packet);
+        pending_controls_.push_back(std::move(pending));
+    }
+    return true;
+}
+
+void UdpProtocol::RetransmitControls() {
+    bool failed = false;
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        if (udp_ == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> control_lock(control_mutex_);
+        auto now = esp_timer_get_time();
+        for (auto& pending : pending_controls_) {
+            if (now - pending.last_send_time < pending.rto_ms * 1000LL) {
+                continue;
+            }
+            if (pending.retries >= UDP_CONTROL_MAX_RETRIES) {
+                failed = !control_failed_;
+                control_failed_ = true;
+                pending_controls_.clear();
+                break;
+            }
+            udp_->Send(pending.packet);
+            pending.retries++;
+            pending.last_send_time = now;
+            pending.rto_ms = std::min(pending.rto_ms * 2, UDP_CONTROL_MAX_RTO_MS);
+        }
+    }
+    if (failed) {
+        ESP_LOGE(TAG, "Control message was not acknowledged after %d retries", UDP_CONTROL_MAX_RETRIES);
+        SetError(Lang::Strings::SERVER_TIMEOUT);
+    }
+}
+
+void UdpProtocol::OnPacket(const std::string& data) {
+    if (data.size() < AUDIO_CHANNEL_NONCE_SIZE) {
+        ESP_LOGE(TAG, "Invalid packet size: %u", data.size());
+        return;
+    }
+    uint8_t type = data[0];
+    uint8_t flags = data[1];
+    uint16_t payload_len = ntohs(*(uint16_t*)&data[2]);
+    uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
+    uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
+    if (!(flags & UDP_PACKET_FLAG_DOWNLINK) || payload_len != data.size() - AUDIO_CHANNEL_NONCE_SIZE) {
+        ESP_LOGE(TAG, "Malformed packet, type: %x, flags: %x", type, flags);
+        return;
+    }
+
+    if (type == UDP_PACKET_TYPE_AUDIO) {
+        if (remote_audio_sequence_ != 0 && !SequenceAfter(sequence, remote_audio_sequence_)) {
+            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence,
+                remote_audio_sequence_ + 1);
+            return;
+        }
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = server_sample_rate_;
+        packet->frame_duration = server_frame_duration_;
+        packet->timestamp = timestamp;
+        packet->payload.resize(payload_len);
+        if (!Decrypt(data, packet->payload.data())) {
+            return;
+        }
+        remote_audio_sequence_ = sequence;
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(std::move(packet));
+        }
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    } else if (type == UDP_PACKET_TYPE_CONTROL) {
+        if (flags & UDP_PACKET_FLAG_ACK) {
+            HandleAck(timestamp);
+        }
+        std::string fragment(payload_len, '\0');
+        if (!Decrypt(data, (uint8_t*)fragment.data())) {
+            return;
+        }
+        OnControlPacket(flags, sequence, std::move(fragment));
+    } else if (type == UDP_PACKET_TYPE_ACK) {
+        if (flags & UDP_PACKET_FLAG_ACK) {
+            HandleAck(timestamp);
+        }
+    } else {
+        ESP_LOGE(TAG, "Invalid packet type: %x", type);
+    }
+}
+
+// OpenAudioChannel re-keys the cipher under channel_mutex_, packets of a closed channel are dropped
+bool UdpProtocol::Decrypt(const std::string& data, uint8_t* out) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return udp_ != nullptr && cipher_.Decrypt((const uint8_t*)data.data(), data.size(), out);
+}
+
+void UdpProtocol::OnControlPacket(uint8_t flags, uint32_t sequence, std::string&& fragment) {
+    std::vector<std::string> messages;
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        if (flags & UDP_PACKET_FLAG_SYN && !control_synced_) {
+            remote_control_expected_ = sequence;
+            control_synced_ = true;
+        }
+        if (!control_synced_) {
+            // Cannot order anything before the server's first packet, let it retransmit
+            return;
+        }
+
+        if (SequenceAfter(sequence, remote_control_expected_)) {
+            if (out_of_order_controls_.size() < UDP_CONTROL_MAX_PENDING) {
+                out_of_order_controls_.emplace(sequence, std::make_pair(flags, std::move(fragment)));
+            }
+        } else if (sequence == remote_control_expected_) {
+            out_of_order_controls_.emplace(sequence, std::make_pair(flags, std::move(fragment)));
+            // Deliver everything that is now contiguous
+            auto it = out_of_order_controls_.find(remote_control_expected_);
+            while (it != out_of_order_controls_.end()) {
+                partial_control_ += it->second.second;
+                if (!(it->second.first & UDP_PACKET_FLAG_MORE)) {
+                    messages.push_back(std::move(partial_control_));
+                    partial_control_.clear();
+                }
+                out_of_order_controls_.erase(it);
+                it = out_of_order_controls_.find(++remote_control_expected_);
+            }
+        }
+        // Older sequences are duplicates of delivered packets, acking again is enough
+    }
+
+    SendAck();
+    for (auto& message : messages) {
+        HandleJson(message);
+    }
+    last_incoming_time_ = std::chrono::steady_clock::now();
+}
+
+void UdpProtocol::HandleAck(uint32_t ack) {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    while (!pending_controls_.empty() && !SequenceAfter(pending_controls_.front().sequence, ack)) {
+        pending_controls_.pop_front();
+    }
+}
+
+void UdpProtocol::SendAck() {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (udp_ == nullptr) {
+        return;
+    }
+    std::string packet;
+    {
+        std::lock_guard<std::mutex> control_lock(control_mutex_);
+        if (!control_synced_) {
+            return;
+        }
+        if (!cipher_.EncryptPacket(UDP_PACKET_TYPE_ACK, UDP_PACKET_FLAG_ACK, nullptr, 0, remote_control_expected_ - 1,
+            0, packet)) {
+            return;
+        }
+    }
+    udp_->Send(packet);
+}
+
+void UdpProtocol::HandleJson(const std::string& json) {
+    auto root = cJSON_ParseWithLength(json.data(), json.size());
+    if (root == nullptr) {
+        ESP_LOGE(TAG, "Failed to parse json message %s", json.c_str());
+        return;
+    }
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (!cJSON_IsString(type)) {
+        ESP_LOGE(TAG, "Message type is invalid");
+    } else if (strcmp(type->valuestring, "hello") == 0) {
+        ParseServerHello(root);
+    } else if (strcmp(type->valuestring, "goodbye") == 0) {
+        auto session_id = cJSON_GetObjectItem(root, "session_id");
+        if (!cJSON_IsString(session_id) || session_id_ == session_id->valuestring) {
+            auto alive = alive_;  // Capture alive flag
+            Application::GetInstance().Schedule([this, alive]() {
+                if (*alive) {
+                    // Server initiated goodbye, don't send goodbye back to avoid ping-pong
+                    CloseAudioChannel(false);
+                }
+            });
+        }
+    } else if (on_incoming_json_ != nullptr) {
+        on_incoming_json_(root);
+    }
+    cJSON_Delete(root);
+}
+
+std::string UdpProtocol::GetHelloMessage() {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "hello");
+    cJSON_AddNumberToObject(root, "version", 3);
+    cJSON_AddStringToObject(root, "transport", "udp");
+    cJSON_AddStringToObject(root, "device_id", SystemInfo::GetMacAddress().c_str());
+    cJSON_AddStringToObject(root, "client_id", Board::GetInstance().GetUuid().c_str());
+    cJSON* features = cJSON_CreateObject();
+#if CONFIG_USE_SERVER_AEC
+    cJSON_AddBoolToObject(features, "aec", true);
+#endif
+    cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddItemToObject(root, "features", features);
+    cJSON* audio_params = cJSON_CreateObject();
+    cJSON_AddStringToObject(audio_params, "format", "opus");
+    cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
+    cJSON_AddNumberToObject(audio_params, "channels", 1);
+    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddItemToObject(root, "audio_params", audio_params);
+    auto json_str = cJSON_PrintUnformatted(root);
+    std::string message(json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return message;
+}
+
+void UdpProtocol::ParseServerHello(const cJSON* root) {
+    auto transport = cJSON_GetObjectItem(root, "transport");
+    if (!cJSON_IsString(transport) || strcmp(transport->valuestring, "udp") != 0) {
+        ESP_LOGE(TAG, "Unsupported transport");
+        return;
+    }
+
+    auto session_id = cJSON_GetObjectItem(root, "session_id");
+    if (cJSON_IsString(session_id)) {
+        session_id_ = session_id->valuestring;
+        ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
+    }
+
+    auto audio_params = cJSON_GetObjectItem(root, "audio_params");
+    if (cJSON_IsObject(audio_params)) {
+        auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
+        if (cJSON_IsNumber(sample_rate)) {
+            server_sample_rate_ = sample_rate->valueint;
+        }
+        auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
+        if (cJSON_IsNumber(frame_duration)) {
+            server_frame_duration_ = frame_duration->valueint;
+        }
+    }
+
+    xEventGroupSetBits(event_group_handle_, UDP_PROTOCOL_SERVER_HELLO_EVENT);
+}
@@ -0,0 +1,113 @@
+#ifndef UDP_PROTOCOL_H
+#define UDP_PROTOCOL_H
+
+
+#include "protocol.h"
+#include "audio_channel_cipher.h"
+#include "endpoint_selector.h"
+
+#include <udp.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <esp_timer.h>
+
+#include <string>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+#define UDP_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+
+/*
+ * All packets share the header documented in docs/mqtt-udp.md:
+ * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+ * |payload payload_len|
+ *
+ * type 0x01: Opus audio, unreliable, timestamp is the audio timestamp
+ * type 0x02: JSON control message, reliable, timestamp carries the cumulative ack
+ * type 0x03: bare ack, no payload, timestamp carries the cumulative ack
+ *
+ * ssrc is assigned by the server in the OTA config and selects the device key. The AES-CTR counter block
+ * is the header with the sequence moved to the timestamp field and the block counter in the low word, so
+ * every packet of a type and direction has its own counter range. Each session starts from random
+ * sequence numbers so the counter blocks are not reused across sessions either.
+ * Control messages are split into UDP_CONTROL_FRAGMENT_SIZE fragments to stay below the MTU.
+ */
+#define UDP_PACKET_TYPE_AUDIO       0x01
+#define UDP_PACKET_TYPE_CONTROL     0x02
+#define UDP_PACKET_TYPE_ACK         0x03
+#define UDP_PACKET_FLAG_DOWNLINK    0x01    // Sent by the server, keeps the two directions' keystreams apart
+#define UDP_PACKET_FLAG_MORE        0x02    // Control message continues in the next control packet
+#define UDP_PACKET_FLAG_SYN         0x04    // First control packet of a session, receiver syncs its sequence
+#define UDP_PACKET_FLAG_ACK         0x08    // The timestamp field carries a valid cumulative ack
+
+#define UDP_CONTROL_FRAGMENT_SIZE   1024
+
+#define UDP_CONTROL_TICK_MS         100
+#define UDP_CONTROL_MIN_RTO_MS      300
+#define UDP_CONTROL_MAX_RTO_MS      3000
+#define UDP_CONTROL_MAX_RETRIES     8
+#define UDP_CONTROL_MAX_PENDING     32
+
+class UdpProtocol : public Protocol {
+public:
+    UdpProtocol();
+    ~UdpProtocol();
+
+    bool Start() override;
+    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool OpenAudioChannel() override;
+    void CloseAudioChannel(bool send_goodbye = true) override;
+    bool IsAudioChannelOpened() const override;
+
+private:
+    struct PendingControl {
+        uint32_t sequence;
+        std::string packet;
+        int64_t last_send_time;
+        int rto_ms;
+        int retries;
+    };
+
+    // Alive flag for safe scheduled callbacks - set to false in destructor
+    std::shared_ptr<std::atomic<bool>> alive_ = std::make_shared<std::atomic<bool>>(true);
+
+    EventGroupHandle_t event_group_handle_;
+    esp_timer_handle_t control_timer_ = nullptr;
+    EndpointSelector endpoint_selector_;
+
+    // channel_mutex_ guards udp_, the cipher and the send path, control_mutex_ guards the reliable channel state.
+    // Lock order is channel_mutex_ -> control_mutex_, the receive path never holds both.
+    std::mutex channel_mutex_;
+    std::mutex control_mutex_;
+    std::unique_ptr<Udp> udp_;
+    AudioChannelCipher cipher_;
+    std::string audio_buffer_;
+    uint32_t audio_sequence_ = 0;
+    uint32_t remote_audio_sequence_ = 0;
+
+    uint32_t control_sequence_ = 0;
+    uint32_t remote_control_expected_ = 1;
+    std::deque<PendingControl> pending_controls_;
+    std::map<uint32_t, std::pair<uint8_t, std::string>> out_of_order_controls_;
+    std::string partial_control_;
+    bool control_synced_ = false;
+    bool control_failed_ = false;
+
+    void OnPacket(const std::string& data);
+    bool Decrypt(const std::string& data, uint8_t* out);
+    void OnControlPacket(uint8_t flags, uint32_t sequence, std::string&& fragment);
+    void HandleAck(uint32_t ack);
+    void SendAck();
+    void ResetUdp();
+    void HandleJson(const std::string& json);
+    void RetransmitControls();
+    void ParseServerHello(const cJSON* root);
+    bool SendControl(const std::string& text, bool syn);
+    bool SendText(const std::string& text) override;
+    std::string GetHelloMessage();
+};
+
+#endif // UDP_PROTOCOL_H
@@ -3,6 +3,7 @@
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
+#include "heap_profiler.h"
 
 #include <cstring>
 #include <cJSON.h>
@@ -12,7 +13,7 @@
 
 #define TAG "WS"
 
-WebsocketProtocol::WebsocketProtocol() {
+WebsocketProtocol::WebsocketProtocol() : endpoint_selector_("websocket", "urls", "url", 443, true) {
     event_group_handle_ = xEventGroupCreate();
 }
 
@@ -71,6 +72,28 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+void WebsocketProtocol::SendMcpMessage(MessageStream& payload) {
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return;
+    }
+
+    // Send the message as one fragmented text frame, only one chunk is in memory at a time
+    std::string chunk = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":";
+    bool ok = websocket_->Send(chunk.data(), chunk.size(), false, false);
+    chunk.resize(MESSAGE_STREAM_CHUNK_SIZE);
+    while (ok) {
+        size_t size = payload.Read(chunk.data(), chunk.size());
+        if (size == 0) {
+            break;
+        }
+        ok = websocket_->Send(chunk.data(), size, false, false);
+    }
+    if (!ok || !websocket_->Send("}", 1, false, true)) {
+        ESP_LOGE(TAG, "Failed to send mcp message stream");
+        SetError(Lang::Strings::SERVER_ERROR);
+    }
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
     return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
@@ -82,7 +105,6 @@ void WebsocketProtocol::CloseAudioChannel(bool send_goodbye) {
 
 bool WebsocketProtocol::OpenAudioChannel() {
     Settings settings("websocket", false);
-    std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
     int version = settings.GetInt("version");
     if (version != 0) {
@@ -91,6 +113,49 @@ bool WebsocketProtocol::OpenAudioChannel() {
 
     error_occurred_ = false;
 
+    auto candidates = endpoint_selector_.GetCandidates();
+    if (candidates.empty()) {
+        ESP_LOGE(TAG, "Websocket url is not specified");
+        SetError(Lang::Strings::SERVER_NOT_FOUND);
+        return false;
+    }
+
+    bool connected = false;
+    for (auto& url : candidates) {
+        if (ConnectToServer(url, token)) {
+            endpoint_selector_.ReportSuccess(url);
+            connected = true;
+            break;
+        }
+    }
+    if (!connected) {
+        endpoint_selector_.ReportFailure();
+        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        return false;
+    }
+
+    // Send hello message to describe the client
+    auto message = GetHelloMessage();
+    if (!SendText(message)) {
+        return false;
+    }
+
+    // Wait for server hello
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+        ESP_LOGE(TAG, "Failed to receive server hello");
+        SetError(Lang::Strings::SERVER_TIMEOUT);
+        return false;
+    }
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+
+    return true;
+}
+
+bool WebsocketProtocol::ConnectToServer(const std::string& url, std::string token) {
     auto network = Board::GetInstance().GetNetwork();
     websocket_ = network->CreateWebSocket(1);
     if (websocket_ == nullptr) {
@@ -110,6 +175,7 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
+        HeapTagScope heap_tag(kHeapTagProtocol);
         if (binary) {
             if (on_incoming_audio_ != nullptr) {
                 if (version_ == 2) {
@@ -175,28 +241,9 @@ bool WebsocketProtocol::OpenAudioChannel() {
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
     if (!websocket_->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server, code=%d", websocket_->GetLastError());
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
-        return false;
-    }
-
-    // Send hello message to describe the client
-    auto message = GetHelloMessage();
-    if (!SendText(message)) {
+        websocket_.reset();
         return false;
     }
-
-    // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
-        ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
-        return false;
-    }
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-
     return true;
 }
 
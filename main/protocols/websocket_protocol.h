@@ -3,6 +3,7 @@
 
 
 #include "protocol.h"
+#include "endpoint_selector.h"
 
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
@@ -20,12 +21,16 @@ public:
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    using Protocol::SendMcpMessage;
+    void SendMcpMessage(MessageStream& payload) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
+    EndpointSelector endpoint_selector_;
 
+    bool ConnectToServer(const std::string& url, std::string token);
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
     std::string GetHelloMessage();
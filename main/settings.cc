@@ -1,88 +1,367 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+namespace {
+
+// Namespaces also written by components outside of Settings are always read from NVS
+const char* const kUncachedNamespaces[] = { "wifi" };
+
+enum SettingType {
+    kSettingTypeString,
+    kSettingTypeInt,
+    kSettingTypeBool
+};
+
+struct SettingEntry {
+    SettingType type;
+    bool exists = false;    // False if the key is not in NVS (with this type) or was erased
+    bool dirty = false;     // Not committed to NVS yet
+    std::string string_value;
+    int32_t int_value = 0;
+};
+
+class SettingsCache {
+public:
+    static SettingsCache& GetInstance() {
+        static SettingsCache instance;
+        return instance;
+    }
+
+    bool Get(const std::string& ns, const std::string& key, SettingType type, SettingEntry& result);
+    void Set(const std::string& ns, const std::string& key, const SettingEntry& value);
+    void EraseAll(const std::string& ns);
+    void Flush();
+    void AddObserver(const std::string& ns, std::function<void(const std::string& key)> callback);
+
+private:
+    struct Namespace {
+        nvs_handle_t handle = 0;
+        bool writable = false;
+        bool cached = true;
+        bool dirty = false;
+        std::unordered_map<std::string, SettingEntry> entries;
+        std::vector<std::function<void(const std::string& key)>> observers;
+    };
+
+    std::mutex mutex_;
+    std::mutex flush_mutex_;
+    std::map<std::string, Namespace> namespaces_;
+    esp_timer_handle_t commit_timer_ = nullptr;
+    int64_t first_change_time_ = 0;
+
+    SettingsCache();
+
+    Namespace& GetNamespace(const std::string& ns);
+    bool OpenNamespace(const std::string& name, Namespace& ns, bool writable);
+    bool ReadEntry(Namespace& ns, const std::string& key, SettingType type, SettingEntry& entry);
+    void ScheduleCommit();
+    void NotifyObservers(const std::string& ns, const std::string& key);
+};
+
+SettingsCache::SettingsCache() {
+    esp_timer_create_args_t commit_timer_args = {
+        .callback = [](void* arg) {
+            SettingsCache* cache = (SettingsCache*)arg;
+            cache->Flush();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "settings_commit",
+        .skip_unhandled_events = true
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&commit_timer_args, &commit_timer_));
+
+    // Pending changes must survive esp_restart(), wherever it is called from
+    esp_register_shutdown_handler([]() {
+        SettingsCache::GetInstance().Flush();
+    });
 }
 
-Settings::~Settings() {
-    if (nvs_handle_ != 0) {
-        if (read_write_ && dirty_) {
-            ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+SettingsCache::Namespace& SettingsCache::GetNamespace(const std::string& name) {
+    auto it = namespaces_.find(name);
+    if (it != namespaces_.end()) {
+        return it->second;
+    }
+    auto& ns = namespaces_[name];
+    for (auto uncached : kUncachedNamespaces) {
+        if (name == uncached) {
+            ns.cached = false;
         }
-        nvs_close(nvs_handle_);
     }
+    return ns;
 }
 
-std::string Settings::GetString(const std::string& key, const std::string& default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
+bool SettingsCache::OpenNamespace(const std::string& name, Namespace& ns, bool writable) {
+    if (ns.handle != 0 && (ns.writable || !writable)) {
+        return true;
     }
+    // A read-only open fails until the namespace exists, so it is retried on the next read
+    nvs_handle_t handle = 0;
+    auto ret = nvs_open(name.c_str(), writable ? NVS_READWRITE : NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        if (writable) {
+            ESP_LOGE(TAG, "Failed to open namespace %s: %s", name.c_str(), esp_err_to_name(ret));
+        }
+        return false;
+    }
+    if (ns.handle != 0) {
+        nvs_close(ns.handle);
+    }
+    ns.handle = handle;
+    ns.writable = writable;
+    return true;
+}
 
-    size_t length = 0;
-    if (nvs_get_str(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
-        return default_value;
+bool SettingsCache::ReadEntry(Namespace& ns, const std::string& key, SettingType type, SettingEntry& entry) {
+    entry = SettingEntry{ .type = type };
+    if (ns.handle == 0) {
+        return false;
     }
 
-    std::string value;
-    value.resize(length);
-    ESP_ERROR_CHECK(nvs_get_str(nvs_handle_, key.c_str(), value.data(), &length));
-    while (!value.empty() && value.back() == '\0') {
-        value.pop_back();
+    if (type == kSettingTypeString) {
+        size_t length = 0;
+        if (nvs_get_str(ns.handle, key.c_str(), nullptr, &length) != ESP_OK) {
+            return false;
+        }
+        entry.string_value.resize(length);
+        ESP_ERROR_CHECK(nvs_get_str(ns.handle, key.c_str(), entry.string_value.data(), &length));
+        while (!entry.string_value.empty() && entry.string_value.back() == '\0') {
+            entry.string_value.pop_back();
+        }
+    } else if (type == kSettingTypeInt) {
+        if (nvs_get_i32(ns.handle, key.c_str(), &entry.int_value) != ESP_OK) {
+            return false;
+        }
+    } else {
+        uint8_t value;
+        if (nvs_get_u8(ns.handle, key.c_str(), &value) != ESP_OK) {
+            return false;
+        }
+        entry.int_value = value != 0;
+    }
+    entry.exists = true;
+    return true;
+}
+
+bool SettingsCache::Get(const std::string& name, const std::string& key, SettingType type, SettingEntry& result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& ns = GetNamespace(name);
+    if (ns.cached) {
+        auto it = ns.entries.find(key);
+        // A pending change of another type replaces the key, as it will in NVS
+        if (it != ns.entries.end() && (it->second.type == type || it->second.dirty)) {
+            result = it->second;
+            return result.exists && result.type == type;
+        }
     }
-    return value;
+
+    OpenNamespace(name, ns, false);
+    bool found = ReadEntry(ns, key, type, result);
+    if (ns.cached) {
+        ns.entries[key] = result;
+    }
+    return found;
+}
+
+void SettingsCache::Set(const std::string& name, const std::string& key, const SettingEntry& value) {
+    bool cached;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& ns = GetNamespace(name);
+        auto it = ns.entries.find(key);
+        if (ns.cached && it != ns.entries.end() && it->second.type == value.type && it->second.exists == value.exists &&
+            it->second.string_value == value.string_value && it->second.int_value == value.int_value) {
+            return;
+        }
+
+        auto& entry = ns.entries[key];
+        entry = value;
+        entry.dirty = true;
+        ns.dirty = true;
+        cached = ns.cached;
+        if (cached) {
+            ScheduleCommit();
+        }
+    }
+    // Others read uncached namespaces from NVS directly, so write them through
+    if (!cached) {
+        Flush();
+    }
+    NotifyObservers(name, key);
+}
+
+void SettingsCache::EraseAll(const std::string& name) {
+    std::vector<std::string> keys;
+    {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& ns = GetNamespace(name);
+        if (!OpenNamespace(name, ns, true)) {
+            return;
+        }
+        for (auto& [key, entry] : ns.entries) {
+            if (entry.exists) {
+                keys.push_back(key);
+            }
+        }
+        ns.entries.clear();
+        ns.dirty = false;
+        ESP_ERROR_CHECK(nvs_erase_all(ns.handle));
+        ESP_ERROR_CHECK(nvs_commit(ns.handle));
+    }
+    for (auto& key : keys) {
+        NotifyObservers(name, key);
+    }
+}
+
+void SettingsCache::ScheduleCommit() {
+    // Restart the delay on every change, but do not postpone the commit for longer than the max delay
+    int64_t now = esp_timer_get_time();
+    if (esp_timer_is_active(commit_timer_)) {
+        if (now - first_change_time_ >= SETTINGS_COMMIT_MAX_DELAY_MS * 1000LL) {
+            return;
+        }
+        esp_timer_stop(commit_timer_);
+    } else {
+        first_change_time_ = now;
+    }
+    esp_timer_start_once(commit_timer_, SETTINGS_COMMIT_DELAY_MS * 1000LL);
+}
+
+void SettingsCache::Flush() {
+    struct PendingWrite {
+        nvs_handle_t handle;
+        std::string key;
+        SettingEntry entry;
+    };
+
+    // Writes go to flash without holding mutex_, so readers are not blocked by the commit
+    std::lock_guard<std::mutex> flush_lock(flush_mutex_);
+    std::vector<PendingWrite> writes;
+    std::vector<nvs_handle_t> handles;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        esp_timer_stop(commit_timer_);
+        for (auto& [name, ns] : namespaces_) {
+            if (!ns.dirty) {
+                continue;
+            }
+            if (!OpenNamespace(name, ns, true)) {
+                continue;
+            }
+            for (auto& [key, entry] : ns.entries) {
+                if (entry.dirty) {
+                    writes.push_back({ ns.handle, key, entry });
+                    entry.dirty = false;
+                }
+            }
+            ns.dirty = false;
+            handles.push_back(ns.handle);
+        }
+    }
+
+    for (auto& write : writes) {
+        auto& entry = write.entry;
+        if (!entry.exists) {
+            auto ret = nvs_erase_key(write.handle, write.key.c_str());
+            if (ret != ESP_ERR_NVS_NOT_FOUND) {
+                ESP_ERROR_CHECK(ret);
+            }
+        } else if (entry.type == kSettingTypeString) {
+            ESP_ERROR_CHECK(nvs_set_str(write.handle, write.key.c_str(), entry.string_value.c_str()));
+        } else if (entry.type == kSettingTypeInt) {
+            ESP_ERROR_CHECK(nvs_set_i32(write.handle, write.key.c_str(), entry.int_value));
+        } else {
+            ESP_ERROR_CHECK(nvs_set_u8(write.handle, write.key.c_str(), entry.int_value ? 1 : 0));
+        }
+    }
+    for (auto handle : handles) {
+        ESP_ERROR_CHECK(nvs_commit(handle));
+    }
+    if (!writes.empty()) {
+        ESP_LOGI(TAG, "Committed %u changes", writes.size());
+    }
+}
+
+void SettingsCache::AddObserver(const std::string& name, std::function<void(const std::string& key)> callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    GetNamespace(name).observers.push_back(std::move(callback));
+}
+
+void SettingsCache::NotifyObservers(const std::string& name, const std::string& key) {
+    std::vector<std::function<void(const std::string& key)>> observers;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        observers = GetNamespace(name).observers;
+    }
+    for (auto& observer : observers) {
+        observer(key);
+    }
+}
+
+} // namespace
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+Settings::~Settings() {
+}
+
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
+    SettingEntry entry;
+    if (!SettingsCache::GetInstance().Get(ns_, key, kSettingTypeString, entry)) {
+        return default_value;
+    }
+    return entry.string_value;
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
-        dirty_ = true;
+        SettingsCache::GetInstance().Set(ns_, key, SettingEntry{ .type = kSettingTypeString, .exists = true, .string_value = value });
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
-    if (nvs_handle_ == 0) {
+    SettingEntry entry;
+    if (!SettingsCache::GetInstance().Get(ns_, key, kSettingTypeInt, entry)) {
         return default_value;
     }
-
-    int32_t value;
-    if (nvs_get_i32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
-        return default_value;
-    }
-    return value;
+    return entry.int_value;
 }
 
 void Settings::SetInt(const std::string& key, int32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        SettingsCache::GetInstance().Set(ns_, key, SettingEntry{ .type = kSettingTypeInt, .exists = true, .int_value = value });
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 bool Settings::GetBool(const std::string& key, bool default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
-    uint8_t value;
-    if (nvs_get_u8(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    SettingEntry entry;
+    if (!SettingsCache::GetInstance().Get(ns_, key, kSettingTypeBool, entry)) {
         return default_value;
     }
-    return value != 0;
+    return entry.int_value != 0;
 }
 
 void Settings::SetBool(const std::string& key, bool value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_u8(nvs_handle_, key.c_str(), value ? 1 : 0));
-        dirty_ = true;
+        SettingsCache::GetInstance().Set(ns_, key, SettingEntry{ .type = kSettingTypeBool, .exists = true, .int_value = value ? 1 : 0 });
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -90,10 +369,7 @@ void Settings::SetBool(const std::string& key, bool value) {
 
 void Settings::EraseKey(const std::string& key) {
     if (read_write_) {
-        auto ret = nvs_erase_key(nvs_handle_, key.c_str());
-        if (ret != ESP_ERR_NVS_NOT_FOUND) {
-            ESP_ERROR_CHECK(ret);
-        }
+        SettingsCache::GetInstance().Set(ns_, key, SettingEntry{ .type = kSettingTypeString, .exists = false });
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -101,8 +377,16 @@ void Settings::EraseKey(const std::string& key) {
 
 void Settings::EraseAll() {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        SettingsCache::GetInstance().EraseAll(ns_);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
+
+void Settings::Flush() {
+    SettingsCache::GetInstance().Flush();
+}
+
+void Settings::AddObserver(const std::string& ns, std::function<void(const std::string& key)> callback) {
+    SettingsCache::GetInstance().AddObserver(ns, std::move(callback));
+}
@@ -2,8 +2,21 @@
 #define SETTINGS_H
 
 #include <string>
+#include <functional>
 #include <nvs_flash.h>
 
+// Changes are kept in RAM and committed to NVS together once no change happened for this long
+#define SETTINGS_COMMIT_DELAY_MS 1000
+// Upper bound of the delay above while changes keep coming, e.g. when turning the volume knob
+#define SETTINGS_COMMIT_MAX_DELAY_MS 5000
+
+/*
+ * A view of one NVS namespace. Values are read through a process-wide RAM cache, so constructing
+ * a Settings object and reading the same key again is cheap. Writes are committed with a short delay,
+ * Flush() writes them immediately and esp_restart() always flushes before the reboot. Deep sleep does not,
+ * the power-off primitives (Axp2101, Sy6970, the board power managers) and PowerSaveTimer/SleepTimer flush
+ * before they cut the power, board code that cuts it another way must call Flush() itself.
+ */
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
@@ -18,11 +31,14 @@ public:
     void EraseKey(const std::string& key);
     void EraseAll();
 
+    // Commit pending changes of all namespaces now, e.g. before deep sleep
+    static void Flush();
+    // The callback runs on the task that made the change, with the changed (or erased) key
+    static void AddObserver(const std::string& ns, std::function<void(const std::string& key)> callback);
+
 private:
     std::string ns_;
-    nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
-    bool dirty_ = false;
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include "system_info.h"
+#include "heap_profiler.h"
 
 #include <freertos/task.h>
 #include <esp_log.h>
@@ -149,6 +150,9 @@ void SystemInfo::PrintHeapStats() {
     int free_sram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
     int min_free_sram = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
     ESP_LOGI(TAG, "free sram: %u minimal sram: %u", free_sram, min_free_sram);
+#if CONFIG_HEAP_PROFILER
+    HeapProfiler::PrintReport();
+#endif
 }
 
 void SystemInfo::PrintPmLocks() {
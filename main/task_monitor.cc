@@ -0,0 +1,190 @@
+#include "task_monitor.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "TaskMonitor"
+
+TaskMonitor::TaskMonitor() {
+    memset(tasks_, 0, sizeof(tasks_));
+    memset(samples_, 0, sizeof(samples_));
+}
+
+void TaskMonitor::Sample() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    if (last_sample_time_ != 0 && now - last_sample_time_ < TASK_MONITOR_INTERVAL_MS * 1000LL) {
+        return;
+    }
+    bool first = last_sample_time_ == 0;
+    last_sample_time_ = now;
+
+    configRUN_TIME_COUNTER_TYPE total_run_time = 0;
+    int count = uxTaskGetSystemState(status_, TASK_MONITOR_MAX_TASKS, &total_run_time);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, skipping sample", TASK_MONITOR_MAX_TASKS);
+        return;
+    }
+    // Run time is counted per core, like in SystemInfo::PrintTaskCpuUsage
+    configRUN_TIME_COUNTER_TYPE elapsed = first ? 0 : total_run_time - last_total_run_time_;
+    last_total_run_time_ = total_run_time;
+
+    SampleRecord sample = {};
+    sample.time = now;
+    TaskHandle_t idle_tasks[portNUM_PROCESSORS];
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        idle_tasks[core] = xTaskGetIdleTaskHandleForCore(core);
+        for (int i = 0; i < count; i++) {
+            if (status_[i].xHandle != idle_tasks[core]) {
+                continue;
+            }
+            configRUN_TIME_COUNTER_TYPE idle = status_[i].ulRunTimeCounter - idle_run_time_[core];
+            idle_run_time_[core] = status_[i].ulRunTimeCounter;
+            if (elapsed > 0) {
+                sample.core_load[core] = 100 - std::min<uint64_t>(100, idle * 100ULL / elapsed);
+            }
+            break;
+        }
+    }
+
+    for (int j = 0; j < task_count_; j++) {
+        tasks_[j].seen = false;
+    }
+    for (int i = 0; i < count; i++) {
+        auto& status = status_[i];
+        // A handle can be reused by a new task once the old one was deleted
+        int j = 0;
+        while (j < task_count_ && (tasks_[j].handle != status.xHandle || strcmp(tasks_[j].name, status.pcTaskName) != 0)) {
+            j++;
+        }
+        bool found = j < task_count_;
+        if (!found) {
+            if (task_count_ == TASK_MONITOR_MAX_TASKS) {
+                continue;
+            }
+            task_count_++;
+            tasks_[j] = {};
+            tasks_[j].handle = status.xHandle;
+            strncpy(tasks_[j].name, status.pcTaskName, sizeof(tasks_[j].name) - 1);
+        }
+
+        auto& task = tasks_[j];
+        task.seen = true;
+        task.priority = status.uxCurrentPriority;
+        task.cpu_percent = 0;
+        if (found && elapsed > 0) {
+            configRUN_TIME_COUNTER_TYPE run_time = status.ulRunTimeCounter - task.run_time;
+            task.cpu_percent = std::min<uint64_t>(100, run_time * 100ULL / elapsed);
+        }
+        task.run_time = status.ulRunTimeCounter;
+        // The high water mark is in bytes and only ever goes down
+        task.stack_free_min = status.usStackHighWaterMark;
+        if (task.stack_free_min < TASK_MONITOR_STACK_WARNING_BYTES && !task.stack_warned) {
+            task.stack_warned = true;
+            ESP_LOGW(TAG, "Task %s is low on stack: %lu bytes never used", task.name, (unsigned long)task.stack_free_min);
+        }
+
+        bool idle = std::find(idle_tasks, idle_tasks + portNUM_PROCESSORS, status.xHandle) != idle_tasks + portNUM_PROCESSORS;
+        if (!idle && task.cpu_percent >= sample.busiest_percent) {
+            sample.busiest_percent = task.cpu_percent;
+            strncpy(sample.busiest_name, task.name, sizeof(sample.busiest_name) - 1);
+        }
+    }
+
+    // Drop the tasks that exited
+    low_stack_count_ = 0;
+    int kept = 0;
+    for (int j = 0; j < task_count_; j++) {
+        if (!tasks_[j].seen) {
+            continue;
+        }
+        if (tasks_[j].stack_warned) {
+            low_stack_count_++;
+        }
+        tasks_[kept++] = tasks_[j];
+    }
+    task_count_ = kept;
+
+    if (!first) {
+        samples_[sample_head_] = sample;
+        sample_head_ = (sample_head_ + 1) % TASK_MONITOR_HISTORY_SIZE;
+        sample_count_ = std::min(sample_count_ + 1, TASK_MONITOR_HISTORY_SIZE);
+    }
+}
+
+const TaskMonitor::SampleRecord* TaskMonitor::LatestSample() const {
+    if (sample_count_ == 0) {
+        return nullptr;
+    }
+    return &samples_[(sample_head_ + TASK_MONITOR_HISTORY_SIZE - 1) % TASK_MONITOR_HISTORY_SIZE];
+}
+
+cJSON* TaskMonitor::GetStatusJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+    if (auto sample = LatestSample()) {
+        cJSON* cpu_load = cJSON_CreateArray();
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            cJSON_AddItemToArray(cpu_load, cJSON_CreateNumber(sample->core_load[core]));
+        }
+        cJSON_AddItemToObject(json, "cpu_load", cpu_load);
+    }
+    if (low_stack_count_ > 0) {
+        cJSON* low_stack = cJSON_CreateArray();
+        for (int j = 0; j < task_count_; j++) {
+            if (tasks_[j].stack_warned) {
+                cJSON_AddItemToArray(low_stack, cJSON_CreateString(tasks_[j].name));
+            }
+        }
+        cJSON_AddItemToObject(json, "low_stack_tasks", low_stack);
+    }
+    return json;
+}
+
+cJSON* TaskMonitor::GetStatisticsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "interval_ms", TASK_MONITOR_INTERVAL_MS);
+    cJSON_AddNumberToObject(json, "stack_warning_bytes", TASK_MONITOR_STACK_WARNING_BYTES);
+
+    // Busiest first
+    int order[TASK_MONITOR_MAX_TASKS];
+    for (int j = 0; j < task_count_; j++) {
+        order[j] = j;
+    }
+    std::sort(order, order + task_count_, [this](int a, int b) {
+        return tasks_[a].cpu_percent > tasks_[b].cpu_percent;
+    });
+    cJSON* tasks = cJSON_CreateArray();
+    for (int j = 0; j < task_count_; j++) {
+        auto& task = tasks_[order[j]];
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "name", task.name);
+        cJSON_AddNumberToObject(item, "priority", task.priority);
+        cJSON_AddNumberToObject(item, "cpu_percent", task.cpu_percent);
+        cJSON_AddNumberToObject(item, "stack_free_min", task.stack_free_min);
+        cJSON_AddItemToArray(tasks, item);
+    }
+    cJSON_AddItemToObject(json, "tasks", tasks);
+
+    // Oldest first
+    int64_t now = esp_timer_get_time();
+    cJSON* history = cJSON_CreateArray();
+    for (int k = 0; k < sample_count_; k++) {
+        auto& sample = samples_[(sample_head_ + TASK_MONITOR_HISTORY_SIZE - sample_count_ + k) % TASK_MONITOR_HISTORY_SIZE];
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "age_ms", (now - sample.time) / 1000);
+        cJSON* cpu_load = cJSON_CreateArray();
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            cJSON_AddItemToArray(cpu_load, cJSON_CreateNumber(sample.core_load[core]));
+        }
+        cJSON_AddItemToObject(item, "cpu_load", cpu_load);
+        cJSON_AddStringToObject(item, "busiest", sample.busiest_name);
+        cJSON_AddNumberToObject(item, "busiest_percent", sample.busiest_percent);
+        cJSON_AddItemToArray(history, item);
+    }
+    cJSON_AddItemToObject(json, "history", history);
+    return json;
+}
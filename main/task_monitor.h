@@ -0,0 +1,71 @@
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <mutex>
+
+#include <cJSON.h>
+
+// Tasks tracked per sample, the rest are ignored until some exit
+#define TASK_MONITOR_MAX_TASKS          40
+// Samples kept in the ring, one every interval
+#define TASK_MONITOR_HISTORY_SIZE       12
+#define TASK_MONITOR_INTERVAL_MS        5000
+// A task whose stack never had more than this many bytes left is logged once and reported
+#define TASK_MONITOR_STACK_WARNING_BYTES 512
+
+/*
+ * Sampling task profiler that is cheap enough to stay on. Every interval it takes one uxTaskGetSystemState
+ * snapshot into a preallocated array and keeps, per task, the CPU share since the last sample and the lowest
+ * free stack seen, and per sample the load of every core and the busiest task in a fixed ring.
+ */
+class TaskMonitor {
+public:
+    TaskMonitor();
+
+    // Called periodically, takes a sample once the interval has passed since the last one
+    void Sample();
+
+    // Short summary for the device status: current load per core and the tasks low on stack
+    cJSON* GetStatusJson();
+    // Every task and the ring of samples
+    cJSON* GetStatisticsJson();
+
+private:
+    struct TaskRecord {
+        TaskHandle_t handle;
+        char name[configMAX_TASK_NAME_LEN];
+        UBaseType_t priority;
+        configRUN_TIME_COUNTER_TYPE run_time;
+        uint8_t cpu_percent;            // Of one core, over the last interval
+        uint32_t stack_free_min;        // Bytes
+        bool stack_warned;
+        bool seen;
+    };
+
+    struct SampleRecord {
+        int64_t time;
+        uint8_t core_load[portNUM_PROCESSORS];
+        uint8_t busiest_percent;
+        char busiest_name[configMAX_TASK_NAME_LEN];
+    };
+
+    std::mutex mutex_;
+    TaskStatus_t status_[TASK_MONITOR_MAX_TASKS];
+    TaskRecord tasks_[TASK_MONITOR_MAX_TASKS];
+    int task_count_ = 0;
+    SampleRecord samples_[TASK_MONITOR_HISTORY_SIZE];
+    int sample_count_ = 0;
+    int sample_head_ = 0;
+    int64_t last_sample_time_ = 0;
+    configRUN_TIME_COUNTER_TYPE last_total_run_time_ = 0;
+    configRUN_TIME_COUNTER_TYPE idle_run_time_[portNUM_PROCESSORS] = {};
+    int low_stack_count_ = 0;
+
+    const SampleRecord* LatestSample() const;
+};
+
+#endif // TASK_MONITOR_H
@@ -0,0 +1,75 @@
+#include "worker_pool.h"
+
+#include <esp_log.h>
+#include <string>
+#include <stdexcept>
+
+#define TAG "WorkerPool"
+
+WorkerPool::WorkerPool(const char* name, int worker_count, uint32_t stack_size, UBaseType_t priority,
+    size_t max_queue_size) : max_queue_size_(max_queue_size) {
+    for (int i = 0; i < worker_count; i++) {
+        std::string task_name = std::string(name) + "_" + std::to_string(i);
+        TaskHandle_t handle = nullptr;
+        auto ret = xTaskCreate([](void* arg) {
+            WorkerPool* pool = (WorkerPool*)arg;
+            pool->WorkerLoop();
+            vTaskDelete(NULL);
+        }, task_name.c_str(), stack_size, this, priority, &handle);
+        if (ret != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create worker task %s", task_name.c_str());
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        worker_tasks_.push_back(handle);
+        running_count_++;
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    queue_.clear();
+    cv_.notify_all();
+    cv_.wait(lock, [this]() { return running_count_ == 0; });
+}
+
+bool WorkerPool::Submit(std::function<void()>&& work) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || worker_tasks_.empty() || queue_.size() >= max_queue_size_) {
+        return false;
+    }
+    queue_.push_back(std::move(work));
+    cv_.notify_one();
+    return true;
+}
+
+size_t WorkerPool::pending_count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+}
+
+void WorkerPool::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (stopping_) {
+            break;
+        }
+        auto work = std::move(queue_.front());
+        queue_.pop_front();
+        busy_count_++;
+        lock.unlock();
+
+        try {
+            work();
+        } catch (const std::exception& e) {
+            ESP_LOGE(TAG, "Work failed: %s", e.what());
+        }
+
+        lock.lock();
+        busy_count_--;
+    }
+    running_count_--;
+    cv_.notify_all();
+}
@@ -0,0 +1,40 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+ * A fixed set of FreeRTOS tasks that run blocking work (HTTP uploads, JPEG encoding, etc.)
+ * away from the main task. The queue is bounded, Submit() fails instead of blocking when it is full.
+ */
+class WorkerPool {
+public:
+    WorkerPool(const char* name, int worker_count, uint32_t stack_size, UBaseType_t priority, size_t max_queue_size);
+    ~WorkerPool();
+
+    bool Submit(std::function<void()>&& work);
+    size_t pending_count();
+    int busy_count() const { return busy_count_; }
+    int worker_count() const { return worker_tasks_.size(); }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    std::vector<TaskHandle_t> worker_tasks_;
+    size_t max_queue_size_;
+    int busy_count_ = 0;
+    int running_count_ = 0;
+    bool stopping_ = false;
+
+    void WorkerLoop();
+};
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,39 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+'''
+  Per-packet crypto cost of the UDP audio channel (main/protocols/audio_channel_cipher.cc), on the host.
+
+    python scripts/audio_channel_cipher_bench/audio_channel_cipher_bench.py
+
+  Builds audio_channel_cipher_bench.cc with the cipher against stubs/ (software AES with the mbedtls API,
+  checked against the NIST CTR vector first) and prints nanoseconds per packet for the old SendAudio path,
+  Encrypt, Decrypt and the AES work alone. The difference between the first two columns is what the old
+  path spent on allocation and copies. On the device the AES column is the peripheral instead.
+'''
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+PROTOCOLS_DIR = os.path.join(BENCH_DIR, '..', '..', 'main', 'protocols')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Host bench of main/protocols/audio_channel_cipher.cc')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'), help='C++ compiler (default: g++)')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, 'audio_channel_cipher_bench')
+        subprocess.run([args.cxx, '-std=gnu++17', '-O2', '-Wall', '-Wno-format',
+                        '-I', os.path.join(BENCH_DIR, 'stubs'), '-I', PROTOCOLS_DIR,
+                        os.path.join(BENCH_DIR, 'audio_channel_cipher_bench.cc'),
+                        os.path.join(PROTOCOLS_DIR, 'audio_channel_cipher.cc'), '-o', binary], check=True)
+        return subprocess.run([binary]).returncode
+
+
+if __name__ == '__main__':
+    sys.exit(main())
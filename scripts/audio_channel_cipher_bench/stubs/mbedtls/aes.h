@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Plain software AES-128 with the mbedtls calling convention, only what AudioChannelCipher uses (encryption
+// key schedule and CTR mode). Like mbedtls without CONFIG_MBEDTLS_HARDWARE_AES, it is table based.
+
+struct mbedtls_aes_context {
+    uint32_t round_keys[44];
+    int rounds;
+};
+
+namespace mbedtls_stub {
+
+inline uint8_t Xtime(uint8_t x) {
+    return (uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+struct Tables {
+    uint8_t sbox[256];
+    uint32_t te[4][256];
+
+    Tables() {
+        // The S-box from the multiplicative inverse in GF(2^8) and the affine transform
+        uint8_t p = 1, q = 1;
+        do {
+            p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1b : 0);
+            q ^= q << 1;
+            q ^= q << 2;
+            q ^= q << 4;
+            if (q & 0x80) {
+                q ^= 0x09;
+            }
+            uint8_t x = q ^ (uint8_t)(q << 1 | q >> 7) ^ (uint8_t)(q << 2 | q >> 6) ^ (uint8_t)(q << 3 | q >> 5) ^
+                (uint8_t)(q << 4 | q >> 4);
+            sbox[p] = x ^ 0x63;
+        } while (p != 1);
+        sbox[0] = 0x63;
+        for (int i = 0; i < 256; i++) {
+            uint8_t s = sbox[i];
+            uint32_t t = (uint32_t)Xtime(s) << 24 | (uint32_t)s << 16 | (uint32_t)s << 8 | (uint32_t)(Xtime(s) ^ s);
+            for (int j = 0; j < 4; j++) {
+                te[j][i] = t;
+                t = t >> 8 | t << 24;
+            }
+        }
+    }
+};
+
+inline const Tables& GetTables() {
+    static const Tables tables;
+    return tables;
+}
+
+inline uint32_t Load32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+inline void Store32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+inline void EncryptBlock(const mbedtls_aes_context* ctx, const uint8_t input[16], uint8_t output[16]) {
+    const auto& t = GetTables();
+    const uint32_t* rk = ctx->round_keys;
+    uint32_t s[4], n[4];
+    for (int i = 0; i < 4; i++) {
+        s[i] = Load32(input + i * 4) ^ rk[i];
+    }
+    for (int round = 1; round < ctx->rounds; round++) {
+        rk += 4;
+        for (int i = 0; i < 4; i++) {
+            n[i] = t.te[0][s[i] >> 24] ^ t.te[1][(s[(i + 1) & 3] >> 16) & 0xff] ^
+                t.te[2][(s[(i + 2) & 3] >> 8) & 0xff] ^ t.te[3][s[(i + 3) & 3] & 0xff] ^ rk[i];
+        }
+        memcpy(s, n, sizeof(s));
+    }
+    rk += 4;
+    for (int i = 0; i < 4; i++) {
+        uint32_t v = (uint32_t)t.sbox[s[i] >> 24] << 24 | (uint32_t)t.sbox[(s[(i + 1) & 3] >> 16) & 0xff] << 16 |
+            (uint32_t)t.sbox[(s[(i + 2) & 3] >> 8) & 0xff] << 8 | t.sbox[s[(i + 3) & 3] & 0xff];
+        Store32(output + i * 4, v ^ rk[i]);
+    }
+}
+
+} // namespace mbedtls_stub
+
+inline void mbedtls_aes_init(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+inline void mbedtls_aes_free(mbedtls_aes_context* ctx) {
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+inline int mbedtls_aes_setkey_enc(mbedtls_aes_context* ctx, const unsigned char* key, unsigned int keybits) {
+    if (keybits != 128) {
+        return -0x0020;     // MBEDTLS_ERR_AES_INVALID_KEY_LENGTH
+    }
+    const auto& t = mbedtls_stub::GetTables();
+    uint32_t* w = ctx->round_keys;
+    for (int i = 0; i < 4; i++) {
+        w[i] = mbedtls_stub::Load32(key + i * 4);
+    }
+    uint8_t rcon = 1;
+    for (int i = 4; i < 44; i++) {
+        uint32_t temp = w[i - 1];
+        if (i % 4 == 0) {
+            temp = (uint32_t)t.sbox[(temp >> 16) & 0xff] << 24 | (uint32_t)t.sbox[(temp >> 8) & 0xff] << 16 |
+                (uint32_t)t.sbox[temp & 0xff] << 8 | t.sbox[temp >> 24];
+            temp ^= (uint32_t)rcon << 24;
+            rcon = mbedtls_stub::Xtime(rcon);
+        }
+        w[i] = w[i - 4] ^ temp;
+    }
+    ctx->rounds = 10;
+    return 0;
+}
+
+inline int mbedtls_aes_crypt_ctr(mbedtls_aes_context* ctx, size_t length, size_t* nc_off, unsigned char nonce_counter[16],
+                                 unsigned char stream_block[16], const unsigned char* input, unsigned char* output) {
+    size_t n = *nc_off;
+    if (n > 15) {
+        return -0x0021;     // MBEDTLS_ERR_AES_BAD_INPUT_DATA
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (n == 0) {
+            mbedtls_stub::EncryptBlock(ctx, nonce_counter, stream_block);
+            for (int j = 15; j >= 0; j--) {
+                if (++nonce_counter[j] != 0) {
+                    break;
+                }
+            }
+        }
+        output[i] = input[i] ^ stream_block[n];
+        n = (n + 1) & 15;
+    }
+    *nc_off = n;
+    return 0;
+}
@@ -398,6 +398,9 @@ def pack_assets_simple(target_path, include_path, out_file, assets_path, max_nam
 
         merged_data.extend(bin_data)
 
+    # The device binary-searches the table, so sort it by the stored (truncated) name bytes.
+    # The file data keeps its order, the entries point to it by offset.
+    file_info_list.sort(key=lambda info: info[0].encode('utf-8')[:max_name_len])
     total_files = len(file_info_list)
 
     mmap_table = bytearray()
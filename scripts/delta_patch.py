@@ -0,0 +1,347 @@
+#!/usr/bin/env python3
+import argparse
+import hashlib
+import os
+import random
+import struct
+import sys
+
+
+'''
+  Delta patches for firmware and assets images, applied on the device by main/delta_patch.cc.
+
+    python delta_patch.py diff xiaozhi_old.bin xiaozhi_new.bin xiaozhi.patch
+    python delta_patch.py diff assets_old.bin assets_new.bin assets.patch --assets
+    python delta_patch.py apply assets_old.bin assets.patch assets_new.bin
+    python delta_patch.py self-test
+
+  delta_patch_test/delta_patch_test.py replays patches from this tool through main/delta_patch.cc on the host.
+
+  Serve the patch instead of the image at the firmware or assets URL, the device recognizes it by its magic.
+
+  Format (little endian):
+    header  "XZD1" | block_size u32 | source_size u32 | source sha256 | target_size u32 | target sha256
+    ops     0x01 COPY    source_offset u32, length u32
+            0x02 INSERT  length u32, data
+            0x00 END
+
+  block_size 0: the target is written to another partition (firmware, from the running app partition).
+  block_size N: the target overwrites the source in place, N bytes at a time (assets). A COPY never reads
+  from a block that was already rewritten, this tool trims or drops the matches that would.
+'''
+
+MAGIC = b'XZD1'
+HEADER = struct.Struct('<4sII32sI32s')
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+SECTOR_SIZE = 4096
+MATCH_BLOCK = 16        # source index granularity
+MIN_MATCH = 32          # shorter matches cost more than inserting the bytes
+
+ASSETS_HEADER_SIZE = 12
+ASSETS_ENTRY = struct.Struct('<32sIIHH')
+
+
+def common_length(a, ai, b, bi, limit):
+    """Length of the common run of a[ai:] and b[bi:], at most limit"""
+    length = 0
+    step = 4096
+    while length < limit:
+        n = min(step, limit - length)
+        if a[ai + length:ai + length + n] == b[bi + length:bi + length + n]:
+            length += n
+            continue
+        if n <= 16:
+            while length < limit and a[ai + length] == b[bi + length]:
+                length += 1
+            return length
+        step = max(16, n // 8)
+    return length
+
+
+class Differ:
+    """Greedy block-hash matcher, like rsync with matches extended byte by byte"""
+
+    def __init__(self, source, block_size):
+        self.source = source
+        self.block_size = block_size
+        self.index = {}
+        for offset in range(0, len(source) - MATCH_BLOCK + 1, MATCH_BLOCK):
+            self.index.setdefault(source[offset:offset + MATCH_BLOCK], offset)
+
+    def allowed(self, target_pos, source_pos, length):
+        """Trim a match so an in-place patch never reads a block that was already rewritten"""
+        if self.block_size == 0 or source_pos >= target_pos:
+            return length
+        block_start = target_pos - target_pos % self.block_size
+        if source_pos < block_start:
+            return 0
+        return min(length, block_start + self.block_size - target_pos)
+
+    def diff(self, target, start, end, ops, hint=None):
+        """Appends the ops producing target[start:end]. hint (source_offset, length, target_offset) maps a range
+        of the target to the source range tried first."""
+        pos = start
+        literal_start = start
+        while pos < end:
+            best_source, best_length = self.find_match(target, pos, end, hint)
+            if best_length >= MIN_MATCH:
+                if literal_start < pos:
+                    ops.append((OP_INSERT, literal_start, pos - literal_start))
+                ops.append((OP_COPY, best_source, best_length))
+                pos += best_length
+                literal_start = pos
+            else:
+                pos += 1
+        if literal_start < end:
+            ops.append((OP_INSERT, literal_start, end - literal_start))
+
+    def find_match(self, target, pos, end, hint):
+        candidates = []
+        if hint is not None:
+            hint_offset, hint_length, hint_target = hint
+            if 0 <= pos - hint_target < hint_length:
+                candidates.append(hint_offset + pos - hint_target)
+        source_offset = self.index.get(target[pos:pos + MATCH_BLOCK])
+        if source_offset is not None:
+            candidates.append(source_offset)
+
+        best_source, best_length = 0, 0
+        for candidate in candidates:
+            limit = min(end - pos, len(self.source) - candidate)
+            length = common_length(self.source, candidate, target, pos, limit)
+            length = self.allowed(pos, candidate, length)
+            if length > best_length:
+                best_source, best_length = candidate, length
+        return best_source, best_length
+
+
+def parse_assets(image):
+    files, _, length = struct.unpack_from('<III', image, 0)
+    data_offset = ASSETS_HEADER_SIZE + files * ASSETS_ENTRY.size
+    if data_offset > ASSETS_HEADER_SIZE + length:
+        raise ValueError('not an assets image')
+    entries = {}
+    for i in range(files):
+        name, size, offset, _, _ = ASSETS_ENTRY.unpack_from(image, ASSETS_HEADER_SIZE + i * ASSETS_ENTRY.size)
+        # Files are stored with a 2 byte 'ZZ' prefix, or compressed as 'ZC', the stored size and the data
+        start = data_offset + offset
+        if image[start:start + 2] == b'ZC':
+            size = 4 + struct.unpack_from('<I', image, start + 2)[0]
+        entries[name.rstrip(b'\0')] = (start, size + 2)
+    return data_offset, entries
+
+
+def make_ops(source, target, assets):
+    block_size = SECTOR_SIZE if assets else 0
+    differ = Differ(source, block_size)
+    ops = []
+    if not assets:
+        differ.diff(target, 0, len(target), ops)
+        return block_size, ops
+
+    # Per file: the file of the same name in the old image is tried first
+    _, old_entries = parse_assets(source)
+    data_offset, new_entries = parse_assets(target)
+    differ.diff(target, 0, data_offset, ops)
+    pos = data_offset
+    for name, (offset, size) in sorted(new_entries.items(), key=lambda item: item[1][0]):
+        if offset > pos:
+            differ.diff(target, pos, offset, ops)
+        old = old_entries.get(name)
+        hint = (old[0], old[1], offset) if old is not None else None
+        differ.diff(target, offset, offset + size, ops, hint)
+        pos = offset + size
+    if pos < len(target):
+        differ.diff(target, pos, len(target), ops)
+    return block_size, ops
+
+
+def write_patch(source, target, block_size, ops):
+    out = bytearray(HEADER.pack(MAGIC, block_size, len(source), hashlib.sha256(source).digest(),
+                                len(target), hashlib.sha256(target).digest()))
+    # Merge adjacent ops of the same kind
+    merged = []
+    for op in ops:
+        if merged and merged[-1][0] == op[0] and merged[-1][1] + merged[-1][2] == op[1]:
+            merged[-1] = (op[0], merged[-1][1], merged[-1][2] + op[2])
+        else:
+            merged.append(op)
+    for kind, offset, length in merged:
+        if kind == OP_COPY:
+            out += struct.pack('<BII', OP_COPY, offset, length)
+        else:
+            out += struct.pack('<BI', OP_INSERT, length)
+            out += target[offset:offset + length]
+    out.append(OP_END)
+    return bytes(out)
+
+
+def diff(source, target, assets=False):
+    block_size, ops = make_ops(source, target, assets)
+    return write_patch(source, target, block_size, ops)
+
+
+def apply(source, patch):
+    """Applies the patch the way the device does, in place when the patch says so"""
+    magic, block_size, source_size, source_hash, target_size, target_hash = HEADER.unpack_from(patch, 0)
+    if magic != MAGIC:
+        raise ValueError('not a delta patch')
+    if len(source) < source_size or hashlib.sha256(source[:source_size]).digest() != source_hash:
+        raise ValueError('the patch does not apply to this source')
+
+    # The partition being patched in place, it may be larger than the old image
+    flash = bytearray(source) + bytes(max(0, target_size - len(source)))
+    output = bytearray()
+    flushed = 0
+
+    def write(data):
+        nonlocal flushed
+        output.extend(data)
+        while block_size and len(output) - flushed >= block_size:
+            flash[flushed:flushed + block_size] = output[flushed:flushed + block_size]
+            flushed += block_size
+
+    pos = HEADER.size
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack_from('<II', patch, pos)
+            pos += 8
+            if offset + length > source_size:
+                raise ValueError('copy out of the source')
+            # Piece by piece, blocks may be rewritten in between
+            end = offset + length
+            while offset < end:
+                n = min(SECTOR_SIZE, end - offset)
+                if block_size and offset < flushed:
+                    raise ValueError('copy from a block that was already rewritten')
+                write(flash[offset:offset + n])
+                offset += n
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from('<I', patch, pos)
+            pos += 4
+            write(patch[pos:pos + length])
+            pos += length
+        else:
+            raise ValueError(f'unknown op {op}')
+
+    if len(output) != target_size or hashlib.sha256(output).digest() != target_hash:
+        raise ValueError('target hash mismatch')
+    return bytes(output)
+
+
+def build_assets(files):
+    """A packed assets image like scripts/spiffs_assets/spiffs_assets_gen.py writes"""
+    data = bytearray()
+    entries = []
+    for name, content in files:
+        entries.append((name, len(data), len(content)))
+        data += b'ZZ' + content
+    entries.sort()
+    table = bytearray()
+    for name, offset, size in entries:
+        table += ASSETS_ENTRY.pack(name.encode(), size, offset, 0, 0)
+    combined = table + data
+    return struct.pack('<III', len(entries), sum(combined) & 0xFFFF, len(combined)) + combined
+
+
+def self_test():
+    rng = random.Random(1)
+
+    def blob(n):
+        return rng.randbytes(n)
+
+    def check(name, source, target, assets=False):
+        patch = diff(source, target, assets)
+        result = apply(source, patch)
+        assert result == target, name
+        print(f'{name}: {len(target)} bytes, patch {len(patch)} bytes ({len(patch) * 100 // max(1, len(target))}%)')
+
+    # Firmware-like: edits, shifted code, appended data
+    old = blob(300000)
+    new = bytearray(old)
+    new[1000:1010] = b'0123456789'
+    new[50000:50000] = blob(777)
+    del new[120000:121500]
+    new[200000:200400] = blob(400)
+    new += blob(3000)
+    check('firmware', old, bytes(new))
+    check('firmware identical', old, old)
+    check('firmware unrelated', old[:5000], blob(6000))
+
+    # Assets: one emoji changed, one font grown, one file added, one removed
+    files = [(f'emoji_{i:02d}.png', blob(rng.randrange(2000, 20000))) for i in range(30)]
+    files.append(('font.bin', blob(150000)))
+    files.append(('index.json', b'{"version":1}'))
+    old_assets = build_assets(files)
+    changed = list(files)
+    changed[5] = (changed[5][0], blob(len(changed[5][1])))
+    changed[30] = ('font.bin', changed[30][1][:70000] + blob(5000) + changed[30][1][70000:])
+    changed.insert(10, ('emoji_new.png', blob(9000)))
+    del changed[20]
+    check('assets', old_assets, build_assets(changed), assets=True)
+    check('assets identical', old_assets, old_assets, assets=True)
+
+    # In place copies must never read a rewritten block, whatever the layout
+    for i in range(20):
+        shuffled = list(files)
+        rng.shuffle(shuffled)
+        shuffled = shuffled[:rng.randrange(5, len(shuffled))]
+        shuffled.insert(0, ('a_first.bin', blob(rng.randrange(1, 9000))))
+        target = build_assets(shuffled)
+        assert apply(old_assets, diff(old_assets, target, assets=True)) == target
+    print('assets in place, random layouts: ok')
+
+    try:
+        apply(old_assets[:-1] + b'\0', diff(old_assets, old_assets, assets=True))
+        raise AssertionError('wrong source accepted')
+    except ValueError:
+        print('wrong source rejected: ok')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Delta patches for firmware and assets images')
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('diff', help='Create a patch from the old to the new image')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('patch')
+    p.add_argument('--assets', action='store_true', help='Assets image, patched in place and diffed per file')
+    p = sub.add_parser('apply', help='Apply a patch like the device does')
+    p.add_argument('old')
+    p.add_argument('patch')
+    p.add_argument('new')
+    sub.add_parser('self-test', help='Round trip tests')
+    args = parser.parse_args()
+
+    if args.command == 'diff':
+        with open(args.old, 'rb') as f:
+            source = f.read()
+        with open(args.new, 'rb') as f:
+            target = f.read()
+        patch = diff(source, target, args.assets)
+        # Verify before handing the patch out
+        if apply(source, patch) != target:
+            sys.exit('Round trip failed')
+        with open(args.patch, 'wb') as f:
+            f.write(patch)
+        print(f'{os.path.basename(args.patch)}: {len(patch)} bytes for a {len(target)} byte image')
+    elif args.command == 'apply':
+        with open(args.old, 'rb') as f:
+            source = f.read()
+        with open(args.patch, 'rb') as f:
+            patch = f.read()
+        with open(args.new, 'wb') as f:
+            f.write(apply(source, patch))
+    else:
+        self_test()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,189 @@
+// Host test of DeltaPatcher and InPlacePartitionWriter (main/delta_patch.cc), run by delta_patch_test.py:
+//   delta_patch_test firmware|assets <old> <new> <patch>
+// Replays a patch made by scripts/delta_patch.py the way the device downloads it, in random piece sizes,
+// then checks that corrupted, truncated and misapplied patches are rejected.
+
+#include "delta_patch.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#define PARTITION_SIZE      (1024 * 1024)
+#define SECTOR_SIZE         4096
+#define ROUNDS              20
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+static std::vector<uint8_t> LoadFile(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+// Feeds the patch in pieces of random size, like HTTP reads of a download
+static bool FeedPieces(DeltaPatcher& patcher, const std::vector<uint8_t>& patch, std::mt19937& rng) {
+    size_t offset = 0;
+    while (offset < patch.size()) {
+        size_t length = std::min(patch.size() - offset, (size_t)(1 + rng() % 5000));
+        if (!patcher.Feed((const char*)patch.data() + offset, length)) {
+            return false;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+// Firmware: the old image is read from the running partition, the output goes to the other one
+static bool ApplyFirmware(const std::vector<uint8_t>& old_image, const std::vector<uint8_t>& patch,
+                          std::vector<uint8_t>& output, std::mt19937& rng) {
+    DeltaPatcher patcher(
+        [&](const DeltaPatchHeader& header) {
+            uint8_t sha256[32];
+            std::vector<uint8_t> flash = old_image;
+            esp_partition_t partition = {(uint32_t)flash.size(), SECTOR_SIZE, "ota_0", &flash, 0};
+            return header.block_size == 0 && DeltaPatcher::HashPartition(&partition, header.source_size, sha256) &&
+                memcmp(sha256, header.source_sha256, sizeof(sha256)) == 0;
+        },
+        [&](size_t offset, void* buffer, size_t length) {
+            if (offset + length > old_image.size()) {
+                return false;
+            }
+            memcpy(buffer, old_image.data() + offset, length);
+            return true;
+        },
+        [&](const char* data, size_t length) {
+            output.insert(output.end(), data, data + length);
+            return true;
+        });
+    return FeedPieces(patcher, patch, rng) && patcher.Finish();
+}
+
+// Assets: the patch rewrites the partition holding the old image in place
+static bool ApplyAssets(std::vector<uint8_t>& flash, const std::vector<uint8_t>& patch, std::mt19937& rng,
+                        int& erases, size_t& rewritten_sectors) {
+    esp_partition_t partition = {(uint32_t)flash.size(), SECTOR_SIZE, "assets", &flash, 0};
+    InPlacePartitionWriter writer(&partition);
+    DeltaPatcher patcher(
+        [&](const DeltaPatchHeader& header) {
+            uint8_t sha256[32];
+            return header.block_size == writer.sector_size() &&
+                DeltaPatcher::HashPartition(&partition, header.source_size, sha256) &&
+                memcmp(sha256, header.source_sha256, sizeof(sha256)) == 0;
+        },
+        [&](size_t offset, void* buffer, size_t length) { return writer.Read(offset, buffer, length); },
+        [&](const char* data, size_t length) { return writer.Write(data, length); });
+    bool success = FeedPieces(patcher, patch, rng) && writer.Flush() && patcher.Finish();
+    erases = partition.erases;
+    rewritten_sectors = writer.rewritten_sectors();
+    return success;
+}
+
+static std::vector<uint8_t> MakeFlash(const std::vector<uint8_t>& image) {
+    std::vector<uint8_t> flash(PARTITION_SIZE, 0xff);
+    memcpy(flash.data(), image.data(), image.size());
+    return flash;
+}
+
+static void TestFirmware(const std::vector<uint8_t>& old_image, const std::vector<uint8_t>& new_image,
+                         const std::vector<uint8_t>& patch, std::mt19937& rng) {
+    for (int round = 0; round < ROUNDS; round++) {
+        std::vector<uint8_t> output;
+        CHECK(ApplyFirmware(old_image, patch, output, rng), "patch rejected in round %d", round);
+        CHECK(output == new_image, "output differs from the new image in round %d", round);
+    }
+
+    // A flipped bit in every part of the patch: header, ops or inserted data
+    for (int round = 0; round < ROUNDS; round++) {
+        auto corrupted = patch;
+        corrupted[rng() % corrupted.size()] ^= 1 << (rng() % 8);
+        std::vector<uint8_t> output;
+        CHECK(!ApplyFirmware(old_image, corrupted, output, rng), "corrupted patch accepted in round %d", round);
+    }
+
+    for (size_t length : {(size_t)0, (size_t)DELTA_PATCH_HEADER_SIZE - 1, patch.size() / 2, patch.size() - 1}) {
+        std::vector<uint8_t> truncated(patch.begin(), patch.begin() + length);
+        std::vector<uint8_t> output;
+        CHECK(!ApplyFirmware(old_image, truncated, output, rng), "patch truncated to %zu bytes accepted", length);
+    }
+
+    auto wrong_source = old_image;
+    wrong_source[wrong_source.size() / 2] ^= 1;
+    std::vector<uint8_t> output;
+    CHECK(!ApplyFirmware(wrong_source, patch, output, rng) && output.empty(),
+        "patch applied to the wrong source");
+}
+
+static void TestAssets(const std::vector<uint8_t>& old_image, const std::vector<uint8_t>& new_image,
+                       const std::vector<uint8_t>& patch, std::mt19937& rng) {
+    for (int round = 0; round < ROUNDS; round++) {
+        auto flash = MakeFlash(old_image);
+        int erases = 0;
+        size_t rewritten_sectors = 0;
+        CHECK(ApplyAssets(flash, patch, rng, erases, rewritten_sectors), "patch rejected in round %d", round);
+        CHECK(memcmp(flash.data(), new_image.data(), new_image.size()) == 0,
+            "partition differs from the new image in round %d", round);
+        CHECK(erases == (int)rewritten_sectors, "%d erases for %zu rewritten sectors", erases, rewritten_sectors);
+        if (round == 0) {
+            printf("  %zu of %zu sectors rewritten\n", rewritten_sectors, (new_image.size() + SECTOR_SIZE - 1) / SECTOR_SIZE);
+        }
+    }
+
+    // Patching a partition that already holds the new image must not write anything
+    if (old_image != new_image) {
+        auto flash = MakeFlash(new_image);
+        int erases = 0;
+        size_t rewritten_sectors = 0;
+        CHECK(!ApplyAssets(flash, patch, rng, erases, rewritten_sectors) && erases == 0,
+            "patch applied to the new image");
+    }
+
+    auto wrong_source = old_image;
+    wrong_source[wrong_source.size() / 2] ^= 1;
+    auto flash = MakeFlash(wrong_source);
+    int erases = 0;
+    size_t rewritten_sectors = 0;
+    CHECK(!ApplyAssets(flash, patch, rng, erases, rewritten_sectors) && erases == 0,
+        "patch applied to the wrong source");
+
+    for (int round = 0; round < ROUNDS; round++) {
+        auto corrupted = patch;
+        corrupted[rng() % corrupted.size()] ^= 1 << (rng() % 8);
+        auto flash = MakeFlash(old_image);
+        CHECK(!ApplyAssets(flash, corrupted, rng, erases, rewritten_sectors), "corrupted patch accepted in round %d", round);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 5 || (strcmp(argv[1], "firmware") != 0 && strcmp(argv[1], "assets") != 0)) {
+        fprintf(stderr, "Usage: %s firmware|assets <old> <new> <patch>\n", argv[0]);
+        return 2;
+    }
+    auto old_image = LoadFile(argv[2]);
+    auto new_image = LoadFile(argv[3]);
+    auto patch = LoadFile(argv[4]);
+    if (old_image.size() > PARTITION_SIZE || new_image.size() > PARTITION_SIZE || patch.empty()) {
+        fprintf(stderr, "Images must fit in %d bytes\n", PARTITION_SIZE);
+        return 2;
+    }
+
+    std::mt19937 rng(std::hash<std::string>()(argv[4]));
+    if (strcmp(argv[1], "firmware") == 0) {
+        TestFirmware(old_image, new_image, patch, rng);
+    } else {
+        TestAssets(old_image, new_image, patch, rng);
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import delta_patch  # noqa: E402
+
+
+'''
+  Host test of the device side patch applier (main/delta_patch.cc) against patches from scripts/delta_patch.py.
+
+    python scripts/delta_patch_test/delta_patch_test.py
+
+  Builds delta_patch_test.cc with main/delta_patch.cc, stubs/ stands in for esp_partition (a RAM partition
+  that only writes erased bytes) and mbedtls. Then it makes firmware and assets patches with the tool and
+  replays each one: the output must match the new image, and corrupted, truncated or misapplied patches
+  must be rejected, for assets before anything is erased.
+'''
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+MAIN_DIR = os.path.join(TEST_DIR, '..', '..', 'main')
+
+
+def build(output, compiler, sanitize):
+    command = [compiler, '-std=gnu++17', '-O1', '-g', '-Wall', '-Wno-format',
+               '-I', os.path.join(TEST_DIR, 'stubs'), '-I', MAIN_DIR,
+               os.path.join(TEST_DIR, 'delta_patch_test.cc'), os.path.join(MAIN_DIR, 'delta_patch.cc'),
+               '-o', output]
+    if sanitize:
+        command[1:1] = ['-fsanitize=address,undefined', '-fno-sanitize-recover=all']
+    subprocess.run(command, check=True)
+
+
+def cases():
+    """Old and new images like the ones delta_patch.py self-test uses"""
+    rng = random.Random(1)
+    blob = rng.randbytes
+
+    old = blob(300000)
+    new = bytearray(old)
+    new[1000:1010] = b'0123456789'
+    new[50000:50000] = blob(777)
+    del new[120000:121500]
+    new[200000:200400] = blob(400)
+    new += blob(3000)
+    yield 'firmware', 'firmware', old, bytes(new)
+    yield 'firmware identical', 'firmware', old, old
+    yield 'firmware unrelated', 'firmware', old[:5000], blob(6000)
+
+    files = [(f'emoji_{i:02d}.png', blob(rng.randrange(2000, 20000))) for i in range(30)]
+    files.append(('font.bin', blob(150000)))
+    files.append(('index.json', b'{"version":1}'))
+    old_assets = delta_patch.build_assets(files)
+    changed = list(files)
+    changed[5] = (changed[5][0], blob(len(changed[5][1])))
+    changed[30] = ('font.bin', changed[30][1][:70000] + blob(5000) + changed[30][1][70000:])
+    changed.insert(10, ('emoji_new.png', blob(9000)))
+    del changed[20]
+    yield 'assets', 'assets', old_assets, delta_patch.build_assets(changed)
+    yield 'assets identical', 'assets', old_assets, old_assets
+
+    for i in range(10):
+        shuffled = list(files)
+        rng.shuffle(shuffled)
+        shuffled = shuffled[:rng.randrange(5, len(shuffled))]
+        shuffled.insert(0, ('a_first.bin', blob(rng.randrange(1, 9000))))
+        yield f'assets layout {i}', 'assets', old_assets, delta_patch.build_assets(shuffled)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Host test of main/delta_patch.cc')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'), help='C++ compiler (default: g++)')
+    parser.add_argument('--no-sanitize', action='store_true', help='Build without ASan/UBSan')
+    args = parser.parse_args()
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, 'delta_patch_test')
+        build(binary, args.cxx, not args.no_sanitize)
+        for index, (name, mode, old, new) in enumerate(cases()):
+            paths = [os.path.join(work, f'{index}.{suffix}') for suffix in ('old', 'new', 'patch')]
+            for path, data in zip(paths, (old, new, delta_patch.diff(old, new, assets=mode == 'assets'))):
+                with open(path, 'wb') as f:
+                    f.write(data)
+            print(f'{name}: {len(new)} bytes, patch {os.path.getsize(paths[2])} bytes')
+            result = subprocess.run([binary, mode] + paths, stderr=subprocess.PIPE, text=True)
+            failures = [line for line in result.stderr.splitlines() if line.startswith('FAILED')]
+            if result.returncode != 0:
+                print('\n'.join(failures) or result.stderr)
+                failed += 1
+    print('all ok' if failed == 0 else f'{failed} failed')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
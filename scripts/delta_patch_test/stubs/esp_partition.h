@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "esp_err.h"
+
+// A partition backed by host memory, with the flash rules that matter to the patcher: writes only
+// clear bits of erased bytes, and erases are whole sectors.
+struct esp_partition_t {
+    uint32_t size;
+    uint32_t erase_size;
+    const char* label;
+    std::vector<uint8_t>* flash;
+    int erases;
+};
+
+inline esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* buffer, size_t length) {
+    if (offset + length > partition->size) {
+        return ESP_FAIL;
+    }
+    memcpy(buffer, partition->flash->data() + offset, length);
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t length) {
+    if (offset % partition->erase_size != 0 || length % partition->erase_size != 0 || offset + length > partition->size) {
+        return ESP_FAIL;
+    }
+    memset(partition->flash->data() + offset, 0xff, length);
+    const_cast<esp_partition_t*>(partition)->erases++;
+    return ESP_OK;
+}
+
+inline esp_err_t esp_partition_write(const esp_partition_t* partition, size_t offset, const void* buffer, size_t length) {
+    if (offset + length > partition->size) {
+        return ESP_FAIL;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (partition->flash->at(offset + i) != 0xff) {
+            return ESP_FAIL;
+        }
+    }
+    memcpy(partition->flash->data() + offset, buffer, length);
+    return ESP_OK;
+}
@@ -0,0 +1,220 @@
+// Host bench of the firmware download loop before and after DownloadPipeline (main/download_pipeline.cc),
+// run by download_pipeline_bench.py. Both loops run in real time against a simulated link and flash:
+//
+// - Link: the server sends at --rate KB/s while the receive window (--window bytes, lwIP's TCP_WND) has
+//   room, so the link idles whenever the device stops reading for longer than the window lasts.
+// - Flash: esp_ota_write with OTA_WITH_SEQUENTIAL_WRITES, which erases every sector (--erase-ms) the first
+//   time it is written and programs 256 byte pages (--program-ms).
+//
+// With --stall the link also stops during flash operations. On the device an erase or write disables the
+// flash cache on both cores, and whatever part of the Wi-Fi and lwIP receive path is not in IRAM waits for
+// it. The real device is somewhere between the two runs, ota_stand_in_server.py measures it.
+
+#include "download_pipeline.h"
+#include "settings.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define OLD_BUFFER_SIZE     4096
+#define SECTOR_SIZE         4096
+#define PAGE_SIZE           256
+
+struct BenchConfig {
+    size_t size;
+    double rate;        // KB/s
+    size_t window;
+    double erase_ms;
+    double program_ms;
+    bool stall;
+};
+
+static int64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class SimulatedLink : public Http {
+public:
+    SimulatedLink(const std::string& body, const BenchConfig& config) : body_(body), config_(config) {
+        last_update_ = NowUs();
+    }
+
+    void SetHeader(const std::string& key, const std::string& value) override {}
+    bool Open(const std::string& method, const std::string& url) override { return true; }
+    int GetStatusCode() override { return 200; }
+    std::string GetResponseHeader(const std::string& key) const override { return ""; }
+    size_t GetBodyLength() override { return body_.size(); }
+
+    int Read(char* buffer, size_t buffer_size) override {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                Update();
+                size_t available = std::min((size_t)sent_, body_.size()) - consumed_;
+                if (consumed_ == body_.size()) {
+                    return 0;
+                }
+                if (available > 0) {
+                    size_t length = std::min(buffer_size, available);
+                    memcpy(buffer, body_.data() + consumed_, length);
+                    consumed_ += length;
+                    return length;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    // The link makes no progress while the flash is busy, with --stall
+    void FlashBusy(bool busy) {
+        if (!config_.stall) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        Update();
+        flash_busy_ = busy;
+    }
+
+private:
+    const std::string& body_;
+    const BenchConfig& config_;
+    std::mutex mutex_;
+    double sent_ = 0;
+    size_t consumed_ = 0;
+    int64_t last_update_;
+    bool flash_busy_ = false;
+
+    void Update() {
+        auto now = NowUs();
+        if (!flash_busy_) {
+            sent_ = std::min(sent_ + config_.rate * 1024 * (now - last_update_) / 1000000, (double)(consumed_ + config_.window));
+        }
+        last_update_ = now;
+    }
+};
+
+class SimulatedFlash {
+public:
+    SimulatedFlash(size_t size, const BenchConfig& config, SimulatedLink& link)
+        : data_(size, '\xff'), config_(config), link_(link) {}
+
+    // esp_ota_write with sequential writes: erase a sector when it is first reached, then program its pages
+    bool Write(const char* data, size_t offset, size_t length) {
+        if (offset + length > data_.size()) {
+            return false;
+        }
+        double busy_ms = 0;
+        for (size_t sector = offset / SECTOR_SIZE * SECTOR_SIZE; sector < offset + length; sector += SECTOR_SIZE) {
+            if (sector >= erased_) {
+                busy_ms += config_.erase_ms;
+                erased_ = sector + SECTOR_SIZE;
+            }
+        }
+        busy_ms += config_.program_ms * (length + PAGE_SIZE - 1) / PAGE_SIZE;
+        link_.FlashBusy(true);
+        std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(busy_ms * 1000)));
+        link_.FlashBusy(false);
+        memcpy(&data_[offset], data, length);
+        return true;
+    }
+
+    const std::string& data() const { return data_; }
+
+private:
+    std::string data_;
+    const BenchConfig& config_;
+    SimulatedLink& link_;
+    size_t erased_ = 0;
+};
+
+// The loop of Ota::Upgrade before the pipeline: fill a 4 KB buffer, then write it
+static bool RunOld(Http* http, size_t total_length, SimulatedFlash& flash) {
+    std::vector<char> buffer(OLD_BUFFER_SIZE);
+    size_t buffer_offset = 0;
+    size_t total_read = 0;
+    while (true) {
+        int ret = http->Read(buffer.data() + buffer_offset, OLD_BUFFER_SIZE - buffer_offset);
+        if (ret < 0) {
+            return false;
+        }
+        buffer_offset += ret;
+        total_read += ret;
+        bool is_last_chunk = ret == 0 || total_read >= total_length;
+        if (buffer_offset == OLD_BUFFER_SIZE || (is_last_chunk && buffer_offset > 0)) {
+            if (!flash.Write(buffer.data(), total_read - buffer_offset, buffer_offset)) {
+                return false;
+            }
+            buffer_offset = 0;
+        }
+        if (is_last_chunk) {
+            return total_read == total_length;
+        }
+    }
+}
+
+static bool RunPipeline(Http* http, size_t total_length, SimulatedFlash& flash, size_t chunk_size, int chunk_count) {
+    DownloadPipeline pipeline(chunk_size, chunk_count);
+    return pipeline.Run(http, 0, total_length, [&flash](const char* data, size_t offset, size_t length) {
+        return flash.Write(data, offset, length);
+    }, nullptr);
+}
+
+static double Measure(const char* name, const std::string& body, const BenchConfig& config, size_t chunk_size, int chunk_count) {
+    SimulatedLink link(body, config);
+    SimulatedFlash flash(body.size(), config, link);
+    auto start = NowUs();
+    bool success = chunk_count == 0 ? RunOld(&link, body.size(), flash) :
+        RunPipeline(&link, body.size(), flash, chunk_size, chunk_count);
+    double seconds = (NowUs() - start) / 1000000.0;
+    if (!success || flash.data() != body) {
+        fprintf(stderr, "%s: the download failed or the flash does not hold the body\n", name);
+        exit(1);
+    }
+    printf("  %-26s %7.2f s %8.1f KB/s\n", name, seconds, body.size() / 1024.0 / seconds);
+    return seconds;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 7) {
+        fprintf(stderr, "Usage: %s <size KB> <rate KB/s> <window> <erase ms> <program ms> <stall 0|1>\n", argv[0]);
+        return 2;
+    }
+    BenchConfig config;
+    config.size = atoi(argv[1]) * 1024;
+    config.rate = atof(argv[2]);
+    config.window = atoi(argv[3]);
+    config.erase_ms = atof(argv[4]);
+    config.program_ms = atof(argv[5]);
+    config.stall = atoi(argv[6]) != 0;
+
+    std::string body(config.size, '\0');
+    for (size_t i = 0; i < body.size(); i++) {
+        body[i] = (char)(i * 2654435761u >> 13);
+    }
+
+    printf("%u KB at %.0f KB/s, window %u, erase %.1f ms per sector, program %.2f ms per page%s\n",
+        (unsigned)(config.size / 1024), config.rate, (unsigned)config.window, config.erase_ms, config.program_ms,
+        config.stall ? ", link stalls during flash operations" : "");
+    double before = Measure("before (4 KB buffer)", body, config, 0, 0);
+    double internal = Measure("pipeline 2 x 4 KB", body, config, 4096, 2);
+    double psram = Measure("pipeline 4 x 32 KB (PSRAM)", body, config, 32 * 1024, 4);
+    printf("  speedup %.2fx without PSRAM, %.2fx with PSRAM\n", before / internal, before / psram);
+    return 0;
+}
+
+// DownloadJournal is linked in with the pipeline, the bench never resumes so NVS is always empty
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {}
+Settings::~Settings() {}
+std::string Settings::GetString(const std::string& key, const std::string& default_value) { return default_value; }
+void Settings::SetString(const std::string& key, const std::string& value) {}
+int32_t Settings::GetInt(const std::string& key, int32_t default_value) { return default_value; }
+void Settings::SetInt(const std::string& key, int32_t value) {}
+void Settings::EraseKey(const std::string& key) {}
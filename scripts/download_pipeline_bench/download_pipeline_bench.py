@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+
+'''
+  Before / after wall time of a firmware download through main/download_pipeline.cc, on the host.
+
+    python scripts/download_pipeline_bench/download_pipeline_bench.py
+    python scripts/download_pipeline_bench/download_pipeline_bench.py --size 2048 --rate 300 --erase-ms 30
+
+  Builds download_pipeline_bench.cc with main/download_pipeline.cc (stubs/ maps FreeRTOS tasks to threads)
+  and times the old read-4-KB-then-write loop of Ota::Upgrade against the pipeline, with and without PSRAM
+  chunks. The link and flash are simulated, see the top of download_pipeline_bench.cc. Every setting is
+  run twice: once with the link independent of the flash, once with the link stalled during flash
+  operations, which bound the device from both sides. Take the flash timings from the datasheet of the
+  board's flash chip, and compare with the times scripts/ota_stand_in_server.py prints on the device.
+'''
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+MAIN_DIR = os.path.join(BENCH_DIR, '..', '..', 'main')
+
+
+def build(output, compiler):
+    subprocess.run([compiler, '-std=gnu++17', '-O2', '-Wall', '-Wno-format', '-Wno-unused-variable', '-pthread',
+                    '-I', os.path.join(BENCH_DIR, 'stubs'), '-I', MAIN_DIR,
+                    os.path.join(BENCH_DIR, 'download_pipeline_bench.cc'), os.path.join(MAIN_DIR, 'download_pipeline.cc'),
+                    '-o', output], check=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Host bench of main/download_pipeline.cc')
+    parser.add_argument('--size', type=int, default=512, help='Download size in KB (default: 512)')
+    parser.add_argument('--rate', type=float, default=500, help='Link rate in KB/s (default: 500)')
+    parser.add_argument('--window', type=int, default=5760, help='TCP receive window in bytes (default: 5760, lwIP)')
+    parser.add_argument('--erase-ms', type=float, default=45, help='Sector erase time in ms (default: 45)')
+    parser.add_argument('--program-ms', type=float, default=0.4, help='256 byte page program time in ms (default: 0.4)')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'), help='C++ compiler (default: g++)')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, 'download_pipeline_bench')
+        build(binary, args.cxx)
+        for stall in (0, 1):
+            command = [binary, str(args.size), str(args.rate), str(args.window), str(args.erase_ms),
+                       str(args.program_ms), str(stall)]
+            if subprocess.run(command).returncode != 0:
+                return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+
+// The journal is not used by the bench, downloads always start from the beginning
+struct esp_partition_t {
+    uint32_t size;
+    uint32_t erase_size;
+    const char* label;
+};
+
+inline esp_err_t esp_partition_read(const esp_partition_t* partition, size_t offset, void* buffer, size_t length) {
+    return ESP_FAIL;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <thread>
+
+#include "FreeRTOS.h"
+
+// Tasks are detached threads, a task function returns right after vTaskDelete(NULL)
+inline BaseType_t xTaskCreate(void (*function)(void*), const char* name, uint32_t stack_size, void* arg,
+                              UBaseType_t priority, TaskHandle_t* handle) {
+    std::thread(function, arg).detach();
+    return pdPASS;
+}
+
+inline void vTaskDelete(TaskHandle_t task) {
+}
+
+inline UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+    return 5;
+}
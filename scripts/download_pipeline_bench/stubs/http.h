@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// The part of the Http interface of the network component that main/download_pipeline.cc uses
+class Http {
+public:
+    virtual ~Http() = default;
+    virtual void SetHeader(const std::string& key, const std::string& value) = 0;
+    virtual bool Open(const std::string& method, const std::string& url) = 0;
+    virtual int GetStatusCode() = 0;
+    virtual std::string GetResponseHeader(const std::string& key) const = 0;
+    virtual size_t GetBodyLength() = 0;
+    virtual int Read(char* buffer, size_t buffer_size) = 0;
+};
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+import argparse
+import html
+import json
+import sys
+
+
+'''
+  Renders the heap profile of a device built with CONFIG_HEAP_PROFILER as a flame graph (SVG).
+
+    python heap_flamegraph.py monitor.log heap.svg
+    python heap_flamegraph.py profile.json heap.svg --metric peak --heap spiram
+    python heap_flamegraph.py monitor.log --folded
+
+  The input is a serial log, of which the last "heap_profile: {...}" line is used, or the JSON returned
+  by the self.heap.get_profile MCP tool. Frames are the tag scopes ("protocol" > "mcp") with the heap
+  (internal or spiram) as leaf, widths are the live or peak bytes. --folded prints the stacks in the
+  folded format of flamegraph.pl and speedscope instead.
+
+  Peak bytes are tracked per scope path, so the peak of a parent frame is the sum of the peaks of its
+  children, which were not necessarily reached at the same time.
+'''
+
+MARKER = 'heap_profile: '
+
+WIDTH = 1200
+FRAME_HEIGHT = 18
+FONT_SIZE = 12
+MARGIN = 10
+TITLE_HEIGHT = 40
+
+
+def load_profile(path):
+    with open(path, 'r', encoding='utf-8', errors='replace') as f:
+        text = f.read()
+    stripped = text.strip()
+    if stripped.startswith('{'):
+        return json.loads(stripped)
+
+    profile = None
+    for line in text.splitlines():
+        index = line.find(MARKER)
+        if index < 0:
+            continue
+        payload = line[index + len(MARKER):]
+        # Strip the color reset of the ESP log line
+        end = payload.rfind('}')
+        try:
+            profile = json.loads(payload[:end + 1])
+        except json.JSONDecodeError:
+            continue
+    if profile is None:
+        raise ValueError(f'no "{MARKER.strip()}" line in {path}')
+    return profile
+
+
+def folded_stacks(profile, metric, heap):
+    stacks = {}
+    for entry in profile.get('tags', []):
+        if heap and entry['heap'] != heap:
+            continue
+        value = entry.get(metric, 0)
+        if value <= 0:
+            continue
+        stack = ';'.join(entry['path'].split(';') + [entry['heap']])
+        stacks[stack] = stacks.get(stack, 0) + value
+    return stacks
+
+
+def build_tree(stacks):
+    root = {'name': 'all', 'value': 0, 'children': {}}
+    for stack, value in stacks.items():
+        root['value'] += value
+        node = root
+        for name in stack.split(';'):
+            node = node['children'].setdefault(name, {'name': name, 'value': 0, 'children': {}})
+            node['value'] += value
+    return root
+
+
+def tree_depth(node):
+    return 1 + max((tree_depth(child) for child in node['children'].values()), default=0)
+
+
+def frame_color(name):
+    # Stable warm colors per name, like flamegraph.pl
+    h = 0
+    for c in name:
+        h = (h * 31 + ord(c)) & 0xFFFFFFFF
+    return f'rgb({205 + h % 50},{(h >> 8) % 180 + 50},{(h >> 16) % 55})'
+
+
+def format_bytes(value):
+    if value >= 1024 * 1024:
+        return f'{value / 1024 / 1024:.1f} MB'
+    if value >= 1024:
+        return f'{value / 1024:.1f} KB'
+    return f'{value} B'
+
+
+def render_svg(root, title, subtitle):
+    depth = tree_depth(root)
+    height = TITLE_HEIGHT + depth * FRAME_HEIGHT + MARGIN * 2
+    scale = (WIDTH - MARGIN * 2) / root['value'] if root['value'] else 0
+    out = [
+        f'<svg xmlns="http://www.w3.org/2000/svg" width="{WIDTH}" height="{height}" '
+        f'font-family="Verdana,sans-serif" font-size="{FONT_SIZE}">',
+        f'<rect width="100%" height="100%" fill="#f8f8f8"/>',
+        f'<text x="{WIDTH / 2}" y="20" text-anchor="middle" font-size="16">{html.escape(title)}</text>',
+        f'<text x="{WIDTH / 2}" y="34" text-anchor="middle" fill="#666">{html.escape(subtitle)}</text>',
+    ]
+
+    def draw(node, x, level):
+        width = node['value'] * scale
+        if width < 0.5:
+            return
+        # Root at the bottom, children stacked above
+        y = height - MARGIN - (level + 1) * FRAME_HEIGHT
+        label = f"{node['name']} ({format_bytes(node['value'])}, {node['value'] * 100.0 / root['value']:.1f}%)"
+        out.append('<g>')
+        out.append(f'<title>{html.escape(label)}</title>')
+        out.append(f'<rect x="{x:.1f}" y="{y}" width="{width:.1f}" height="{FRAME_HEIGHT - 1}" '
+                   f'fill="{frame_color(node["name"])}" rx="2"/>')
+        max_chars = int((width - 6) / (FONT_SIZE * 0.6))
+        if max_chars >= 3:
+            text = label if len(label) <= max_chars else label[:max_chars - 2] + '..'
+            out.append(f'<text x="{x + 3:.1f}" y="{y + FRAME_HEIGHT - 5}">{html.escape(text)}</text>')
+        out.append('</g>')
+        for child in sorted(node['children'].values(), key=lambda n: n['name']):
+            draw(child, x, level + 1)
+            x += child['value'] * scale
+
+    draw(root, MARGIN, 0)
+    out.append('</svg>')
+    return '\n'.join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Render a heap profile as a flame graph')
+    parser.add_argument('input', help='serial log or JSON from self.heap.get_profile')
+    parser.add_argument('output', nargs='?', help='SVG file to write')
+    parser.add_argument('--metric', choices=['live', 'peak'], default='live', help='bytes to show')
+    parser.add_argument('--heap', choices=['internal', 'spiram'], help='only show one heap')
+    parser.add_argument('--folded', action='store_true', help='print folded stacks instead of an SVG')
+    args = parser.parse_args()
+
+    profile = load_profile(args.input)
+    stacks = folded_stacks(profile, args.metric, args.heap)
+
+    if args.folded:
+        for stack, value in sorted(stacks.items()):
+            print(f'{stack} {value}')
+        return
+    if not args.output:
+        parser.error('output is required unless --folded is given')
+
+    subtitle = ', '.join(
+        f"{heap['name']}: {format_bytes(heap['free'])} free, {format_bytes(heap['largest_free_block'])} largest block"
+        for heap in profile.get('heaps', []))
+    if profile.get('untracked_allocations'):
+        subtitle += f", {profile['untracked_allocations']} untracked allocations"
+    svg = render_svg(build_tree(stacks), f'Heap profile ({args.metric} bytes)', subtitle)
+    with open(args.output, 'w', encoding='utf-8') as f:
+        f.write(svg)
+    print(f'Wrote {args.output}, {len(stacks)} stacks, {format_bytes(sum(stacks.values()))}')
+
+
+if __name__ == '__main__':
+    sys.exit(main())
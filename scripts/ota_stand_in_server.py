@@ -0,0 +1,96 @@
+import argparse
+import os
+import re
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+'''
+  Local stand-in for the firmware and assets download servers.
+
+  Serves the files of --root over plain HTTP, e.g. http://192.168.1.10:8080/xiaozhi.bin, and prints the
+  wall time of every transfer. The device only reads as fast as it writes to flash, so the transfer time
+  is the upgrade time without the final image validation. Use --rate to emulate a slower link.
+
+  Range requests are answered with 206, so interrupted downloads resume. --drop-after cuts every transfer
+  after that many KB to exercise it.
+
+  Point the device at it with the self.upgrade_firmware or self.assets.set_download_url tools,
+  or with the "firmware" section of the OTA check response.
+
+  download_pipeline_bench/download_pipeline_bench.py times the download loop before and after the pipeline
+  on the host, against a simulated link and flash.
+'''
+
+SEND_SIZE = 4096
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def do_GET(self):
+        path = os.path.realpath(os.path.join(self.server.root, self.path.lstrip('/').split('?')[0]))
+        if not path.startswith(self.server.root + os.sep) or not os.path.isfile(path):
+            self.send_error(404)
+            return
+
+        total = os.path.getsize(path)
+        first = 0
+        match = re.fullmatch(r'bytes=(\d+)-', self.headers.get('Range', ''))
+        if match and int(match.group(1)) < total:
+            first = int(match.group(1))
+            self.send_response(206)
+            self.send_header('Content-Range', f'bytes {first}-{total - 1}/{total}')
+        else:
+            self.send_response(200)
+        size = total - first
+        self.send_header('Content-Type', 'application/octet-stream')
+        self.send_header('Content-Length', str(size))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.end_headers()
+
+        start = time.monotonic()
+        sent = 0
+        with open(path, 'rb') as f:
+            f.seek(first)
+            while True:
+                data = f.read(SEND_SIZE)
+                if not data:
+                    break
+                if self.server.drop_after > 0 and sent + len(data) > self.server.drop_after:
+                    print(f'{self.path}: dropping the connection after {sent} bytes from {first}')
+                    self.close_connection = True
+                    return
+                try:
+                    self.wfile.write(data)
+                except (BrokenPipeError, ConnectionResetError):
+                    print(f'{self.path}: connection closed after {sent} of {size} bytes')
+                    return
+                sent += len(data)
+                if self.server.rate > 0:
+                    # Sleep until the average rate is back at the limit
+                    delay = sent / self.server.rate - (time.monotonic() - start)
+                    if delay > 0:
+                        time.sleep(delay)
+        elapsed = time.monotonic() - start
+        print(f'{self.path}: {size} bytes from {first} in {elapsed:.2f} s, {size / elapsed / 1024:.1f} KB/s')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Local firmware / assets download server')
+    parser.add_argument('--port', '-p', type=int, default=8080, help='HTTP port (default: 8080)')
+    parser.add_argument('--root', '-r', default='.', help='Directory with the files to serve')
+    parser.add_argument('--rate', type=float, default=0, help='Limit the send rate in KB/s (default: no limit)')
+    parser.add_argument('--drop-after', type=float, default=0, help='Close every transfer after this many KB (default: never)')
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer(('0.0.0.0', args.port), Handler)
+    server.root = os.path.realpath(args.root)
+    server.rate = args.rate * 1024
+    server.drop_after = int(args.drop_after * 1024)
+    print(f'Serving {server.root} on port {args.port}')
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
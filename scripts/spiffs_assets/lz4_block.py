@@ -0,0 +1,123 @@
+import sys
+import time
+
+
+'''
+  LZ4 block format (no frame header), decoded on the device by main/lz4_block.cc.
+
+  The compressor is a plain greedy matcher over a 4-byte hash, good enough for assets that are packed
+  once at build time. It follows the end-of-block rules of the format, so the output also decodes
+  with the reference LZ4 library.
+
+    python lz4_block.py file...     round trip the files and print the ratio
+
+  lz4_block_test.py runs the device decoder on the host against blocks from this compressor.
+'''
+
+MIN_MATCH = 4
+LAST_LITERALS = 5
+MF_LIMIT = 12
+MAX_OFFSET = 65535
+COMPARE_STEP = 64
+
+
+def _write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _write_sequence(out, literals, offset=0, match_length=0):
+    literal_length = len(literals)
+    token = min(literal_length, 15) << 4
+    if offset:
+        token |= min(match_length - MIN_MATCH, 15)
+    out.append(token)
+    if literal_length >= 15:
+        _write_length(out, literal_length - 15)
+    out += literals
+    if offset:
+        out += offset.to_bytes(2, 'little')
+        if match_length - MIN_MATCH >= 15:
+            _write_length(out, match_length - MIN_MATCH - 15)
+
+
+def _match_length(data, a, b, limit):
+    length = 0
+    while length + COMPARE_STEP <= limit and data[a + length:a + length + COMPARE_STEP] == data[b + length:b + length + COMPARE_STEP]:
+        length += COMPARE_STEP
+    while length < limit and data[a + length] == data[b + length]:
+        length += 1
+    return length
+
+
+def compress(data):
+    data = bytes(data)
+    size = len(data)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    while pos < size - MF_LIMIT:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+        if candidate is None or pos - candidate > MAX_OFFSET:
+            # Skip faster through data that does not compress, like png or gif files
+            pos += 1 + ((pos - anchor) >> 6)
+            continue
+        length = MIN_MATCH + _match_length(data, candidate + MIN_MATCH, pos + MIN_MATCH, size - LAST_LITERALS - pos - MIN_MATCH)
+        _write_sequence(out, data[anchor:pos], pos - candidate, length)
+        pos += length
+        anchor = pos
+    _write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress(data, size):
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        token = data[pos]
+        pos += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                length += data[pos]
+                pos += 1
+                if data[pos - 1] != 255:
+                    break
+        out += data[pos:pos + length]
+        pos += length
+        if pos == len(data):
+            break
+        offset = int.from_bytes(data[pos:pos + 2], 'little')
+        pos += 2
+        if offset == 0 or offset > len(out):
+            raise ValueError('invalid offset')
+        length = token & 15
+        if length == 15:
+            while True:
+                length += data[pos]
+                pos += 1
+                if data[pos - 1] != 255:
+                    break
+        length += MIN_MATCH
+        start = len(out) - offset
+        for i in range(length):
+            out.append(out[start + i])
+    if len(out) != size:
+        raise ValueError('size mismatch')
+    return bytes(out)
+
+
+if __name__ == '__main__':
+    for path in sys.argv[1:]:
+        with open(path, 'rb') as f:
+            original = f.read()
+        start = time.monotonic()
+        packed = compress(original)
+        elapsed = time.monotonic() - start
+        assert decompress(packed, len(original)) == original, path
+        print(f'{path}: {len(original)} -> {len(packed)} bytes ({len(packed) * 100 // max(1, len(original))}%), {elapsed:.2f} s')
@@ -0,0 +1,140 @@
+// Host test of the device LZ4 decoder (main/lz4_block.cc), run by lz4_block_test.py:
+//   lz4_block_test <vectors>
+// The vectors file holds blocks packed by lz4_block.py: |size u32|packed_size u32|data|packed|...
+// Every buffer is allocated at its exact size, so ASan reports any read or write past either end.
+
+#include "lz4_block.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <vector>
+
+#define CORRUPTIONS_PER_VECTOR  2000
+#define RANDOM_INPUTS           20000
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+} while (0)
+
+struct Vector {
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> packed;
+};
+
+static uint32_t ReadUint32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static bool LoadVectors(const char* path, std::vector<Vector>& vectors) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> content(std::istreambuf_iterator<char>(file), {});
+    size_t pos = 0;
+    while (pos < content.size()) {
+        if (content.size() - pos < 8) {
+            return false;
+        }
+        uint32_t size = ReadUint32(&content[pos]);
+        uint32_t packed_size = ReadUint32(&content[pos + 4]);
+        pos += 8;
+        if (content.size() - pos < (size_t)size + packed_size) {
+            return false;
+        }
+        Vector vector;
+        vector.data.assign(content.begin() + pos, content.begin() + pos + size);
+        pos += size;
+        vector.packed.assign(content.begin() + pos, content.begin() + pos + packed_size);
+        pos += packed_size;
+        vectors.push_back(std::move(vector));
+    }
+    return !vectors.empty();
+}
+
+// Decodes src[0, src_size) into a buffer of dst_size bytes, both copied to allocations of exactly that size
+static bool Decode(const uint8_t* src, size_t src_size, size_t dst_size, std::vector<uint8_t>* output = nullptr) {
+    auto src_copy = std::make_unique<uint8_t[]>(src_size + (src_size == 0));
+    if (src_size > 0) {
+        memcpy(src_copy.get(), src, src_size);
+    }
+    auto dst = std::make_unique<uint8_t[]>(dst_size + (dst_size == 0));
+    bool success = Lz4DecompressBlock(src_copy.get(), src_size, dst.get(), dst_size);
+    if (success && output != nullptr) {
+        output->assign(dst.get(), dst.get() + dst_size);
+    }
+    return success;
+}
+
+static void TestVector(size_t index, const Vector& vector, std::mt19937& rng) {
+    const auto& data = vector.data;
+    const auto& packed = vector.packed;
+
+    std::vector<uint8_t> output;
+    CHECK(Decode(packed.data(), packed.size(), data.size(), &output) && output == data,
+        "vector %zu does not round trip", index);
+    CHECK(!Decode(packed.data(), packed.size(), data.size() + 1), "vector %zu decoded into a larger buffer", index);
+    if (data.size() > 0) {
+        CHECK(!Decode(packed.data(), packed.size(), data.size() - 1), "vector %zu decoded into a smaller buffer", index);
+    }
+
+    // A truncated block only decodes if the cut dropped a trailing empty sequence, and then still to the data
+    size_t step = packed.size() > 4096 ? packed.size() / 4096 : 1;
+    for (size_t length = 0; length < packed.size(); length += step) {
+        output.clear();
+        if (Decode(packed.data(), length, data.size(), &output)) {
+            CHECK(output == data, "vector %zu truncated to %zu bytes decoded to other data", index, length);
+        }
+    }
+
+    // Corrupted blocks may decode to anything, they just must stay inside the buffers
+    for (int round = 0; round < CORRUPTIONS_PER_VECTOR && !packed.empty(); round++) {
+        auto corrupted = packed;
+        int changes = 1 + rng() % 4;
+        for (int i = 0; i < changes; i++) {
+            corrupted[rng() % corrupted.size()] = (rng() % 2) ? rng() : corrupted[rng() % corrupted.size()] ^ (1 << (rng() % 8));
+        }
+        size_t dst_size = data.size();
+        if (rng() % 4 == 0) {
+            dst_size = rng() % (2 * data.size() + 16);
+        }
+        Decode(corrupted.data(), corrupted.size(), dst_size);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <vectors>\n", argv[0]);
+        return 2;
+    }
+    std::vector<Vector> vectors;
+    if (!LoadVectors(argv[1], vectors)) {
+        fprintf(stderr, "Invalid vectors file %s\n", argv[1]);
+        return 2;
+    }
+
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < vectors.size(); i++) {
+        TestVector(i, vectors[i], rng);
+    }
+
+    // Random bytes, mostly invalid blocks, with tokens biased toward long lengths and short offsets
+    for (int round = 0; round < RANDOM_INPUTS; round++) {
+        std::vector<uint8_t> src(rng() % 64);
+        for (auto& byte : src) {
+            byte = (rng() % 3 == 0) ? 0xff : rng();
+        }
+        Decode(src.data(), src.size(), rng() % 1024);
+    }
+
+    printf("%zu vectors, %d failures\n", vectors.size(), failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+
+import lz4_block
+
+
+'''
+  Host test of the device LZ4 decoder (main/lz4_block.cc) against blocks from lz4_block.py.
+
+    python lz4_block_test.py [file...]
+
+  Builds lz4_block_test.cc with ASan/UBSan and feeds it blocks packed by lz4_block.compress: generated data
+  with long literal runs, long and overlapping matches, plus any files given (such as assets). The decoder
+  must round trip every block, reject a wrong output size, and stay inside its buffers for truncated,
+  corrupted and random input.
+'''
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+MAIN_DIR = os.path.join(SCRIPT_DIR, '..', '..', 'main')
+
+
+def build(output, compiler, sanitize):
+    command = [compiler, '-std=gnu++17', '-O1', '-g', '-Wall', '-I', MAIN_DIR,
+               os.path.join(SCRIPT_DIR, 'lz4_block_test.cc'), os.path.join(MAIN_DIR, 'lz4_block.cc'), '-o', output]
+    if sanitize:
+        command[1:1] = ['-fsanitize=address,undefined', '-fno-sanitize-recover=all']
+    subprocess.run(command, check=True)
+
+
+def generated():
+    rng = random.Random(1)
+    yield b''
+    yield b'a'
+    yield b'abcdefghijkl'
+    yield b'abcdefghijklm' * 2
+    yield bytes(100000)                                   # one long overlapping match, length bytes of 255
+    yield b'ab' * 5000                                    # offset 2 overlaps
+    yield rng.randbytes(70000)                            # literals only, long literal length
+    yield rng.randbytes(300) * 300                        # matches at the end of the 64 KB window
+    text = b' '.join(rng.choice([b'xiaozhi', b'assets', b'emoji', b'font', b'lvgl', b'image']) for _ in range(20000))
+    yield text
+    mixed = bytearray()
+    for _ in range(200):
+        mixed += rng.randbytes(rng.randrange(1, 300)) if rng.random() < 0.5 else bytes([rng.randrange(256)]) * rng.randrange(4, 600)
+    yield bytes(mixed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Host test of main/lz4_block.cc')
+    parser.add_argument('files', nargs='*', help='Files to pack and decode as well')
+    parser.add_argument('--cxx', default=os.environ.get('CXX', 'g++'), help='C++ compiler (default: g++)')
+    parser.add_argument('--no-sanitize', action='store_true', help='Build without ASan/UBSan')
+    args = parser.parse_args()
+
+    blocks = list(generated())
+    for path in args.files:
+        with open(path, 'rb') as f:
+            blocks.append(f.read())
+
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, 'lz4_block_test')
+        build(binary, args.cxx, not args.no_sanitize)
+        vectors = os.path.join(work, 'vectors.bin')
+        with open(vectors, 'wb') as f:
+            for data in blocks:
+                packed = lz4_block.compress(data)
+                f.write(struct.pack('<II', len(data), len(packed)) + data + packed)
+        return subprocess.run([binary, vectors]).returncode
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -22,6 +22,8 @@ from packaging import version
 
 sys.dont_write_bytecode = True
 
+import lz4_block
+
 GREEN = '\033[1;32m'
 RED = '\033[1;31m'
 RESET = '\033[0m'
@@ -45,6 +47,9 @@ class PackModelsConfig:
     image_file: str
     assets_path: str
     name_length: int
+    compress: bool = False
+    compress_exclude: List[str] = None
+    compress_min_saving: int = 10
 
 def generate_header_filename(path):
     asset_name = os.path.basename(path)
@@ -56,6 +61,24 @@ def compute_checksum(data):
     checksum = sum(data) & 0xFFFF
     return checksum
 
+def compress_asset(file_name, bin_data, config):
+    """
+    Returns the stored form of an asset. Compressed assets are stored as 'ZC', the compressed size
+    (4 bytes) and an LZ4 block, the device decompresses them when they are used, emoji only while they are shown.
+    Assets that are used in place all the time (index.json, fonts, models) stay uncompressed.
+    """
+    if config.compress and file_name not in (config.compress_exclude or []) and len(bin_data) > 0:
+        packed = lz4_block.compress(bin_data)
+        if len(packed) * 100 <= len(bin_data) * (100 - int(config.compress_min_saving)):
+            return b'\x5A\x43' + len(packed).to_bytes(4, byteorder='little') + packed, True
+    return b'\x5A' * 2 + bin_data, False
+
+def print_compression_report(stats):
+    print(f'{"Type":<10} {"Files":>6} {"Compressed":>11} {"Original":>12} {"Stored":>12} {"Saved":>7}')
+    for extension, (files, compressed, original, stored) in sorted(stats.items()):
+        saved = (original - stored) * 100 / original if original else 0
+        print(f'{extension:<10} {files:>6} {compressed:>11} {original / 1024:>11.1f}K {stored / 1024:>11.1f}K {saved:>6.1f}%')
+
 def sort_key(filename):
     basename, extension = os.path.splitext(filename)
     return extension, basename
@@ -401,6 +424,7 @@ def pack_assets(config: PackModelsConfig):
 
     merged_data = bytearray()
     file_info_list = []
+    compression_stats = {}
     skip_files = ['config.json', 'lvgl_image_converter']
 
     file_list = sorted(os.listdir(target_path), key=sort_key)
@@ -430,14 +454,21 @@ def pack_assets(config: PackModelsConfig):
                 width, height = 0, 0
 
         file_info_list.append((file_name, len(merged_data), file_size, width, height))
-        # Add 0x5A5A prefix to merged_data
-        merged_data.extend(b'\x5A' * 2)
 
         with open(file_path, 'rb') as bin_file:
             bin_data = bin_file.read()
 
-        merged_data.extend(bin_data)
+        # Stored with a 0x5A5A prefix, or 'ZC' when compressed
+        stored_data, compressed = compress_asset(file_name, bin_data, config)
+        merged_data.extend(stored_data)
+
+        extension = os.path.splitext(file_name)[1].lower() or '(none)'
+        files, compressed_files, original_size, stored_size = compression_stats.get(extension, (0, 0, 0, 0))
+        compression_stats[extension] = (files + 1, compressed_files + compressed, original_size + len(bin_data), stored_size + len(stored_data))
 
+    # The device binary-searches the table, so sort it by the stored (truncated) name bytes.
+    # The file data keeps its order, the entries point to it by offset.
+    file_info_list.sort(key=lambda info: info[0].encode('utf-8')[:int(max_name_len)])
     total_files = len(file_info_list)
 
     mmap_table = bytearray()
@@ -487,6 +518,8 @@ def pack_assets(config: PackModelsConfig):
 
         output_header.write('};\n')
 
+    if config.compress:
+        print_compression_report(compression_stats)
     print(f'All bin files have been merged into {os.path.basename(out_file)}')
 
 def copy_assets(config: AssetCopyConfig):
@@ -557,7 +590,10 @@ def process_assets_build(config_data):
         include_path=include_path,
         image_file=image_file,
         assets_path=assets_path,
-        name_length=name_length
+        name_length=name_length,
+        compress=config_data.get('compress', False),
+        compress_exclude=config_data.get('compress_exclude', []),
+        compress_min_saving=config_data.get('compress_min_saving', 10)
     )
 
     print('--support_format:', support_format)
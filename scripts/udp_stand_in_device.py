@@ -0,0 +1,162 @@
+import argparse
+import heapq
+import json
+import os
+import socket
+import struct
+import time
+
+from udp_stand_in_server import (TYPE_CONTROL, TYPE_ACK, FLAG_DOWNLINK, FLAG_MORE, FLAG_SYN, FLAG_ACK, FRAGMENT_SIZE,
+                                 Cipher, algorithms, modes)
+
+
+'''
+  Simulated device for scripts/udp_stand_in_server.py, to time --mcp-setup without a board.
+
+    python scripts/udp_stand_in_server.py --key <key> --mcp-setup batch
+    python scripts/udp_stand_in_device.py --key <key> --rtt 80 --handler-ms 5
+
+  Speaks the device side of the UDP datagram protocol: sends hello, acks and reassembles control messages,
+  and answers MCP requests the way McpServer does, a batch with one array. Every packet it sends is held
+  back by --rtt ms, so the link round trip is the emulated one. Each MCP request costs --handler-ms before
+  its reply, and tools/list returns --tools tools of about the size of the device's, paged at 8000 bytes.
+  The server prints the setup time. Retransmission is not simulated, keep --rtt below the server's RTO.
+'''
+
+MAX_PAGE_SIZE = 8000
+
+
+class StandInDevice:
+    def __init__(self, server, key, ssrc, rtt, handler_ms, tools):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.connect(server)
+        self.key = key
+        self.ssrc = ssrc
+        self.rtt = rtt / 1000
+        self.handler_ms = handler_ms
+        self.tools = [{"name": f"self.tool_{i}", "description": "x" * 180,
+                       "inputSchema": {"type": "object", "properties": {"value": {"type": "integer"}}}}
+                      for i in range(tools)]
+        self.outgoing = []
+        self.control_seq = struct.unpack(">I", os.urandom(4))[0]
+        self.synced = False
+        self.expected = None
+        self.buffered = {}
+        self.partial = b""
+
+    def crypt(self, header, payload):
+        counter = header[:8] + header[12:16] + bytes(4)
+        ctx = Cipher(algorithms.AES(self.key), modes.CTR(counter)).encryptor()
+        return ctx.update(payload) + ctx.finalize()
+
+    def ack_value(self):
+        return (self.expected - 1) & 0xFFFFFFFF if self.expected is not None else 0
+
+    def send(self, ptype, flags, payload, sequence):
+        header = struct.pack(">BBHIII", ptype, flags, len(payload), self.ssrc, self.ack_value(), sequence)
+        heapq.heappush(self.outgoing, (time.time() + self.rtt, sequence, header + self.crypt(header, payload)))
+
+    def send_control(self, message):
+        data = json.dumps(message, separators=(",", ":")).encode("utf-8")
+        chunks = [data[i:i + FRAGMENT_SIZE] for i in range(0, len(data), FRAGMENT_SIZE)] or [b""]
+        for index, chunk in enumerate(chunks):
+            self.control_seq = (self.control_seq + 1) & 0xFFFFFFFF
+            flags = FLAG_ACK if self.expected is not None else 0
+            if index < len(chunks) - 1:
+                flags |= FLAG_MORE
+            if not self.synced and index == 0:
+                flags |= FLAG_SYN
+            self.send(TYPE_CONTROL, flags, chunk, self.control_seq)
+        self.synced = True
+
+    def tools_list(self, cursor):
+        start = next((i for i, tool in enumerate(self.tools) if tool["name"] == cursor), 0)
+        page, size = [], 30
+        for tool in self.tools[start:]:
+            tool_size = len(json.dumps(tool, separators=(",", ":"))) + 1
+            if page and size + tool_size > MAX_PAGE_SIZE:
+                return {"tools": page, "nextCursor": tool["name"]}
+            page.append(tool)
+            size += tool_size
+        return {"tools": page}
+
+    def handle_request(self, request):
+        time.sleep(self.handler_ms / 1000)
+        if "id" not in request:
+            return None
+        method = request.get("method")
+        if method == "initialize":
+            result = {"protocolVersion": "2024-11-05", "capabilities": {"tools": {}},
+                      "serverInfo": {"name": "stand-in-device", "version": "1.0.0"}}
+        elif method == "tools/list":
+            result = self.tools_list(request.get("params", {}).get("cursor", ""))
+        elif method == "tools/call":
+            result = {"content": [{"type": "text", "text": "{}"}], "isError": False}
+        else:
+            return {"jsonrpc": "2.0", "id": request["id"], "error": {"message": f"Method not implemented: {method}"}}
+        return {"jsonrpc": "2.0", "id": request["id"], "result": result}
+
+    def handle_message(self, data):
+        message = json.loads(data.decode("utf-8"))
+        if message.get("type") != "mcp":
+            return
+        payload = message.get("payload")
+        if isinstance(payload, list):
+            replies = [reply for reply in map(self.handle_request, payload) if reply is not None]
+            reply = replies or None
+        else:
+            reply = self.handle_request(payload)
+        if reply is not None:
+            self.send_control({"session_id": message.get("session_id"), "type": "mcp", "payload": reply})
+
+    def handle_packet(self, data):
+        if len(data) < 16:
+            return
+        ptype, flags, length, ssrc, timestamp, sequence = struct.unpack(">BBHIII", data[:16])
+        if not flags & FLAG_DOWNLINK or ptype != TYPE_CONTROL or length != len(data) - 16:
+            return
+        if self.expected is None:
+            if not flags & FLAG_SYN:
+                return
+            self.expected = sequence
+        if ((sequence - self.expected) & 0xFFFFFFFF) < 0x80000000:
+            self.buffered[sequence] = (flags, self.crypt(data[:16], data[16:]))
+        while self.expected in self.buffered:
+            fragment_flags, fragment = self.buffered.pop(self.expected)
+            self.expected = (self.expected + 1) & 0xFFFFFFFF
+            self.partial += fragment
+            if not fragment_flags & FLAG_MORE:
+                message, self.partial = self.partial, b""
+                self.handle_message(message)
+        self.send(TYPE_ACK, FLAG_ACK, b"", 0)
+
+    def run(self, duration):
+        self.send_control({"type": "hello", "version": 3, "transport": "udp", "features": {"mcp": True},
+                           "audio_params": {"format": "opus", "sample_rate": 16000, "channels": 1,
+                                            "frame_duration": 60}})
+        end = time.time() + duration
+        while time.time() < end:
+            now = time.time()
+            while self.outgoing and self.outgoing[0][0] <= now:
+                self.sock.send(heapq.heappop(self.outgoing)[2])
+            timeout = self.outgoing[0][0] - now if self.outgoing else 0.05
+            self.sock.settimeout(max(0.001, min(timeout, 0.05)))
+            try:
+                self.handle_packet(self.sock.recv(65536))
+            except (socket.timeout, ConnectionRefusedError):
+                pass
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Simulated device for the UDP stand-in server")
+    parser.add_argument("--server", default="127.0.0.1:8884", help="Stand-in server address (default: 127.0.0.1:8884)")
+    parser.add_argument("--key", "-k", required=True, help="AES-128 key, 32 hex chars")
+    parser.add_argument("--ssrc", type=int, default=1, help="SSRC (default: 1)")
+    parser.add_argument("--rtt", type=float, default=80, help="Emulated round trip in ms (default: 80)")
+    parser.add_argument("--handler-ms", type=float, default=5, help="Time per MCP request in ms (default: 5)")
+    parser.add_argument("--tools", type=int, default=40, help="Number of tools in tools/list (default: 40)")
+    parser.add_argument("--duration", type=float, default=5, help="Seconds to run (default: 5)")
+    args = parser.parse_args()
+    host, port = args.server.rsplit(":", 1)
+    StandInDevice((host, int(port)), bytes.fromhex(args.key), args.ssrc, args.rtt, args.handler_ms,
+                  args.tools).run(args.duration)
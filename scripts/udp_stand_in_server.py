@@ -0,0 +1,245 @@
+import argparse
+import json
+import os
+import socket
+import struct
+import time
+import uuid
+
+try:
+    from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+except ImportError:
+    raise SystemExit("Please install cryptography: pip install cryptography")
+
+
+'''
+  Local stand-in server for the UDP datagram protocol (main/protocols/udp_protocol.h).
+
+  Every packet carries the 16 byte header from docs/mqtt-udp.md:
+  |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+  The AES-CTR counter block is the header with the sequence in place of the timestamp and a zero block counter:
+  |type 1u|flags 1u|payload_len 2u|ssrc 4u|sequence 4u|0 4u|
+
+  - type 0x01 audio: echoed back to the device when --echo is given
+  - type 0x02 control: reliable JSON, acked and delivered in order, "hello" is answered
+  - type 0x03 ack
+
+  Configure the device with an OTA "udp" section such as:
+  {"udp": {"endpoint": "192.168.1.10:8884", "key": "<32 hex chars>", "ssrc": 1}}
+
+  --mcp-setup runs the MCP session setup (initialize, tools/list, tools/call) after hello and prints
+  how long it took, either one request per round trip (sequential) or as a JSON-RPC batch (batch).
+  scripts/udp_stand_in_device.py can stand in for the device.
+'''
+
+TYPE_AUDIO = 0x01
+TYPE_CONTROL = 0x02
+TYPE_ACK = 0x03
+FLAG_DOWNLINK = 0x01
+FLAG_MORE = 0x02
+FLAG_SYN = 0x04
+FLAG_ACK = 0x08
+FRAGMENT_SIZE = 1024
+RTO = 0.3
+
+MCP_SETUP_REQUESTS = [
+    {"jsonrpc": "2.0", "id": 1, "method": "initialize", "params": {"capabilities": {}}},
+    {"jsonrpc": "2.0", "id": 2, "method": "tools/list", "params": {"cursor": ""}},
+    {"jsonrpc": "2.0", "id": 3, "method": "tools/call", "params": {"name": "self.get_device_status", "arguments": {}}},
+]
+
+
+def seq_after(a, b):
+    diff = (a - b) & 0xFFFFFFFF
+    return 0 < diff < 0x80000000
+
+
+class Session:
+    def __init__(self, address, ssrc):
+        self.address = address
+        self.ssrc = ssrc
+        self.session_id = str(uuid.uuid4())
+        self.expected = None
+        self.buffered = {}
+        self.partial = b""
+        self.control_seq = struct.unpack(">I", os.urandom(4))[0]
+        self.audio_seq = struct.unpack(">I", os.urandom(4))[0]
+        self.pending = {}
+        self.synced_peer = False
+        self.audio_frames = 0
+        self.mcp_queue = []
+        self.mcp_next_id = 100
+        self.mcp_start = None
+
+
+class StandInServer:
+    def __init__(self, port, key, echo, sample_rate, mcp_setup=None):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("0.0.0.0", port))
+        self.sock.settimeout(0.1)
+        self.key = key
+        self.echo = echo
+        self.sample_rate = sample_rate
+        self.mcp_setup = mcp_setup
+        self.sessions = {}
+
+    def crypt(self, header, payload):
+        counter = header[:8] + header[12:16] + bytes(4)
+        cipher = Cipher(algorithms.AES(self.key), modes.CTR(counter))
+        ctx = cipher.encryptor()
+        return ctx.update(payload) + ctx.finalize()
+
+    def build(self, session, ptype, flags, payload, timestamp, sequence):
+        header = struct.pack(">BBHIII", ptype, flags | FLAG_DOWNLINK, len(payload), session.ssrc, timestamp, sequence)
+        return header + self.crypt(header, payload)
+
+    def ack_value(self, session):
+        return (session.expected - 1) & 0xFFFFFFFF if session.expected is not None else 0
+
+    def send_control(self, session, message):
+        data = json.dumps(message, ensure_ascii=False, separators=(",", ":")).encode("utf-8")
+        chunks = [data[i:i + FRAGMENT_SIZE] for i in range(0, len(data), FRAGMENT_SIZE)] or [b""]
+        for index, chunk in enumerate(chunks):
+            session.control_seq = (session.control_seq + 1) & 0xFFFFFFFF
+            flags = FLAG_ACK if session.expected is not None else 0
+            if index < len(chunks) - 1:
+                flags |= FLAG_MORE
+            if not session.synced_peer and index == 0:
+                flags |= FLAG_SYN
+            packet = self.build(session, TYPE_CONTROL, flags, chunk, self.ack_value(session), session.control_seq)
+            session.pending[session.control_seq] = [packet, time.time()]
+            self.sock.sendto(packet, session.address)
+        session.synced_peer = True
+        print(f"-> {message}")
+
+    def send_ack(self, session):
+        packet = self.build(session, TYPE_ACK, FLAG_ACK, b"", self.ack_value(session), 0)
+        self.sock.sendto(packet, session.address)
+
+    def handle_ack(self, session, ack):
+        for seq in list(session.pending.keys()):
+            if not seq_after(seq, ack):
+                del session.pending[seq]
+
+    def handle_message(self, session, data):
+        message = json.loads(data.decode("utf-8"))
+        print(f"<- {message}")
+        if message.get("type") == "hello":
+            self.send_control(session, {
+                "type": "hello",
+                "transport": "udp",
+                "session_id": session.session_id,
+                "audio_params": {"format": "opus", "sample_rate": self.sample_rate, "channels": 1,
+                                 "frame_duration": 60},
+            })
+            if self.mcp_setup:
+                self.start_mcp_setup(session)
+        elif message.get("type") == "mcp" and session.mcp_start is not None:
+            self.handle_mcp_reply(session, message.get("payload"))
+
+    def send_mcp(self, session, payload):
+        self.send_control(session, {"session_id": session.session_id, "type": "mcp", "payload": payload})
+
+    def start_mcp_setup(self, session):
+        session.mcp_start = time.time()
+        if self.mcp_setup == "batch":
+            self.send_mcp(session, MCP_SETUP_REQUESTS)
+        else:
+            session.mcp_queue = MCP_SETUP_REQUESTS[1:]
+            self.send_mcp(session, MCP_SETUP_REQUESTS[0])
+
+    def handle_mcp_reply(self, session, payload):
+        replies = payload if isinstance(payload, list) else [payload]
+        follow_up = []
+        for reply in replies:
+            result = reply.get("result") or {}
+            if "error" in reply:
+                print(f"MCP request {reply.get('id')} failed: {reply['error']}")
+            if isinstance(result, dict) and result.get("nextCursor"):
+                session.mcp_next_id += 1
+                follow_up.append({"jsonrpc": "2.0", "id": session.mcp_next_id, "method": "tools/list",
+                                  "params": {"cursor": result["nextCursor"]}})
+        session.mcp_queue = follow_up + session.mcp_queue
+        if session.mcp_queue:
+            if self.mcp_setup == "batch":
+                self.send_mcp(session, session.mcp_queue)
+                session.mcp_queue = []
+            else:
+                self.send_mcp(session, session.mcp_queue.pop(0))
+            return
+        elapsed = (time.time() - session.mcp_start) * 1000
+        print(f"MCP setup ({self.mcp_setup}) finished in {elapsed:.0f} ms")
+        session.mcp_start = None
+
+    def handle_packet(self, data, address):
+        if len(data) < 16:
+            return
+        ptype, flags, length, ssrc, timestamp, sequence = struct.unpack(">BBHIII", data[:16])
+        if flags & FLAG_DOWNLINK or length != len(data) - 16:
+            return
+        session = self.sessions.get(address)
+        if session is None or (ptype == TYPE_CONTROL and flags & FLAG_SYN and session.expected is not None
+                               and sequence != (session.expected - 1) & 0xFFFFFFFF):
+            session = Session(address, ssrc)
+            self.sessions[address] = session
+        if flags & FLAG_ACK:
+            self.handle_ack(session, timestamp)
+
+        payload = self.crypt(data[:16], data[16:])
+        if ptype == TYPE_AUDIO:
+            session.audio_frames += 1
+            if self.echo:
+                session.audio_seq = (session.audio_seq + 1) & 0xFFFFFFFF
+                self.sock.sendto(self.build(session, TYPE_AUDIO, 0, payload, timestamp, session.audio_seq), address)
+        elif ptype == TYPE_CONTROL:
+            if session.expected is None:
+                if not flags & FLAG_SYN:
+                    return
+                session.expected = sequence
+            if sequence == session.expected or seq_after(sequence, session.expected):
+                session.buffered[sequence] = (flags, payload)
+            while session.expected in session.buffered:
+                fragment_flags, fragment = session.buffered.pop(session.expected)
+                session.expected = (session.expected + 1) & 0xFFFFFFFF
+                session.partial += fragment
+                if not fragment_flags & FLAG_MORE:
+                    message, session.partial = session.partial, b""
+                    self.handle_message(session, message)
+            self.send_ack(session)
+
+    def retransmit(self):
+        now = time.time()
+        for session in self.sessions.values():
+            for seq, entry in session.pending.items():
+                if now - entry[1] >= RTO:
+                    self.sock.sendto(entry[0], session.address)
+                    entry[1] = now
+
+    def run(self):
+        print(f"UDP stand-in server listening on {self.sock.getsockname()}")
+        last_report = time.time()
+        while True:
+            try:
+                data, address = self.sock.recvfrom(65536)
+                self.handle_packet(data, address)
+            except socket.timeout:
+                pass
+            self.retransmit()
+            if time.time() - last_report >= 5:
+                for session in self.sessions.values():
+                    if session.audio_frames:
+                        print(f"{session.address}: {session.audio_frames} audio frames")
+                        session.audio_frames = 0
+                last_report = time.time()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="UDP datagram protocol stand-in server")
+    parser.add_argument("--port", "-p", type=int, default=8884, help="UDP port (default: 8884)")
+    parser.add_argument("--key", "-k", required=True, help="AES-128 key, 32 hex chars")
+    parser.add_argument("--echo", action="store_true", help="Echo uplink audio back to the device")
+    parser.add_argument("--sample-rate", type=int, default=16000, help="Downlink sample rate in hello")
+    parser.add_argument("--mcp-setup", choices=["sequential", "batch"],
+                        help="Time the MCP session setup after hello")
+    args = parser.parse_args()
+    StandInServer(args.port, bytes.fromhex(args.key), args.echo, args.sample_rate, args.mcp_setup).run()